@@ -187,8 +187,19 @@
 
 \function{_fits_read_img}
 \synopsis{Read an image}
-\usage{status = _fits_read_img (Fits_File_Type fptr, Ref_Type img)}
+\usage{status = _fits_read_img (Fits_File_Type fptr, Ref_Type img [,bscale, bzero] [,type])}
 \description
+  If an array is passed in place of the reference \exmp{img}, the image
+  is read into it.  The array must have the type and dimensions of the
+  image.
+
+  If the optional references \exmp{bscale} and \exmp{bzero} are given,
+  the image is read in its stored type without applying the scaling, and
+  the values of the BSCALE and BZERO keywords are assigned to them.
+
+  If the optional \exmp{DataType_Type} argument \exmp{type} is given,
+  the image is returned in that type, the pixels being converted by
+  cfitsio as they are read.
   \xreferences{fits_read_img}
 \notes
   This function differs from the corresponding cfitsio routine in that
@@ -426,7 +437,7 @@
 \usage{status = _fits_insert_rows (fptr, firstrow, nrows)}
 #v+
    Fits_File_Type fptr;
-   Int_Type firstrow, nrows;
+   Long_Type firstrow, nrows;
 #v-
 \description
   \xreferences{fits_insert_rows}
@@ -437,7 +448,7 @@
 \usage{status = _fits_delete_rows (fptr, firstrow, nrows)}
 #v+
    Fits_File_Type fptr;
-   Int_Type firstrow, nrows;
+   Long_Type firstrow, nrows;
 #v-
 \description
   \xreferences{fits_delete_rows}
@@ -482,9 +493,12 @@
 
 \function{_fits_get_num_rows}
 \synopsis{Get the number of table rows}
-\usage{status = _fits_get_num_cols (Fits_File_Type fptr, Ref_Type nrows)}
+\usage{status = _fits_get_num_rows (Fits_File_Type fptr, Ref_Type nrows)}
 \description
   \xreferences{fits_get_num_rows}
+\notes
+  The number of rows is returned as an \exmp{Int_Type} if it fits, and
+  as a 64 bit integer otherwise.
 \done
 
 \function{_fits_write_col}
@@ -493,7 +507,7 @@
 #v+
    Fits_File_Type fptr;
    Int_Type colnum;
-   Int_Type firstrow, firstelem;
+   Long_Type firstrow, firstelem;
    Array_Type array;
 #v-
 \description
@@ -501,15 +515,28 @@
 \notes
    The number of elements written out to the column by this function
    will be equal to the number of elements in the array.
+
+   A bit column accepts integer words laid out as read by
+   \ifun{_fits_read_col}, or a \exmp{[numrows, n]} array of 1 byte
+   integers with one 0/1 value per bit.  A cell of a variable length
+   bit column may be written from a \exmp{UChar_Type} array with one
+   value per bit, or from words that contribute all of their bits.
+
+   For a numeric variable length column, \exmp{array} may also be an
+   array of arrays, in which case one cell per element is written
+   starting at \exmp{firstrow}, and \exmp{firstelem} is ignored.
+\seealso{_fits_write_var_col}
 \done
 
 \function{_fits_read_col}
 \synopsis{Read elements from a column}
-\usage{status = _fits_read_col (fptr, colnum, firstrow, numrows, array}
+\usage{status = _fits_read_col (fptr, colnum, firstrow, numrows, array [,type])}
 #v+
    Fits_File_Type fptr;
-   Int_Type colnum, firstrow, numrows;
+   Int_Type colnum;
+   Long_Type firstrow, numrows;
    Ref_Type array;
+   DataType_Type type;
 #v-
 \description
   This function is a complicated wrapper around a number of cfitsio
@@ -525,9 +552,27 @@
   variable length column, where data are stored in the heap of the
   HDU, the data will be read as a 1-d array of \exmp{numrows} arrays.
   
-  If the column is a bit-valued column, then data will be returned as
-  an array of integers of the appropriate size.  Currently only 8X,
-  16X, and 32X bit columns are supported.
+  If the column is a bit-valued column \exmp{nX}, then data will be
+  returned as an array of integers of the appropriate size: 8, 16, 32
+  or 64 bit integers for columns of up to 64 bits, and
+  \exmp{(n+31)/32} 32 bit words per row for wider columns.  Word k
+  holds bits 32k+1 onward, right-aligned.  The cells of variable length
+  bit columns are read as arrays of such words.  Use
+  \ifun{_fits_read_bit_mask} to read the bits unpacked.
+
+  If an array is passed in place of the reference \exmp{array}, the
+  data are read into that array, which must have the type of the column
+  and \exmp{numrows*repeat} elements.  This is not supported for string
+  and variable length columns.
+
+  Row numbers and counts may exceed 2^31.  A single call is limited by
+  the size of a \slang array, however: if \exmp{numrows*repeat} does
+  not fit into an array index, an error is raised and the rows must be
+  read in smaller pieces.
+
+  If \exmp{type} is given, a numeric column is returned in that type,
+  the values being converted by cfitsio as they are read.  String,
+  logical and bit columns are not affected.
 \seealso{_fits_read_cols, _fits_write_col}
 \done
 
@@ -558,12 +603,13 @@
 
 \function{_fits_read_cols}
 \synopsis{Read one or more table columns}
-\usage{status = _fits_read_cols (fptr, colnums, firstrow, nrows, arrays)}
+\usage{status = _fits_read_cols (fptr, colnums, firstrow, nrows, arrays [,tscales, tzeros] [,type])}
 #v+
    Fits_File_Type fptr;
    Array_Type colnums;
-   Int_Type firstrow, numrows;
-   Ref_Type arrays;
+   Long_Type firstrow, numrows;
+   Ref_Type arrays, tscales, tzeros;
+   DataType_Type type;
 #v-
 \description
   This function performs a similar task as the \exmp{_fits_read_col}.
@@ -573,6 +619,15 @@
   variable referenced by the \exmp{arrays} parameter.  See the
   documentation for the \ifun{_fits_read_col} function for more
   information.
+
+  If the optional \exmp{tscales} and \exmp{tzeros} references are
+  given, the columns are read in their stored types without applying
+  the scaling, and the scaling parameters of the columns are assigned to
+  them as \exmp{Double_Type} arrays.
+
+  If an array of arrays is passed in place of the reference
+  \exmp{arrays}, the data of the i-th column are read into its i-th
+  element.  See \ifun{_fits_read_col} for the requirements.
 \notes
   This function takes advantage of the cfitsio buffering mechanism to
   optimize the reads.
@@ -620,3 +675,377 @@
 \description
   \xreferences{fits_get_version}
 \done
+
+\function{_fits_get_stats}
+\synopsis{Get the I/O and call statistics}
+\usage{Struct_Type _fits_get_stats (fptr)}
+#v+
+   Fits_File_Type or NULL fptr;
+#v-
+\description
+  If \exmp{fptr} is NULL, the statistics aggregated over all file
+  pointers are returned.
+  \xreferences{fits_get_stats}
+\done
+
+\function{_fits_reset_stats}
+\synopsis{Reset the I/O and call statistics}
+\usage{_fits_reset_stats (fptr)}
+#v+
+   Fits_File_Type or NULL fptr;
+#v-
+\description
+  \xreferences{fits_reset_stats}
+\done
+
+\function{_fits_trace_start}
+\synopsis{Start tracing the intrinsic calls}
+\usage{status = _fits_trace_start (String_Type file, Int_Type max_events)}
+\description
+  If \exmp{max_events} is 0, a default size is used for the event buffer.
+  \xreferences{fits_trace_start}
+\done
+
+\function{_fits_trace_stop}
+\synopsis{Stop tracing and write the trace file}
+\usage{status = _fits_trace_stop ()}
+\description
+  \xreferences{fits_trace_stop}
+\done
+
+\function{_fits_set_column_cache}
+\synopsis{Enable or disable the column cache}
+\usage{_fits_set_column_cache (dir, Double_Type max_bytes)}
+#v+
+   String_Type or NULL dir;
+#v-
+\description
+  A value of 0 for \exmp{max_bytes} means that the size of the cache is
+  not limited.
+  \xreferences{fits_set_column_cache}
+\done
+
+\function{_fits_open_table}
+\synopsis{Create a table object whose columns are read on demand}
+\usage{Fits_Table_Type _fits_open_table (fptr, names, colnums, nrows, reader)}
+#v+
+   Fits_File_Type fptr;
+   String_Type names[];
+   Int_Type colnums[], nrows;
+   Ref_Type reader;
+#v-
+\description
+  The column \exmp{colnums[i]} of the current HDU is accessible as the
+  field \exmp{names[i]} of the returned object.  When a field is first
+  accessed, the column is read by calling
+  \exmp{(@reader)(fptr, colnum, firstrow, nrows)}, which must return
+  the data as an array.
+  \xreferences{fits_open_table}
+\done
+
+\function{_fits_prefetch_open}
+\synopsis{Start reading blocks of table rows in a background thread}
+\usage{pf = _fits_prefetch_open (fptr, Int_Type colnums[], Int_Type nrows, Int_Type nblocks)}
+\description
+  This function opens a second read-only handle of the file and starts a
+  thread that reads the specified columns of the current HDU in blocks
+  of \exmp{nrows} rows, keeping up to \exmp{nblocks} blocks ahead of the
+  caller.  The blocks are obtained via \ifun{_fits_prefetch_next}.
+  \NULL is returned if the columns cannot be prefetched, e.g., because
+  they are not fixed width numeric columns, the file was not opened
+  read-only, or the cfitsio library is not thread-safe.
+\notes
+  This function is only available if the module was compiled with
+  support for POSIX threads.  It is used by the \exmp{prefetch}
+  qualifier of \sfun{fits_iterate}.
+\seealso{_fits_prefetch_next, _fits_read_cols}
+\done
+
+\function{_fits_prefetch_next}
+\synopsis{Get the next block of rows read by the prefetcher}
+\usage{status = _fits_prefetch_next (pf, Ref_Type arrays, Ref_Type firstrow, Ref_Type nrows)}
+\description
+  This function waits for the next block of rows and assigns the data
+  as an array of arrays to \exmp{arrays}, and the first row and number
+  of rows of the block to \exmp{firstrow} and \exmp{nrows}.  After the
+  last block, \NULL is assigned to \exmp{arrays}.
+\seealso{_fits_prefetch_open}
+\done
+
+\function{_fits_open_memory}
+\synopsis{Open a FITS file held in a binary string}
+\usage{status = _fits_open_memory (Ref_Type fptr, BString_Type bytes, String_Type mode)}
+\description
+  In read-only mode (\exmp{"r"}), cfitsio reads directly from
+  \exmp{bytes}, which is kept alive until the file is closed.
+  \xreferences{fits_open_memfile}
+\seealso{fits_open_memory}
+\done
+
+\function{_fits_create_memory}
+\synopsis{Create a FITS file in memory}
+\usage{status = _fits_create_memory (Ref_Type fptr)}
+\description
+  \xreferences{fits_create_memfile}
+\seealso{fits_create_memory}
+\done
+
+\function{_fits_get_memory_bytes}
+\synopsis{Get the contents of an in-memory FITS file}
+\usage{status = _fits_get_memory_bytes (Fits_File_Type fptr, Ref_Type bytes)}
+\seealso{fits_get_memory_bytes}
+\done
+
+\function{_fits_copy_table}
+\synopsis{Copy selected columns and rows of a binary table}
+\usage{status = _fits_copy_table (infptr, outfptr, columns, rows, expr, drows [,append])}
+#v+
+   Fits_File_Type infptr, outfptr;
+   Int_Type columns[];
+   Long_Type rows[];    % or NULL for all rows
+   String_Type expr;    % or NULL
+   Int_Type drows;      % 0 for a default block size
+   Int_Type append;
+#v-
+\description
+  A new binary table with the specified columns is appended to
+  \exmp{outfptr}, and the selected rows of the current HDU of
+  \exmp{infptr} are copied to it in blocks of \exmp{drows} rows.  If
+  \exmp{expr} is not NULL, only the rows for which the row filter
+  expression is true are copied.  If \exmp{append} is non-zero, the
+  rows are instead appended to the table in the current HDU of
+  \exmp{outfptr}, whose columns must have the same formats.
+\seealso{fits_copy_table}
+\done
+
+\function{_fits_readahead}
+\synopsis{Start reading a file into the system's page cache}
+\usage{_fits_readahead (String_Type file)}
+\description
+  This function asks the operating system to start reading the
+  specified file in the background, so that it can be read quickly
+  when it is opened later.  It does nothing for files that are not
+  plain disk files, or if the system does not support this.
+\seealso{fits_open_dataset}
+\done
+
+\function{_fits_sort_table}
+\synopsis{Sort the rows of a binary table}
+\usage{status = _fits_sort_table (infptr, outfptr, keys, descending, mem_limit, nthreads, tmpdir)}
+#v+
+   Fits_File_Type infptr, outfptr;
+   Int_Type keys[], descending[];
+   Double_Type mem_limit;
+   Int_Type nthreads;      % 0 for the number of CPUs
+   String_Type tmpdir;     % or NULL
+#v-
+\description
+  A copy of the table in the current HDU of \exmp{infptr}, with its
+  rows sorted by the key columns, is appended to \exmp{outfptr}.
+  Runs of rows that fit into \exmp{mem_limit} bytes are sorted and
+  spilled to temporary files in \exmp{tmpdir}, which are then merged.
+\seealso{fits_sort_table}
+\done
+
+\function{_fits_read_bit_mask}
+\synopsis{Read a bit column as a mask}
+\usage{status = _fits_read_bit_mask (fptr, colnum, firstrow, numrows, mask)}
+#v+
+   Fits_File_Type fptr;
+   Int_Type colnum, firstrow, numrows;
+   Ref_Type mask;
+#v-
+\description
+  The bits of the specified rows of a bit column are unpacked into a
+  \exmp{UChar_Type} array with one 0 or 1 per bit, which is assigned to
+  the variable referenced by \exmp{mask}.  For a fixed width column
+  \exmp{nX} the array has the dimensions \exmp{[numrows, n]}; for a
+  variable length column it is an array of \exmp{numrows} arrays.
+  \xreferences{fits_read_col_bit}
+\seealso{_fits_read_col, fits_read_col}
+\done
+
+\function{_fits_write_subset}
+\synopsis{Write a section of an image}
+\usage{status = _fits_write_subset (fptr, array, origin)}
+#v+
+   Fits_File_Type fptr;
+   Array_Type array;
+   Long_Type origin[];
+#v-
+\description
+  The array is written into the image of the current HDU with its
+  first element at the 0-based pixel \exmp{origin}, which has one
+  element per image dimension and is given in the order of the array
+  indices.  If the array has fewer dimensions than the image, its
+  missing leading dimensions are taken to be 1.
+  \xreferences{fits_write_subset}
+\seealso{fits_write_img_section, _fits_write_img}
+\done
+
+\function{_fits_read_img_binned}
+\synopsis{Read an image reduced by blocks of pixels}
+\usage{status = _fits_read_img_binned (fptr, factors, op, img)}
+#v+
+   Fits_File_Type fptr;
+   Int_Type factors[];
+   String_Type op;    % "mean", "sum", "min", "max", or "median"
+   Ref_Type img;
+#v-
+\description
+  The image of the current HDU is read in bands of whole rows of blocks
+  and each block of \exmp{factors} pixels is reduced to one value
+  according to \exmp{op}.  The result is assigned as a
+  \exmp{Double_Type} array to the variable referenced by \exmp{img}.
+  The factors are given in the order of the array dimensions, or as a
+  single value for all of them.  NaN and undefined pixels are ignored.
+\seealso{fits_read_img_binned, _fits_read_img}
+\done
+
+\function{_fits_read_pixels}
+\synopsis{Read the values of scattered image pixels}
+\usage{status = _fits_read_pixels (fptr, x, y, ..., values)}
+#v+
+   Fits_File_Type fptr;
+   Long_Type x[], y[], ...;
+   Ref_Type values;
+#v-
+\description
+  The values of the pixels with the 1-based coordinates
+  \exmp{(x[i], y[i], ...)} of the image in the current HDU are assigned
+  as a \exmp{Double_Type} array to the variable referenced by
+  \exmp{values}.  One coordinate array must be given per image axis,
+  starting with \exmp{NAXIS1}.  Pixels outside the image are NaN.  Each
+  image row, or tile of a compressed image, that holds requested pixels
+  is read once.
+  \xreferences{fits_read_subset}
+\seealso{fits_read_pixels}
+\done
+
+\function{_fits_read_images}
+\synopsis{Read the images of several HDUs}
+\usage{status = _fits_read_images (fptr, hdunums, nthreads, images)}
+#v+
+   Fits_File_Type fptr;
+   Int_Type hdunums[];
+   Int_Type nthreads;    % 0 for the number of CPUs
+   Ref_Type images;
+#v-
+\description
+  The images of the HDUs \exmp{hdunums} are read and assigned as an
+  array of arrays to the variable referenced by \exmp{images}.  If the
+  file is a plain disk file opened read-only and cfitsio is
+  thread-safe, the images are divided among up to \exmp{nthreads}
+  threads, each of which opens the file again.  The current HDU of
+  \exmp{fptr} is not changed.
+\seealso{fits_read_all_images, _fits_read_img}
+\done
+
+\function{_fits_write_var_col}
+\synopsis{Write many cells of a variable length column}
+\usage{status = _fits_write_var_col (fptr, colnum, firstrow, values, offsets)}
+#v+
+   Fits_File_Type fptr;
+   Int_Type colnum;
+   Long_Type firstrow;
+   Array_Type values;
+   Long_Type offsets[];
+#v-
+\description
+  This function writes \exmp{length(offsets)-1} cells of the variable
+  length column \exmp{colnum}, where the cell in row
+  \exmp{firstrow+i} holds \exmp{values[[offsets[i]:offsets[i+1]-1]]}.
+  The data of all cells are written to the heap with a single call, and
+  the descriptors of all rows with another, so that this is much faster
+  than writing one cell at a time.  Numeric \exmp{P} and \exmp{Q}
+  columns are supported.
+  \xreferences{fits_write_col, fits_write_descript}
+\seealso{_fits_write_col, fits_write_binary_table}
+\done
+
+\function{_fits_read_rows}
+\synopsis{Read several columns of a range of rows}
+\usage{status = _fits_read_rows (fptr, columns, firstrow, numrows, arrays)}
+#v+
+   Fits_File_Type fptr;
+   Int_Type columns[];
+   Long_Type firstrow, numrows;
+   Ref_Type arrays;
+#v-
+\description
+  This function returns the same arrays as \ifun{_fits_read_cols}.
+  The rows are read as raw bytes with one call per run of consecutive
+  rows, and the fixed width numeric, logical and string columns of a
+  binary table are decoded from these bytes by the module, so that
+  reading a few rows does not require a cfitsio call per column.  Other
+  columns are read with cfitsio.  If \exmp{firstrow} and
+  \exmp{numrows} are replaced by a single \exmp{Long_Type} array of row
+  numbers (starting at 1), these rows are returned in that order.
+  \xreferences{fits_read_tblbytes}
+\seealso{fits_read_rows, _fits_read_cols}
+\done
+
+\function{_fits_search_sorted}
+\synopsis{Find the rows of a sorted column by binary search}
+\usage{status = _fits_search_sorted (fptr, col, values, side, descending, rows)}
+#v+
+   Fits_File_Type fptr;
+   Int_Type col, side, descending;
+   Int64_Type or Double_Type values[];
+   Ref_Type rows;
+#v-
+\description
+  For each of the \exmp{values}, this function finds the first row of
+  the sorted numeric column \exmp{col} whose value is greater than or
+  equal to it (\exmp{side=0}) or greater than it (\exmp{side=1}).  If
+  \exmp{descending} is non-zero, the column is taken to be in
+  descending order, and the comparisons are reversed.  The row numbers
+  are assigned to \exmp{rows}, with the number of rows plus one for a
+  value that is beyond the end of the column.  Each search reads single
+  cells, about log2 of the number of rows of them.  NaN values are
+  taken to sort after all others.  The cells of an integer column are
+  compared as 64 bit integers, so that \exmp{Int64_Type} values keep
+  their precision.  The column is assumed to be sorted.
+\seealso{_fits_get_sort_order, fits_read_col, fits_sort_table}
+\done
+
+\function{_fits_get_sort_order}
+\synopsis{Check whether a column is sorted}
+\usage{status = _fits_get_sort_order (fptr, col, order)}
+#v+
+   Fits_File_Type fptr;
+   Int_Type col;
+   Ref_Type order;
+#v-
+\description
+  This function reads the numeric scalar column \exmp{col} in blocks of
+  rows and assigns 1 to \exmp{order} if its values never decrease, -1
+  if they never increase, or 0 if the column is not sorted.  NaN values
+  are ignored.  The result is remembered for files that are opened
+  read-only and have not been modified since, so that checking the same
+  column again does not read it.
+\seealso{_fits_search_sorted, fits_read_col}
+\done
+
+\function{_fits_scan_headers}
+\synopsis{Read keywords from the headers of many files}
+\usage{status = _fits_scan_headers (files, keys, hdu, nthreads, values, errors)}
+#v+
+   String_Type files[], keys[];
+   Int_Type or String_Type or Null_Type hdu;
+   Int_Type nthreads;
+   Ref_Type values, errors;
+#v-
+\description
+  This function reads the \exmp{keys} from the specified HDU of each of
+  the \exmp{files}, which is given by number, by EXTNAME or HDUNAME,
+  or, if \exmp{hdu} is \NULL, is the first HDU with \exmp{NAXIS} not
+  equal to 0.  An array of arrays, one per key with an element per
+  file, is assigned to \exmp{values}, and an array with an error message
+  for each file that could not be read, and \NULL otherwise, to
+  \exmp{errors}.  The headers of plain FITS files are parsed by the
+  module; other files are read with cfitsio.  The files are divided
+  among \exmp{nthreads} threads, or as many as there are CPUs if
+  \exmp{nthreads} is 0.
+\seealso{fits_scan_headers}
+\done
@@ -29,13 +29,59 @@
 #include "config.h"
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#ifdef HAVE_STDLIB_H
+# include <stdlib.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#if defined(_POSIX_MAPPED_FILES) && (_POSIX_MAPPED_FILES > 0)
+# define HAVE_MMAP 1
+# define HAVE_COLUMN_CACHE 1
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <fcntl.h>
+# include <dirent.h>
+# include <utime.h>
+/* The nanoseconds of the file times, which tell apart versions of a
+ * file written within the same second.
+ */
+# if defined(__APPLE__)
+#  define STAT_MTIME_NSEC(st)	((long) (st).st_mtimespec.tv_nsec)
+#  define STAT_CTIME_NSEC(st)	((long) (st).st_ctimespec.tv_nsec)
+# elif defined(st_mtime)	       /* st_mtime is st_mtim.tv_sec */
+#  define STAT_MTIME_NSEC(st)	((long) (st).st_mtim.tv_nsec)
+#  define STAT_CTIME_NSEC(st)	((long) (st).st_ctim.tv_nsec)
+# else
+#  define STAT_MTIME_NSEC(st)	0L
+#  define STAT_CTIME_NSEC(st)	0L
+# endif
+#endif
 #include <math.h>
+#include <sys/time.h>
 #include <slang.h>
 
 #include <errno.h>
 
 #include "cfitsio.h"
 
+/* Background reads require a thread-safe cfitsio (fits_is_reentrant
+ * appeared in version 3.14, before CFITSIO_MAJOR was defined).
+ */
+#if defined(HAVE_LIBPTHREAD) && defined(_POSIX_THREADS) && (_POSIX_THREADS > 0) \
+   && defined(CFITSIO_MAJOR)
+# define HAVE_FITS_THREADS 1
+# include <pthread.h>
+#endif
+
+/* The gzidx:// driver reads the compressed file in place */
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ) && defined(HAVE_MMAP)
+# define HAVE_GZIP_INDEX 1
+# include <zlib.h>
+#endif
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -47,6 +93,10 @@ SLANG_MODULE(cfitsio);
 
 #include "version.h"
 
+#ifndef SLFUTURE_CONST
+# define SLFUTURE_CONST
+#endif
+
 /* This is a hack that works for all 32 and 64 bit systems that I know */
 /* The CFITSIO_INT*_TYPE objects must refer to the corresponding C type
  * and have the approriate length.
@@ -77,14 +127,430 @@ typedef int int32_type;
 # endif
 #endif
 
+/* Row numbers and counts are passed to the intrinsics as 64 bit integers
+ * and are LONGLONG internally.  Arrays are still indexed by SLindex_Type,
+ * see get_array_dim.
+ */
+#if (SIZEOF_LONG == 8)
+# define SLANG_ROWS_TYPE	SLANG_LONG_TYPE
+typedef long rows_type;
+#else
+# define SLANG_ROWS_TYPE	SLANG_LLONG_TYPE
+typedef long long rows_type;
+#endif
+
+/* Per-handle I/O and call statistics.  Every intrinsic that operates on an
+ * open file brackets its work with begin_call/end_call, which records the
+ * call under its name together with the wall time spent in the module.
+ * The lower level read and write routines do not see the FitsFile_Type,
+ * so they charge their I/O to the call in progress via Current_Call.
+ * Everything is also accumulated in Global_Stats.  Each call name gets a
+ * fixed index into Call_Names the first time it is seen, which is then
+ * found from the address of the name (a string literal) via a small
+ * hash table, so that end_call does not compare strings.
+ */
+#define MAX_STATS_CALL_NAMES	128
+#define CALL_NAME_HASH_SIZE	256	       /* a power of 2 */
+
+typedef struct
+{
+   unsigned long num_calls;
+   double secs;
+}
+Call_Stats_Type;
+
+typedef struct
+{
+   unsigned long num_calls;
+   unsigned long num_reads;	       /* cfitsio data read calls */
+   unsigned long num_writes;	       /* cfitsio data write calls */
+   double bytes_read;		       /* bytes of data moved */
+   double bytes_written;
+   unsigned long num_hdu_moves;
+   unsigned long num_key_reads;
+   double secs;			       /* wall time inside the module */
+   Call_Stats_Type calls[MAX_STATS_CALL_NAMES];	/* indexed as Call_Names */
+}
+Fits_Stats_Type;
+
 typedef struct
 {
    fitsfile *fptr;
+   Fits_Stats_Type stats;
+   /* The buffer of an in-memory file.  cfitsio keeps pointers to mem_ptr
+    * and mem_size, which must remain valid until the file is closed.  If
+    * mem_bstring is non-NULL, mem_ptr points into it and the file is
+    * read-only; otherwise mem_ptr was obtained from malloc.
+    */
+   void *mem_ptr;
+   size_t mem_size;
+   SLang_BString_Type *mem_bstring;
 }
 FitsFile_Type;
 
 static SLtype Fits_Type_Id = 0;
 
+/* A table whose columns are read when first accessed */
+typedef struct
+{
+   SLang_MMT_Type *file_mmt;	       /* the Fits_File_Type of the table */
+   SLang_Name_Type *reader;	       /* reader (fp, col, firstrow, nrows) */
+   int hdunum;
+   LONGLONG firstrow;
+   LONGLONG num_rows;
+   int num_columns;
+   char **names;		       /* slstrings */
+   int *colnums;
+   SLang_Array_Type **data;	       /* NULL if not yet read */
+}
+FitsTable_Type;
+
+static SLtype Fits_Table_Type_Id = 0;
+
+static char *Call_Names[MAX_STATS_CALL_NAMES];
+static unsigned int Num_Call_Names = 0;
+static struct
+{
+   char *name;
+   int index;
+}
+Call_Name_Hash[CALL_NAME_HASH_SIZE];
+
+typedef struct _Call_Context_Type
+{
+   char *name;
+   FitsFile_Type *ft;		       /* NULL if no handle is involved */
+   struct _Call_Context_Type *prev;
+   double t0;
+   double num_elements;		       /* data transferred by this call */
+   double num_bytes;
+}
+Call_Context_Type;
+
+static Fits_Stats_Type Global_Stats;
+static Call_Context_Type *Current_Call = NULL;
+
+#define COUNT_STAT(field, n) \
+   do \
+     { \
+	Global_Stats.field += (n); \
+	if ((Current_Call != NULL) && (Current_Call->ft != NULL)) \
+	  Current_Call->ft->stats.field += (n); \
+     } \
+   while (0)
+
+static double get_wall_time (void)
+{
+   struct timeval tv;
+
+   if (-1 == gettimeofday (&tv, NULL))
+     return 0.0;
+   return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static void begin_call (Call_Context_Type *cc, FitsFile_Type *ft, char *name)
+{
+   cc->name = name;
+   cc->ft = ft;
+   cc->num_elements = 0.0;
+   cc->num_bytes = 0.0;
+   cc->prev = Current_Call;
+   Current_Call = cc;
+   cc->t0 = get_wall_time ();
+}
+
+/* Used by the intrinsics that pop their own arguments, which do not know
+ * the handle when the call begins.  Since the handle may be freed along
+ * with its mmt, these must call end_call before SLang_free_mmt.
+ */
+static void set_call_handle (Call_Context_Type *cc, FitsFile_Type *ft)
+{
+   cc->ft = ft;
+}
+
+/* Returns the index of the call name in Call_Names, or -1 if the table
+ * is full.
+ */
+static int get_call_index (char *name)
+{
+   unsigned int h = (unsigned int) (((unsigned long) name >> 3) & (CALL_NAME_HASH_SIZE - 1));
+   unsigned int i, k;
+
+   for (k = 0; k < CALL_NAME_HASH_SIZE; k++)
+     {
+	unsigned int j = (h + k) & (CALL_NAME_HASH_SIZE - 1);
+	if (Call_Name_Hash[j].name == name)
+	  return Call_Name_Hash[j].index;
+	if (Call_Name_Hash[j].name == NULL)
+	  break;
+     }
+
+   /* The same name may be used by several callers */
+   for (i = 0; i < Num_Call_Names; i++)
+     {
+	if (0 == strcmp (Call_Names[i], name))
+	  break;
+     }
+   if (i == Num_Call_Names)
+     {
+	if (i == MAX_STATS_CALL_NAMES)
+	  return -1;
+	Call_Names[Num_Call_Names++] = name;
+     }
+   if (k < CALL_NAME_HASH_SIZE)
+     {
+	k = (h + k) & (CALL_NAME_HASH_SIZE - 1);
+	Call_Name_Hash[k].name = name;
+	Call_Name_Hash[k].index = (int) i;
+     }
+   return (int) i;
+}
+
+static void add_call_stats (Fits_Stats_Type *s, int index, double secs)
+{
+   s->num_calls++;
+   s->secs += secs;
+   if (index < 0)
+     return;
+   s->calls[index].num_calls++;
+   s->calls[index].secs += secs;
+}
+
+/* Call tracing.  When enabled, each call is recorded in a ring buffer that
+ * is allocated when tracing starts.  The buffer is written out as Chrome
+ * trace-event JSON (chrome://tracing, Perfetto) when tracing stops, or at
+ * exit if tracing was never stopped.
+ */
+#define TRACE_ENV_VAR		"CFITSIO_MODULE_TRACE"
+#define DEFAULT_MAX_TRACE_EVENTS	65536
+
+typedef struct
+{
+   char *name;
+   int hdu;
+   double num_elements;
+   double num_bytes;
+   double t0, t1;
+}
+Trace_Event_Type;
+
+static Trace_Event_Type *Trace_Events = NULL;   /* non-NULL when tracing */
+static unsigned long Trace_Max_Events;
+static unsigned long Trace_Num_Events;	       /* total, including overwritten */
+static char *Trace_File = NULL;
+static double Trace_Start_Time;
+
+static void record_trace_event (Call_Context_Type *cc, double t1)
+{
+   Trace_Event_Type *ev;
+   FitsFile_Type *ft = cc->ft;
+
+   ev = Trace_Events + (Trace_Num_Events % Trace_Max_Events);
+   Trace_Num_Events++;
+
+   ev->name = cc->name;
+   ev->hdu = 0;
+   if ((ft != NULL) && (ft->fptr != NULL))
+     (void) fits_get_hdu_num (ft->fptr, &ev->hdu);
+   ev->num_elements = cc->num_elements;
+   ev->num_bytes = cc->num_bytes;
+   ev->t0 = cc->t0;
+   ev->t1 = t1;
+}
+
+static void free_trace (void)
+{
+   if (Trace_Events != NULL)
+     SLfree ((char *) Trace_Events);
+   Trace_Events = NULL;
+   if (Trace_File != NULL)
+     SLfree (Trace_File);
+   Trace_File = NULL;
+}
+
+static int write_trace_file (void)
+{
+   FILE *fp;
+   unsigned long i, n, first;
+   long pid = 0;
+   int ret = 0;
+
+   if (NULL == (fp = fopen (Trace_File, "w")))
+     return -1;
+
+#ifdef HAVE_UNISTD_H
+   pid = (long) getpid ();
+#endif
+
+   n = Trace_Num_Events;
+   first = 0;
+   if (n > Trace_Max_Events)
+     {
+	first = n % Trace_Max_Events;
+	n = Trace_Max_Events;
+     }
+
+   (void) fputs ("{\"traceEvents\":[\n", fp);
+   for (i = 0; i < n; i++)
+     {
+	Trace_Event_Type *ev = Trace_Events + ((first + i) % Trace_Max_Events);
+
+	if (0 > fprintf (fp, "%s{\"name\":\"%s\",\"cat\":\"cfitsio\",\"ph\":\"X\",\"pid\":%ld,\"tid\":0,"
+			 "\"ts\":%.3f,\"dur\":%.3f,"
+			 "\"args\":{\"hdu\":%d,\"elements\":%.0f,\"bytes\":%.0f}}",
+			 (i ? ",\n" : ""), ev->name, pid,
+			 1e6*(ev->t0 - Trace_Start_Time), 1e6*(ev->t1 - ev->t0),
+			 ev->hdu, ev->num_elements, ev->num_bytes))
+	  {
+	     ret = -1;
+	     break;
+	  }
+     }
+   (void) fprintf (fp, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%lu}}\n",
+		   Trace_Num_Events - n);
+
+   if (-1 == fclose (fp))
+     ret = -1;
+   return ret;
+}
+
+static void trace_atexit (void)
+{
+   if (Trace_Events == NULL)
+     return;
+
+   if (-1 == write_trace_file ())
+     fprintf (stderr, "*** Unable to write the cfitsio trace file %s\n", Trace_File);
+   free_trace ();
+}
+
+static int start_trace (char *file, unsigned long max_events)
+{
+   static int atexit_registered = 0;
+
+   free_trace ();
+
+   if (max_events == 0)
+     max_events = DEFAULT_MAX_TRACE_EVENTS;
+
+   if (NULL == (Trace_File = SLmalloc (strlen (file) + 1)))
+     return -1;
+   strcpy (Trace_File, file);
+
+   Trace_Events = (Trace_Event_Type *) SLmalloc (max_events * sizeof (Trace_Event_Type));
+   if (Trace_Events == NULL)
+     {
+	free_trace ();
+	return -1;
+     }
+   Trace_Max_Events = max_events;
+   Trace_Num_Events = 0;
+   Trace_Start_Time = get_wall_time ();
+
+   if (atexit_registered == 0)
+     {
+	(void) atexit (trace_atexit);
+	atexit_registered = 1;
+     }
+   return 0;
+}
+
+/* Returns status so that it may be used as: return end_call (&cc, status); */
+static int end_call (Call_Context_Type *cc, int status)
+{
+   double t1 = get_wall_time ();
+   double secs = t1 - cc->t0;
+   int index = get_call_index (cc->name);
+
+   add_call_stats (&Global_Stats, index, secs);
+   if (cc->ft != NULL)
+     add_call_stats (&cc->ft->stats, index, secs);
+   if (Trace_Events != NULL)
+     record_trace_event (cc, t1);
+   Current_Call = cc->prev;
+   return status;
+}
+
+static void count_io (double num_elements, double num_bytes)
+{
+   if (Current_Call == NULL)
+     return;
+   Current_Call->num_elements += num_elements;
+   Current_Call->num_bytes += num_bytes;
+}
+
+static void count_read (double num_elements, unsigned int sizeof_elem)
+{
+   COUNT_STAT(num_reads, 1);
+   COUNT_STAT(bytes_read, num_elements * sizeof_elem);
+   count_io (num_elements, num_elements * sizeof_elem);
+}
+
+static void count_write (double num_elements, unsigned int sizeof_elem)
+{
+   COUNT_STAT(num_writes, 1);
+   COUNT_STAT(bytes_written, num_elements * sizeof_elem);
+   count_io (num_elements, num_elements * sizeof_elem);
+}
+
+static int pop_rows_value (LONGLONG *np)
+{
+   rows_type n;
+
+#if (SIZEOF_LONG == 8)
+   if (-1 == SLang_pop_long (&n))
+     return -1;
+#else
+   if (-1 == SLang_pop_long_long (&n))
+     return -1;
+#endif
+   *np = (LONGLONG) n;
+   return 0;
+}
+
+static int push_rows_value (LONGLONG n)
+{
+   int in = (int) n;
+
+   if ((LONGLONG) in == n)
+     return SLang_push_integer (in);
+#if (SIZEOF_LONG == 8)
+   return SLang_push_long ((long) n);
+#else
+   return SLang_push_long_long ((long long) n);
+#endif
+}
+
+/* Values that fit are returned as Int_Type, as they were before rows were
+ * 64 bit quantities.
+ */
+static int assign_rows_value (SLang_Ref_Type *ref, LONGLONG n)
+{
+   rows_type rn = (rows_type) n;
+   int in = (int) n;
+
+   if ((LONGLONG) in == n)
+     return SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &in);
+   return SLang_assign_to_ref (ref, SLANG_ROWS_TYPE, (VOID_STAR) &rn);
+}
+
+/* An array dimension of n elements.  This fails if n does not fit into an
+ * SLindex_Type, in which case fewer rows must be read at a time.
+ */
+static int get_array_dim (LONGLONG n, SLindex_Type *dimp)
+{
+   SLindex_Type dim = (SLindex_Type) n;
+
+   if ((n < 0) || ((LONGLONG) dim != n))
+     {
+	SLang_verror (SL_LIMIT_EXCEEDED, "%.0f elements are too many for an array; read fewer rows at a time",
+		      (double) n);
+	return -1;
+     }
+   *dimp = dim;
+   return 0;
+}
+
 /* This routine is used for binary tables --- not keywords.  For a binary table,
  * TLONG always specifies a 32 bit integer, but for a keyword is simply means
  * a long integer.
@@ -171,8 +637,20 @@ static int map_fitsio_type_to_slang (int *typep, long *repeat, SLtype *stype)
 	     *stype = SLANG_INT32_TYPE;
 	     break;
 	  }
-	SLang_verror (SL_NOT_IMPLEMENTED, "bit type %ldX is not supported", *repeat);
-	return -1;
+#ifdef SLANG_INT64_TYPE
+	if (*repeat <= 64)
+	  {
+	     *repeat = 1;
+	     *stype = SLANG_INT64_TYPE;
+	     break;
+	  }
+#endif
+	/* Wider columns are split into 32 bit words; see
+	 * packed_bits_to_words.
+	 */
+	*repeat = (*repeat + 31)/32;
+	*stype = SLANG_INT32_TYPE;
+	break;
 
       case TSTRING:
 	*stype = SLANG_STRING_TYPE;
@@ -187,7 +665,7 @@ static int map_fitsio_type_to_slang (int *typep, long *repeat, SLtype *stype)
    return 0;
 }
 
-static int open_file (SLang_Ref_Type *ref, char *filename, char *mode)
+static int do_open_file (SLang_Ref_Type *ref, char *filename, char *mode)
 {
    fitsfile *fptr;
    int status;
@@ -256,137 +734,384 @@ static int open_file (SLang_Ref_Type *ref, char *filename, char *mode)
    return status;
 }
 
-static int delete_file (FitsFile_Type *ft)
+static void free_fits_memory (FitsFile_Type *ft)
 {
-   int status = 0;
+   if (ft->mem_bstring != NULL)
+     SLbstring_free (ft->mem_bstring);
+   else if (ft->mem_ptr != NULL)
+     free (ft->mem_ptr);
+   ft->mem_bstring = NULL;
+   ft->mem_ptr = NULL;
+   ft->mem_size = 0;
+}
 
+/* Close the cfitsio handle and release the buffer of an in-memory file */
+static void close_fits_handle (FitsFile_Type *ft, int *status)
+{
    if (ft->fptr != NULL)
-     fits_delete_file (ft->fptr, &status);
+     (void) fits_close_file (ft->fptr, status);
    ft->fptr = NULL;
-   return status;
+   free_fits_memory (ft);
 }
 
-static int close_file (FitsFile_Type *ft)
+static int push_fits_file_type (SLang_Ref_Type *ref, FitsFile_Type *ft)
 {
-   int status = 0;
+   SLang_MMT_Type *mmt;
 
-   status = 0;
-   if (ft->fptr != NULL)
+   if (NULL == (mmt = SLang_create_mmt (Fits_Type_Id, (VOID_STAR) ft)))
      {
-	(void) fits_close_file (ft->fptr, &status);
-	ft->fptr = NULL;
+	int status = 0;
+	close_fits_handle (ft, &status);
+	SLfree ((char *) ft);
+	return -1;
      }
-   return status;
-}
 
-static int movnam_hdu (FitsFile_Type *ft, int *hdutype, char *extname, int *extvers)
-{
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   return fits_movnam_hdu (ft->fptr, *hdutype, extname, *extvers, &status);
+   if (-1 == SLang_assign_to_ref (ref, Fits_Type_Id, &mmt))
+     {
+	SLang_free_mmt (mmt);	       /* This will close the file */
+	return -1;
+     }
+   return 0;
 }
 
-static int movabs_hdu (FitsFile_Type *ft, int *n)
-{
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   return fits_movabs_hdu (ft->fptr, *n, NULL, &status);
-}
+#define MEMFILE_DELTA_SIZE (10*2880)
 
-static int movrel_hdu (FitsFile_Type *ft, int *n)
+/* Usage: status = _fits_open_memory (&fp, bstring, mode)
+ * For mode "r", cfitsio reads directly from the bstring.  For "w", the
+ * bytes are copied to a buffer that may grow as the file is modified.
+ */
+static int open_memory (void)
 {
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   return fits_movrel_hdu (ft->fptr, *n, NULL, &status);
-}
+   Call_Context_Type cc;
+   SLang_Ref_Type *ref = NULL;
+   SLang_BString_Type *b = NULL;
+   FitsFile_Type *ft;
+   char *mode = NULL;
+   unsigned char *bytes;
+   SLstrlen_Type len;
+   int status = -1;
 
-static int get_num_hdus (FitsFile_Type *ft, SLang_Ref_Type *ref)
-{
-   int status = 0;
-   int num;
+   begin_call (&cc, NULL, "_fits_open_memory");
 
-   if (ft->fptr == NULL)
-     return -1;
+   if ((-1 == SLang_pop_slstring (&mode))
+       || (-1 == SLang_pop_bstring (&b))
+       || (-1 == SLang_pop_ref (&ref))
+       || (-1 == SLang_assign_to_ref (ref, SLANG_NULL_TYPE, NULL)))
+     goto free_and_return;
 
-   if (0 == fits_get_num_hdus (ft->fptr, &num, &status))
+   if ((*mode != 'r') && (*mode != 'w'))
      {
-	if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, &num))
-	  return -1;
+	SLang_verror (SL_INVALID_PARM, "fits_open_memory: iomode \"%s\" is invalid", mode);
+	goto free_and_return;
      }
 
-   return status;
-}
-
-static int get_hdu_num (FitsFile_Type *ft)
-{
-   int num;
-   if (ft->fptr == NULL)
-     return -1;
-   return fits_get_hdu_num (ft->fptr, &num);
-}
+   if (NULL == (bytes = SLbstring_get_pointer (b, &len)))
+     goto free_and_return;
 
-static int get_hdu_type (FitsFile_Type *ft, SLang_Ref_Type *ref)
-{
-   int hdutype;
-   int status = 0;
+   if (NULL == (ft = (FitsFile_Type *) SLmalloc (sizeof (FitsFile_Type))))
+     goto free_and_return;
+   memset ((char *) ft, 0, sizeof (FitsFile_Type));
 
-   if (ft->fptr == NULL)
-     return -1;
-   if (0 == fits_get_hdu_type (ft->fptr, &hdutype, &status))
+   status = 0;
+   if (*mode == 'r')
      {
-	if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, &hdutype))
-	  return -1;
+	ft->mem_bstring = b;
+	b = NULL;
+	ft->mem_ptr = (void *) bytes;
+	ft->mem_size = len;
+	(void) fits_open_memfile (&ft->fptr, "mem.fits", READONLY, &ft->mem_ptr,
+				  &ft->mem_size, 0, NULL, &status);
      }
-   return status;
-}
-
-static int copy_file (FitsFile_Type *ft, FitsFile_Type *gt,
-		      int *prev, int *cur, int *next)
-{
-   int status = 0;
-
+   else
+     {
+	if (NULL == (ft->mem_ptr = malloc (len ? len : 1)))
+	  {
+	     SLang_set_error (SL_MALLOC_ERROR);
+	     SLfree ((char *) ft);
+	     status = -1;
+	     goto free_and_return;
+	  }
+	memcpy (ft->mem_ptr, bytes, len);
+	ft->mem_size = len;
+	(void) fits_open_memfile (&ft->fptr, "mem.fits", READWRITE, &ft->mem_ptr,
+				  &ft->mem_size, MEMFILE_DELTA_SIZE, realloc, &status);
+     }
+
+   if (status || (ft->fptr == NULL))
+     {
+	int status1 = 0;
+	close_fits_handle (ft, &status1);
+	SLfree ((char *) ft);
+	if (status == 0) status = -1;
+	goto free_and_return;
+     }
+
+   if (-1 == push_fits_file_type (ref, ft))
+     status = -1;
+
+   free_and_return:
+   if (b != NULL)
+     SLbstring_free (b);
+   SLang_free_ref (ref);
+   SLang_free_slstring (mode);
+   return end_call (&cc, status);
+}
+
+/* Usage: status = _fits_create_memory (&fp) */
+static int create_memory (SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   FitsFile_Type *ft;
+   int status = 0;
+
+   begin_call (&cc, NULL, "_fits_create_memory");
+
+   if (-1 == SLang_assign_to_ref (ref, SLANG_NULL_TYPE, NULL))
+     return end_call (&cc, -1);
+
+   if (NULL == (ft = (FitsFile_Type *) SLmalloc (sizeof (FitsFile_Type))))
+     return end_call (&cc, -1);
+   memset ((char *) ft, 0, sizeof (FitsFile_Type));
+
+   ft->mem_size = 2880;
+   if (NULL == (ft->mem_ptr = malloc (ft->mem_size)))
+     {
+	SLang_set_error (SL_MALLOC_ERROR);
+	SLfree ((char *) ft);
+	return end_call (&cc, -1);
+     }
+
+   (void) fits_create_memfile (&ft->fptr, &ft->mem_ptr, &ft->mem_size,
+			       MEMFILE_DELTA_SIZE, realloc, &status);
+   if (status || (ft->fptr == NULL))
+     {
+	int status1 = 0;
+	close_fits_handle (ft, &status1);
+	SLfree ((char *) ft);
+	return end_call (&cc, status ? status : -1);
+     }
+
+   if (-1 == push_fits_file_type (ref, ft))
+     status = -1;
+   return end_call (&cc, status);
+}
+
+/* Usage: status = _fits_get_memory_bytes (fp, &bstring) */
+static int get_memory_bytes (FitsFile_Type *ft, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   SLang_BString_Type *b;
+   size_t size;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_get_memory_bytes");
+
+   if (ft->mem_ptr == NULL)
+     {
+	SLang_verror (SL_INVALID_PARM, "fits_get_memory_bytes: not an in-memory file");
+	return end_call (&cc, -1);
+     }
+
+   if ((ft->mem_bstring == NULL)
+       && fits_flush_file (ft->fptr, &status))
+     return end_call (&cc, status);
+
+   size = ft->mem_size;
+   if ((ft->fptr->Fptr != NULL)
+       && (ft->fptr->Fptr->filesize >= 0)
+       && ((size_t) ft->fptr->Fptr->filesize < size))
+     size = (size_t) ft->fptr->Fptr->filesize;
+
+   if (NULL == (b = SLbstring_create ((unsigned char *) ft->mem_ptr, size)))
+     return end_call (&cc, -1);
+
+   count_io (0, (double) size);
+   if (-1 == SLang_assign_to_ref (ref, SLANG_BSTRING_TYPE, (VOID_STAR) &b))
+     status = -1;
+   SLbstring_free (b);
+   return end_call (&cc, status);
+}
+
+static int open_file (SLang_Ref_Type *ref, char *filename, char *mode)
+{
+   Call_Context_Type cc;
+
+   begin_call (&cc, NULL, "_fits_open_file");
+   return end_call (&cc, do_open_file (ref, filename, mode));
+}
+
+static int delete_file (FitsFile_Type *ft)
+{
+   Call_Context_Type cc;
+   int status = 0;
+
+   begin_call (&cc, ft, "_fits_delete_file");
+   if (ft->fptr != NULL)
+     fits_delete_file (ft->fptr, &status);
+   ft->fptr = NULL;
+   free_fits_memory (ft);
+   return end_call (&cc, status);
+}
+
+static int close_file (FitsFile_Type *ft)
+{
+   Call_Context_Type cc;
+   int status = 0;
+
+   status = 0;
+   if (ft->fptr != NULL)
+     {
+	begin_call (&cc, ft, "_fits_close_file");
+	close_fits_handle (ft, &status);
+	(void) end_call (&cc, status);
+     }
+   return status;
+}
+
+static int movnam_hdu (FitsFile_Type *ft, int *hdutype, char *extname, int *extvers)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_movnam_hdu");
+   COUNT_STAT(num_hdu_moves, 1);
+   return end_call (&cc, fits_movnam_hdu (ft->fptr, *hdutype, extname, *extvers, &status));
+}
+
+static int movabs_hdu (FitsFile_Type *ft, int *n)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_movabs_hdu");
+   COUNT_STAT(num_hdu_moves, 1);
+   return end_call (&cc, fits_movabs_hdu (ft->fptr, *n, NULL, &status));
+}
+
+static int movrel_hdu (FitsFile_Type *ft, int *n)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_movrel_hdu");
+   COUNT_STAT(num_hdu_moves, 1);
+   return end_call (&cc, fits_movrel_hdu (ft->fptr, *n, NULL, &status));
+}
+
+static int get_num_hdus (FitsFile_Type *ft, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   int num;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_get_num_hdus");
+
+   if (0 == fits_get_num_hdus (ft->fptr, &num, &status))
+     {
+	if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, &num))
+	  return end_call (&cc, -1);
+     }
+
+   return end_call (&cc, status);
+}
+
+static int get_hdu_num (FitsFile_Type *ft)
+{
+   Call_Context_Type cc;
+   int num;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_get_hdu_num");
+   return end_call (&cc, fits_get_hdu_num (ft->fptr, &num));
+}
+
+static int get_hdu_type (FitsFile_Type *ft, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   int hdutype;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_get_hdu_type");
+   if (0 == fits_get_hdu_type (ft->fptr, &hdutype, &status))
+     {
+	if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, &hdutype))
+	  return end_call (&cc, -1);
+     }
+   return end_call (&cc, status);
+}
+
+static int copy_file (FitsFile_Type *ft, FitsFile_Type *gt,
+		      int *prev, int *cur, int *next)
+{
+   Call_Context_Type cc;
+   int status = 0;
+
    if ((ft->fptr == NULL) || (gt->fptr == NULL))
      return -1;
+
+   begin_call (&cc, ft, "_fits_copy_file");
 #ifndef fits_copy_file
    (void) status; (void) prev; (void) cur; (void) next;
    SLang_verror (SL_NOT_IMPLEMENTED, "Not supported by this version of cfitsio");
-   return -1;
+   return end_call (&cc, -1);
 #else
-   return fits_copy_file (ft->fptr, gt->fptr, *prev, *cur, *next, &status);
+   return end_call (&cc, fits_copy_file (ft->fptr, gt->fptr, *prev, *cur, *next, &status));
 #endif
 }
 
 static int copy_hdu (FitsFile_Type *ft, FitsFile_Type *gt, int *morekeys)
 {
+   Call_Context_Type cc;
    int status = 0;
 
    if ((ft->fptr == NULL) || (gt->fptr == NULL))
      return -1;
 
-   return fits_copy_hdu (ft->fptr, gt->fptr, *morekeys, &status);
+   begin_call (&cc, ft, "_fits_copy_hdu");
+
+   return end_call (&cc, fits_copy_hdu (ft->fptr, gt->fptr, *morekeys, &status));
 }
 
 static int copy_header (FitsFile_Type *ft, FitsFile_Type *gt)
 {
+   Call_Context_Type cc;
    int status = 0;
 
    if ((ft->fptr == NULL) || (gt->fptr == NULL))
      return -1;
 
-   return fits_copy_header (ft->fptr, gt->fptr, &status);
+   begin_call (&cc, ft, "_fits_copy_header");
+
+   return end_call (&cc, fits_copy_header (ft->fptr, gt->fptr, &status));
 }
 
 static int delete_hdu (FitsFile_Type *ft)
 {
+   Call_Context_Type cc;
    int status = 0;
 
    if (ft->fptr == NULL)
      return -1;
 
-   return fits_delete_hdu (ft->fptr, NULL, &status);
+   begin_call (&cc, ft, "_fits_delete_hdu");
+
+   return end_call (&cc, fits_delete_hdu (ft->fptr, NULL, &status));
 }
 
 static int pop_string_or_null (char **s)
@@ -425,1966 +1150,9483 @@ static FitsFile_Type *pop_fits_type (SLang_MMT_Type **mmt)
    return ft;
 }
 
-static int create_img (FitsFile_Type *ft, int *bitpix,
-		       SLang_Array_Type *at_naxes)
+/* Copying a subset of a binary table.  The output table is created with
+ * the TTYPE/TFORM/TUNIT values of the selected columns, and the other
+ * keywords of the input header are copied, with the column specific ones
+ * (TDIMn, TNULLn, TSCALn, TCTYPn, iCRVLn, ...) renumbered or dropped.
+ * The rows are copied in blocks as raw bytes.  The descriptors of
+ * variable length columns cannot be copied that way, so their cells are
+ * read and written individually, which appends them to the output heap.
+ */
+#define COPY_TABLE_BLOCK_BYTES	(1L << 20)
+
+/* The roots of the column specific keywords of the FITS standard and of
+ * the WCS conventions for tables.  Those of the axis keywords follow the
+ * axis number(s) i or ij, e.g., 1CTYP5 or 12PC5; the others precede the
+ * column number.
+ */
+static const char *Column_Keyword_Roots[] =
 {
-   long *axes;
-   unsigned int i, imax;
-   int status = 0;
+   "TTYPE", "TFORM", "TUNIT", "TSCAL", "TZERO", "TNULL", "TDISP", "TDIM",
+   "TBCOL", "TLMIN", "TLMAX", "TDMIN", "TDMAX",
+   "TCTYP", "TCUNI", "TCRVL", "TCDLT", "TCRPX", "TCROT", "TCNAM", "TCRDE",
+   "TCSYE", "TCTY", "TCUN", "TCRV", "TCDE", "TCRP", "TCSY", "TWCS",
+   "TPC", "TCD", "TPV", "TPS", "TP", "TC", "TV", "TS",
+   "WCAX", "WCSN", "WCST", "LONP", "LATP", "EQUI", "RADE", "MJDOB", "MJDA",
+   "DOBS", "DAVG", "RFRQ", "RWAV", "SPEC", "SSYS", "SOBS", "VSYS", "ZSOU",
+   "VELA", NULL
+};
 
-   if (ft->fptr == NULL)
-     return -1;
+static const char *Axis_Keyword_Roots[] =
+{
+   "CTYP", "CUNI", "CRVL", "CDLT", "CRPX", "CROT", "CNAM", "CRDE", "CSYE",
+   "CTY", "CUN", "CRV", "CDE", "CRP", "CSY", "PC", "CD", "PV", "PS",
+   "V", "S", NULL
+};
 
-   if (at_naxes->data_type != SLANG_INT_TYPE)
+/* Returns the column number of a column specific keyword, or 0 if the
+ * keyword is not specific to a column.  The position and length of the
+ * number in the name are returned via pos and len.
+ */
+static int get_keyword_column (const char *name, int *pos, int *len)
+{
+   const char *p = name, *root;
+   const char **roots = Column_Keyword_Roots;
+   int col = 0;
+
+   while (isdigit ((unsigned char) *p))
+     p++;
+   if (p != name)
+     roots = Axis_Keyword_Roots;
+
+   root = p;
+   while (isupper ((unsigned char) *p))
+     p++;
+
+   if ((p == root) || (0 == isdigit ((unsigned char) *p)))
+     return 0;
+
+   while (*roots != NULL)
      {
-	SLang_verror (SL_TYPE_MISMATCH,
-		      "fits_create_img: naxis must be an integer array");
-	return -1;
+	if ((strlen (*roots) == (size_t) (p - root))
+	    && (0 == strncmp (root, *roots, p - root)))
+	  break;
+	roots++;
      }
+   if (*roots == NULL)
+     return 0;
 
-   imax = at_naxes->num_elements;
-   axes = (long *) SLmalloc ((imax+1) * sizeof (long));
-   if (axes == NULL)
-     return -1;
+   *pos = (int) (p - name);
+   while (isdigit ((unsigned char) *p))
+     {
+	col = 10 * col + (*p - '0');
+	if (col > 999)
+	  return 0;
+	p++;
+     }
+   *len = (int) (p - name) - *pos;
+   return col;
+}
 
-   /* Transpose to FORTRAN order */
-   for (i = 0; i < imax; i++)
-     axes[i] = ((int *) at_naxes->data)[imax-(i+1)];
+static int is_table_structure_keyword (const char *name)
+{
+   static const char *Structure_Keywords[] =
+     {
+	"XTENSION", "BITPIX", "NAXIS", "NAXIS1", "NAXIS2", "PCOUNT", "GCOUNT",
+	"TFIELDS", "THEAP", "EXTNAME", "CHECKSUM", "DATASUM", "END", NULL
+     };
+   static const char *Column_Keywords[] =
+     {
+	"TTYPE", "TFORM", "TUNIT", "TBCOL", NULL
+     };
+   const char **k;
 
-   (void) fits_create_img (ft->fptr, *bitpix, imax, axes, &status);
-   SLfree ((char *) axes);
-   return status;
+   for (k = Structure_Keywords; *k != NULL; k++)
+     {
+	if (0 == strcmp (name, *k))
+	  return 1;
+     }
+   for (k = Column_Keywords; *k != NULL; k++)
+     {
+	size_t n = strlen (*k);
+	if ((0 == strncmp (name, *k, n)) && isdigit ((unsigned char) name[n]))
+	  return 1;
+     }
+   return 0;
 }
 
-static int write_img (FitsFile_Type *ft, SLang_Array_Type *at)
+static int copy_table_keywords (fitsfile *in, fitsfile *out, int *cols, int num_cols,
+				int *status)
 {
-   int type;
-   int status = 0;
+   char card[FLEN_CARD], newcard[FLEN_CARD];
+   char name[FLEN_KEYWORD], newname[FLEN_KEYWORD];
+   int nkeys, morekeys, tfields;
+   int i, j, keep = 1;
 
-   if (ft->fptr == NULL)
-     return -1;
+   if (fits_get_hdrspace (in, &nkeys, &morekeys, status)
+       || fits_read_key (in, TINT, "TFIELDS", &tfields, NULL, status))
+     return *status;
 
-   switch (at->data_type)
+   for (i = 1; i <= nkeys; i++)
      {
-      case SLANG_STRING_TYPE:
-	type = TSTRING;
-	break;
+	int namelen, col, pos, len;
 
-      case SLANG_DOUBLE_TYPE:
-	type = TDOUBLE;
-	break;
+	if (fits_read_record (in, i, card, status))
+	  return *status;
+	if (0 == strncmp (card, "CONTINUE", 8))
+	  {
+	     /* Follows the fate of the keyword that it continues */
+	     if (keep && fits_write_record (out, card, status))
+	       return *status;
+	     continue;
+	  }
+	if (fits_get_keyname (card, name, &namelen, status))
+	  return *status;
 
-      case SLANG_FLOAT_TYPE:
-	type = TFLOAT;
-	break;
+	keep = 0;
+	if (is_table_structure_keyword (name))
+	  continue;
 
-      case SLANG_INT16_TYPE:
-	type = CFITSIO_INT16_TYPE;
-	break;
+	col = get_keyword_column (name, &pos, &len);
+	if ((col == 0) || (col > tfields) || (namelen > 8))
+	  {
+	     keep = 1;
+	     if (fits_write_record (out, card, status))
+	       return *status;
+	     continue;
+	  }
 
-      case SLANG_UINT16_TYPE:
-	type = CFITSIO_UINT16_TYPE;
-	break;
+	/* A column may be selected more than once */
+	for (j = 0; j < num_cols; j++)
+	  {
+	     if (cols[j] != col)
+	       continue;
+	     sprintf (newname, "%.*s%d%s", pos, name, j + 1, name + pos + len);
+	     if (strlen (newname) > 8)
+	       continue;
+	     sprintf (newcard, "%-8s%s", newname, card + 8);
+	     keep = 1;
+	     if (fits_write_record (out, newcard, status))
+	       return *status;
+	  }
+     }
+   return *status;
+}
 
-      case SLANG_INT32_TYPE:
-	type = CFITSIO_INT32_TYPE;
-	break;
+static int create_table_copy (fitsfile *in, fitsfile *out, int *cols, int num_cols,
+			      LONGLONG num_rows, int *status)
+{
+   char **ttype, **tform, **tunit;
+   char keyname[FLEN_KEYWORD];
+   char extname[FLEN_VALUE];
+   char *ext = NULL;
+   int i;
 
-      case SLANG_UINT32_TYPE:
-	type = CFITSIO_UINT32_TYPE;
-	break;
+   ttype = (char **) SLcalloc (3 * num_cols, sizeof (char *));
+   if (ttype == NULL)
+     return *status = MEMORY_ALLOCATION;
+   tform = ttype + num_cols;
+   tunit = tform + num_cols;
 
-      case SLANG_CHAR_TYPE:
-      case SLANG_UCHAR_TYPE:
-	type = TBYTE;
-	break;
+   for (i = 0; i < 3 * num_cols; i++)
+     {
+	if (NULL == (ttype[i] = (char *) SLmalloc (FLEN_VALUE)))
+	  {
+	     *status = MEMORY_ALLOCATION;
+	     goto free_and_return;
+	  }
+	ttype[i][0] = 0;
+     }
 
-#ifdef SLANG_INT64_TYPE
-      case SLANG_INT64_TYPE:
-	type = CFITSIO_INT64_TYPE;
-	break;
-#endif
+   for (i = 0; i < num_cols; i++)
+     {
+	sprintf (keyname, "TFORM%d", cols[i]);
+	if (fits_read_key (in, TSTRING, keyname, tform[i], NULL, status))
+	  goto free_and_return;
+	sprintf (keyname, "TTYPE%d", cols[i]);
+	(void) fits_read_key (in, TSTRING, keyname, ttype[i], NULL, status);
+	if (*status == KEY_NO_EXIST) *status = 0;
+	sprintf (keyname, "TUNIT%d", cols[i]);
+	(void) fits_read_key (in, TSTRING, keyname, tunit[i], NULL, status);
+	if (*status == KEY_NO_EXIST) *status = 0;
+     }
+   (void) fits_read_key (in, TSTRING, "EXTNAME", extname, NULL, status);
+   if (*status == 0)
+     ext = extname;
+   else if (*status == KEY_NO_EXIST)
+     *status = 0;
+   fits_clear_errmsg ();
 
-      default:
-	SLang_verror (SL_NOT_IMPLEMENTED,
-		      "fits_write_img: %s not supported",
-		      SLclass_get_datatype_name (at->data_type));
-	return -1;
+   if (*status == 0)
+     {
+	(void) fits_create_tbl (out, BINARY_TBL, num_rows, num_cols, ttype, tform, tunit, ext, status);
+	(void) copy_table_keywords (in, out, cols, num_cols, status);
+	(void) fits_set_hdustruc (out, status);
      }
 
-   return fits_write_img (ft->fptr, type, 1, at->num_elements,
-			  at->data, &status);
+   free_and_return:
+   for (i = 0; i < 3 * num_cols; i++)
+     SLfree (ttype[i]);
+   SLfree ((char *) ttype);
+   return *status;
 }
 
-static int read_img (FitsFile_Type *ft, SLang_Ref_Type *ref)
+/* The native type used to copy the cells of a variable length column, or
+ * 0 if the column is not supported.
+ */
+static int get_varlen_copy_type (int type, unsigned int *sizeof_type)
 {
-   int status = 0;
-   int anynul = 0;
-   int type, stype;
-   int num_dims, i;
-   long ldims[SLARRAY_MAX_DIMS];
-   int dims[SLARRAY_MAX_DIMS];
-   SLang_Array_Type *at;
+   switch (-type)
+     {
+      case TBYTE: case TSBYTE: case TLOGICAL: case TSTRING:
+	*sizeof_type = 1; return -type;
+      case TSHORT:
+	*sizeof_type = sizeof (short); return TSHORT;
+      case TLONG: case TINT:
+	*sizeof_type = sizeof (int); return TINT;
+      case TLONGLONG:
+	*sizeof_type = sizeof (LONGLONG); return TLONGLONG;
+      case TFLOAT:
+	*sizeof_type = sizeof (float); return TFLOAT;
+      case TDOUBLE:
+	*sizeof_type = sizeof (double); return TDOUBLE;
+      case TCOMPLEX:
+	*sizeof_type = 2 * sizeof (float); return TCOMPLEX;
+      case TDBLCOMPLEX:
+	*sizeof_type = 2 * sizeof (double); return TDBLCOMPLEX;
+      case TBIT:			       /* one byte per bit */
+	*sizeof_type = 1; return TBIT;
+     }
+   return 0;
+}
 
-   if (ft->fptr == NULL)
-     return -1;
+static int copy_varlen_cell (fitsfile *in, int incol, LONGLONG inrow,
+			     fitsfile *out, int outcol, LONGLONG outrow,
+			     int type, unsigned int sizeof_type,
+			     char **bufp, size_t *bufsizep, int *status)
+{
+   LONGLONG repeat, offset;
+   size_t size;
+   int anynul;
 
-#ifdef fits_get_img_equivtype
-   status = fits_get_img_equivtype (ft->fptr, &type, &status);
-#else
-   status = fits_get_img_type (ft->fptr, &type, &status);
-#endif
-   if (status)
-     return status;
+   if (fits_read_descriptll (in, incol, inrow, &repeat, &offset, status)
+       || (repeat == 0))
+     return *status;
 
-   switch (type)
+   size = (size_t) repeat * sizeof_type + 1;
+   if (size > *bufsizep)
      {
-      case BYTE_IMG:
-	stype = SLANG_UCHAR_TYPE;
-	type = TBYTE;
-	break;
+	char *buf = (char *) SLrealloc (*bufp, size);
+	if (buf == NULL)
+	  return *status = MEMORY_ALLOCATION;
+	*bufp = buf;
+	*bufsizep = size;
+     }
 
-      case SHORT_IMG:		       /* 16 bit image */
-	stype = SLANG_INT16_TYPE;
-	type = CFITSIO_INT16_TYPE;
-	break;
+   if (type == TSTRING)
+     {
+	char *strs[1];
+	strs[0] = *bufp;
+	if (0 == fits_read_col (in, TSTRING, incol, inrow, 1, 1, NULL, strs, &anynul, status))
+	  (void) fits_write_col (out, TSTRING, outcol, outrow, 1, 1, strs, status);
+     }
+   else if (type == TBIT)
+     {
+	if (0 == fits_read_col_bit (in, incol, inrow, 1, repeat, *bufp, status))
+	  (void) fits_write_col_bit (out, outcol, outrow, 1, repeat, *bufp, status);
+     }
+   else if (0 == fits_read_col (in, type, incol, inrow, 1, repeat, NULL, *bufp, &anynul, status))
+     (void) fits_write_col (out, type, outcol, outrow, 1, repeat, *bufp, status);
 
-      case USHORT_IMG:		       /* 16 bit image */
-	stype = SLANG_UINT16_TYPE;
-	type = CFITSIO_UINT16_TYPE;
-	break;
+   count_read ((double) repeat, sizeof_type);
+   count_write ((double) repeat, sizeof_type);
+   return *status;
+}
 
-      case LONG_IMG:		       /* 32 bit image */
-	stype = SLANG_INT32_TYPE;
-	type = CFITSIO_INT32_TYPE;
-	break;
+typedef struct
+{
+   fitsfile *in, *out;
+   int num_cols;
+   int *cols;
+   LONGLONG *in_offsets, *out_offsets, *widths;
+   int *varlen_types;
+   unsigned int *varlen_sizes;
+   LONGLONG in_rowlen, out_rowlen;
+   unsigned char *buf;		       /* output rows */
+   LONGLONG *in_rows;		       /* input row of each output row */
+   long num_buffered, max_buffered;
+   LONGLONG next_out_row;
+   char *cell_buf;
+   size_t cell_bufsize;
+   double *saved_scales;	       /* of variable length columns */
+}
+Table_Copy_Type;
 
-      case ULONG_IMG:		       /* 32 bit image */
-	stype = SLANG_UINT32_TYPE;
-	type = CFITSIO_UINT32_TYPE;
-	break;
+static int flush_table_copy (Table_Copy_Type *tc, int *status)
+{
+   long i;
+   int j;
 
-#ifdef TLONGLONG
-      case LONGLONG_IMG:	       /* 64 bit image */
-	stype = SLANG_INT64_TYPE;
-	type = CFITSIO_INT64_TYPE;
-	break;
-#endif
+   if (tc->num_buffered == 0)
+     return *status;
 
-      case DOUBLE_IMG:
-	stype = SLANG_DOUBLE_TYPE;
-	type = TDOUBLE;
-	break;
+   if (fits_write_tblbytes (tc->out, tc->next_out_row, 1, tc->num_buffered * tc->out_rowlen,
+			    tc->buf, status))
+     return *status;
+   count_write ((double) tc->num_buffered, (unsigned int) tc->out_rowlen);
 
-      case FLOAT_IMG:
-      default:
-	stype = SLANG_FLOAT_TYPE;
-	type = TFLOAT;
-	break;
+   for (j = 0; j < tc->num_cols; j++)
+     {
+	if (tc->varlen_types[j] == 0)
+	  continue;
+	for (i = 0; i < tc->num_buffered; i++)
+	  {
+	     if (copy_varlen_cell (tc->in, tc->cols[j], tc->in_rows[i],
+				   tc->out, j + 1, tc->next_out_row + i,
+				   tc->varlen_types[j], tc->varlen_sizes[j],
+				   &tc->cell_buf, &tc->cell_bufsize, status))
+	       return *status;
+	  }
      }
+   tc->next_out_row += tc->num_buffered;
+   tc->num_buffered = 0;
+   return *status;
+}
 
-   if (fits_get_img_dim (ft->fptr, &num_dims, &status))
-     return status;
+/* Get the next run of consecutive candidate rows, at most max_rows long.
+ * The candidates are either the rows listed in the rows array, or all
+ * rows of the table.
+ */
+static LONGLONG next_row_run (long *rows, LONGLONG num_candidates, LONGLONG *ip,
+			      LONGLONG max_rows, LONGLONG *firstrowp)
+{
+   LONGLONG i = *ip, n;
 
-   if ((num_dims > SLARRAY_MAX_DIMS) || (num_dims < 0))
+   if (i >= num_candidates)
+     return 0;
+
+   if (rows == NULL)
      {
-	SLang_verror (SL_NOT_IMPLEMENTED, "Image dimensionality is not supported");
-	return -1;
+	n = num_candidates - i;
+	if (n > max_rows) n = max_rows;
+	*firstrowp = i + 1;
+     }
+   else
+     {
+	*firstrowp = rows[i];
+	n = 1;
+	while ((n < max_rows) && (i + n < num_candidates) && (rows[i+n] == rows[i] + n))
+	  n++;
      }
+   *ip = i + n;
+   return n;
+}
 
-   if (fits_get_img_size (ft->fptr, num_dims, ldims, &status))
-     return status;
+static int count_matching_rows (fitsfile *in, char *expr, long *rows, LONGLONG num_candidates,
+				LONGLONG block_rows, char *flags, LONGLONG *countp, int *status)
+{
+   LONGLONG i = 0, firstrow, n;
 
-#if 0
-   for (i = 0; i < num_dims; i++) dims[i] = (int) ldims[i];
-#else
-   for (i = 0; i < num_dims; i++) dims[num_dims-1-i] = (int) ldims[i];
-#endif
+   *countp = 0;
+   while (0 != (n = next_row_run (rows, num_candidates, &i, block_rows, &firstrow)))
+     {
+	long ngood;
+	if (fits_find_rows (in, expr, (long) firstrow, (long) n, &ngood, flags, status))
+	  return *status;
+	*countp += ngood;
+     }
+   return *status;
+}
 
-   if (NULL == (at = SLang_create_array (stype, 0, NULL, dims, num_dims)))
+static int check_table_copy_handles (FitsFile_Type *ft, FitsFile_Type *gt, char *fun)
+{
+   if ((ft->fptr == NULL) || (gt->fptr == NULL))
      return -1;
+   if (ft->fptr == gt->fptr)
+     {
+	SLang_verror (SL_INVALID_PARM, "%s: the input and output must be different handles", fun);
+	return -1;
+     }
+   return 0;
+}
+
+/* The current HDU must be a binary table */
+static int get_table_num_rows (fitsfile *f, LONGLONG *num_rows, int *status)
+{
+   int hdutype;
 
-   status = fits_read_img (ft->fptr, type, 1, at->num_elements, NULL,
-			   at->data, &anynul, &status);
+   if (fits_get_hdu_type (f, &hdutype, status)
+       || fits_get_num_rowsll (f, num_rows, status))
+     return *status;
+   if ((hdutype != BINARY_TBL) || (f->Fptr == NULL) || (f->Fptr->tableptr == NULL))
+     return *status = NOT_BTABLE;
+   return *status;
+}
 
-   if (status)
+/* Set up the copy of the specified input columns.  At most max_buffered
+ * rows are buffered before they are written.
+ */
+static int init_table_copy (Table_Copy_Type *tc, fitsfile *in, fitsfile *out,
+			    int *cols, int num_cols, long max_buffered,
+			    int *has_varlen, int *status)
+{
+   int j;
+
+   memset ((char *) tc, 0, sizeof (Table_Copy_Type));
+   tc->in = in;
+   tc->out = out;
+   tc->cols = cols;
+   tc->num_cols = num_cols;
+   tc->max_buffered = max_buffered;
+   tc->next_out_row = 1;
+   tc->in_rowlen = in->Fptr->rowlength;
+   *has_varlen = 0;
+
+   if ((NULL == (tc->in_offsets = (LONGLONG *) SLcalloc (3 * num_cols, sizeof (LONGLONG))))
+       || (NULL == (tc->varlen_types = (int *) SLcalloc (num_cols, sizeof (int))))
+       || (NULL == (tc->varlen_sizes = (unsigned int *) SLcalloc (num_cols, sizeof (unsigned int))))
+       || (NULL == (tc->in_rows = (LONGLONG *) SLcalloc (max_buffered, sizeof (LONGLONG)))))
+     return *status = -1;
+   tc->out_offsets = tc->in_offsets + num_cols;
+   tc->widths = tc->out_offsets + num_cols;
+
+   for (j = 0; j < num_cols; j++)
      {
-	SLang_free_array (at);
-	return status;
+	tcolumn *colptr;
+	long repeat, width;
+	int type, col = cols[j];
+
+	if ((col <= 0) || (col > in->Fptr->tfield))
+	  return *status = BAD_COL_NUM;
+
+	colptr = in->Fptr->tableptr + (col - 1);
+	tc->in_offsets[j] = colptr->tbcol;
+	tc->widths[j] = ((col < in->Fptr->tfield) ? (colptr+1)->tbcol : tc->in_rowlen) - colptr->tbcol;
+
+	if (fits_get_coltype (in, col, &type, &repeat, &width, status))
+	  return *status;
+	if (type < 0)
+	  {
+	     if (0 == (tc->varlen_types[j] = get_varlen_copy_type (type, &tc->varlen_sizes[j])))
+	       {
+		  SLang_verror (SL_NOT_IMPLEMENTED, "column %d: unsupported variable length column type", col);
+		  return *status = -1;
+	       }
+	     *has_varlen = 1;
+	  }
      }
+   return *status;
+}
 
-   if (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR)&at))
-     status = -1;
+/* Called once the output table exists */
+static int start_table_copy_output (Table_Copy_Type *tc, int *status)
+{
+   int j;
 
-   SLang_free_array (at);
-   return status;
+   tc->out_rowlen = tc->out->Fptr->rowlength;
+   if ((NULL == (tc->buf = (unsigned char *) SLmalloc ((size_t) (tc->max_buffered * tc->out_rowlen + 1))))
+       || (NULL == (tc->saved_scales = (double *) SLcalloc (4 * tc->num_cols, sizeof (double)))))
+     return *status = -1;
+
+   /* The cells of variable length columns are copied without scaling */
+   for (j = 0; j < tc->num_cols; j++)
+     {
+	tcolumn *colptr = tc->out->Fptr->tableptr + j;
+	tc->out_offsets[j] = colptr->tbcol;
+	if (tc->varlen_types[j] == 0)
+	  continue;
+	tc->saved_scales[4*j] = colptr->tscale;
+	tc->saved_scales[4*j+1] = colptr->tzero;
+	colptr = tc->in->Fptr->tableptr + (tc->cols[j] - 1);
+	tc->saved_scales[4*j+2] = colptr->tscale;
+	tc->saved_scales[4*j+3] = colptr->tzero;
+	if (fits_set_tscale (tc->out, j + 1, 1.0, 0.0, status)
+	    || fits_set_tscale (tc->in, tc->cols[j], 1.0, 0.0, status))
+	  return *status;
+     }
+   return *status;
 }
 
-static int create_binary_tbl (void)
+/* Add the raw bytes of an input row to the output buffer */
+static int add_table_copy_row (Table_Copy_Type *tc, unsigned char *src, LONGLONG inrow, int *status)
 {
-   SLang_MMT_Type *mmt;
-   FitsFile_Type *ft;
-   SLang_Array_Type *at_ttype, *at_tform, *at_tunit;
-   char *extname;
-   int tfields, nrows;
-   int status;
+   unsigned char *dst = tc->buf + tc->num_buffered * tc->out_rowlen;
+   int j;
 
-   status = -1;
-   at_ttype = at_tform = at_tunit = NULL;
-   mmt = NULL;
-   ft = NULL;
+   for (j = 0; j < tc->num_cols; j++)
+     {
+	if (tc->varlen_types[j])
+	  memset ((char *) dst + tc->out_offsets[j], 0, (size_t) tc->widths[j]);
+	else
+	  memcpy ((char *) dst + tc->out_offsets[j], (char *) src + tc->in_offsets[j], (size_t) tc->widths[j]);
+     }
+   tc->in_rows[tc->num_buffered++] = inrow;
+   if (tc->num_buffered == tc->max_buffered)
+     return flush_table_copy (tc, status);
+   return *status;
+}
 
-   if (-1 == pop_string_or_null (&extname))
-     return -1;
+static void free_table_copy (Table_Copy_Type *tc)
+{
+   int j;
 
-   if (-1 == pop_array_or_null (&at_tunit))
-     goto free_and_return;
+   if (tc->saved_scales != NULL)
+     {
+	int status = 0;
+	for (j = 0; j < tc->num_cols; j++)
+	  {
+	     if (tc->varlen_types[j] == 0)
+	       continue;
+	     (void) fits_set_tscale (tc->out, j + 1, tc->saved_scales[4*j], tc->saved_scales[4*j+1], &status);
+	     (void) fits_set_tscale (tc->in, tc->cols[j], tc->saved_scales[4*j+2], tc->saved_scales[4*j+3], &status);
+	  }
+     }
+   SLfree ((char *) tc->buf);
+   SLfree (tc->cell_buf);
+   SLfree ((char *) tc->in_rows);
+   SLfree ((char *) tc->saved_scales);
+   SLfree ((char *) tc->varlen_sizes);
+   SLfree ((char *) tc->varlen_types);
+   SLfree ((char *) tc->in_offsets);
+   memset ((char *) tc, 0, sizeof (Table_Copy_Type));
+}
 
-   if (-1 == SLang_pop_array (&at_tform, 1))
-     goto free_and_return;
+/* When appending, the current HDU of the output must be a table whose
+ * columns have the same formats as the selected ones.
+ */
+static int check_append_table (Table_Copy_Type *tc, int *status)
+{
+   fitsfile *out = tc->out;
+   int j, hdutype;
 
-   if (-1 == SLang_pop_array (&at_ttype, 1))
-     goto free_and_return;
+   if (fits_get_hdu_type (out, &hdutype, status))
+     return *status;
+   if ((hdutype != BINARY_TBL) || (out->Fptr == NULL) || (out->Fptr->tableptr == NULL))
+     return *status = NOT_BTABLE;
+   if (out->Fptr->tfield != tc->num_cols)
+     return *status = BAD_TFIELDS;
 
-   if (-1 == SLang_pop_integer (&nrows))
-     goto free_and_return;
+   for (j = 0; j < tc->num_cols; j++)
+     {
+	tcolumn *incol = tc->in->Fptr->tableptr + (tc->cols[j] - 1);
+	tcolumn *outcol = out->Fptr->tableptr + j;
+	if (0 != strcmp (incol->tform, outcol->tform))
+	  return *status = BAD_TFORM;
+     }
+   return *status;
+}
 
-   if (NULL == (ft = pop_fits_type (&mmt)))
-     goto free_and_return;
+static int do_copy_table (FitsFile_Type *ft, FitsFile_Type *gt, SLang_Array_Type *cols_at,
+			  SLang_Array_Type *rows_at, char *expr, int drows, int append)
+{
+   Table_Copy_Type tc;
+   unsigned char *inbuf = NULL;
+   char *flags = NULL;
+   long *rows = NULL;
+   LONGLONG num_rows, num_candidates, num_out, i, firstrow, n;
+   int has_varlen = 0;
+   int status = 0;
 
-   if (ft->fptr == NULL)
-     goto free_and_return;
+   memset ((char *) &tc, 0, sizeof (Table_Copy_Type));
+   if (-1 == check_table_copy_handles (ft, gt, "_fits_copy_table"))
+     return -1;
+   if (cols_at->num_elements == 0)
+     {
+	SLang_verror (SL_INVALID_PARM, "_fits_copy_table: no columns were specified");
+	return -1;
+     }
 
-   tfields = (int) at_ttype->num_elements;
+   if (get_table_num_rows (ft->fptr, &num_rows, &status))
+     return status;
 
-   if (at_ttype->data_type != SLANG_STRING_TYPE)
+   num_candidates = num_rows;
+   if (rows_at != NULL)
      {
-	SLang_verror (SL_TYPE_MISMATCH,
-		      "fits_create_binary_tbl: ttype must be String_Type[%d]",
-		      tfields);
-	goto free_and_return;
+	rows = (long *) rows_at->data;
+	num_candidates = (LONGLONG) rows_at->num_elements;
+	for (i = 0; i < num_candidates; i++)
+	  {
+	     if ((rows[i] <= 0) || (rows[i] > num_rows))
+	       return BAD_ROW_NUM;
+	  }
      }
 
-   if ((tfields != (int) at_tform->num_elements)
-       || (at_tform->data_type != SLANG_STRING_TYPE))
+   if (drows <= 0)
      {
-	SLang_verror (SL_TYPE_MISMATCH,
-		      "fits_create_binary_tbl: tform must be String_Type[%d]",
-		      tfields);
-	goto free_and_return;
+	LONGLONG rowlen = ft->fptr->Fptr->rowlength;
+	drows = (int) (COPY_TABLE_BLOCK_BYTES / (rowlen > 0 ? rowlen : 1));
+	if (drows < 1) drows = 1;
      }
+   if ((LONGLONG) drows > num_candidates)
+     drows = (num_candidates > 0) ? (int) num_candidates : 1;
 
-   if ((at_tunit != NULL)
-       && ((tfields != (int) at_tunit->num_elements)
-	   || (at_tunit->data_type != SLANG_STRING_TYPE)))
+   if (init_table_copy (&tc, ft->fptr, gt->fptr, (int *) cols_at->data,
+			(int) cols_at->num_elements, drows, &has_varlen, &status))
+     goto free_and_return;
+
+   if ((NULL == (flags = (char *) SLmalloc (drows)))
+       || (NULL == (inbuf = (unsigned char *) SLmalloc ((size_t) (drows * tc.in_rowlen + 1)))))
      {
-	SLang_verror (SL_TYPE_MISMATCH,
-		      "fits_create_binary_tbl: tunit must be String_Type[%d]",
-		      tfields);
+	status = -1;
 	goto free_and_return;
      }
 
-   status = 0;
-   fits_create_tbl (ft->fptr, BINARY_TBL, nrows, tfields,
-		    (char **) at_ttype->data,
-		    (char **) at_tform->data,
-		    ((at_tunit == NULL) ? NULL : (char **) at_tunit->data),
-		    extname, &status);
+   /* The output table is sized up front if the number of rows is known,
+    * since adding rows to a table with a heap moves the heap.
+    */
+   num_out = 0;
+   if (expr == NULL)
+     num_out = num_candidates;
+   else if (has_varlen
+	    && count_matching_rows (tc.in, expr, rows, num_candidates, drows, flags, &num_out, &status))
+     goto free_and_return;
 
-   /* drop */
+   if (append)
+     {
+	LONGLONG out_rows;
+	if (check_append_table (&tc, &status)
+	    || fits_get_num_rowsll (tc.out, &out_rows, &status)
+	    || ((num_out > 0) && fits_insert_rows (tc.out, out_rows, num_out, &status)))
+	  goto free_and_return;
+	tc.next_out_row = out_rows + 1;
+     }
+   else if (create_table_copy (tc.in, tc.out, tc.cols, tc.num_cols, num_out, &status))
+     goto free_and_return;
 
-   free_and_return:
-   SLang_free_array (at_ttype);
-   SLang_free_array (at_tform);
-   SLang_free_array (at_tunit);
-   SLang_free_mmt (mmt);
-   SLang_free_slstring (extname);
+   if (start_table_copy_output (&tc, &status))
+     goto free_and_return;
+
+   i = 0;
+   while (0 != (n = next_row_run (rows, num_candidates, &i, drows, &firstrow)))
+     {
+	LONGLONG k;
+
+	if (fits_read_tblbytes (tc.in, firstrow, 1, n * tc.in_rowlen, inbuf, &status))
+	  goto free_and_return;
+	count_read ((double) n, (unsigned int) tc.in_rowlen);
 
+	if (expr != NULL)
+	  {
+	     long ngood;
+	     if (fits_find_rows (tc.in, expr, (long) firstrow, (long) n, &ngood, flags, &status))
+	       goto free_and_return;
+	  }
+
+	for (k = 0; k < n; k++)
+	  {
+	     if ((expr != NULL) && (flags[k] == 0))
+	       continue;
+	     if (add_table_copy_row (&tc, inbuf + k * tc.in_rowlen, firstrow + k, &status))
+	       goto free_and_return;
+	  }
+     }
+   (void) flush_table_copy (&tc, &status);
+
+   free_and_return:
+   free_table_copy (&tc);
+   SLfree ((char *) inbuf);
+   SLfree (flags);
    return status;
 }
 
-static int update_key (void)
+/* Usage: status = _fits_copy_table (in, out, columns, rows, expr, drows [,append])
+ * The rows and expr arguments may be NULL.  If append is non-zero, the
+ * rows are appended to the current HDU of out instead of a new table.
+ */
+static int copy_table (void)
 {
-   SLang_MMT_Type *mmt;
-   FitsFile_Type *ft;
-   char *comment;
-   int i;
-   unsigned int ui;
-   double d;
-   long l;
-   unsigned long ul;
-   char *s;
-   char *key;
-   int type;
-   VOID_STAR v;
-   int status;
+   SLang_MMT_Type *in_mmt = NULL, *out_mmt = NULL;
+   SLang_Array_Type *cols_at = NULL, *rows_at = NULL;
+   FitsFile_Type *ft, *gt;
+   Call_Context_Type cc;
+   char *expr = NULL;
+   int drows, append = 0, status = -1;
+
+   if ((SLang_Num_Function_Args == 7)
+       && (-1 == SLang_pop_integer (&append)))
+     return -1;
 
-   if (-1 == pop_string_or_null (&comment))
+   if (-1 == SLang_pop_integer (&drows))
      return -1;
 
-   key = s = NULL;
-   mmt = NULL;
-   status = -1;
+   if (SLang_peek_at_stack () == SLANG_NULL_TYPE)
+     (void) SLdo_pop ();
+   else if (-1 == SLang_pop_slstring (&expr))
+     return -1;
+
+   if (SLang_peek_at_stack () == SLANG_NULL_TYPE)
+     (void) SLdo_pop ();
+   else if (-1 == SLang_pop_array_of_type (&rows_at, SLANG_LONG_TYPE))
+     goto free_and_return;
+
+   if ((-1 == SLang_pop_array_of_type (&cols_at, SLANG_INT_TYPE))
+       || (NULL == (gt = pop_fits_type (&out_mmt)))
+       || (NULL == (ft = pop_fits_type (&in_mmt))))
+     goto free_and_return;
+
+   begin_call (&cc, gt, "_fits_copy_table");
+   status = end_call (&cc, do_copy_table (ft, gt, cols_at, rows_at, expr, drows, append));
+
+   free_and_return:
+   SLang_free_mmt (in_mmt);
+   SLang_free_mmt (out_mmt);
+   SLang_free_array (cols_at);
+   SLang_free_array (rows_at);
+   SLang_free_slstring (expr);
+   return status;
+}
+
+/* External sorting of tables.  Each row is stored in a record that is
+ * prefixed by a key that compares as the sort order under memcmp: the
+ * values of the key columns are converted from their big-endian FITS
+ * representation such that the byte order matches the numerical order,
+ * followed by the row number, which makes the sort stable.  Runs of as
+ * many records as fit into the memory limit are sorted (by several
+ * threads, each sorting a part that is then merged) and written to
+ * temporary files, which are finally merged into the output table.
+ */
+#define SORT_KEY_UNSIGNED	1      /* unsigned integers, strings */
+#define SORT_KEY_SIGNED		2
+#define SORT_KEY_FLOAT		3
+#define SORT_MAX_THREADS	16
+
+typedef struct
+{
+   LONGLONG offset, width;	       /* in the row */
+   unsigned int elem_size;
+   int kind;
+   int invert;			       /* descending order */
+}
+Sort_Key_Type;
+
+typedef struct
+{
+   FILE *fp;
+   unsigned char *buf;
+   size_t num, pos, max_num;
+   LONGLONG num_left;		       /* records in the file */
+}
+Sort_Run_Type;
+
+static size_t Sort_Key_Length;
+
+static int compare_sort_records (const void *a, const void *b)
+{
+   return memcmp (*(unsigned char **) a, *(unsigned char **) b, Sort_Key_Length);
+}
+
+/* Is the big-endian float or double a NaN, i.e., is its exponent all
+ * ones and its mantissa not zero?
+ */
+static int is_big_endian_nan (unsigned char *b, unsigned int n)
+{
+   unsigned int i, mantissa;
+
+   if (n == 4)
+     {
+	if (((b[0] & 0x7F) != 0x7F) || (0 == (b[1] & 0x80)))
+	  return 0;
+	mantissa = b[1] & 0x7F;
+     }
+   else
+     {
+	if (((b[0] & 0x7F) != 0x7F) || ((b[1] & 0xF0) != 0xF0))
+	  return 0;
+	mantissa = b[1] & 0x0F;
+     }
+   for (i = 2; i < n; i++)
+     mantissa |= b[i];
+   return (mantissa != 0);
+}
+
+static void encode_sort_key (Sort_Key_Type *keys, int num_keys, unsigned char *row,
+			     LONGLONG rownum, unsigned char *dst)
+{
+   int i, k;
+
+   for (k = 0; k < num_keys; k++)
+     {
+	Sort_Key_Type *key = keys + k;
+	unsigned char *src = row + key->offset;
+	unsigned char *end = dst + key->width;
+	unsigned char *d;
+
+	while (dst < end)
+	  {
+	     unsigned int n = key->elem_size;
+	     switch (key->kind)
+	       {
+		case SORT_KEY_SIGNED:
+		  memcpy (dst, src, n);
+		  dst[0] ^= 0x80;
+		  break;
+
+		case SORT_KEY_FLOAT:
+		  if (is_big_endian_nan (src, n))
+		    {
+		       /* NaNs of either sign sort last in either order */
+		       memset (dst, key->invert ? 0 : 0xFF, n);
+		       break;
+		    }
+		  if (src[0] & 0x80)
+		    {
+		       for (i = 0; i < (int) n; i++)
+			 dst[i] = (unsigned char) ~src[i];
+		    }
+		  else
+		    {
+		       memcpy (dst, src, n);
+		       dst[0] ^= 0x80;
+		    }
+		  break;
+
+		default:
+		  memcpy (dst, src, n);
+		  break;
+	       }
+	     if (key->invert)
+	       {
+		  for (d = dst; d < dst + n; d++)
+		    *d = (unsigned char) ~*d;
+	       }
+	     dst += n;
+	     src += n;
+	  }
+     }
+
+   for (i = 7; i >= 0; i--)
+     {
+	dst[i] = (unsigned char) (rownum & 0xFF);
+	rownum >>= 8;
+     }
+}
+
+static LONGLONG decode_sort_rownum (unsigned char *key_end)
+{
+   LONGLONG rownum = 0;
+   int i;
+   for (i = -8; i < 0; i++)
+     rownum = (rownum << 8) | key_end[i];
+   return rownum;
+}
+
+static int init_sort_keys (fitsfile *in, int *cols, int *descending, int num_keys,
+			   Sort_Key_Type *keys, size_t *key_len, int *status)
+{
+   int k;
+
+   *key_len = 8;		       /* row number */
+   for (k = 0; k < num_keys; k++)
+     {
+	Sort_Key_Type *key = keys + k;
+	tcolumn *colptr;
+	long repeat, width;
+	int type, col = cols[k];
+
+	if ((col <= 0) || (col > in->Fptr->tfield))
+	  return *status = BAD_COL_NUM;
+	if (fits_get_coltype (in, col, &type, &repeat, &width, status))
+	  return *status;
+
+	colptr = in->Fptr->tableptr + (col - 1);
+	key->offset = colptr->tbcol;
+	key->width = ((col < in->Fptr->tfield) ? (colptr+1)->tbcol : in->Fptr->rowlength) - colptr->tbcol;
+	key->invert = (descending[k] != 0);
+	switch (type)
+	  {
+	   case TBYTE: case TLOGICAL: case TSTRING: case TBIT:
+	     key->kind = SORT_KEY_UNSIGNED;
+	     key->elem_size = (unsigned int) key->width;
+	     break;
+	   case TSHORT:
+	     key->kind = SORT_KEY_SIGNED; key->elem_size = 2;
+	     break;
+	   case TLONG: case TINT:
+	     key->kind = SORT_KEY_SIGNED; key->elem_size = 4;
+	     break;
+	   case TLONGLONG:
+	     key->kind = SORT_KEY_SIGNED; key->elem_size = 8;
+	     break;
+	   case TFLOAT:
+	     key->kind = SORT_KEY_FLOAT; key->elem_size = 4;
+	     break;
+	   case TDOUBLE:
+	     key->kind = SORT_KEY_FLOAT; key->elem_size = 8;
+	     break;
+	   default:
+	     SLang_verror (SL_NOT_IMPLEMENTED, "_fits_sort_table: column %d cannot be used as a sort key", col);
+	     return *status = -1;
+	  }
+	/* A negative scale reverses the order of the physical values */
+	if ((key->kind != SORT_KEY_UNSIGNED) && (colptr->tscale < 0))
+	  key->invert = !key->invert;
+	if ((key->elem_size == 0) || (key->width % key->elem_size))
+	  return *status = BAD_TFORM;
+	*key_len += (size_t) key->width;
+     }
+   return *status;
+}
+
+#ifdef HAVE_FITS_THREADS
+typedef struct
+{
+   unsigned char **ptrs;
+   size_t num;
+}
+Sort_Part_Type;
+
+static void *sort_part_thread (void *arg)
+{
+   Sort_Part_Type *part = (Sort_Part_Type *) arg;
+   qsort (part->ptrs, part->num, sizeof (unsigned char *), compare_sort_records);
+   return NULL;
+}
+#endif
+
+/* Sort the record pointers.  Returns ptrs or tmp, whichever holds the
+ * sorted pointers.
+ */
+static unsigned char **sort_records (unsigned char **ptrs, unsigned char **tmp, size_t num,
+				     int num_threads)
+{
+#ifdef HAVE_FITS_THREADS
+   Sort_Part_Type parts[SORT_MAX_THREADS];
+   pthread_t threads[SORT_MAX_THREADS];
+   int started[SORT_MAX_THREADS];
+   size_t heads[SORT_MAX_THREADS], ends[SORT_MAX_THREADS];
+   size_t i, part_size;
+   int t;
+
+   if (num_threads > SORT_MAX_THREADS)
+     num_threads = SORT_MAX_THREADS;
+   if ((num_threads < 2) || (num < 65536))
+     {
+	qsort (ptrs, num, sizeof (unsigned char *), compare_sort_records);
+	return ptrs;
+     }
+
+   part_size = (num + num_threads - 1) / num_threads;
+   for (t = 0; t < num_threads; t++)
+     {
+	heads[t] = t * part_size;
+	ends[t] = (heads[t] + part_size < num) ? heads[t] + part_size : num;
+	parts[t].ptrs = ptrs + heads[t];
+	parts[t].num = ends[t] - heads[t];
+	started[t] = (0 == pthread_create (&threads[t], NULL, sort_part_thread, parts + t));
+	if (started[t] == 0)
+	  (void) sort_part_thread (parts + t);
+     }
+   for (t = 0; t < num_threads; t++)
+     {
+	if (started[t])
+	  pthread_join (threads[t], NULL);
+     }
+
+   /* Merge the sorted parts */
+   for (i = 0; i < num; i++)
+     {
+	int best = -1;
+	for (t = 0; t < num_threads; t++)
+	  {
+	     if (heads[t] == ends[t])
+	       continue;
+	     if ((best == -1)
+		 || (memcmp (ptrs[heads[t]], ptrs[heads[best]], Sort_Key_Length) < 0))
+	       best = t;
+	  }
+	tmp[i] = ptrs[heads[best]++];
+     }
+   return tmp;
+#else
+   (void) tmp; (void) num_threads;
+   qsort (ptrs, num, sizeof (unsigned char *), compare_sort_records);
+   return ptrs;
+#endif
+}
+
+static FILE *open_sort_run_file (char *tmpdir)
+{
+   char *file;
+   FILE *fp = NULL;
+   int fd;
+
+   if (tmpdir == NULL)
+     tmpdir = getenv ("TMPDIR");
+   if ((tmpdir == NULL) || (*tmpdir == 0))
+     tmpdir = "/tmp";
+
+   if (NULL == (file = (char *) SLmalloc (strlen (tmpdir) + 32)))
+     return NULL;
+   sprintf (file, "%s/slfits-sort-XXXXXX", tmpdir);
+   if (-1 != (fd = mkstemp (file)))
+     {
+	(void) unlink (file);	       /* removed when closed */
+	if (NULL == (fp = fdopen (fd, "w+b")))
+	  (void) close (fd);
+     }
+   if (fp == NULL)
+     SLang_verror (SL_OPEN_ERROR, "_fits_sort_table: unable to create a temporary file in %s: %s",
+		   tmpdir, SLerrno_strerror (errno));
+   SLfree (file);
+   return fp;
+}
+
+static int fill_sort_run (Sort_Run_Type *run, size_t rec_len)
+{
+   size_t n = run->max_num;
+   if ((LONGLONG) n > run->num_left)
+     n = (size_t) run->num_left;
+   run->pos = 0;
+   run->num = (n == 0) ? 0 : fread (run->buf, rec_len, n, run->fp);
+   if (run->num != n)
+     {
+	SLang_verror (SL_READ_ERROR, "_fits_sort_table: error reading a temporary file");
+	return -1;
+     }
+   run->num_left -= n;
+   return 0;
+}
+
+#define SORT_RUN_RECORD(run, rec_len) ((run)->buf + (run)->pos * (rec_len))
+
+static void sift_down_runs (Sort_Run_Type **heap, int n, int i, size_t rec_len)
+{
+   while (1)
+     {
+	int l = 2*i + 1, m = i;
+	Sort_Run_Type *tmp;
+	if ((l < n) && (memcmp (SORT_RUN_RECORD(heap[l], rec_len),
+				SORT_RUN_RECORD(heap[m], rec_len), Sort_Key_Length) < 0))
+	  m = l;
+	if ((l + 1 < n) && (memcmp (SORT_RUN_RECORD(heap[l+1], rec_len),
+				    SORT_RUN_RECORD(heap[m], rec_len), Sort_Key_Length) < 0))
+	  m = l + 1;
+	if (m == i)
+	  return;
+	tmp = heap[i]; heap[i] = heap[m]; heap[m] = tmp;
+	i = m;
+     }
+}
+
+/* Merge the sorted runs into the output */
+static int merge_sort_runs (Table_Copy_Type *tc, FILE **run_files, int num_runs,
+			    LONGLONG *run_sizes, size_t rec_len, size_t key_len,
+			    double mem_limit, int *status)
+{
+   Sort_Run_Type *runs, **heap;
+   size_t max_num;
+   int i, n;
+
+   if ((NULL == (runs = (Sort_Run_Type *) SLcalloc (num_runs, sizeof (Sort_Run_Type))))
+       || (NULL == (heap = (Sort_Run_Type **) SLcalloc (num_runs, sizeof (Sort_Run_Type *)))))
+     {
+	SLfree ((char *) runs);
+	return *status = -1;
+     }
+
+   max_num = (size_t) (mem_limit / ((double) num_runs * rec_len));
+   if (max_num < 1) max_num = 1;
+
+   n = 0;
+   for (i = 0; i < num_runs; i++)
+     {
+	Sort_Run_Type *run = runs + i;
+	run->fp = run_files[i];
+	run->num_left = run_sizes[i];
+	run->max_num = max_num;
+	if ((NULL == (run->buf = (unsigned char *) SLmalloc (max_num * rec_len)))
+	    || (-1 == fseek (run->fp, 0, SEEK_SET))
+	    || (-1 == fill_sort_run (run, rec_len)))
+	  {
+	     *status = -1;
+	     goto free_and_return;
+	  }
+	if (run->num)
+	  heap[n++] = run;
+     }
+   for (i = n/2 - 1; i >= 0; i--)
+     sift_down_runs (heap, n, i, rec_len);
+
+   while (n > 0)
+     {
+	Sort_Run_Type *run = heap[0];
+	unsigned char *rec = SORT_RUN_RECORD(run, rec_len);
+
+	if (add_table_copy_row (tc, rec + key_len, decode_sort_rownum (rec + key_len), status))
+	  goto free_and_return;
+
+	run->pos++;
+	if ((run->pos == run->num)
+	    && (-1 == fill_sort_run (run, rec_len)))
+	  {
+	     *status = -1;
+	     goto free_and_return;
+	  }
+	if (run->num == 0)
+	  heap[0] = heap[--n];
+	sift_down_runs (heap, n, 0, rec_len);
+     }
+
+   free_and_return:
+   for (i = 0; i < num_runs; i++)
+     SLfree ((char *) runs[i].buf);
+   SLfree ((char *) runs);
+   SLfree ((char *) heap);
+   return *status;
+}
+
+static int do_sort_table (FitsFile_Type *ft, FitsFile_Type *gt,
+			  SLang_Array_Type *keys_at, SLang_Array_Type *desc_at,
+			  double mem_limit, int num_threads, char *tmpdir)
+{
+   Table_Copy_Type tc;
+   Sort_Key_Type *keys = NULL;
+   FILE **run_files = NULL;
+   LONGLONG *run_sizes = NULL;
+   unsigned char *runbuf = NULL, *inbuf = NULL;
+   unsigned char **ptrs = NULL, **tmp = NULL, **sorted;
+   int *cols = NULL;
+   LONGLONG num_rows, row, rowlen;
+   size_t key_len, rec_len, max_recs, num_recs, i;
+   int j, num_cols, num_keys, num_runs = 0, max_runs = 0, has_varlen;
+   int block_rows, status = 0;
+
+   memset ((char *) &tc, 0, sizeof (Table_Copy_Type));
+   if (-1 == check_table_copy_handles (ft, gt, "_fits_sort_table"))
+     return -1;
+   num_keys = (int) keys_at->num_elements;
+   if ((num_keys == 0) || (desc_at->num_elements != keys_at->num_elements))
+     {
+	SLang_verror (SL_INVALID_PARM, "_fits_sort_table: invalid sort keys");
+	return -1;
+     }
+
+   if (get_table_num_rows (ft->fptr, &num_rows, &status))
+     return status;
+   rowlen = ft->fptr->Fptr->rowlength;
+   num_cols = ft->fptr->Fptr->tfield;
+
+   if (NULL == (keys = (Sort_Key_Type *) SLcalloc (num_keys, sizeof (Sort_Key_Type))))
+     return -1;
+   if (init_sort_keys (ft->fptr, (int *) keys_at->data, (int *) desc_at->data, num_keys,
+		       keys, &key_len, &status))
+     goto free_and_return;
+   rec_len = key_len + (size_t) rowlen;
+
+   if (num_threads <= 0)
+     {
+	num_threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	num_threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+     }
+
+   /* Each record also needs two pointers */
+   max_recs = (size_t) (mem_limit / (rec_len + 2 * sizeof (unsigned char *)));
+   if (max_recs < 1) max_recs = 1;
+   if ((LONGLONG) max_recs > num_rows)
+     max_recs = (num_rows > 0) ? (size_t) num_rows : 1;
+
+   block_rows = (int) (COPY_TABLE_BLOCK_BYTES / (rowlen > 0 ? rowlen : 1));
+   if (block_rows < 1) block_rows = 1;
+   if ((size_t) block_rows > max_recs) block_rows = (int) max_recs;
+
+   if ((NULL == (cols = (int *) SLcalloc (num_cols > 0 ? num_cols : 1, sizeof (int))))
+       || (NULL == (runbuf = (unsigned char *) SLmalloc (max_recs * rec_len)))
+       || (NULL == (ptrs = (unsigned char **) SLcalloc (max_recs, sizeof (unsigned char *))))
+       || (NULL == (tmp = (unsigned char **) SLcalloc (max_recs, sizeof (unsigned char *))))
+       || (NULL == (inbuf = (unsigned char *) SLmalloc ((size_t) (block_rows * rowlen + 1)))))
+     {
+	status = -1;
+	goto free_and_return;
+     }
+   for (j = 0; j < num_cols; j++)
+     cols[j] = j + 1;
+
+   if (init_table_copy (&tc, ft->fptr, gt->fptr, cols, num_cols, block_rows, &has_varlen, &status)
+       || create_table_copy (tc.in, tc.out, cols, num_cols, num_rows, &status)
+       || start_table_copy_output (&tc, &status))
+     goto free_and_return;
+
+   Sort_Key_Length = key_len;
+   row = 1;
+   while (row <= num_rows)
+     {
+	/* Read and sort the next run */
+	num_recs = 0;
+	while ((num_recs < max_recs) && (row <= num_rows))
+	  {
+	     LONGLONG k, n = block_rows;
+	     if ((LONGLONG) (max_recs - num_recs) < n) n = (LONGLONG) (max_recs - num_recs);
+	     if (num_rows - row + 1 < n) n = num_rows - row + 1;
+
+	     if (fits_read_tblbytes (tc.in, row, 1, n * rowlen, inbuf, &status))
+	       goto free_and_return;
+	     count_read ((double) n, (unsigned int) rowlen);
+
+	     for (k = 0; k < n; k++)
+	       {
+		  unsigned char *rec = runbuf + num_recs * rec_len;
+		  unsigned char *src = inbuf + k * rowlen;
+		  encode_sort_key (keys, num_keys, src, row + k, rec);
+		  memcpy (rec + key_len, src, (size_t) rowlen);
+		  ptrs[num_recs++] = rec;
+	       }
+	     row += n;
+	  }
+	sorted = sort_records (ptrs, tmp, num_recs, num_threads);
+
+	if ((num_runs == 0) && (row > num_rows))
+	  {
+	     /* Everything fit into memory */
+	     for (i = 0; i < num_recs; i++)
+	       {
+		  if (add_table_copy_row (&tc, sorted[i] + key_len,
+					  decode_sort_rownum (sorted[i] + key_len), &status))
+		    goto free_and_return;
+	       }
+	     (void) flush_table_copy (&tc, &status);
+	     goto free_and_return;
+	  }
+
+	if (num_runs == max_runs)
+	  {
+	     int new_max = max_runs + 32;
+	     FILE **f = (FILE **) SLrealloc ((char *) run_files, new_max * sizeof (FILE *));
+	     LONGLONG *sz;
+	     if (f == NULL)
+	       {
+		  status = -1;
+		  goto free_and_return;
+	       }
+	     run_files = f;
+	     if (NULL == (sz = (LONGLONG *) SLrealloc ((char *) run_sizes, new_max * sizeof (LONGLONG))))
+	       {
+		  status = -1;
+		  goto free_and_return;
+	       }
+	     run_sizes = sz;
+	     max_runs = new_max;
+	  }
+	if (NULL == (run_files[num_runs] = open_sort_run_file (tmpdir)))
+	  {
+	     status = -1;
+	     goto free_and_return;
+	  }
+	run_sizes[num_runs] = (LONGLONG) num_recs;
+	num_runs++;
+
+	for (i = 0; i < num_recs; i++)
+	  {
+	     if (1 != fwrite (sorted[i], rec_len, 1, run_files[num_runs-1]))
+	       {
+		  SLang_verror (SL_WRITE_ERROR, "_fits_sort_table: error writing a temporary file: %s",
+				SLerrno_strerror (errno));
+		  status = -1;
+		  goto free_and_return;
+	       }
+	  }
+	if (0 != fflush (run_files[num_runs-1]))
+	  {
+	     SLang_verror (SL_WRITE_ERROR, "_fits_sort_table: error writing a temporary file: %s",
+			   SLerrno_strerror (errno));
+	     status = -1;
+	     goto free_and_return;
+	  }
+     }
+
+   /* The run buffer is no longer needed for the merge */
+   SLfree ((char *) runbuf); runbuf = NULL;
+   SLfree ((char *) ptrs); ptrs = NULL;
+   SLfree ((char *) tmp); tmp = NULL;
+
+   if ((num_runs > 0)
+       && (0 == merge_sort_runs (&tc, run_files, num_runs, run_sizes, rec_len, key_len,
+				 mem_limit, &status)))
+     (void) flush_table_copy (&tc, &status);
+
+   free_and_return:
+   for (j = 0; j < num_runs; j++)
+     (void) fclose (run_files[j]);
+   free_table_copy (&tc);
+   SLfree ((char *) run_files);
+   SLfree ((char *) run_sizes);
+   SLfree ((char *) runbuf);
+   SLfree ((char *) inbuf);
+   SLfree ((char *) ptrs);
+   SLfree ((char *) tmp);
+   SLfree ((char *) cols);
+   SLfree ((char *) keys);
+   return status;
+}
+
+/* Usage: status = _fits_sort_table (in, out, keycols, descending, mem_limit, nthreads, tmpdir)
+ * tmpdir may be NULL.
+ */
+static int sort_table (void)
+{
+   SLang_MMT_Type *in_mmt = NULL, *out_mmt = NULL;
+   SLang_Array_Type *keys_at = NULL, *desc_at = NULL;
+   FitsFile_Type *ft, *gt;
+   Call_Context_Type cc;
+   char *tmpdir = NULL;
+   double mem_limit;
+   int num_threads, status = -1;
+
+   if (SLang_peek_at_stack () == SLANG_NULL_TYPE)
+     (void) SLdo_pop ();
+   else if (-1 == SLang_pop_slstring (&tmpdir))
+     return -1;
+
+   if ((-1 == SLang_pop_integer (&num_threads))
+       || (-1 == SLang_pop_double (&mem_limit))
+       || (-1 == SLang_pop_array_of_type (&desc_at, SLANG_INT_TYPE))
+       || (-1 == SLang_pop_array_of_type (&keys_at, SLANG_INT_TYPE))
+       || (NULL == (gt = pop_fits_type (&out_mmt)))
+       || (NULL == (ft = pop_fits_type (&in_mmt))))
+     goto free_and_return;
+
+   begin_call (&cc, gt, "_fits_sort_table");
+   status = end_call (&cc, do_sort_table (ft, gt, keys_at, desc_at, mem_limit, num_threads, tmpdir));
+
+   free_and_return:
+   SLang_free_mmt (in_mmt);
+   SLang_free_mmt (out_mmt);
+   SLang_free_array (keys_at);
+   SLang_free_array (desc_at);
+   SLang_free_slstring (tmpdir);
+   return status;
+}
+
+/* Usage: _fits_readahead (file)
+ * Ask the system to start reading a file into the page cache, so that
+ * its data are available when the file is opened later.  Only plain disk
+ * files are supported; nothing is done otherwise.
+ */
+static void readahead_file (char *file)
+{
+#if defined(HAVE_MMAP) && defined(POSIX_FADV_WILLNEED)
+   char *name, *p;
+   int fd;
+
+   if (0 == strncmp (file, "file://", 7))
+     file += 7;
+   else if (NULL != strstr (file, "://"))
+     return;
+
+   if (NULL == (name = SLmake_string (file)))
+     return;
+   if (NULL != (p = strchr (name, '[')))
+     *p = 0;
+
+   if (-1 != (fd = open (name, O_RDONLY)))
+     {
+	(void) posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+	(void) close (fd);
+     }
+   SLfree (name);
+#else
+   (void) file;
+#endif
+}
+
+static int create_img (FitsFile_Type *ft, int *bitpix,
+		       SLang_Array_Type *at_naxes)
+{
+   Call_Context_Type cc;
+   long *axes;
+   unsigned int i, imax;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_create_img");
+
+   if (at_naxes->data_type != SLANG_INT_TYPE)
+     {
+	SLang_verror (SL_TYPE_MISMATCH,
+		      "fits_create_img: naxis must be an integer array");
+	return end_call (&cc, -1);
+     }
+
+   imax = at_naxes->num_elements;
+   axes = (long *) SLmalloc ((imax+1) * sizeof (long));
+   if (axes == NULL)
+     return end_call (&cc, -1);
+
+   /* Transpose to FORTRAN order */
+   for (i = 0; i < imax; i++)
+     axes[i] = ((int *) at_naxes->data)[imax-(i+1)];
+
+   (void) fits_create_img (ft->fptr, *bitpix, imax, axes, &status);
+   SLfree ((char *) axes);
+   return end_call (&cc, status);
+}
+
+/* The cfitsio datatype used to read or write an array of data_type */
+static int map_slang_to_fitsio_type (char *fun, SLtype data_type, int *typep)
+{
+   int type;
+
+   switch (data_type)
+     {
+      case SLANG_STRING_TYPE:
+	type = TSTRING;
+	break;
+
+      case SLANG_DOUBLE_TYPE:
+	type = TDOUBLE;
+	break;
+
+      case SLANG_FLOAT_TYPE:
+	type = TFLOAT;
+	break;
+
+      case SLANG_INT16_TYPE:
+	type = CFITSIO_INT16_TYPE;
+	break;
+
+      case SLANG_UINT16_TYPE:
+	type = CFITSIO_UINT16_TYPE;
+	break;
+
+      case SLANG_INT32_TYPE:
+	type = CFITSIO_INT32_TYPE;
+	break;
+
+      case SLANG_UINT32_TYPE:
+	type = CFITSIO_UINT32_TYPE;
+	break;
+
+      case SLANG_CHAR_TYPE:
+      case SLANG_UCHAR_TYPE:
+	type = TBYTE;
+	break;
+
+#ifdef SLANG_INT64_TYPE
+      case SLANG_INT64_TYPE:
+	type = CFITSIO_INT64_TYPE;
+	break;
+#endif
+
+      default:
+	SLang_verror (SL_NOT_IMPLEMENTED,
+		      "%s: %s not supported", fun,
+		      SLclass_get_datatype_name (data_type));
+	return -1;
+     }
+   *typep = type;
+   return 0;
+}
+
+/* Pop the type that data are to be converted to by cfitsio as they are
+ * read, and its cfitsio datatype.
+ */
+static int pop_read_type (char *fun, SLtype *datatypep, int *typep)
+{
+   SLtype datatype;
+
+   if (-1 == SLang_pop_datatype (&datatype))
+     return -1;
+
+   if (datatype == SLANG_STRING_TYPE)
+     {
+	SLang_verror (SL_INVALID_PARM, "%s: type= must be a numeric type", fun);
+	return -1;
+     }
+   if (-1 == map_slang_to_fitsio_type (fun, datatype, typep))
+     return -1;
+#ifdef TSBYTE
+   if (datatype == SLANG_CHAR_TYPE)
+     *typep = TSBYTE;
+#endif
+   *datatypep = datatype;
+   return 0;
+}
+
+/* Replace the type that a column is read as by the one requested by
+ * the caller, if any.  String, logical and bit columns are not
+ * converted.
+ */
+static void convert_column_type (int *typep, SLtype *datatypep,
+				 int read_type, SLtype read_datatype)
+{
+   int type = *typep;
+
+   if (type < 0)
+     type = -type;
+   if ((read_type == 0) || (type == TBIT) || (type == TLOGICAL)
+       || (*datatypep == SLANG_STRING_TYPE))
+     return;
+
+   *typep = (*typep < 0) ? -read_type : read_type;
+   *datatypep = read_datatype;
+}
+
+static int write_img (FitsFile_Type *ft, SLang_Array_Type *at)
+{
+   Call_Context_Type cc;
+   int type;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_write_img");
+
+   if (-1 == map_slang_to_fitsio_type ("fits_write_img", at->data_type, &type))
+     return end_call (&cc, -1);
+
+   if (0 == fits_write_img (ft->fptr, type, 1, at->num_elements,
+			    at->data, &status))
+     count_write (at->num_elements, at->sizeof_type);
+   return end_call (&cc, status);
+}
+
+/* Usage: status = _fits_write_subset (ft, array, origin)
+ * Writes the array into the current image HDU with its first element at
+ * the 0-based pixel origin, which is given in the same order as the
+ * array indices.  The array may have fewer dimensions than the image, in
+ * which case its missing leading dimensions are taken to be 1.
+ */
+static int write_subset (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt = NULL;
+   SLang_Array_Type *at = NULL, *origin_at = NULL;
+   FitsFile_Type *ft;
+   LONGLONG naxes[SLARRAY_MAX_DIMS], *origin;
+   long fpixel[SLARRAY_MAX_DIMS], lpixel[SLARRAY_MAX_DIMS];
+   int i, num_dims, type, status = 0;
+   int ret = -1;
+
+   if ((-1 == SLang_pop_array_of_type (&origin_at, SLANG_LLONG_TYPE))
+       || (-1 == SLang_pop_array (&at, 0))
+       || (NULL == (ft = pop_fits_type (&mmt))))
+     goto free_and_return;
+
+   if (ft->fptr == NULL)
+     goto free_and_return;
+
+   begin_call (&cc, ft, "_fits_write_subset");
+
+   if (-1 == map_slang_to_fitsio_type ("fits_write_img_section", at->data_type, &type))
+     goto end_call_and_return;
+
+   if (type == TSTRING)
+     {
+	SLang_verror (SL_NOT_IMPLEMENTED, "fits_write_img_section: String_Type images are not supported");
+	goto end_call_and_return;
+     }
+
+   if (fits_get_img_dim (ft->fptr, &num_dims, &status)
+       || ((num_dims > 0) && (num_dims <= SLARRAY_MAX_DIMS)
+	   && fits_get_img_sizell (ft->fptr, num_dims, naxes, &status)))
+     {
+	ret = status;
+	goto end_call_and_return;
+     }
+
+   if ((num_dims > SLARRAY_MAX_DIMS) || (num_dims < 1)
+       || ((int) at->num_dims > num_dims)
+       || ((int) origin_at->num_elements != num_dims))
+     {
+	SLang_verror (SL_INVALID_PARM,
+		      "fits_write_img_section: the image has %d dimensions, the section %d and the origin %d",
+		      num_dims, (int) at->num_dims, (int) origin_at->num_elements);
+	goto end_call_and_return;
+     }
+
+   /* FITS axis i is the array dimension num_dims-1-i */
+   origin = (LONGLONG *) origin_at->data;
+   for (i = 0; i < num_dims; i++)
+     {
+	int j = num_dims - 1 - i;
+	int k = j - (num_dims - (int) at->num_dims);
+	LONGLONG first = origin[j];
+	LONGLONG n = (k >= 0) ? (LONGLONG) at->dims[k] : 1;
+
+	if ((first < 0) || (n < 1) || (first + n > naxes[i]))
+	  {
+	     SLang_verror (SL_INDEX_ERROR,
+			   "fits_write_img_section: the section does not fit into the image along dimension %d",
+			   j);
+	     goto end_call_and_return;
+	  }
+	fpixel[i] = (long) (first + 1);
+	lpixel[i] = (long) (first + n);
+     }
+
+   if (0 == fits_write_subset (ft->fptr, type, fpixel, lpixel, at->data, &status))
+     count_write (at->num_elements, at->sizeof_type);
+   ret = status;
+
+end_call_and_return:
+   ret = end_call (&cc, ret);
+free_and_return:
+   SLang_free_array (origin_at);
+   SLang_free_array (at);
+   SLang_free_mmt (mmt);
+   return ret;
+}
+
+/* Check that an array supplied by the caller via into= may receive
+ * num_elements values of the given type, and that its dimensions match
+ * dims.  If exact is 0, only the leading dimension is compared, which
+ * allows the caller to use a different shape for the remaining ones.
+ */
+static int check_into_array (char *fun, SLang_Array_Type *at, SLtype type,
+			     SLuindex_Type num_elements, SLindex_Type *dims, int num_dims,
+			     int exact)
+{
+   char buf[16*SLARRAY_MAX_DIMS + 4];
+   unsigned int len;
+   int i, ok;
+
+   if (at->data_type != type)
+     {
+	SLang_verror (SL_TYPE_MISMATCH, "%s: into= requires a %s array, found %s",
+		      fun, SLclass_get_datatype_name (type),
+		      SLclass_get_datatype_name (at->data_type));
+	return -1;
+     }
+
+   if ((at->flags & SLARR_DATA_VALUE_IS_READ_ONLY)
+#ifdef SLARR_DATA_VALUE_IS_RANGE
+       || (at->flags & SLARR_DATA_VALUE_IS_RANGE)
+#endif
+      )
+     {
+	SLang_verror (SL_INVALID_PARM, "%s: the into= array is not writable", fun);
+	return -1;
+     }
+
+   ok = (at->num_elements == num_elements);
+   if (exact)
+     ok = ok && ((int) at->num_dims == num_dims);
+   for (i = 0; ok && (i < num_dims) && (i < (int) at->num_dims); i++)
+     {
+	if (exact || (i == 0))
+	  ok = (at->dims[i] == dims[i]);
+     }
+   if (ok)
+     return 0;
+
+   len = 0;
+   for (i = 0; i < num_dims; i++)
+     {
+	if (exact || (i == 0))
+	  sprintf (buf + len, (i ? ",%d" : "%d"), dims[i]);
+	else
+	  strcpy (buf + len, ",*");
+	len += strlen (buf + len);
+     }
+   SLang_verror (SL_INVALID_PARM,
+		 "%s: into= array has the wrong shape: expected [%s] with %lu elements",
+		 fun, buf, (unsigned long) num_elements);
+   return -1;
+}
+
+/* Read a double valued keyword, using defval if it does not exist */
+static int read_double_key (fitsfile *f, char *name, double defval, double *valp)
+{
+   int status = 0;
+
+   if (0 == fits_read_key (f, TDOUBLE, name, valp, NULL, &status))
+     return 0;
+
+   if (status != KEY_NO_EXIST)
+     return status;
+
+   fits_clear_errmsg ();
+   *valp = defval;
+   return 0;
+}
+
+/* The S-Lang and cfitsio types used to read an image of the given
+ * (equivalent) BITPIX type.
+ */
+static void map_img_type (int img_type, SLtype *stypep, int *typep)
+{
+   SLtype stype;
+   int type;
+
+   switch (img_type)
+     {
+      case BYTE_IMG:
+	stype = SLANG_UCHAR_TYPE;
+	type = TBYTE;
+	break;
+
+      case SHORT_IMG:		       /* 16 bit image */
+	stype = SLANG_INT16_TYPE;
+	type = CFITSIO_INT16_TYPE;
+	break;
+
+      case USHORT_IMG:		       /* 16 bit image */
+	stype = SLANG_UINT16_TYPE;
+	type = CFITSIO_UINT16_TYPE;
+	break;
+
+      case LONG_IMG:		       /* 32 bit image */
+	stype = SLANG_INT32_TYPE;
+	type = CFITSIO_INT32_TYPE;
+	break;
+
+      case ULONG_IMG:		       /* 32 bit image */
+	stype = SLANG_UINT32_TYPE;
+	type = CFITSIO_UINT32_TYPE;
+	break;
+
+#ifdef TLONGLONG
+      case LONGLONG_IMG:	       /* 64 bit image */
+	stype = SLANG_INT64_TYPE;
+	type = CFITSIO_INT64_TYPE;
+	break;
+#endif
+
+      case DOUBLE_IMG:
+	stype = SLANG_DOUBLE_TYPE;
+	type = TDOUBLE;
+	break;
+
+      case FLOAT_IMG:
+      default:
+	stype = SLANG_FLOAT_TYPE;
+	type = TFLOAT;
+	break;
+     }
+   *stypep = stype;
+   *typep = type;
+}
+
+/* If bscale_ref is non-NULL, the image is read in its stored type
+ * without applying BSCALE/BZERO, whose values are assigned to
+ * bscale_ref and bzero_ref.  If read_type is non-zero, the pixels are
+ * converted to read_datatype by cfitsio instead.
+ */
+static int do_read_img (FitsFile_Type *ft, SLang_Ref_Type *ref, SLang_Array_Type *into,
+			SLang_Ref_Type *bscale_ref, SLang_Ref_Type *bzero_ref,
+			int read_type, SLtype read_datatype)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   int anynul = 0;
+   int type;
+   SLtype stype;
+   int num_dims, i;
+   long ldims[SLARRAY_MAX_DIMS];
+   SLindex_Type dims[SLARRAY_MAX_DIMS];
+   SLang_Array_Type *at;
+   double bscale = 1.0, bzero = 0.0;
+   int raw = (bscale_ref != NULL);
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_read_img");
+
+#ifdef fits_get_img_equivtype
+   if (raw == 0)
+     status = fits_get_img_equivtype (ft->fptr, &type, &status);
+   else
+#endif
+     status = fits_get_img_type (ft->fptr, &type, &status);
+   if (status)
+     return end_call (&cc, status);
+
+   if (raw)
+     {
+	if ((0 != (status = read_double_key (ft->fptr, "BSCALE", 1.0, &bscale)))
+	    || (0 != (status = read_double_key (ft->fptr, "BZERO", 0.0, &bzero))))
+	  return end_call (&cc, status);
+     }
+
+   map_img_type (type, &stype, &type);
+
+   if (read_type != 0)
+     {
+	stype = read_datatype;
+	type = read_type;
+     }
+
+   if (fits_get_img_dim (ft->fptr, &num_dims, &status))
+     return end_call (&cc, status);
+
+   if ((num_dims > SLARRAY_MAX_DIMS) || (num_dims < 0))
+     {
+	SLang_verror (SL_NOT_IMPLEMENTED, "Image dimensionality is not supported");
+	return end_call (&cc, -1);
+     }
+
+   if (fits_get_img_size (ft->fptr, num_dims, ldims, &status))
+     return end_call (&cc, status);
+
+#if 0
+   for (i = 0; i < num_dims; i++) dims[i] = (int) ldims[i];
+#else
+   for (i = 0; i < num_dims; i++) dims[num_dims-1-i] = (int) ldims[i];
+#endif
+
+   if (into != NULL)
+     {
+	SLuindex_Type num_elements = 1;
+	for (i = 0; i < num_dims; i++) num_elements *= dims[i];
+	if (-1 == check_into_array ("fits_read_img", into, stype, num_elements,
+				    dims, num_dims, 1))
+	  return end_call (&cc, -1);
+	at = into;
+     }
+   else if (NULL == (at = SLang_create_array (stype, 0, NULL, dims, num_dims)))
+     return end_call (&cc, -1);
+
+   if (raw)
+     (void) fits_set_bscale (ft->fptr, 1.0, 0.0, &status);
+
+   (void) fits_read_img (ft->fptr, type, 1, at->num_elements, NULL,
+			 at->data, &anynul, &status);
+   count_read (at->num_elements, at->sizeof_type);
+
+   if (raw)
+     {
+	int status1 = 0;
+	/* Restore the scaling, even after an error */
+	if ((0 != fits_set_bscale (ft->fptr, bscale, bzero, &status1))
+	    && (status == 0))
+	  status = status1;
+     }
+
+   if ((status == 0)
+       && (((ref != NULL)
+	    && (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR)&at)))
+	   || (raw
+	       && ((-1 == SLang_assign_to_ref (bscale_ref, SLANG_DOUBLE_TYPE, (VOID_STAR)&bscale))
+		   || (-1 == SLang_assign_to_ref (bzero_ref, SLANG_DOUBLE_TYPE, (VOID_STAR)&bzero))))))
+     status = -1;
+
+   if (at != into)
+     SLang_free_array (at);
+   return end_call (&cc, status);
+}
+
+/* Usage: _fits_read_img (ft, &img|into [, &bscale, &bzero] [,type])
+ * If an array is passed instead of a reference, the image is read into it.
+ */
+static int read_img (void)
+{
+   SLang_MMT_Type *mmt = NULL;
+   FitsFile_Type *ft;
+   SLang_Ref_Type *ref = NULL, *bscale_ref = NULL, *bzero_ref = NULL;
+   SLang_Array_Type *into = NULL;
+   SLtype read_datatype = 0;
+   int read_type = 0;
+   int nargs = SLang_Num_Function_Args;
+   int status = -1;
+
+   if ((nargs == 3) || (nargs == 5))
+     {
+	if (-1 == pop_read_type ("fits_read_img", &read_datatype, &read_type))
+	  return -1;
+	nargs--;
+     }
+
+   if (nargs == 4)
+     {
+	if ((-1 == SLang_pop_ref (&bzero_ref))
+	    || (-1 == SLang_pop_ref (&bscale_ref)))
+	  goto free_and_return;
+     }
+   else if (nargs != 2)
+     {
+	SLang_verror (SL_USAGE_ERROR, "Usage: _fits_read_img (fptr, &img|into [,&bscale, &bzero] [,type])");
+	return -1;
+     }
+
+   if (SLang_peek_at_stack () == SLANG_ARRAY_TYPE)
+     {
+	if (-1 == SLang_pop_array (&into, 0))
+	  goto free_and_return;
+     }
+   else if (-1 == SLang_pop_ref (&ref))
+     goto free_and_return;
+
+   if (NULL == (ft = pop_fits_type (&mmt)))
+     goto free_and_return;
+
+   status = do_read_img (ft, ref, into, bscale_ref, bzero_ref, read_type, read_datatype);
+
+   free_and_return:
+   SLang_free_array (into);
+   SLang_free_ref (bzero_ref);
+   SLang_free_ref (bscale_ref);
+   SLang_free_ref (ref);
+   SLang_free_mmt (mmt);
+   return status;
+}
+
+/* Reduction of an image by blocks of pixels.  The image is read as
+ * doubles, a band of whole rows of blocks at a time, so that the memory
+ * used is one band plus the output.  For a tile-compressed image, the
+ * band is made at least as tall as a row of tiles so that each tile is
+ * decompressed only once.  NaN pixels, which include the undefined
+ * pixels of integer images, are ignored; a block without valid pixels
+ * yields a NaN.
+ */
+#define BIN_OP_MEAN	1
+#define BIN_OP_SUM	2
+#define BIN_OP_MIN	3
+#define BIN_OP_MAX	4
+#define BIN_OP_MEDIAN	5
+
+#ifdef NAN
+# define BIN_NAN_VALUE	NAN
+#else
+# define BIN_NAN_VALUE	(0.0/0.0)
+#endif
+
+static int map_bin_op (char *name)
+{
+   if (0 == strcmp (name, "mean")) return BIN_OP_MEAN;
+   if (0 == strcmp (name, "sum")) return BIN_OP_SUM;
+   if (0 == strcmp (name, "min")) return BIN_OP_MIN;
+   if (0 == strcmp (name, "max")) return BIN_OP_MAX;
+   if (0 == strcmp (name, "median")) return BIN_OP_MEDIAN;
+
+   SLang_verror (SL_INVALID_PARM, "fits_read_img_binned: op=%s is not supported", name);
+   return -1;
+}
+
+/* Partially sort x so that x[k] is the kth smallest of the n values */
+static void select_kth_double (double *x, size_t n, size_t k)
+{
+   size_t lo = 0, hi = n - 1;
+
+   while (lo < hi)
+     {
+	double pivot = x[lo + (hi - lo)/2];
+	size_t i = lo, j = hi;
+
+	while (i <= j)
+	  {
+	     while (x[i] < pivot) i++;
+	     while (x[j] > pivot) j--;
+	     if (i <= j)
+	       {
+		  double t = x[i]; x[i] = x[j]; x[j] = t;
+		  i++;
+		  if (j == 0)
+		    break;
+		  j--;
+	       }
+	  }
+	if (k <= j)
+	  hi = j;
+	else if (k >= i)
+	  lo = i;
+	else
+	  break;
+     }
+}
+
+static double reduce_block (int op, double *band, size_t *offsets, size_t num_offsets,
+			    double *values)
+{
+   double result = 0.0;
+   size_t i, n = 0;
+
+   for (i = 0; i < num_offsets; i++)
+     {
+	double x = band[offsets[i]];
+	if (x != x)
+	  continue;
+
+	switch (op)
+	  {
+	   case BIN_OP_MIN:
+	     if ((n == 0) || (x < result)) result = x;
+	     break;
+	   case BIN_OP_MAX:
+	     if ((n == 0) || (x > result)) result = x;
+	     break;
+	   case BIN_OP_MEDIAN:
+	     values[n] = x;
+	     break;
+	   default:
+	     result += x;
+	     break;
+	  }
+	n++;
+     }
+
+   if (n == 0)
+     return BIN_NAN_VALUE;
+
+   if (op == BIN_OP_MEAN)
+     return result / n;
+
+   if (op == BIN_OP_MEDIAN)
+     {
+	size_t k = n/2;
+	select_kth_double (values, n, k);
+	result = values[k];
+	if ((n % 2) == 0)
+	  {
+	     double lower = values[0];
+	     for (i = 1; i < k; i++)
+	       if (values[i] > lower) lower = values[i];
+	     result = 0.5 * (result + lower);
+	  }
+     }
+   return result;
+}
+
+/* Usage: status = _fits_read_img_binned (ft, factors, op, &img)
+ * The factors are given in the order of the array dimensions; a single
+ * factor applies to all of them.  Trailing pixels that do not fill a
+ * block are ignored.
+ */
+static int read_img_binned (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt = NULL;
+   FitsFile_Type *ft;
+   SLang_Ref_Type *ref = NULL;
+   SLang_Array_Type *factors_at = NULL, *at = NULL;
+   char *opname = NULL;
+   LONGLONG ldims[SLARRAY_MAX_DIMS];
+   SLindex_Type dims[SLARRAY_MAX_DIMS], out_dims[SLARRAY_MAX_DIMS];
+   size_t strides[SLARRAY_MAX_DIMS], factors[SLARRAY_MAX_DIMS];
+   size_t *offsets = NULL, *cell_offsets = NULL;
+   double *band = NULL, *values = NULL, *out;
+   size_t num_offsets, row_pixels, out_cells, band_rows, rows_done, num_out_rows;
+   double nulval = BIN_NAN_VALUE;
+   int i, op, num_dims, status = 0;
+   int ret = -1;
+
+   if ((-1 == SLang_pop_ref (&ref))
+       || (-1 == SLang_pop_slstring (&opname))
+       || (-1 == SLang_pop_array_of_type (&factors_at, SLANG_INT_TYPE))
+       || (NULL == (ft = pop_fits_type (&mmt))))
+     goto free_and_return;
+
+   if (ft->fptr == NULL)
+     goto free_and_return;
+
+   begin_call (&cc, ft, "_fits_read_img_binned");
+
+   if (-1 == (op = map_bin_op (opname)))
+     goto end_call_and_return;
+
+   if (fits_get_img_dim (ft->fptr, &num_dims, &status)
+       || ((num_dims > 0) && (num_dims <= SLARRAY_MAX_DIMS)
+	   && fits_get_img_sizell (ft->fptr, num_dims, ldims, &status)))
+     {
+	ret = status;
+	goto end_call_and_return;
+     }
+   if ((num_dims < 1) || (num_dims > SLARRAY_MAX_DIMS))
+     {
+	SLang_verror (SL_NOT_IMPLEMENTED, "Image dimensionality is not supported");
+	goto end_call_and_return;
+     }
+   if (((int) factors_at->num_elements != num_dims) && (factors_at->num_elements != 1))
+     {
+	SLang_verror (SL_INVALID_PARM, "fits_read_img_binned: expected 1 or %d binning factors", num_dims);
+	goto end_call_and_return;
+     }
+
+   num_offsets = 1;
+   row_pixels = 1;
+   out_cells = 1;
+   for (i = num_dims - 1; i >= 0; i--)
+     {
+	int f = ((int *) factors_at->data)[(factors_at->num_elements == 1) ? 0 : i];
+
+	dims[i] = (SLindex_Type) ldims[num_dims-1-i];
+	if ((f < 1) || (dims[i] < f))
+	  {
+	     SLang_verror (SL_INVALID_PARM, "fits_read_img_binned: invalid binning factor %d for a dimension of %ld",
+			   f, (long) dims[i]);
+	     goto end_call_and_return;
+	  }
+	factors[i] = (size_t) f;
+	out_dims[i] = dims[i] / f;
+	strides[i] = row_pixels;
+	row_pixels *= (size_t) dims[i];
+	num_offsets *= factors[i];
+	if (i > 0)
+	  out_cells *= (size_t) out_dims[i];
+     }
+   /* From here on, row_pixels is the number of pixels in a row of the
+    * slowest varying dimension.
+    */
+   row_pixels = strides[0];
+
+   /* The offsets of the pixels of a block relative to its first one, and
+    * the offsets of the first pixels of the blocks of a row of blocks.
+    */
+   if ((NULL == (offsets = (size_t *) SLmalloc (num_offsets * sizeof (size_t))))
+       || (NULL == (cell_offsets = (size_t *) SLmalloc (out_cells * sizeof (size_t)))))
+     goto end_call_and_return;
+   for (i = 0; i < 2; i++)
+     {
+	size_t *list = (i == 0) ? offsets : cell_offsets;
+	size_t num = (i == 0) ? num_offsets : out_cells;
+	size_t k;
+
+	for (k = 0; k < num; k++)
+	  {
+	     size_t m = k, ofs = 0;
+	     int j;
+	     for (j = num_dims - 1; j >= (i == 0 ? 0 : 1); j--)
+	       {
+		  size_t n = (i == 0) ? factors[j] : (size_t) out_dims[j];
+		  size_t idx = m % n;
+		  m /= n;
+		  ofs += ((i == 0) ? idx : idx * factors[j]) * strides[j];
+	       }
+	     list[k] = ofs;
+	  }
+     }
+
+   num_out_rows = (size_t) out_dims[0];
+   band_rows = factors[0];
+   if (fits_is_compressed_image (ft->fptr, &status))
+     {
+	char keyname[16];
+	double tile_rows;
+
+	sprintf (keyname, "ZTILE%d", num_dims);
+	if (0 == read_double_key (ft->fptr, keyname, 1.0, &tile_rows))
+	  {
+	     while ((band_rows < tile_rows) && (band_rows < num_out_rows * factors[0]))
+	       band_rows += factors[0];
+	  }
+     }
+   status = 0;
+
+   if ((NULL == (band = (double *) SLmalloc (band_rows * row_pixels * sizeof (double))))
+       || ((op == BIN_OP_MEDIAN)
+	   && (NULL == (values = (double *) SLmalloc (num_offsets * sizeof (double))))))
+     goto end_call_and_return;
+
+   if (NULL == (at = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, out_dims, num_dims)))
+     goto end_call_and_return;
+   out = (double *) at->data;
+
+   rows_done = 0;
+   while (rows_done < num_out_rows * factors[0])
+     {
+	size_t nrows = band_rows, r;
+	int anynul = 0;
+
+	if (nrows > num_out_rows * factors[0] - rows_done)
+	  nrows = num_out_rows * factors[0] - rows_done;
+
+	if (fits_read_img (ft->fptr, TDOUBLE, (LONGLONG) (rows_done * row_pixels) + 1,
+			   (LONGLONG) (nrows * row_pixels), &nulval, band, &anynul, &status))
+	  {
+	     ret = status;
+	     goto end_call_and_return;
+	  }
+	count_read ((double) (nrows * row_pixels), sizeof (double));
+
+	for (r = 0; r < nrows; r += factors[0])
+	  {
+	     double *band_row = band + r * row_pixels;
+	     size_t k;
+
+	     for (k = 0; k < out_cells; k++)
+	       *out++ = reduce_block (op, band_row + cell_offsets[k], offsets, num_offsets, values);
+	  }
+	rows_done += nrows;
+     }
+
+   if (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR) &at))
+     goto end_call_and_return;
+   ret = 0;
+
+end_call_and_return:
+   ret = end_call (&cc, ret);
+free_and_return:
+   SLfree ((char *) values);
+   SLfree ((char *) band);
+   SLfree ((char *) cell_offsets);
+   SLfree ((char *) offsets);
+   SLang_free_array (at);
+   SLang_free_array (factors_at);
+   SLang_free_slstring (opname);
+   SLang_free_ref (ref);
+   SLang_free_mmt (mmt);
+   return ret;
+}
+
+/* Reading the values of scattered pixels.  The requests are sorted by
+ * the block of the image that holds them, which is a tile for a
+ * tile-compressed image and a row otherwise, and each block that is
+ * touched is read once, as the bounding box of its requests.  The I/O
+ * thus scales with the number of distinct rows or tiles requested rather
+ * than with the size of the image.
+ */
+typedef struct
+{
+   LONGLONG block;		       /* -1 if outside the image */
+   LONGLONG offset;		       /* of the pixel in the image */
+   SLuindex_Type index;		       /* of the request */
+}
+Pixel_Request_Type;
+
+static int compare_pixel_requests (const void *a, const void *b)
+{
+   const Pixel_Request_Type *ra = (const Pixel_Request_Type *) a;
+   const Pixel_Request_Type *rb = (const Pixel_Request_Type *) b;
+
+   if (ra->block != rb->block)
+     return (ra->block < rb->block) ? -1 : 1;
+   if (ra->offset != rb->offset)
+     return (ra->offset < rb->offset) ? -1 : 1;
+   return 0;
+}
+
+/* Usage: status = _fits_read_pixels (ft, x, y, ..., &values)
+ * The 1-based pixel coordinates are given in FITS order, one array per
+ * axis.  Pixels outside the image are returned as NaN.
+ */
+static int read_pixels (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt = NULL;
+   FitsFile_Type *ft;
+   SLang_Ref_Type *ref = NULL;
+   SLang_Array_Type *coords_at[SLARRAY_MAX_DIMS];
+   SLang_Array_Type *at = NULL;
+   LONGLONG *coords[SLARRAY_MAX_DIMS];
+   LONGLONG naxes[SLARRAY_MAX_DIMS], tiles[SLARRAY_MAX_DIMS];
+   long fpixel[SLARRAY_MAX_DIMS], lpixel[SLARRAY_MAX_DIMS], inc[SLARRAY_MAX_DIMS];
+   Pixel_Request_Type *requests = NULL;
+   double *buf = NULL, *values;
+   double nulval = BIN_NAN_VALUE;
+   size_t buf_size = 0;
+   SLuindex_Type num, i, i0;
+   int num_coords, num_dims, k, is_compressed;
+   int status = 0, ret = -1;
+
+   num_coords = SLang_Num_Function_Args - 2;
+   for (k = 0; k < SLARRAY_MAX_DIMS; k++)
+     coords_at[k] = NULL;
+
+   if ((num_coords < 1) || (num_coords > SLARRAY_MAX_DIMS))
+     {
+	SLang_verror (SL_USAGE_ERROR, "Usage: _fits_read_pixels (fptr, x, y, ..., &values)");
+	return -1;
+     }
+
+   if (-1 == SLang_pop_ref (&ref))
+     return -1;
+   for (k = num_coords - 1; k >= 0; k--)
+     {
+	if (-1 == SLang_pop_array_of_type (&coords_at[k], SLANG_LLONG_TYPE))
+	  goto free_and_return;
+	coords[k] = (LONGLONG *) coords_at[k]->data;
+     }
+   if (NULL == (ft = pop_fits_type (&mmt)))
+     goto free_and_return;
+
+   if (ft->fptr == NULL)
+     goto free_and_return;
+
+   begin_call (&cc, ft, "_fits_read_pixels");
+
+   if (fits_get_img_dim (ft->fptr, &num_dims, &status)
+       || ((num_dims == num_coords)
+	   && fits_get_img_sizell (ft->fptr, num_dims, naxes, &status)))
+     {
+	ret = status;
+	goto end_call_and_return;
+     }
+   if (num_dims != num_coords)
+     {
+	SLang_verror (SL_INVALID_PARM, "fits_read_pixels: the image has %d dimensions, but %d coordinates were given",
+		      num_dims, num_coords);
+	goto end_call_and_return;
+     }
+
+   num = coords_at[0]->num_elements;
+   for (k = 1; k < num_dims; k++)
+     {
+	if (coords_at[k]->num_elements != num)
+	  {
+	     SLang_verror (SL_INVALID_PARM, "fits_read_pixels: the coordinate arrays must have the same length");
+	     goto end_call_and_return;
+	  }
+     }
+
+   /* The blocks are tiles of the compressed image, or rows */
+   is_compressed = fits_is_compressed_image (ft->fptr, &status);
+   status = 0;
+   for (k = 0; k < num_dims; k++)
+     {
+	tiles[k] = (k == 0) ? naxes[0] : 1;
+	if (is_compressed)
+	  {
+	     char keyname[16];
+	     double tile;
+
+	     sprintf (keyname, "ZTILE%d", k+1);
+	     if ((0 == read_double_key (ft->fptr, keyname, (double) tiles[k], &tile))
+		 && (tile >= 1.0))
+	       tiles[k] = (LONGLONG) tile;
+	  }
+	inc[k] = 1;
+     }
+
+   if (NULL == (at = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL,
+					 coords_at[0]->dims, coords_at[0]->num_dims)))
+     goto end_call_and_return;
+   values = (double *) at->data;
+
+   if ((num > 0)
+       && (NULL == (requests = (Pixel_Request_Type *) SLmalloc (num * sizeof (Pixel_Request_Type)))))
+     goto end_call_and_return;
+
+   for (i = 0; i < num; i++)
+     {
+	LONGLONG offset = 0, block = 0;
+
+	for (k = num_dims - 1; k >= 0; k--)
+	  {
+	     LONGLONG c = coords[k][i] - 1;
+	     if ((c < 0) || (c >= naxes[k]))
+	       {
+		  block = -1;
+		  break;
+	       }
+	     offset = offset * naxes[k] + c;
+	     block = block * ((naxes[k] + tiles[k] - 1) / tiles[k]) + c / tiles[k];
+	  }
+	requests[i].block = block;
+	requests[i].offset = offset;
+	requests[i].index = i;
+	values[i] = BIN_NAN_VALUE;
+     }
+   if (num > 1)
+     qsort (requests, num, sizeof (Pixel_Request_Type), compare_pixel_requests);
+
+   for (i0 = 0; i0 < num; i0 = i)
+     {
+	size_t box_size = 1;
+	int anynul = 0;
+
+	i = i0 + 1;
+	if (requests[i0].block == -1)
+	  {
+	     while ((i < num) && (requests[i].block == -1))
+	       i++;
+	     continue;
+	  }
+	while ((i < num) && (requests[i].block == requests[i0].block))
+	  i++;
+
+	/* The bounding box of the requests of this block */
+	for (k = 0; k < num_dims; k++)
+	  {
+	     SLuindex_Type j;
+	     LONGLONG cmin, cmax;
+
+	     cmin = cmax = coords[k][requests[i0].index];
+	     for (j = i0 + 1; j < i; j++)
+	       {
+		  LONGLONG c = coords[k][requests[j].index];
+		  if (c < cmin) cmin = c;
+		  if (c > cmax) cmax = c;
+	       }
+	     fpixel[k] = (long) cmin;
+	     lpixel[k] = (long) cmax;
+	     box_size *= (size_t) (cmax - cmin + 1);
+	  }
+
+	if (box_size > buf_size)
+	  {
+	     double *b = (double *) SLrealloc ((char *) buf, box_size * sizeof (double));
+	     if (b == NULL)
+	       goto end_call_and_return;
+	     buf = b;
+	     buf_size = box_size;
+	  }
+
+	if (fits_read_subset (ft->fptr, TDOUBLE, fpixel, lpixel, inc, &nulval,
+			      buf, &anynul, &status))
+	  {
+	     ret = status;
+	     goto end_call_and_return;
+	  }
+	count_read ((double) box_size, sizeof (double));
+
+	for (; i0 < i; i0++)
+	  {
+	     SLuindex_Type index = requests[i0].index;
+	     size_t ofs = 0;
+
+	     for (k = num_dims - 1; k >= 0; k--)
+	       ofs = ofs * (size_t) (lpixel[k] - fpixel[k] + 1)
+		 + (size_t) (coords[k][index] - fpixel[k]);
+	     values[index] = buf[ofs];
+	  }
+     }
+
+   if (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR) &at))
+     goto end_call_and_return;
+   ret = 0;
+
+end_call_and_return:
+   ret = end_call (&cc, ret);
+free_and_return:
+   SLfree ((char *) buf);
+   SLfree ((char *) requests);
+   SLang_free_array (at);
+   for (k = 0; k < num_coords; k++)
+     SLang_free_array (coords_at[k]);
+   SLang_free_ref (ref);
+   SLang_free_mmt (mmt);
+   return ret;
+}
+
+static int create_binary_tbl (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt;
+   FitsFile_Type *ft;
+   SLang_Array_Type *at_ttype, *at_tform, *at_tunit;
+   char *extname;
+   LONGLONG nrows;
+   int tfields;
+   int status;
+
+   begin_call (&cc, NULL, "_fits_create_binary_tbl");
+
+   status = -1;
+   at_ttype = at_tform = at_tunit = NULL;
+   mmt = NULL;
+   ft = NULL;
+
+   if (-1 == pop_string_or_null (&extname))
+     return end_call (&cc, -1);
+
+   if (-1 == pop_array_or_null (&at_tunit))
+     goto free_and_return;
+
+   if (-1 == SLang_pop_array (&at_tform, 1))
+     goto free_and_return;
+
+   if (-1 == SLang_pop_array (&at_ttype, 1))
+     goto free_and_return;
+
+   if (-1 == pop_rows_value (&nrows))
+     goto free_and_return;
+
+   if (NULL == (ft = pop_fits_type (&mmt)))
+     goto free_and_return;
+
+   if (ft->fptr == NULL)
+     goto free_and_return;
+
+   set_call_handle (&cc, ft);
+
+   tfields = (int) at_ttype->num_elements;
+
+   if (at_ttype->data_type != SLANG_STRING_TYPE)
+     {
+	SLang_verror (SL_TYPE_MISMATCH,
+		      "fits_create_binary_tbl: ttype must be String_Type[%d]",
+		      tfields);
+	goto free_and_return;
+     }
+
+   if ((tfields != (int) at_tform->num_elements)
+       || (at_tform->data_type != SLANG_STRING_TYPE))
+     {
+	SLang_verror (SL_TYPE_MISMATCH,
+		      "fits_create_binary_tbl: tform must be String_Type[%d]",
+		      tfields);
+	goto free_and_return;
+     }
+
+   if ((at_tunit != NULL)
+       && ((tfields != (int) at_tunit->num_elements)
+	   || (at_tunit->data_type != SLANG_STRING_TYPE)))
+     {
+	SLang_verror (SL_TYPE_MISMATCH,
+		      "fits_create_binary_tbl: tunit must be String_Type[%d]",
+		      tfields);
+	goto free_and_return;
+     }
+
+   status = 0;
+   fits_create_tbl (ft->fptr, BINARY_TBL, nrows, tfields,
+		    (char **) at_ttype->data,
+		    (char **) at_tform->data,
+		    ((at_tunit == NULL) ? NULL : (char **) at_tunit->data),
+		    extname, &status);
+
+   /* drop */
+
+   free_and_return:
+   SLang_free_array (at_ttype);
+   SLang_free_array (at_tform);
+   SLang_free_array (at_tunit);
+   SLang_free_slstring (extname);
+
+   (void) end_call (&cc, status);
+   SLang_free_mmt (mmt);
+   return status;
+}
+
+static int update_key (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt;
+   FitsFile_Type *ft;
+   char *comment;
+   int i;
+   unsigned int ui;
+   double d;
+   long l;
+   unsigned long ul;
+   char *s;
+   char *key;
+   int type;
+   VOID_STAR v;
+   int status;
+
+   begin_call (&cc, NULL, "_fits_update_key");
+
+   if (-1 == pop_string_or_null (&comment))
+     return end_call (&cc, -1);
+
+   key = s = NULL;
+   mmt = NULL;
+   status = -1;
+
+   type = SLang_peek_at_stack ();
+   switch (type)
+     {
+      case SLANG_STRING_TYPE:
+	type = TSTRING;
+	if (-1 == SLang_pop_slstring (&s))
+	  goto free_and_return;
+	v = (VOID_STAR) s;
+	break;
+
+      case SLANG_CHAR_TYPE:
+      case SLANG_UCHAR_TYPE:
+	type = TLOGICAL;
+	if (-1 == SLang_pop_integer (&i))
+	  goto free_and_return;
+	if (i == 'F') i = 0;
+	i = (i != 0);
+	v = (VOID_STAR) &i;
+	break;
+
+      case SLANG_SHORT_TYPE:
+      case SLANG_INT_TYPE:
+	type = TINT;
+	if (-1 == SLang_pop_integer (&i))
+	  goto free_and_return;
+	v = (VOID_STAR) &i;
+	break;
+
+      case SLANG_USHORT_TYPE:
+      case SLANG_UINT_TYPE:
+	type = TUINT;
+	if (-1 == SLang_pop_uint (&ui))
+	  goto free_and_return;
+	v = (VOID_STAR) &ui;
+	break;
+
+      case SLANG_LONG_TYPE:
+	type = TLONG;
+	if (-1 == SLang_pop_long (&l))
+	  goto free_and_return;
+	v = (VOID_STAR) &l;
+	break;
+
+      case SLANG_ULONG_TYPE:
+	type = TULONG;
+	if (-1 == SLang_pop_long (&l))
+	  goto free_and_return;
+	v = (VOID_STAR) &ul;
+	break;
+
+      case SLANG_NULL_TYPE:
+	if (-1 == SLang_pop_null ())
+	  goto free_and_return;
+	v = NULL;
+	break;
+
+      case -1:			       /* stack underflow */
+	goto free_and_return;
+
+      case SLANG_DOUBLE_TYPE:
+      default:
+	type = TDOUBLE;
+#if SLANG_VERSION < 20000
+	if (-1 == SLang_pop_double (&d, NULL, NULL))
+	  goto free_and_return;
+#else
+	if (-1 == SLang_pop_double (&d))
+	  goto free_and_return;
+#endif
+	v = (VOID_STAR) &d;
+	break;
+     }
+
+   if (-1 == SLang_pop_slstring (&key))
+     goto free_and_return;
+
+   if (NULL == (ft = pop_fits_type (&mmt)))
+     goto free_and_return;
+
+   if (ft->fptr == NULL)
+     goto free_and_return;
+
+   set_call_handle (&cc, ft);
+
+   status = 0;
+   if (v != NULL)
+     {
+	if (type == TSTRING)
+	  fits_update_key_longstr (ft->fptr, key, (char *)v, comment, &status);
+	else
+	  fits_update_key (ft->fptr, type, key, v, comment, &status);
+     }
+   else
+     fits_update_key_null (ft->fptr, key, comment, &status);
+
+   free_and_return:
+
+   SLang_free_slstring (key);
+   SLang_free_slstring (comment);
+   SLang_free_slstring (s);
+
+   (void) end_call (&cc, status);
+   SLang_free_mmt (mmt);
+   return status;
+}
+
+static int update_logical (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt;
+   FitsFile_Type *ft;
+   char *comment;
+   int i;
+   char *key;
+   int status;
+
+   begin_call (&cc, NULL, "_fits_update_logical");
+
+   if (-1 == pop_string_or_null (&comment))
+     return end_call (&cc, -1);
+
+   key = NULL;
+   mmt = NULL;
+   status = -1;
+
+   if ((0 == SLang_pop_integer (&i))
+       && (0 == SLang_pop_slstring (&key))
+       && (NULL != (ft = pop_fits_type (&mmt)))
+       && (ft->fptr != NULL))
+     {
+	set_call_handle (&cc, ft);
+	status = 0;
+	fits_update_key (ft->fptr, TLOGICAL, key,
+			 (VOID_STAR) &i, comment, &status);
+     }
+
+   SLang_free_slstring (key);
+   SLang_free_slstring (comment);
+
+   (void) end_call (&cc, status);
+   SLang_free_mmt (mmt);
+   return status;
+}
+
+static int write_comment (FitsFile_Type *ft, char *comment)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_write_comment");
+   return end_call (&cc, fits_write_comment (ft->fptr, comment, &status));
+}
+
+static int write_history (FitsFile_Type *ft, char *comment)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_write_history");
+   return end_call (&cc, fits_write_history (ft->fptr, comment, &status));
+}
+
+static int write_date (FitsFile_Type *ft)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_write_date");
+   return end_call (&cc, fits_write_date (ft->fptr, &status));
+}
+
+static int write_record (FitsFile_Type *ft, char *card)
+{
+   Call_Context_Type cc;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_write_record");
+
+   /* How robust is fits_write_record to cards that are not 80 characters long? */
+   return end_call (&cc, fits_write_record (ft->fptr, card, &status));
+}
+
+static int insert_record (FitsFile_Type *ft, int *keynum, char *card)
+{
+   Call_Context_Type cc;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_insert_record");
+
+   return end_call (&cc, fits_insert_record (ft->fptr, *keynum, card, &status));
+}
+
+static int modify_name (FitsFile_Type *ft, char *oldname, char *newname)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_modify_name");
+   return end_call (&cc, fits_modify_name (ft->fptr, oldname, newname, &status));
+}
+
+static int do_get_keytype (fitsfile *f, char *name, int *stype)
+{
+   int status = 0;
+   char type;
+   int s;
+   char card [FLEN_CARD + 1];
+   char value [FLEN_CARD + 1];
+
+   if (f == NULL)
+     return -1;
+
+   COUNT_STAT(num_key_reads, 1);
+   if (0 != fits_read_card (f, name, card, &status))
+     return status;
+
+   if (0 != fits_parse_value (card, value, NULL, &status))
+     return status;
+
+   if (0 != fits_get_keytype (value, &type, &status))
+     return status;
+
+   switch (type)
+     {
+      case 'C':
+	s = SLANG_STRING_TYPE;
+	break;
+
+      case 'L':
+	s = SLANG_INT_TYPE;
+	break;
+
+      case 'F':
+	s = SLANG_DOUBLE_TYPE;
+	break;
+
+      case 'X':
+	s = SLANG_COMPLEX_TYPE;
+	break;
+
+      case 'I':
+      default:
+	s = SLANG_INT_TYPE;
+	break;
+     }
+   *stype = s;
+
+   return 0;
+}
+
+static int read_key (int type, char *intrin_name)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt;
+   FitsFile_Type *ft;
+   int status;
+   char *name;
+   char comment_buf [FLEN_COMMENT];
+   SLang_Ref_Type *comment_ref, *v_ref;
+   int ival;
+   long lval;
+   double dval;
+   char *sval = NULL;
+   int ftype;
+   VOID_STAR v;
+
+   begin_call (&cc, NULL, intrin_name);
+
+   v_ref = comment_ref = NULL;
+   name = NULL;
+   mmt = NULL;
+   status = -1;
+
+   if (SLANG_NULL_TYPE == SLang_peek_at_stack ())
+     {
+	if (-1 == SLang_pop_null ())
+	  return end_call (&cc, -1);
+     }
+   else if (-1 == SLang_pop_ref (&comment_ref))
+     return end_call (&cc, -1);
+
+   if (-1 == SLang_pop_ref (&v_ref))
+     goto free_and_return;
+
+   if (-1 == SLang_pop_slstring (&name))
+     goto free_and_return;
+
+   if (NULL == (ft = pop_fits_type (&mmt)))
+     goto free_and_return;
+
+   if (ft->fptr == NULL)
+     goto free_and_return;
+
+   set_call_handle (&cc, ft);
+
+   if (type == SLANG_VOID_TYPE)
+     {
+	if (0 != (status = do_get_keytype (ft->fptr, name, &type)))
+	  goto free_and_return;
+	/* if (type == SLANG_INT_TYPE) type = SLANG_LONG_TYPE; */
+
+	status = -1;
+     }
+
+   switch (type)
+     {
+      case SLANG_INT_TYPE:
+	v = (VOID_STAR) &ival;
+	ftype = TINT;
+	ival = 0;
+	break;
+
+      case SLANG_LONG_TYPE:
+	v = (VOID_STAR) &lval;
+	ftype = TLONG;
+	ival = 0;
+	break;
+
+      case SLANG_DOUBLE_TYPE:
+	ftype = TDOUBLE;
+	v = (VOID_STAR) &dval;
+	dval = 0.0;
+	break;
+
+      case SLANG_STRING_TYPE:
+	ftype = TSTRING;
+	v = (VOID_STAR) &sval;
+	break;
+
+      default:
+	SLang_verror (SL_INVALID_PARM,
+		      "fits_read_key: type %s not supported",
+		      SLclass_get_datatype_name (type));
+	goto free_and_return;
+     }
+
+   status = 0;
+   COUNT_STAT(num_key_reads, 1);
+   if (ftype == TSTRING)
+     fits_read_key_longstr (ft->fptr, name, &sval, comment_buf, &status);
+   else
+     fits_read_key (ft->fptr, ftype, name, v, comment_buf, &status);
+
+   if (status == 0)
+     {
+	if (comment_ref != NULL)
+	  {
+	     char *cptr = comment_buf;
+	     if (-1 == SLang_assign_to_ref (comment_ref,
+					    SLANG_STRING_TYPE, (VOID_STAR) &cptr))
+	       {
+		  status = -1;
+		  goto free_and_return;
+	       }
+	  }
+	if (-1 == SLang_assign_to_ref (v_ref, type, v))
+	  {
+	     status = -1;
+	     goto free_and_return;
+	  }
+     }
+
+   free_and_return:
+   SLfree (sval);
+   SLang_free_ref (comment_ref);
+   SLang_free_ref (v_ref);
+   SLang_free_slstring (name);
+   (void) end_call (&cc, status);
+   SLang_free_mmt (mmt);
+   return status;
+}
+
+static int read_key_integer (void)
+{
+   return read_key (SLANG_INT_TYPE, "_fits_read_key_integer");
+}
+
+static int read_key_double (void)
+{
+   return read_key (SLANG_DOUBLE_TYPE, "_fits_read_key_double");
+}
+
+static int read_key_string (void)
+{
+   return read_key (SLANG_STRING_TYPE, "_fits_read_key_string");
+}
+
+static int read_generic_key (void)
+{
+   return read_key (SLANG_VOID_TYPE, "_fits_read_key");
+}
+
+static int read_record (FitsFile_Type *ft, int *keynum, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   char card[FLEN_CARD+1];
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_read_record");
+   COUNT_STAT(num_key_reads, 1);
+
+   if (0 == fits_read_record (ft->fptr, *keynum, card, &status))
+     {
+	char *c = card;
+	if (-1 == SLang_assign_to_ref (ref, SLANG_STRING_TYPE, &c))
+	  return end_call (&cc, -1);
+     }
+
+   return end_call (&cc, status);
+}
+
+static int delete_key (FitsFile_Type *ft, char *key)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_delete_key");
+   return end_call (&cc, fits_delete_key (ft->fptr, key, &status));
+}
+
+static int get_colnum_internal (FitsFile_Type *ft, char *name, SLang_Ref_Type *ref, int casesen)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   int col;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_get_colnum");
+   /* FIXME: fits_get_colnum may be used to get columns matching a pattern */
+   col = 1;
+   fits_get_colnum (ft->fptr, casesen, name, &col, &status);
+
+   if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &col))
+     status = -1;
+
+   return end_call (&cc, status);
+}
+
+static int get_colnum (FitsFile_Type *ft, char *name, SLang_Ref_Type *ref)
+{
+   return get_colnum_internal (ft, name, ref, CASEINSEN);
+}
+
+static int get_colnum_casesen (FitsFile_Type *ft, char *name, SLang_Ref_Type *ref)
+{
+   return get_colnum_internal (ft, name, ref, CASESEN);
+}
+
+
+static int insert_rows (FitsFile_Type *ft, rows_type *first, rows_type *num)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_insert_rows");
+   if ((*first < 0) || (*num < 0))
+     {
+	SLang_verror (SL_INVALID_PARM, "fits_insert_rows: first and num must be non-negative");
+	return end_call (&cc, -1);
+     }
+
+   return end_call (&cc, fits_insert_rows (ft->fptr, *first, *num, &status));
+}
+
+static int delete_rows (FitsFile_Type *ft, rows_type *first, rows_type *num)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_delete_rows");
+   if ((*first <= 0) || (*num < 0))
+     {
+	SLang_verror (SL_INVALID_PARM, "fits_delete_rows: first and num must be positive");
+	return end_call (&cc, -1);
+     }
+
+   return end_call (&cc, fits_delete_rows (ft->fptr, *first, *num, &status));
+}
+
+static int insert_cols (FitsFile_Type *ft, int *colnum,
+			SLang_Array_Type *at_ttype,
+			SLang_Array_Type *at_tform)
+{
+   Call_Context_Type cc;
+   int ncols;
+   char **ttype, **tform;
+   int i;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_insert_cols");
+   ncols = at_ttype->num_elements;
+   if ((ncols < 0) || (ncols != (int) at_tform->num_elements)
+       || (at_ttype->data_type != SLANG_STRING_TYPE)
+       || (at_tform->data_type != SLANG_STRING_TYPE))
+     {
+	SLang_verror (SL_INVALID_PARM,
+		      "fits_insert_cols: ttype and tform must be string arrays of same size");
+	return end_call (&cc, -1);
+     }
+
+   if (*colnum <= 0)
+     {
+	SLang_verror (SL_INVALID_PARM, "fits_insert_cols: colnum must be positive");
+	return end_call (&cc, -1);
+     }
+
+   tform = (char **)at_tform->data;
+   ttype = (char **)at_ttype->data;
+
+   for (i = 0; i < ncols; i++)
+     {
+	if ((tform[i] == NULL) || (ttype[i] == NULL))
+	  {
+	     SLang_verror (SL_INVALID_PARM,
+			   "fits_insert_cols: ttype and tform elements muts be non NULL");
+	     return end_call (&cc, -1);
+	  }
+     }
+   return end_call (&cc, fits_insert_cols (ft->fptr, *colnum, ncols, ttype, tform, &status));
+}
+
+static int delete_col (FitsFile_Type *ft, int *col)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_delete_col");
+   return end_call (&cc, fits_delete_col (ft->fptr, *col, &status));
+}
+
+static int get_num_rows (FitsFile_Type *ft, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   LONGLONG nrows;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_get_num_rows");
+   if (0 == fits_get_num_rowsll (ft->fptr, &nrows, &status))
+     {
+	if (-1 == assign_rows_value (ref, nrows))
+	  return end_call (&cc, -1);
+     }
+   return end_call (&cc, status);
+}
+
+static int get_rowsize (FitsFile_Type *ft, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   long nrows;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_get_rowsize");
+   if (0 == fits_get_rowsize (ft->fptr, &nrows, &status))
+     {
+	if (-1 == assign_rows_value (ref, (LONGLONG) nrows))
+	  return end_call (&cc, -1);
+     }
+   return end_call (&cc, status);
+}
+
+static int get_num_cols (FitsFile_Type *ft, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   int ncols;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_get_num_cols");
+   if (0 == fits_get_num_cols (ft->fptr, &ncols, &status))
+     {
+	if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &ncols))
+	  return end_call (&cc, -1);
+     }
+   return end_call (&cc, status);
+}
+
+/* Bit columns (nX) are stored as packed bytes, the first bit of a cell
+ * being the most significant bit of its first byte.  A row is handed to
+ * S-Lang as one or more integers ("words") of sizeof_word bytes: word k
+ * holds bits 8*sizeof_word*k+1 onward, right-aligned, so that a column
+ * that fits into a single word maps to an integer as before.
+ * Alternatively the bits may be unpacked into a mask with one 0/1 byte
+ * per bit.
+ */
+static int is_big_endian (void)
+{
+   unsigned short s = 0x1234;
+   return (*(unsigned char *) &s == 0x12);
+}
+
+static int is_bit_word_type (SLtype type)
+{
+   switch (type)
+     {
+      case SLANG_CHAR_TYPE: case SLANG_UCHAR_TYPE:
+      case SLANG_INT16_TYPE: case SLANG_UINT16_TYPE:
+      case SLANG_INT32_TYPE: case SLANG_UINT32_TYPE:
+#ifdef SLANG_INT64_TYPE
+      case SLANG_INT64_TYPE:
+#endif
+	return 1;
+     }
+   return 0;
+}
+
+static unsigned int bit_words_per_row (unsigned int nbits, unsigned int sizeof_word)
+{
+   unsigned int word_bits = 8 * sizeof_word;
+   return (nbits + word_bits - 1) / word_bits;
+}
+
+/* This may be used in place when nbits is a multiple of 8*sizeof_word.
+ * As in earlier versions, a partial word of more than one byte is
+ * sign-extended from its leading bit, whereas a single byte is not.
+ */
+static void packed_bits_to_words (unsigned char *packed, SLuindex_Type num_rows,
+				  unsigned int nbits, unsigned char *words,
+				  unsigned int sizeof_word)
+{
+   unsigned int nbytes = (nbits + 7) / 8;
+   unsigned int word_bits = 8 * sizeof_word;
+   unsigned int nwords = bit_words_per_row (nbits, sizeof_word);
+   int swap = (0 == is_big_endian ());
+   SLuindex_Type r;
+
+   for (r = 0; r < num_rows; r++)
+     {
+	unsigned int k;
+	for (k = 0; k < nwords; k++)
+	  {
+	     unsigned char be[8];
+	     unsigned char *p = packed + k * sizeof_word;
+	     unsigned int n = nbits - k * word_bits;
+	     unsigned int nb, shift, b;
+
+	     if (n > word_bits)
+	       n = word_bits;
+	     nb = (n + 7) / 8;
+	     shift = 8 * nb - n;
+
+	     /* Right-align the n bits as a big-endian number */
+	     memset (be, 0, sizeof_word);
+	     for (b = 0; b < nb; b++)
+	       {
+		  unsigned int v = p[b] >> shift;
+		  if (shift && b)
+		    v |= (p[b-1] << (8 - shift)) & 0xFF;
+		  be[sizeof_word - nb + b] = (unsigned char) v;
+	       }
+
+	     if ((sizeof_word > 1) && (n < word_bits)
+		 && (be[sizeof_word - 1 - (n-1)/8] & (1 << ((n-1) % 8))))
+	       {
+		  unsigned int i = sizeof_word - 1 - (n-1)/8;
+		  be[i] |= (unsigned char) (0xFF << (1 + (n-1) % 8));
+		  while (i > 0)
+		    be[--i] = 0xFF;
+	       }
+
+	     if (swap)
+	       {
+		  for (b = 0; b < sizeof_word; b++)
+		    words[b] = be[sizeof_word - 1 - b];
+	       }
+	     else memcpy (words, be, sizeof_word);
+	     words += sizeof_word;
+	  }
+	packed += nbytes;
+     }
+}
+
+static void words_to_packed_bits (unsigned char *words, SLuindex_Type num_rows,
+				  unsigned int nbits, unsigned int sizeof_word,
+				  unsigned char *packed)
+{
+   unsigned int nbytes = (nbits + 7) / 8;
+   unsigned int word_bits = 8 * sizeof_word;
+   unsigned int nwords = bit_words_per_row (nbits, sizeof_word);
+   int swap = (0 == is_big_endian ());
+   SLuindex_Type r;
+
+   for (r = 0; r < num_rows; r++)
+     {
+	unsigned int k;
+	for (k = 0; k < nwords; k++)
+	  {
+	     unsigned char be[8];
+	     unsigned char *p = packed + k * sizeof_word;
+	     unsigned char *q;
+	     unsigned int n = nbits - k * word_bits;
+	     unsigned int nb, shift, b;
+
+	     if (n > word_bits)
+	       n = word_bits;
+	     nb = (n + 7) / 8;
+	     shift = 8 * nb - n;
+
+	     if (swap)
+	       {
+		  for (b = 0; b < sizeof_word; b++)
+		    be[b] = words[sizeof_word - 1 - b];
+	       }
+	     else memcpy (be, words, sizeof_word);
+
+	     /* Left-align the low n bits; the unused bits become 0 */
+	     q = be + (sizeof_word - nb);
+	     for (b = 0; b < nb; b++)
+	       {
+		  unsigned int v = (q[b] << shift) & 0xFF;
+		  if (shift && (b + 1 < nb))
+		    v |= q[b+1] >> (8 - shift);
+		  p[b] = (unsigned char) v;
+	       }
+	     words += sizeof_word;
+	  }
+	packed += nbytes;
+     }
+}
+
+/* Bit_Mask_Table[c] holds the 8 bits of c as 0/1 bytes, MSB first */
+static unsigned char Bit_Mask_Table[256][8];
+
+static void init_bit_mask_table (void)
+{
+   unsigned int i, j;
+
+   for (i = 0; i < 256; i++)
+     {
+	for (j = 0; j < 8; j++)
+	  Bit_Mask_Table[i][j] = (unsigned char) ((i >> (7 - j)) & 1);
+     }
+}
+
+static void packed_bits_to_mask (unsigned char *packed, SLuindex_Type num_rows,
+				 unsigned int nbits, unsigned char *mask)
+{
+   unsigned int nbytes = (nbits + 7) / 8;
+   unsigned int nfull = nbits / 8;
+   unsigned int nrest = nbits % 8;
+   SLuindex_Type r;
+
+   if (nrest == 0)
+     {
+	/* The rows are contiguous in the mask */
+	SLuindex_Type i, n = num_rows * nbytes;
+	for (i = 0; i < n; i++)
+	  {
+	     memcpy (mask, Bit_Mask_Table[packed[i]], 8);
+	     mask += 8;
+	  }
+	return;
+     }
+
+   for (r = 0; r < num_rows; r++)
+     {
+	unsigned int j;
+	for (j = 0; j < nfull; j++)
+	  {
+	     memcpy (mask, Bit_Mask_Table[packed[j]], 8);
+	     mask += 8;
+	  }
+	memcpy (mask, Bit_Mask_Table[packed[nfull]], nrest);
+	mask += nrest;
+	packed += nbytes;
+     }
+}
+
+static void mask_to_packed_bits (unsigned char *mask, SLuindex_Type num_rows,
+				 unsigned int nbits, unsigned char *packed)
+{
+   unsigned int nbytes = (nbits + 7) / 8;
+   SLuindex_Type r;
+
+   memset (packed, 0, num_rows * nbytes);
+   for (r = 0; r < num_rows; r++)
+     {
+	unsigned int j;
+	for (j = 0; j < nbits; j++)
+	  {
+	     if (mask[j])
+	       packed[j >> 3] |= (unsigned char) (0x80 >> (j & 7));
+	  }
+	mask += nbits;
+	packed += nbytes;
+     }
+}
+
+/* Large reads and writes are split into cfitsio calls of at most this many
+ * elements, so that the byte counts derived from them cannot overflow.
+ */
+#define MAX_ELEMENTS_PER_CALL	((LONGLONG) 1 << 24)
+
+/* Read num_elements elements of a fixed width column with repeat elements
+ * per row, starting with the first element of firstrow.
+ */
+static int read_col_elements (fitsfile *f, int type, int col, LONGLONG firstrow,
+			      LONGLONG repeat, LONGLONG num_elements,
+			      unsigned char *data, unsigned int sizeof_type,
+			      int *status)
+{
+   LONGLONG rows_per_call = MAX_ELEMENTS_PER_CALL / repeat;
+
+   if (rows_per_call < 1)
+     rows_per_call = 1;
+
+   while ((num_elements > 0) && (*status == 0))
+     {
+	LONGLONG n = rows_per_call * repeat;
+	if (n > num_elements)
+	  n = num_elements;
+	(void) fits_read_col (f, type, col, firstrow, 1, n, NULL, data, NULL, status);
+	count_read ((double) n, sizeof_type);
+	data += (size_t) n * sizeof_type;
+	num_elements -= n;
+	firstrow += rows_per_call;
+     }
+   return *status;
+}
+
+static int write_col_elements (fitsfile *f, int type, int col,
+			       LONGLONG firstrow, LONGLONG firstelem,
+			       LONGLONG repeat, LONGLONG num_elements,
+			       unsigned char *data, unsigned int sizeof_type,
+			       int *status)
+{
+   /* Offset of the next element from the start of the column */
+   LONGLONG e = (firstrow - 1) * repeat + (firstelem - 1);
+
+   while ((num_elements > 0) && (*status == 0))
+     {
+	LONGLONG n = MAX_ELEMENTS_PER_CALL;
+	if (n > num_elements)
+	  n = num_elements;
+	if (fits_write_col (f, type, col, 1 + e / repeat, 1 + e % repeat,
+			    n, data, status))
+	  break;
+	count_write ((double) n, sizeof_type);
+	data += (size_t) n * sizeof_type;
+	num_elements -= n;
+	e += n;
+     }
+   return *status;
+}
+
+/* MAJOR HACK!!!! */
+static int hack_write_bit_col (fitsfile *f, unsigned int col,
+			       LONGLONG row, LONGLONG firstelem,
+			       unsigned int sizeof_type, LONGLONG num_elements,
+			       unsigned char *bytes)
+{
+   int status = 0;
+   tcolumn *colptr;
+   long trepeat;
+   int tcode;
+
+   if ((f == NULL) || (f->Fptr == NULL)
+       || (NULL == (colptr  = (f->Fptr)->tableptr)))
+     return WRITE_ERROR;
+
+   colptr += (col - 1);     /* offset to correct column structure */
+   trepeat = colptr->trepeat;
+   tcode = colptr->tdatatype;
+
+   colptr->tdatatype = TBYTE;
+   colptr->trepeat = sizeof_type;
+
+   (void) write_col_elements (f, TBYTE, col, row, firstelem, sizeof_type,
+			      num_elements * sizeof_type, bytes, 1, &status);
+
+   colptr->tdatatype = tcode;
+   colptr->trepeat = trepeat;
+
+   return status;
+}
+
+/* The array may hold words (see packed_bits_to_words), or, if it is a
+ * [nrows, repeat] array of 1 byte integers, a mask with one byte per bit.
+ */
+static int write_tbit_col (fitsfile *f, unsigned int col, LONGLONG row,
+			   LONGLONG firstelem, unsigned int repeat,
+			   unsigned int width, SLang_Array_Type *at)
+{
+   int status = 0;
+   unsigned int num_elements;
+   unsigned int sizeof_type;
+   unsigned int nbytes;
+   SLuindex_Type num_rows;
+   unsigned char *data, *buf;
+   int is_mask;
+
+   (void) width;
+   num_elements = at->num_elements;
+   sizeof_type = at->sizeof_type;
+   data = (unsigned char *) at->data;
+
+   is_mask = ((sizeof_type == 1) && (repeat > 1) && (at->num_dims == 2)
+	      && ((unsigned int) at->dims[1] == repeat));
+
+   /* Words that hold exactly one row are already the packed bits */
+   if ((is_mask == 0) && (8 * sizeof_type == repeat)
+       && (is_big_endian () || (sizeof_type == 1)))
+     {
+	return hack_write_bit_col (f, col, row, firstelem,
+				   sizeof_type, num_elements, data);
+     }
+
+   if (0 == is_bit_word_type (at->data_type))
+     {
+	SLang_verror (SL_TYPE_MISMATCH, "Writing a %dX bit column requires an integer array",
+		      repeat);
+	return -1;
+     }
+
+   if (is_mask)
+     num_rows = at->dims[0];
+   else
+     {
+	unsigned int nwords = bit_words_per_row (repeat, sizeof_type);
+	if (num_elements % nwords)
+	  {
+	     SLang_verror (SL_INVALID_PARM, "Writing a %dX bit column requires %u %u-byte integers per row",
+			   repeat, nwords, sizeof_type);
+	     return -1;
+	  }
+	num_rows = num_elements / nwords;
+     }
+
+   nbytes = (repeat + 7) / 8;
+   buf = (unsigned char *) SLmalloc (num_rows * nbytes + 1);
+   if (buf == NULL)
+     return -1;
+
+   if (is_mask)
+     mask_to_packed_bits (data, num_rows, repeat, buf);
+   else
+     words_to_packed_bits (data, num_rows, repeat, sizeof_type, buf);
+
+   status = hack_write_bit_col (f, col, row, firstelem,
+				nbytes, num_rows, buf);
+
+   SLfree ((char *) buf);
+   return status;
+}
+
+/* A cell of a variable length bit column is written from a UChar mask
+ * (one bit per element), or from integer words that each contribute
+ * 8*sizeof_type bits.
+ */
+static int write_heap_bit_cell (fitsfile *f, unsigned int col, LONGLONG row,
+				SLang_Array_Type *at)
+{
+   unsigned int sizeof_type = at->sizeof_type;
+   SLuindex_Type i, nbits;
+   unsigned char *bits;
+   int status = 0;
+
+   if (0 == is_bit_word_type (at->data_type))
+     {
+	SLang_verror (SL_TYPE_MISMATCH, "Writing a bit column requires an integer array");
+	return -1;
+     }
+
+   if (at->data_type == SLANG_UCHAR_TYPE)
+     nbits = at->num_elements;
+   else
+     nbits = at->num_elements * 8 * sizeof_type;
+
+   if (nbits == 0)
+     return fits_write_descript (f, col, row, 0, 0, &status);
+
+   if (NULL == (bits = (unsigned char *) SLmalloc (nbits + nbits/8 + 1)))
+     return -1;
+
+   if (at->data_type == SLANG_UCHAR_TYPE)
+     {
+	unsigned char *mask = (unsigned char *) at->data;
+	for (i = 0; i < nbits; i++)
+	  bits[i] = (mask[i] != 0);
+     }
+   else
+     {
+	/* Pack the words after the mask, then unpack them in front of it */
+	unsigned char *packed = bits + nbits;
+	words_to_packed_bits ((unsigned char *) at->data, 1, nbits, sizeof_type, packed);
+	packed_bits_to_mask (packed, 1, nbits, bits);
+     }
+
+   if (0 == fits_write_col_bit (f, col, row, 1, nbits, (char *) bits, &status))
+     count_write (1, (nbits + 7) / 8);
+   SLfree ((char *) bits);
+   return status;
+}
+
+/* Writes nrows cells of a variable length column starting at firstrow,
+ * where cell i consists of the elements offsets[i] ... offsets[i+1]-1
+ * of at.  Rather than making one cfitsio call per row, the cells are
+ * written to the heap as a single block by storing their concatenation
+ * in the first row.  The descriptors of all rows are then pointed into
+ * that block, and written with one call by temporarily treating the
+ * column as a fixed column of integer pairs (see hack_write_bit_col).
+ */
+static int write_var_cells (fitsfile *f, unsigned int col, LONGLONG firstrow,
+			    SLang_Array_Type *at, LONGLONG *offsets, LONGLONG nrows)
+{
+   tcolumn *colptr;
+   LONGLONG i, total, len0, heap0 = 0;
+   unsigned int width;
+   int type, tcode, is_q, status = 0;
+   long trepeat, twidth;
+   double tscale, tzero;
+   void *descr;
+
+   if ((f == NULL) || (f->Fptr == NULL) || (f->Fptr->tableptr == NULL))
+     return WRITE_ERROR;
+
+   colptr = f->Fptr->tableptr + (col - 1);
+   tcode = colptr->tdatatype;
+   if ((tcode >= 0) || (tcode == -TSTRING) || (tcode == -TBIT)
+       || (0 == get_varlen_copy_type (tcode, &width)))
+     {
+	SLang_verror (SL_NOT_IMPLEMENTED,
+		      "fits_write_col: column %u is not a numeric variable length column", col);
+	return -1;
+     }
+   is_q = (NULL != strchr (colptr->tform, 'Q'));
+#ifndef TLONGLONG
+   if (is_q)
+     {
+	SLang_verror (SL_NOT_IMPLEMENTED, "fits_write_col: Q columns are not supported");
+	return -1;
+     }
+#endif
+
+   if (-1 == map_slang_to_fitsio_type ("fits_write_col", at->data_type, &type))
+     return -1;
+   if (type == TSTRING)
+     {
+	SLang_verror (SL_TYPE_MISMATCH, "fits_write_col: column %u requires a numeric array", col);
+	return -1;
+     }
+
+   if (nrows < 1)
+     return 0;
+
+   if (offsets[0] < 0)
+     goto bad_offsets;
+   for (i = 0; i < nrows; i++)
+     {
+	if (offsets[i+1] < offsets[i])
+	  goto bad_offsets;
+     }
+   if (offsets[nrows] > (LONGLONG) at->num_elements)
+     goto bad_offsets;
+
+   total = offsets[nrows] - offsets[0];
+   if ((is_q == 0) && ((total > 0x7FFFFFFFLL)
+		       || (f->Fptr->heapsize + total * width > 0x7FFFFFFFLL)))
+     {
+	SLang_verror (SL_INVALID_PARM,
+		      "fits_write_col: the heap of column %u would exceed the range of a P descriptor; use a Q column",
+		      col);
+	return -1;
+     }
+
+   if (total > 0)
+     {
+	if (fits_write_col (f, type, col, firstrow, 1, total,
+			    (unsigned char *) at->data + (size_t) offsets[0] * at->sizeof_type,
+			    &status)
+	    || fits_read_descriptll (f, col, firstrow, &len0, &heap0, &status))
+	  return status;
+	count_write ((double) total, at->sizeof_type);
+     }
+
+   if (NULL == (descr = SLmalloc (2 * nrows * (is_q ? sizeof (LONGLONG) : sizeof (int)) + 1)))
+     return -1;
+
+   for (i = 0; i < nrows; i++)
+     {
+	LONGLONG len = offsets[i+1] - offsets[i];
+	LONGLONG ofs = (len > 0) ? heap0 + (offsets[i] - offsets[0]) * width : 0;
+	if (is_q)
+	  {
+	     ((LONGLONG *) descr)[2*i] = len;
+	     ((LONGLONG *) descr)[2*i+1] = ofs;
+	  }
+	else
+	  {
+	     ((int *) descr)[2*i] = (int) len;
+	     ((int *) descr)[2*i+1] = (int) ofs;
+	  }
+     }
+
+   /* The table may have been re-read by the heap write */
+   colptr = f->Fptr->tableptr + (col - 1);
+   trepeat = colptr->trepeat;
+   twidth = colptr->twidth;
+   tscale = colptr->tscale;
+   tzero = colptr->tzero;
+
+   colptr->trepeat = 2;
+   colptr->tscale = 1.0;
+   colptr->tzero = 0.0;
+#ifdef TLONGLONG
+   if (is_q)
+     {
+	colptr->tdatatype = TLONGLONG;
+	colptr->twidth = 8;
+	(void) fits_write_col (f, TLONGLONG, col, firstrow, 1, 2 * nrows, descr, &status);
+     }
+   else
+#endif
+     {
+	colptr->tdatatype = TLONG;
+	colptr->twidth = 4;
+	(void) fits_write_col (f, TINT, col, firstrow, 1, 2 * nrows, descr, &status);
+     }
+
+   colptr->tdatatype = tcode;
+   colptr->trepeat = trepeat;
+   colptr->twidth = twidth;
+   colptr->tscale = tscale;
+   colptr->tzero = tzero;
+
+   SLfree ((char *) descr);
+   return status;
+
+bad_offsets:
+   SLang_verror (SL_INVALID_PARM,
+		 "fits_write_col: the offsets must be increasing and within the %u values",
+		 (unsigned int) at->num_elements);
+   return -1;
+}
+
+/* Writes the cells of a variable length column from an array of arrays.
+ * The cells are converted to the type of the column and concatenated so
+ * that they can be written by write_var_cells.  NULL cells are empty.
+ */
+static int write_var_col_cells (fitsfile *f, unsigned int col, LONGLONG firstrow,
+				int type, long repeat, SLang_Array_Type *cells)
+{
+   SLang_Array_Type **cellp = (SLang_Array_Type **) cells->data;
+   SLang_Array_Type *flat = NULL, *at;
+   LONGLONG *offsets;
+   SLuindex_Type i, ncells = cells->num_elements;
+   SLindex_Type total;
+   unsigned char *data;
+   SLtype stype;
+   int status = -1;
+
+   if (-1 == map_fitsio_type_to_slang (&type, &repeat, &stype))
+     return -1;
+   if (stype == SLANG_STRING_TYPE)
+     {
+	SLang_verror (SL_NOT_IMPLEMENTED,
+		      "fits_write_col: column %u is not a numeric variable length column", col);
+	return -1;
+     }
+
+   if (NULL == (offsets = (LONGLONG *) SLmalloc ((ncells + 1) * sizeof (LONGLONG))))
+     return -1;
+
+   offsets[0] = 0;
+   for (i = 0; i < ncells; i++)
+     {
+	LONGLONG n = (cellp[i] == NULL) ? 0 : (LONGLONG) cellp[i]->num_elements;
+	offsets[i+1] = offsets[i] + n;
+     }
+   if (offsets[ncells] > 0x7FFFFFFFLL)
+     {
+	SLang_verror (SL_INVALID_PARM,
+		      "fits_write_col: too many elements for one call; use _fits_write_var_col");
+	goto free_and_return;
+     }
+   total = (SLindex_Type) offsets[ncells];
+
+   if (NULL == (flat = SLang_create_array (stype, 0, NULL, &total, 1)))
+     goto free_and_return;
+
+   data = (unsigned char *) flat->data;
+   for (i = 0; i < ncells; i++)
+     {
+	if ((cellp[i] == NULL) || (cellp[i]->num_elements == 0))
+	  continue;
+	if ((-1 == SLang_push_array (cellp[i], 0))
+	    || (-1 == SLang_pop_array_of_type (&at, stype)))
+	  goto free_and_return;
+	memcpy (data, at->data, (size_t) at->num_elements * at->sizeof_type);
+	data += (size_t) at->num_elements * at->sizeof_type;
+	SLang_free_array (at);
+     }
+
+   status = write_var_cells (f, col, firstrow, flat, offsets, ncells);
+
+free_and_return:
+   SLang_free_array (flat);
+   SLfree ((char *) offsets);
+   return status;
+}
+
+#ifdef fits_get_eqcoltype
+# define GET_COL_TYPE fits_get_eqcoltype
+#else
+# define GET_COL_TYPE my_fits_get_coltype
+static int my_fits_get_coltype (fitsfile *fptr, int col, int *type,
+				long *repeat, long *width, int *statusp)
+{
+   int status = *statusp;
+   char tscaln[32];
+   char tzeron[32];
+   double tscal, tzero;
+   double min_val, max_val;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   if (0 != fits_get_coltype (fptr, col, type, repeat, width, &status))
+     {
+	*statusp = status;
+	return status;
+     }
+
+   sprintf (tscaln, "TSCAL%d", col);
+   sprintf (tzeron, "TZERO%d", col);
+
+   if (0 != fits_read_key (fptr, TDOUBLE, tscaln, &tscal, NULL, &status))
+     {
+	fits_clear_errmsg ();
+	tscal = 1.0;
+     }
+
+   if (0 != fits_read_key (fptr, TDOUBLE, tzeron, &tzero, NULL, &status))
+     {
+	fits_clear_errmsg ();
+	tzero = 0;
+     }
+
+   switch (*type)
+     {
+      case TSHORT:
+	min_val = -32768.0;
+	max_val = 32767.0;
+	break;
+
+      case TLONG:
+	min_val = -2147483648.0;
+	max_val = 2147483647.0;
+	break;
+
+      default:
+	return 0;
+     }
+
+   min_val = tzero + tscal * min_val;
+   max_val = tzero + tscal * max_val;
+
+   if (min_val > max_val)
+     {
+	double tmp = max_val;
+	max_val = min_val;
+	min_val = tmp;
+     }
+
+   if ((min_val >= -32768.0) && (max_val <= 32767.0))
+     {
+	*type = TSHORT;
+	return 0;
+     }
+
+   if ((min_val >= 0) && (max_val <= 65535.0))
+     {
+	*type = TUSHORT;
+	return 0;
+     }
+
+   if ((min_val >= -2147483648.0) && (max_val <= 2147483647.0))
+     {
+	*type = TLONG;
+	return 0;
+     }
+
+   if ((min_val >= 0.0) && (max_val <= 4294967295.0))
+     {
+	*type = TULONG;
+	return 0;
+     }
+
+   *type = TDOUBLE;
+   return 0;
+}
+#endif
+
+static int write_col (FitsFile_Type *ft, int *colnum,
+		      rows_type *firstrow, rows_type *firstelem, SLang_Array_Type *at)
+{
+   Call_Context_Type cc;
+   int type;
+   int status = 0;
+   int col, is_var;
+   long repeat;
+   long width;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_write_col");
+
+   col = *colnum;
+
+   if (0 != GET_COL_TYPE (ft->fptr, col, &type, &repeat, &width, &status))
+     return end_call (&cc, status);
+
+   if (type == TBIT)
+     {
+	status = write_tbit_col (ft->fptr, col, *firstrow, *firstelem,
+				 repeat, width, at);
+	return end_call (&cc, status);
+     }
+   if (type == -TBIT)
+     return end_call (&cc, write_heap_bit_cell (ft->fptr, col, *firstrow, at));
+   if ((type < 0) && (at->data_type == SLANG_ARRAY_TYPE))
+     return end_call (&cc, write_var_col_cells (ft->fptr, col, *firstrow,
+						 type, repeat, at));
+   is_var = (type < 0);
+
+   switch (at->data_type)
+     {
+      case SLANG_INT16_TYPE:
+	type = CFITSIO_INT16_TYPE;
+	break;
+      case SLANG_UINT16_TYPE:
+	type = CFITSIO_UINT16_TYPE;
+	break;
+      case SLANG_INT32_TYPE:
+	type = CFITSIO_INT32_TYPE;
+	break;
+      case SLANG_UINT32_TYPE:
+	type = CFITSIO_UINT32_TYPE;
+	break;
+#ifdef CFITSIO_INT64_TYPE
+      case SLANG_INT64_TYPE:
+	type = CFITSIO_INT64_TYPE;
+	break;
+#endif
+
+      case SLANG_DOUBLE_TYPE:
+	type = TDOUBLE;
+	break;
+
+      case SLANG_FLOAT_TYPE:
+	type = TFLOAT;
+	break;
 
-   type = SLang_peek_at_stack ();
-   switch (type)
-     {
       case SLANG_STRING_TYPE:
 	type = TSTRING;
-	if (-1 == SLang_pop_slstring (&s))
+	break;
+
+      case SLANG_CHAR_TYPE:
+      case SLANG_UCHAR_TYPE:
+	type = TBYTE;
+	break;
+
+      default:
+	SLang_verror (SL_NOT_IMPLEMENTED,
+		      "fits_write_col: %s not suppported",
+		      SLclass_get_datatype_name (at->data_type));
+	return end_call (&cc, -1);
+     }
+
+   /* A variable length cell is written with a single call */
+   if (is_var || (type == TSTRING) || (repeat < 1) || (*firstrow < 1) || (*firstelem < 1))
+     {
+	(void) fits_write_col (ft->fptr, type, *colnum, *firstrow, *firstelem,
+			       at->num_elements, at->data, &status);
+	if ((status == 0) && (type == TSTRING))
+	  count_write (at->num_elements, repeat);
+	else if (status == 0)
+	  count_write (at->num_elements, at->sizeof_type);
+     }
+   else
+     (void) write_col_elements (ft->fptr, type, *colnum, *firstrow, *firstelem,
+				repeat, at->num_elements, (unsigned char *) at->data,
+				at->sizeof_type, &status);
+   return end_call (&cc, status);
+}
+
+/* Usage: status = _fits_write_var_col (ft, col, firstrow, values, offsets)
+ * Writes length(offsets)-1 cells of a variable length column, where the
+ * cell in row firstrow+i holds values[[offsets[i]:offsets[i+1]-1]].
+ */
+static int write_var_col (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt = NULL;
+   SLang_Array_Type *at = NULL, *offsets_at = NULL;
+   FitsFile_Type *ft;
+   LONGLONG firstrow;
+   int col;
+   int ret = -1;
+
+   if ((-1 == SLang_pop_array_of_type (&offsets_at, SLANG_LLONG_TYPE))
+       || (-1 == SLang_pop_array (&at, 0))
+       || (-1 == pop_rows_value (&firstrow))
+       || (-1 == SLang_pop_integer (&col))
+       || (NULL == (ft = pop_fits_type (&mmt))))
+     goto free_and_return;
+
+   if (ft->fptr == NULL)
+     goto free_and_return;
+
+   if (offsets_at->num_elements < 1)
+     {
+	SLang_verror (SL_INVALID_PARM, "_fits_write_var_col: at least one offset is required");
+	goto free_and_return;
+     }
+   if ((firstrow < 1) || (col < 1))
+     {
+	SLang_verror (SL_INVALID_PARM, "_fits_write_var_col: invalid row or column");
+	goto free_and_return;
+     }
+
+   begin_call (&cc, ft, "_fits_write_var_col");
+   ret = write_var_cells (ft->fptr, col, firstrow, at, (LONGLONG *) offsets_at->data,
+			  (LONGLONG) offsets_at->num_elements - 1);
+   ret = end_call (&cc, ret);
+
+free_and_return:
+   SLang_free_array (offsets_at);
+   SLang_free_array (at);
+   SLang_free_mmt (mmt);
+   return ret;
+}
+
+static int read_string_cell (fitsfile *f, LONGLONG row, unsigned int col,
+			     unsigned int len, unsigned int num_substrs, char **sp)
+{
+   char *s, *ss;
+   char *sls;
+   int status = 0;
+   int anynul;
+   unsigned int i;
+   unsigned int width;
+
+   *sp = NULL;
+
+   if (f == NULL)
+     return -1;
+
+   if (NULL == (s = SLmalloc (len + 1)))
+     return -1;
+   memset (s, ' ', len);
+
+   width = len/num_substrs;
+   ss = s;
+   for (i = 0; i < num_substrs; i++)
+     {
+	/* Note that the number of elements passed to this must be 1 */
+	if (0 != fits_read_col (f, TSTRING, col, row, i+1, 1, NULL,
+				&ss, &anynul, &status))
+	  {
+	     SLfree (s);
+	     return status;
+	  }
+	count_read (1, width);
+	/* If there is more than one substring, append them together.  Only the
+	 * last substring will have trailing whitespace removed.  This is
+	 * probably ok because fits does not like trailing whitespace.
+	 */
+	if (i + 1 < num_substrs)
+	  {
+	     unsigned int len1 = strlen (ss);
+	     ss[len1] = ' ';
+	  }
+	ss += width;
+     }
+   sls = SLang_create_slstring (s);
+   SLfree (s);
+   if (sls == NULL)
+     return -1;
+
+   *sp = sls;
+   return 0;
+}
+
+static int read_string_column (fitsfile *f, int is_var, LONGLONG repeat, unsigned int num_substrs,
+			       int col, LONGLONG firstrow, LONGLONG numrows,
+			       SLang_Array_Type **atp)
+{
+   SLindex_Type num_elements, i;
+   char **ats;
+   int status = 0;
+   SLang_Array_Type *at;
+
+   *atp = NULL;
+
+   if (f == NULL)
+     return -1;
+
+   if (-1 == get_array_dim (numrows, &num_elements))
+     return -1;
+   at = SLang_create_array (SLANG_STRING_TYPE, 0, NULL, &num_elements, 1);
+   if (at == NULL)
+     return -1;
+
+   ats = (char **) at->data;
+
+   for (i = 0; i < num_elements; i++)
+     {
+	LONGLONG offset;
+	LONGLONG row;
+
+	row = firstrow + i;
+	if (is_var)
+	  {
+	     if (0 != fits_read_descriptll (f, col, row, &repeat, &offset, &status))
+	       {
+		  SLang_free_array (at);
+		  return status;
+	       }
+	  }
+
+	status = read_string_cell (f, row, col, repeat, num_substrs, ats+i);
+	if (status != 0)
+	  {
+	     SLang_free_array (at);
+	     return status;
+	  }
+     }
+
+   *atp = at;
+   return 0;
+}
+
+/* Read num_rows rows of an nbits-bit column as words of sizeof_word
+ * bytes, or, if as_mask is non-zero, as a mask of 0/1 bytes.
+ */
+static int read_bit_column (fitsfile *f, unsigned int col, LONGLONG row,
+			    SLuindex_Type num_rows, unsigned char *data,
+			    unsigned int sizeof_word, unsigned int nbits,
+			    int as_mask)
+{
+   int status;
+   unsigned int nbytes = (nbits + 7) / 8;
+   SLuindex_Type num_bytes = num_rows * nbytes;
+   unsigned char *packed;
+
+   if (f == NULL)
+     return -1;
+
+   /* When the words tile the row exactly, the packed bytes are the
+    * big-endian words and may be converted in place.
+    */
+   if ((as_mask == 0) && (nbits % (8 * sizeof_word) == 0))
+     packed = data;
+   else if (NULL == (packed = (unsigned char *) SLmalloc (num_bytes + 1)))
+     return -1;
+
+   status = 0;
+   if (0 == read_col_elements (f, TBYTE, col, row, nbytes, num_bytes,
+			       packed, 1, &status))
+     {
+	if (as_mask)
+	  packed_bits_to_mask (packed, num_rows, nbits, data);
+	else if ((packed != data) || (0 == is_big_endian ()))
+	  packed_bits_to_words (packed, num_rows, nbits, data, sizeof_word);
+     }
+
+   if (packed != data)
+     SLfree ((char *) packed);
+   return status;
+}
+
+/* Read a cell of a variable length bit column as a mask, or as words of
+ * the given type.
+ */
+static int read_heap_bit_cell (fitsfile *f, int col, LONGLONG row,
+			       SLtype datatype, int as_mask,
+			       SLang_Array_Type **atp)
+{
+   SLang_Array_Type *at;
+   LONGLONG nbits, offset;
+   unsigned char *bits;
+   int status = 0;
+   int n;
+
+   *atp = NULL;
+   if (0 != fits_read_descriptll (f, col, row, &nbits, &offset, &status))
+     return status;
+
+   if (as_mask)
+     {
+	datatype = SLANG_UCHAR_TYPE;
+	n = (int) nbits;
+     }
+   else
+     n = (int) bit_words_per_row ((unsigned int) nbits, SLclass_sizeof_type (datatype));
+
+   if (NULL == (at = SLang_create_array (datatype, 0, NULL, &n, 1)))
+     return -1;
+
+   if (nbits > 0)
+     {
+	/* cfitsio returns one byte per bit */
+	if (as_mask)
+	  bits = (unsigned char *) at->data;
+	else if (NULL == (bits = (unsigned char *) SLmalloc (nbits + nbits/8 + 1)))
+	  {
+	     SLang_free_array (at);
+	     return -1;
+	  }
+
+	if (0 == fits_read_col_bit (f, col, row, 1, nbits, (char *) bits, &status))
+	  {
+	     count_read ((double) ((nbits + 7) / 8), 1);
+	     if (as_mask == 0)
+	       {
+		  unsigned char *packed = bits + nbits;
+		  mask_to_packed_bits (bits, 1, (unsigned int) nbits, packed);
+		  packed_bits_to_words (packed, 1, (unsigned int) nbits,
+					(unsigned char *) at->data, at->sizeof_type);
+	       }
+	  }
+	if (bits != (unsigned char *) at->data)
+	  SLfree ((char *) bits);
+	if (status)
+	  {
+	     SLang_free_array (at);
+	     return status;
+	  }
+     }
+
+   *atp = at;
+   return 0;
+}
+
+/* If into is non-NULL, the values are read into it and *atp is set to into */
+static int read_column_values (fitsfile *f, int type, SLtype datatype,
+			       LONGLONG row, unsigned int col, LONGLONG num_rows,
+			       LONGLONG repeat, LONGLONG repeat_orig, SLang_Array_Type *into,
+			       SLang_Array_Type **atp)
+{
+   SLindex_Type num_elements;
+   int status = 0;
+   SLang_Array_Type *at;
+   SLindex_Type dims[2];
+   int num_dims;
+
+   *atp = NULL;
+
+   if (f == NULL)
+     return -1;
+
+   if (-1 == get_array_dim (num_rows * repeat, &num_elements))
+     return -1;
+   if (num_rows <= 1)
+     {
+	dims[0] = num_elements;
+	num_dims = 1;
+     }
+   else				       /* was repeat>1 */
+     {
+	dims[0] = (SLindex_Type) num_rows;
+	dims[1] = (SLindex_Type) repeat;
+	num_dims = 2;
+     }
+
+   if (into != NULL)
+     {
+	if (-1 == check_into_array ("fits_read_col", into, datatype, num_elements,
+				    dims, num_dims, 0))
+	  return -1;
+	at = into;
+     }
+   else if (NULL == (at = SLang_create_array (datatype, 0, NULL, dims, num_dims)))
+     return -1;
+
+   if (num_elements)
+     {
+	if (type == TBIT)
+	  status = read_bit_column (f, col, row, num_rows, (unsigned char *)at->data, at->sizeof_type, repeat_orig, 0);
+	else
+	  (void) read_col_elements (f, type, col, row, repeat, num_elements,
+				    (unsigned char *) at->data, at->sizeof_type, &status);
+     }
+
+   if (status)
+     {
+	if (at != into)
+	  SLang_free_array (at);
+	return status;
+     }
+
+   *atp = at;
+   return 0;
+}
+
+static int read_var_column (fitsfile *f, int ftype, SLtype datatype,
+			    int col, LONGLONG firstrow, LONGLONG num_rows,
+			    SLang_Array_Type **atp)
+{
+   SLindex_Type num_elements, i;
+   SLang_Array_Type **ati;
+   SLang_Array_Type *at;
+
+   *atp = NULL;
+   if (f == NULL)
+     return -1;
+
+   if (-1 == get_array_dim (num_rows, &num_elements))
+     return -1;
+
+   at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &num_elements, 1);
+   if (at == NULL)
+     return -1;
+
+   ati = (SLang_Array_Type **) at->data;
+   for (i = 0; i < num_elements; i++)
+     {
+	LONGLONG offset;
+	LONGLONG repeat;
+	LONGLONG row;
+	int status = 0;
+
+	row = firstrow + i;
+	if (0 != fits_read_descriptll (f, col, row, &repeat, &offset, &status))
+	  {
+	     SLang_free_array (at);
+	     return status;
+	  }
+
+	if (ftype == TBIT)
+	  status = read_heap_bit_cell (f, col, row, datatype, 0, ati+i);
+	else
+	  status = read_column_values (f, ftype, datatype, row, col, 1, repeat, repeat, NULL, ati+i);
+	if (status)
+	  {
+	     SLang_free_array (at);
+	     return status;
+	  }
+     }
+
+   *atp = at;
+   return 0;
+}
+
+static int do_read_col (FitsFile_Type *ft, int *colnum, LONGLONG *firstrowp,
+			LONGLONG *num_rowsp, SLang_Ref_Type *ref, SLang_Array_Type *into,
+			int read_type, SLtype read_datatype)
+{
+   Call_Context_Type cc;
+   SLang_Array_Type *at;
+   int type;
+   LONGLONG num_rows;
+   long width;
+   int status;
+   SLtype datatype;
+   int num_columns;
+   LONGLONG firstrow;
+   long repeat, save_repeat;
+   int col;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_read_col");
+
+   status = 0;
+   if (0 != fits_get_num_cols (ft->fptr, &num_columns, &status))
+     return end_call (&cc, status);
+
+   if (0 != fits_get_num_rowsll (ft->fptr, &num_rows, &status))
+     return end_call (&cc, status);
+
+   if (*num_rowsp <= 0)
+     {
+	SLang_verror (SL_INVALID_PARM, "Number of rows must positive");
+	return end_call (&cc, -1);
+     }
+
+   col = *colnum;
+
+   if ((col <= 0) || (col > num_columns))
+     {
+	SLang_verror (SL_INVALID_PARM, "Column number out of range");
+	return end_call (&cc, -1);
+     }
+   firstrow = *firstrowp;
+   if ((firstrow <= 0) || (firstrow > num_rows))
+     {
+	SLang_verror (SL_INVALID_PARM, "Row number out of range");
+	return end_call (&cc, -1);
+     }
+
+   if (firstrow + *num_rowsp > num_rows + 1)
+     num_rows = num_rows - (firstrow - 1);
+   else
+     num_rows = *num_rowsp;
+
+   if (0 != GET_COL_TYPE (ft->fptr, col, &type, &repeat, &width, &status))
+     return end_call (&cc, status);
+
+   save_repeat = repeat;
+   if (-1 == map_fitsio_type_to_slang (&type, &repeat, &datatype))
+     return end_call (&cc, -1);
+   convert_column_type (&type, &datatype, read_type, read_datatype);
+
+   if ((into != NULL)
+       && ((datatype == SLANG_STRING_TYPE) || (type < 0)))
+     {
+	SLang_verror (SL_NOT_IMPLEMENTED, "fits_read_col: into= is not supported for string or variable length columns");
+	return end_call (&cc, -1);
+     }
+
+   if (datatype == SLANG_STRING_TYPE)
+     {
+	unsigned int num_substrs;
+	/* This assumes an ASCII_TBL, which will always have a
+	 * repeat of 1, and the number of bytes is given by the
+	 * width field.  In contrast, a BINARY_TBL will have
+	 * repeat = number of bytes, and width represents the
+	 * number of bytes in a substring.
+	 */
+	if ((repeat == 1) && (width != 1))
+	  {
+	     num_substrs = 1;
+	     repeat = width;
+	  }
+	else
+	  {
+	     if (width > 0)
+	       num_substrs = repeat/width;
+	     else
+	       num_substrs = 0;
+	  }
+	status = read_string_column (ft->fptr, (type < 0), repeat, num_substrs, col, firstrow, num_rows, &at);
+     }
+   else if (type < 0)
+     status = read_var_column (ft->fptr, -type, datatype, col, firstrow, num_rows, &at);
+   else
+     status = read_column_values (ft->fptr, type, datatype, firstrow, col, num_rows, repeat, save_repeat, into, &at);
+
+   if (status)
+     return end_call (&cc, status);
+
+   if (at == into)
+     return end_call (&cc, 0);
+
+   if (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR)&at))
+     status = -1;
+
+   SLang_free_array (at);
+   return end_call (&cc, status);
+}
+
+/* Usage: _fits_read_col (ft, col, firstrow, nrows, &data|into [,type])
+ * If an array is passed instead of a reference, the data are read into it.
+ */
+static int read_col (void)
+{
+   SLang_MMT_Type *mmt = NULL;
+   FitsFile_Type *ft;
+   SLang_Ref_Type *ref = NULL;
+   SLang_Array_Type *into = NULL;
+   LONGLONG firstrow, num_rows;
+   SLtype read_datatype = 0;
+   int read_type = 0;
+   int col;
+   int status = -1;
+
+   if ((SLang_Num_Function_Args == 6)
+       && (-1 == pop_read_type ("fits_read_col", &read_datatype, &read_type)))
+     return -1;
+
+   if (SLang_peek_at_stack () == SLANG_ARRAY_TYPE)
+     {
+	if (-1 == SLang_pop_array (&into, 0))
+	  return -1;
+     }
+   else if (-1 == SLang_pop_ref (&ref))
+     return -1;
+
+   if ((-1 == pop_rows_value (&num_rows))
+       || (-1 == pop_rows_value (&firstrow))
+       || (-1 == SLang_pop_integer (&col))
+       || (NULL == (ft = pop_fits_type (&mmt))))
+     goto free_and_return;
+
+   status = do_read_col (ft, &col, &firstrow, &num_rows, ref, into, read_type, read_datatype);
+
+   free_and_return:
+   SLang_free_array (into);
+   SLang_free_ref (ref);
+   SLang_free_mmt (mmt);
+   return status;
+}
+
+/* Integer columns are searched as LONGLONG values */
+static int is_integer_column_type (int type)
+{
+#ifdef TLONGLONG
+   switch (type)
+     {
+      case TBYTE: case TSBYTE: case TSHORT: case TUSHORT:
+      case TINT: case TUINT: case TLONG: case TULONG:
+      case TLONGLONG:
+	return 1;
+     }
+#else
+   (void) type;
+#endif
+   return 0;
+}
+
+/* The values of _fits_search_sorted are Int64 or Double */
+static int pop_search_values (SLang_Array_Type **atp, int *is_intp)
+{
+   SLang_Array_Type *at;
+
+   *is_intp = 0;
+   if (-1 == SLang_pop_array (&at, 1))
+     return -1;
+#ifdef SLANG_INT64_TYPE
+   if (at->data_type == SLANG_INT64_TYPE)
+     {
+	*is_intp = 1;
+	*atp = at;
+	return 0;
+     }
+#endif
+   if (at->data_type == SLANG_DOUBLE_TYPE)
+     {
+	*atp = at;
+	return 0;
+     }
+   if (-1 == SLang_push_array (at, 1))
+     return -1;
+   return SLang_pop_array_of_type (atp, SLANG_DOUBLE_TYPE);
+}
+
+/* Compares a cell with a value: -1, 0 or 1, or 2 if either is a NaN */
+#define SEARCH_CMP(x, v) \
+   (((x) < (v)) ? -1 : (((x) > (v)) ? 1 : (((x) == (v)) ? 0 : 2)))
+
+/* Usage: status = _fits_search_sorted (ft, col, values, side, descending, &rows)
+ * For each value v, rows is the first row of the sorted column whose
+ * value comes after v: the first row >= v if side is 0, or > v if side
+ * is 1 (<= and < for a descending column).  It is the number of rows
+ * plus one if there is no such row.  Each search is a bisection that
+ * reads single cells, with NaNs sorting after all other values.  The
+ * cells of integer columns are compared as 64 bit integers, so that
+ * Int64 values beyond 2^53 keep their precision.
+ */
+static int search_sorted (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt = NULL;
+   SLang_Ref_Type *ref = NULL;
+   SLang_Array_Type *values_at = NULL, *rows_at = NULL;
+   FitsFile_Type *ft;
+   LONGLONG num_rows;
+   SLindex_Type i, n;
+   rows_type *rows;
+   long repeat, width;
+   int col, side, descending, type, int_values, int_col;
+   int ret = -1, status = 0;
+
+   if ((-1 == SLang_pop_ref (&ref))
+       || (-1 == SLang_pop_integer (&descending))
+       || (-1 == SLang_pop_integer (&side))
+       || (-1 == pop_search_values (&values_at, &int_values))
+       || (-1 == SLang_pop_integer (&col))
+       || (NULL == (ft = pop_fits_type (&mmt)))
+       || (ft->fptr == NULL))
+     goto free_and_return;
+
+   begin_call (&cc, ft, "_fits_search_sorted");
+
+   if ((0 != GET_COL_TYPE (ft->fptr, col, &type, &repeat, &width, &status))
+       || (0 != fits_get_num_rowsll (ft->fptr, &num_rows, &status)))
+     {
+	ret = status;
+	goto end_call_and_return;
+     }
+   if ((repeat != 1) || (type < 0) || (type == TSTRING) || (type == TBIT))
+     {
+	SLang_verror (SL_INVALID_PARM, "Column %d is not a numeric scalar column", col);
+	goto end_call_and_return;
+     }
+
+   n = (SLindex_Type) values_at->num_elements;
+   if (NULL == (rows_at = SLang_create_array (SLANG_ROWS_TYPE, 0, NULL, &n, 1)))
+     goto end_call_and_return;
+   rows = (rows_type *) rows_at->data;
+   int_col = is_integer_column_type (type);
+
+   for (i = 0; i < n; i++)
+     {
+	LONGLONG lo = 1, hi = num_rows + 1;
+
+	while (lo < hi)
+	  {
+	     LONGLONG mid = lo + (hi - lo) / 2;
+	     int anynul, after, c;
+
+#ifdef TLONGLONG
+	     if (int_col)
+	       {
+		  LONGLONG x;
+		  if (0 != fits_read_col (ft->fptr, TLONGLONG, col, mid, 1, 1, NULL, &x, &anynul, &status))
+		    {
+		       ret = status;
+		       goto end_call_and_return;
+		    }
+		  count_read (1, sizeof (LONGLONG));
+		  if (int_values)
+		    c = SEARCH_CMP (x, ((LONGLONG *) values_at->data)[i]);
+		  else
+		    c = SEARCH_CMP ((double) x, ((double *) values_at->data)[i]);
+	       }
+	     else
+#endif
+	       {
+		  double x;
+		  if (0 != fits_read_col (ft->fptr, TDOUBLE, col, mid, 1, 1, NULL, &x, &anynul, &status))
+		    {
+		       ret = status;
+		       goto end_call_and_return;
+		    }
+		  count_read (1, sizeof (double));
+		  if (int_values)
+		    c = SEARCH_CMP (x, (double) ((LONGLONG *) values_at->data)[i]);
+		  else
+		    c = SEARCH_CMP (x, ((double *) values_at->data)[i]);
+	       }
+
+	     if (c == 2)
+	       after = 1;
+	     else if (descending)
+	       after = side ? (c < 0) : (c <= 0);
+	     else
+	       after = side ? (c > 0) : (c >= 0);
+	     if (after)
+	       hi = mid;
+	     else
+	       lo = mid + 1;
+	  }
+	rows[i] = (rows_type) lo;
+     }
+
+   ret = SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR) &rows_at);
+
+end_call_and_return:
+   ret = end_call (&cc, ret);
+free_and_return:
+   SLang_free_array (rows_at);
+   SLang_free_array (values_at);
+   SLang_free_ref (ref);
+   SLang_free_mmt (mmt);
+   return ret;
+}
+
+/* The results of get_sort_order for unmodified read-only files */
+#define SORT_ORDER_CACHE_SIZE	32
+typedef struct
+{
+   unsigned long dev, ino;
+   long file_size, file_mtime, file_mtime_nsec;
+   long file_ctime, file_ctime_nsec;
+   LONGLONG datastart, num_rows;
+   int col;
+   int order;
+}
+Sort_Order_Cache_Type;
+
+#ifdef HAVE_COLUMN_CACHE
+static Sort_Order_Cache_Type Sort_Order_Cache[SORT_ORDER_CACHE_SIZE];
+static unsigned int Sort_Order_Cache_Next = 0;
+#endif
+
+/* Returns 0 if the sort order of the column may be cached, and fills in
+ * the key fields of e.
+ */
+static int sort_order_make_key (fitsfile *f, int col, LONGLONG num_rows,
+				Sort_Order_Cache_Type *e)
+{
+#ifdef HAVE_COLUMN_CACHE
+   char filename[FLEN_FILENAME];
+   char urltype[FLEN_FILENAME];
+   struct stat st;
+   int status = 0;
+   int mode;
+
+   if ((f->Fptr == NULL)
+       || fits_file_mode (f, &mode, &status)
+       || (mode != READONLY)
+       || fits_url_type (f, urltype, &status)
+       || ((0 != strcmp (urltype, "file://"))
+	   && (0 != strcmp (urltype, "compress://"))
+	   && (0 != strcmp (urltype, "gzidx://")))
+       || fits_file_name (f, filename, &status)
+       || (NULL != strchr (filename, '['))
+       || (-1 == stat (filename, &st)))
+     return -1;
+
+   memset ((char *) e, 0, sizeof (Sort_Order_Cache_Type));
+   e->dev = (unsigned long) st.st_dev;
+   e->ino = (unsigned long) st.st_ino;
+   e->file_size = (long) st.st_size;
+   e->file_mtime = (long) st.st_mtime;
+   e->file_mtime_nsec = STAT_MTIME_NSEC(st);
+   e->file_ctime = (long) st.st_ctime;
+   e->file_ctime_nsec = STAT_CTIME_NSEC(st);
+   e->datastart = (LONGLONG) f->Fptr->datastart;
+   e->num_rows = num_rows;
+   e->col = col;
+   return 0;
+#else
+   (void) f; (void) col; (void) num_rows; (void) e;
+   return -1;
+#endif
+}
+
+static Sort_Order_Cache_Type *sort_order_cache_find (Sort_Order_Cache_Type *key)
+{
+#ifdef HAVE_COLUMN_CACHE
+   unsigned int i;
+   for (i = 0; i < SORT_ORDER_CACHE_SIZE; i++)
+     {
+	Sort_Order_Cache_Type *e = Sort_Order_Cache + i;
+	if ((e->col == key->col) && (e->dev == key->dev) && (e->ino == key->ino)
+	    && (e->file_size == key->file_size) && (e->file_mtime == key->file_mtime)
+	    && (e->file_mtime_nsec == key->file_mtime_nsec)
+	    && (e->file_ctime == key->file_ctime)
+	    && (e->file_ctime_nsec == key->file_ctime_nsec)
+	    && (e->datastart == key->datastart) && (e->num_rows == key->num_rows))
+	  return e;
+     }
+#else
+   (void) key;
+#endif
+   return NULL;
+}
+
+static void sort_order_cache_add (Sort_Order_Cache_Type *e)
+{
+#ifdef HAVE_COLUMN_CACHE
+   Sort_Order_Cache[Sort_Order_Cache_Next] = *e;
+   Sort_Order_Cache_Next = (Sort_Order_Cache_Next + 1) % SORT_ORDER_CACHE_SIZE;
+#else
+   (void) e;
+#endif
+}
+
+/* Usage: status = _fits_get_sort_order (ft, col, &order)
+ * order is 1 if the values of the numeric scalar column col never
+ * decrease, -1 if they never increase (and do not all agree), and 0 if
+ * the column is not sorted.  NaNs are ignored.  The column is read in
+ * blocks of rows, as 64 bit integers for integer columns.  The result
+ * is remembered for unmodified read-only files, so that the column is
+ * read only once for all range selections on it.
+ */
+#define SORT_ORDER_BLOCK_ROWS	65536
+static int get_sort_order (FitsFile_Type *ft, int *colp, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   Sort_Order_Cache_Type key, *e;
+   LONGLONG num_rows, row, n, k;
+   long repeat, width;
+   void *buf = NULL;
+   int col = *colp, type, have_key, have_last = 0;
+   int up = 0, down = 0, order;
+   int ret = -1, status = 0;
+   double dlast = 0.0;
+#ifdef TLONGLONG
+   LONGLONG llast = 0;
+#endif
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_get_sort_order");
+
+   if ((0 != GET_COL_TYPE (ft->fptr, col, &type, &repeat, &width, &status))
+       || (0 != fits_get_num_rowsll (ft->fptr, &num_rows, &status)))
+     {
+	ret = status;
+	goto end_call_and_return;
+     }
+   if ((repeat != 1) || (type < 0) || (type == TSTRING) || (type == TBIT))
+     {
+	SLang_verror (SL_INVALID_PARM, "Column %d is not a numeric scalar column", col);
+	goto end_call_and_return;
+     }
+
+   have_key = (0 == sort_order_make_key (ft->fptr, col, num_rows, &key));
+   if (have_key && (NULL != (e = sort_order_cache_find (&key))))
+     {
+	order = e->order;
+	goto return_order;
+     }
+
+   if (NULL == (buf = SLmalloc (SORT_ORDER_BLOCK_ROWS * sizeof (double))))
+     goto end_call_and_return;
+
+   for (row = 1; (row <= num_rows) && !(up && down); row += n)
+     {
+	int anynul;
+
+	n = num_rows - row + 1;
+	if (n > SORT_ORDER_BLOCK_ROWS)
+	  n = SORT_ORDER_BLOCK_ROWS;
+#ifdef TLONGLONG
+	if (is_integer_column_type (type))
+	  {
+	     LONGLONG *x = (LONGLONG *) buf;
+	     if (fits_read_col (ft->fptr, TLONGLONG, col, row, 1, n, NULL, x, &anynul, &status))
+	       {
+		  ret = status;
+		  goto end_call_and_return;
+	       }
+	     count_read ((double) n, sizeof (LONGLONG));
+	     for (k = 0; k < n; k++)
+	       {
+		  if (have_last)
+		    {
+		       up |= (x[k] > llast);
+		       down |= (x[k] < llast);
+		    }
+		  llast = x[k];
+		  have_last = 1;
+	       }
+	  }
+	else
+#endif
+	  {
+	     double *x = (double *) buf;
+	     if (fits_read_col (ft->fptr, TDOUBLE, col, row, 1, n, NULL, x, &anynul, &status))
+	       {
+		  ret = status;
+		  goto end_call_and_return;
+	       }
+	     count_read ((double) n, sizeof (double));
+	     for (k = 0; k < n; k++)
+	       {
+		  if (x[k] != x[k])
+		    continue;
+		  if (have_last)
+		    {
+		       up |= (x[k] > dlast);
+		       down |= (x[k] < dlast);
+		    }
+		  dlast = x[k];
+		  have_last = 1;
+	       }
+	  }
+     }
+
+   order = (up && down) ? 0 : (down ? -1 : 1);
+   if (have_key)
+     {
+	key.order = order;
+	sort_order_cache_add (&key);
+     }
+
+return_order:
+   ret = SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &order);
+
+end_call_and_return:
+   SLfree ((char *) buf);
+   return end_call (&cc, ret);
+}
+
+/* Usage: _fits_read_bit_mask (ft, col, firstrow, nrows, &mask)
+ * The bits of a fixed or variable length bit column are returned
+ * unpacked, as one UChar 0/1 per bit: a [nrows, n] array for an nX
+ * column, or an array of arrays for a variable length column.
+ */
+static int read_bit_mask (FitsFile_Type *ft, int *colnum, rows_type *firstrowp,
+			  rows_type *num_rowsp, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
+   SLang_Array_Type *at;
+   long repeat, width;
+   LONGLONG firstrow, num_rows, num_rows_in_table;
+   SLindex_Type n;
+   int type, col;
+   int status = 0;
+
+   if (ft->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, ft, "_fits_read_bit_mask");
+
+   col = *colnum;
+   firstrow = *firstrowp;
+   num_rows = *num_rowsp;
+
+   if ((0 != fits_get_coltype (ft->fptr, col, &type, &repeat, &width, &status))
+       || (0 != fits_get_num_rowsll (ft->fptr, &num_rows_in_table, &status)))
+     return end_call (&cc, status);
+
+   if ((type != TBIT) && (type != -TBIT))
+     {
+	SLang_verror (SL_INVALID_PARM, "Column %d is not a bit column", col);
+	return end_call (&cc, -1);
+     }
+   if ((firstrow <= 0) || (num_rows < 0)
+       || (firstrow - 1 + num_rows > num_rows_in_table))
+     {
+	SLang_verror (SL_INVALID_PARM, "Row number out of range");
+	return end_call (&cc, -1);
+     }
+   if (-1 == get_array_dim (num_rows * (type < 0 ? 1 : repeat), &n))
+     return end_call (&cc, -1);
+
+   if (type < 0)
+     {
+	SLang_Array_Type **ats;
+	SLindex_Type i;
+
+	if (NULL == (at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &n, 1)))
+	  return end_call (&cc, -1);
+	ats = (SLang_Array_Type **) at->data;
+	for (i = 0; i < n; i++)
+	  {
+	     status = read_heap_bit_cell (ft->fptr, col, firstrow + i, SLANG_UCHAR_TYPE, 1, ats + i);
+	     if (status)
+	       break;
+	  }
+     }
+   else
+     {
+	SLindex_Type dims[2];
+
+	dims[0] = (SLindex_Type) num_rows;
+	dims[1] = (SLindex_Type) repeat;
+	if (NULL == (at = SLang_create_array (SLANG_UCHAR_TYPE, 0, NULL, dims, 2)))
+	  return end_call (&cc, -1);
+	if (n > 0)
+	  status = read_bit_column (ft->fptr, col, firstrow, dims[0],
+				    (unsigned char *) at->data, 1, repeat, 1);
+     }
+
+   if ((status == 0)
+       && (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR)&at)))
+     status = -1;
+
+   SLang_free_array (at);
+   return end_call (&cc, status);
+}
+
+typedef struct
+{
+   int type;
+   long repeat, width;
+   long repeat_orig;		       /* used for tbit columns */
+   SLtype datatype;
+   size_t data_offset;
+   int cached;			       /* data came from the column cache */
+}
+Column_Info_Type;
+
+/* The column cache.  When enabled, the decoded, native-endian values of a
+ * fixed width column that has been read in its entirety are saved in a
+ * sidecar file under Column_Cache_Dir.  Subsequent reads of the column
+ * copy the values from the mmapped sidecar instead of going through
+ * cfitsio.  Only files opened READONLY are cached.  The sidecar is keyed
+ * by the identity of the file (device, inode, size, and mtime and ctime
+ * with their nanoseconds), the layout of
+ * the HDU and column, and the scaling in effect.  The total size of the
+ * cache is limited by evicting the least recently used sidecars, where the
+ * mtime of a sidecar is updated when it is used.
+ */
+static char *Column_Cache_Dir = NULL;
+static double Column_Cache_Max_Bytes = 0.0;
+
+#ifdef HAVE_COLUMN_CACHE
+#define COLUMN_CACHE_MAGIC	"SLFCC003"	       /* 003: ctime, nanoseconds */
+#define COLUMN_CACHE_SUFFIX	".slfc"
+
+typedef struct
+{
+   char magic[8];
+   unsigned long dev, ino;
+   long file_size, file_mtime, file_mtime_nsec;
+   long file_ctime, file_ctime_nsec;
+   long datastart;		       /* identifies the HDU */
+   long num_rows, row_length;
+   long tbcol;
+   int col, type;
+   long repeat;
+   unsigned int sizeof_type;
+   double tscale, tzero;
+   unsigned int filename_len;	       /* filename follows the key */
+}
+Column_Cache_Key_Type;
+
+static unsigned long hash_bytes (unsigned char *b, unsigned int len, unsigned long h)
+{
+   unsigned char *bmax = b + len;
+
+   /* FNV-1a, 32 bits */
+   while (b < bmax)
+     {
+	h ^= *b++;
+	h = (h * 16777619UL) & 0xFFFFFFFFUL;
+     }
+   return h;
+}
+
+static unsigned int cache_data_offset (Column_Cache_Key_Type *key)
+{
+   unsigned int ofs = sizeof (Column_Cache_Key_Type) + key->filename_len;
+   return (ofs + 7) & ~7U;
+}
+
+/* Returns 0 if the column is cacheable and fills in the key and filename.
+ * The filename must be freed.
+ */
+static int cache_make_key (fitsfile *f, int col, Column_Info_Type *ci,
+			   SLang_Array_Type *at, Column_Cache_Key_Type *key,
+			   char **filenamep)
+{
+   char filename[FLEN_FILENAME];
+   char urltype[FLEN_FILENAME];
+   struct stat st;
+   tcolumn *colptr;
+   int status = 0;
+   int mode;
+
+   *filenamep = NULL;
+   if ((ci->type <= 0) || (ci->datatype == SLANG_STRING_TYPE)
+       || (f->Fptr == NULL) || (NULL == (colptr = f->Fptr->tableptr)))
+     return -1;
+
+   if (fits_file_mode (f, &mode, &status)
+       || (mode != READONLY)
+       || fits_url_type (f, urltype, &status)
+       || ((0 != strcmp (urltype, "file://"))
+	   && (0 != strcmp (urltype, "compress://"))
+	   && (0 != strcmp (urltype, "gzidx://")))
+       || fits_file_name (f, filename, &status))
+     return -1;
+
+   if ((NULL != strchr (filename, '['))
+       || (-1 == stat (filename, &st)))
+     return -1;
+
+   colptr += col - 1;
+   memset ((char *) key, 0, sizeof (Column_Cache_Key_Type));
+   memcpy (key->magic, COLUMN_CACHE_MAGIC, 8);
+   key->dev = (unsigned long) st.st_dev;
+   key->ino = (unsigned long) st.st_ino;
+   key->file_size = (long) st.st_size;
+   key->file_mtime = (long) st.st_mtime;
+   key->file_mtime_nsec = STAT_MTIME_NSEC(st);
+   key->file_ctime = (long) st.st_ctime;
+   key->file_ctime_nsec = STAT_CTIME_NSEC(st);
+   key->datastart = (long) f->Fptr->datastart;
+   key->num_rows = (long) f->Fptr->numrows;
+   key->row_length = (long) f->Fptr->rowlength;
+   key->tbcol = (long) colptr->tbcol;
+   key->col = col;
+   key->type = ci->type;
+   key->repeat = ci->repeat;
+   key->sizeof_type = at->sizeof_type;
+   key->tscale = colptr->tscale;
+   key->tzero = colptr->tzero;
+   key->filename_len = strlen (filename);
+
+   if (NULL == (*filenamep = SLmalloc (key->filename_len + 1)))
+     return -1;
+   strcpy (*filenamep, filename);
+   return 0;
+}
+
+static char *cache_sidecar_name (Column_Cache_Key_Type *key, char *filename)
+{
+   char buf[32];
+   unsigned long h1, h2;
+   char *path;
+
+   h1 = hash_bytes ((unsigned char *) key, sizeof (Column_Cache_Key_Type), 2166136261UL);
+   h1 = hash_bytes ((unsigned char *) filename, key->filename_len, h1);
+   h2 = hash_bytes ((unsigned char *) filename, key->filename_len, 0x811C9DC5UL ^ 0x5A5A5A5AUL);
+   h2 = hash_bytes ((unsigned char *) key, sizeof (Column_Cache_Key_Type), h2);
+   sprintf (buf, "/%08lx%08lx%s", h1, h2, COLUMN_CACHE_SUFFIX);
+
+   if (NULL == (path = SLmalloc (strlen (Column_Cache_Dir) + strlen (buf) + 1)))
+     return NULL;
+   strcpy (path, Column_Cache_Dir);
+   strcat (path, buf);
+   return path;
+}
+
+/* Copy num_rows rows starting at firstrow (1-based) from the sidecar into
+ * data.  Returns 0 upon success, or -1 if the column is not in the cache.
+ */
+static int cache_read_column (Column_Cache_Key_Type *key, char *filename,
+			      LONGLONG firstrow, LONGLONG num_rows, unsigned char *data)
+{
+   char *path;
+   int fd;
+   struct stat st;
+   size_t row_bytes, ofs, map_size;
+   unsigned char *map;
+   int ret = -1;
+
+   if (NULL == (path = cache_sidecar_name (key, filename)))
+     return -1;
+
+   if (-1 == (fd = open (path, O_RDONLY)))
+     {
+	SLfree (path);
+	return -1;
+     }
+
+   row_bytes = (size_t) key->repeat * key->sizeof_type;
+   ofs = cache_data_offset (key);
+   map_size = ofs + row_bytes * key->num_rows;
+
+   if ((0 == fstat (fd, &st))
+       && ((size_t) st.st_size == map_size)
+       && (MAP_FAILED != (map = (unsigned char *) mmap (NULL, map_size, PROT_READ, MAP_SHARED, fd, 0))))
+     {
+	if ((0 == memcmp (map, (char *) key, sizeof (Column_Cache_Key_Type)))
+	    && (0 == memcmp (map + sizeof (Column_Cache_Key_Type), filename, key->filename_len)))
+	  {
+	     memcpy (data, map + ofs + row_bytes * (size_t) (firstrow - 1), row_bytes * (size_t) num_rows);
+	     ret = 0;
+	  }
+	(void) munmap ((char *) map, map_size);
+     }
+   (void) close (fd);
+
+   if (ret == 0)
+     (void) utime (path, NULL);	       /* for the LRU eviction */
+   SLfree (path);
+   return ret;
+}
+
+typedef struct
+{
+   char *name;
+   time_t mtime;
+   long mtime_nsec;
+   double size;
+}
+Cache_Entry_Type;
+
+static int compare_cache_entries (const void *a, const void *b)
+{
+   Cache_Entry_Type *ea = (Cache_Entry_Type *) a, *eb = (Cache_Entry_Type *) b;
+
+   if (ea->mtime != eb->mtime)
+     return (ea->mtime < eb->mtime) ? -1 : 1;
+   return (ea->mtime_nsec < eb->mtime_nsec) ? -1 : (ea->mtime_nsec > eb->mtime_nsec);
+}
+
+/* Remove the least recently used sidecars until the cache fits */
+static void cache_evict (void)
+{
+   DIR *dir;
+   struct dirent *de;
+   Cache_Entry_Type *entries = NULL;
+   unsigned int num = 0, max_num = 0, i;
+   unsigned int suffix_len = strlen (COLUMN_CACHE_SUFFIX);
+   double total = 0.0;
+
+   if ((Column_Cache_Max_Bytes <= 0.0)
+       || (NULL == (dir = opendir (Column_Cache_Dir))))
+     return;
+
+   while (NULL != (de = readdir (dir)))
+     {
+	unsigned int len = strlen (de->d_name);
+	struct stat st;
+	char *path;
+
+	if ((len <= suffix_len)
+	    || (0 != strcmp (de->d_name + len - suffix_len, COLUMN_CACHE_SUFFIX)))
+	  continue;
+
+	if (NULL == (path = SLmalloc (strlen (Column_Cache_Dir) + len + 2)))
+	  break;
+	sprintf (path, "%s/%s", Column_Cache_Dir, de->d_name);
+	if (-1 == stat (path, &st))
+	  {
+	     SLfree (path);
+	     continue;
+	  }
+
+	if (num == max_num)
+	  {
+	     Cache_Entry_Type *tmp;
+	     max_num += 64;
+	     tmp = (Cache_Entry_Type *) SLrealloc ((char *) entries, max_num * sizeof (Cache_Entry_Type));
+	     if (tmp == NULL)
+	       {
+		  SLfree (path);
+		  break;
+	       }
+	     entries = tmp;
+	  }
+	entries[num].name = path;
+	entries[num].mtime = st.st_mtime;
+	entries[num].mtime_nsec = STAT_MTIME_NSEC(st);
+	entries[num].size = (double) st.st_size;
+	total += entries[num].size;
+	num++;
+     }
+   (void) closedir (dir);
+
+   if (total > Column_Cache_Max_Bytes)
+     {
+	qsort (entries, num, sizeof (Cache_Entry_Type), compare_cache_entries);
+	for (i = 0; (i < num) && (total > Column_Cache_Max_Bytes); i++)
+	  {
+	     if (0 == unlink (entries[i].name))
+	       total -= entries[i].size;
+	  }
+     }
+
+   for (i = 0; i < num; i++)
+     SLfree (entries[i].name);
+   SLfree ((char *) entries);
+}
+
+/* Save all num_rows rows of a column.  Failures are silently ignored since
+ * the cache is only an optimization.
+ */
+static void cache_write_column (Column_Cache_Key_Type *key, char *filename,
+				unsigned char *data)
+{
+   char *path, *tmp_path;
+   FILE *fp;
+   unsigned int ofs;
+   size_t nbytes;
+   int ok;
+   static char zeros[8];
+
+   if (Column_Cache_Max_Bytes > 0.0)
+     {
+	nbytes = cache_data_offset (key) + (size_t) key->repeat * key->sizeof_type * key->num_rows;
+	if (nbytes > Column_Cache_Max_Bytes)
+	  return;
+     }
+
+   if (NULL == (path = cache_sidecar_name (key, filename)))
+     return;
+   if (NULL == (tmp_path = SLmalloc (strlen (path) + 32)))
+     {
+	SLfree (path);
+	return;
+     }
+   sprintf (tmp_path, "%s.%ld", path, (long) getpid ());
+
+   if (NULL == (fp = fopen (tmp_path, "wb")))
+     goto free_and_return;
+
+   ofs = cache_data_offset (key);
+   nbytes = (size_t) key->repeat * key->sizeof_type * key->num_rows;
+   ok = ((1 == fwrite ((char *) key, sizeof (Column_Cache_Key_Type), 1, fp))
+	 && (key->filename_len == fwrite (filename, 1, key->filename_len, fp))
+	 && ((ofs - sizeof (Column_Cache_Key_Type) - key->filename_len)
+	     == fwrite (zeros, 1, ofs - sizeof (Column_Cache_Key_Type) - key->filename_len, fp))
+	 && (nbytes == fwrite ((char *) data, 1, nbytes, fp)));
+
+   if ((EOF == fclose (fp)) || (ok == 0)
+       || (-1 == rename (tmp_path, path)))
+     (void) unlink (tmp_path);
+   else
+     cache_evict ();
+
+free_and_return:
+   SLfree (tmp_path);
+   SLfree (path);
+}
+#endif				       /* HAVE_COLUMN_CACHE */
+
+/* Usage: _fits_set_column_cache (dir or NULL, max_bytes) */
+static void set_column_cache (void)
+{
+   char *dir;
+   double max_bytes;
+
+#if SLANG_VERSION < 20000
+   if (-1 == SLang_pop_double (&max_bytes, NULL, NULL))
+     return;
+#else
+   if (-1 == SLang_pop_double (&max_bytes))
+     return;
+#endif
+   if (-1 == pop_string_or_null (&dir))
+     return;
+
+#ifndef HAVE_COLUMN_CACHE
+   if (dir != NULL)
+     {
+	SLang_verror (SL_NOT_IMPLEMENTED, "The column cache is not supported on this system");
+	SLang_free_slstring (dir);
+	return;
+     }
+#endif
+   SLang_free_slstring (Column_Cache_Dir);
+   Column_Cache_Dir = dir;
+   Column_Cache_Max_Bytes = max_bytes;
+}
+
+static int read_var_column_data (fitsfile *f, int ftype, SLtype datatype,
+				 int col, LONGLONG firstrow, LONGLONG num_rows,
+				 SLang_Array_Type **at_data)
+{
+   LONGLONG i;
+
+   for (i = 0; i < num_rows; i++)
+     {
+	LONGLONG offset;
+	LONGLONG repeat;
+	LONGLONG row;
+	int status = 0;
+
+	row = firstrow + i;
+	if (0 != fits_read_descriptll (f, col, row, &repeat, &offset, &status))
+	  return status;
+
+	if (ftype == TBIT)
+	  status = read_heap_bit_cell (f, col, row, datatype, 0, at_data+i);
+	else
+	  status = read_column_values (f, ftype, datatype, row, col, 1, repeat, repeat, NULL, at_data+i);
+	if (status)
+	  return status;
+     }
+   return 0;
+}
+
+static int read_string_column_data (fitsfile *f, int is_var, LONGLONG repeat, unsigned int num_substrs, int col,
+				    LONGLONG firstrow, LONGLONG num_rows,
+				    char **strs)
+{
+   LONGLONG i;
+   int status = 0;
+
+   for (i = 0; i < num_rows; i++)
+     {
+	LONGLONG offset;
+	LONGLONG row;
+
+	row = firstrow + i;
+	if (is_var)
+	  {
+	     if (0 != fits_read_descriptll (f, col, row, &repeat, &offset, &status))
+	       return status;
+	  }
+
+	status = read_string_cell (f, row, col, repeat, num_substrs, strs + i);
+	if (status != 0)
+	  return status;
+     }
+   return 0;
+}
+
+/* Usage: read_cols (ft, [columns...], firstrow, nrows, &ref|into [,&tscales, &tzeros])
+ * If the tscales and tzeros references are given, the columns are read in
+ * their stored types without applying TSCALn/TZEROn, and the scaling
+ * parameters are returned as arrays.  If an array of arrays (one per
+ * column) is passed instead of &ref, the data are read into those arrays.
+ */
+/* TODO: Add support for the following calling convention:
+ *    read_cols (ft, [columns...], [rows], &ref)
+ * Here rows is an integer-valued array that specifies what rows to be
+ * read.
+ */
+static int read_cols (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt;
+   FitsFile_Type *ft;
+   fitsfile *f;
+   int status;
+   int num_columns_in_table;
+   LONGLONG num_rows_in_table;
+   long delta_rows;
+   LONGLONG num_rows;
+   LONGLONG firstrow;
+   SLindex_Type num_rows_dim;
+   int *cols;
+   int num_cols;
+   int i;
+   SLang_Ref_Type *ref;
+   Column_Info_Type *ci = NULL;
+   SLang_Array_Type *data_arrays_at = NULL;
+   SLang_Array_Type **data_arrays = NULL;
+   SLang_Array_Type *columns_at = NULL;
+   SLang_Array_Type *into_at = NULL;
+   LONGLONG firstrow0, num_rows0;
+   SLang_Ref_Type *tscale_ref = NULL, *tzero_ref = NULL;
+   SLang_Array_Type *tscale_at = NULL, *tzero_at = NULL;
+   int num_unscaled = 0;
+   SLtype read_datatype = 0;
+   int read_type = 0;
+   int nargs = SLang_Num_Function_Args;
+#ifdef HAVE_COLUMN_CACHE
+   Column_Cache_Key_Type key;
+   char *cache_filename;
+#endif
+
+   begin_call (&cc, NULL, "_fits_read_cols");
+
+   ref = NULL;
+   mmt = NULL;
+   f = NULL;
+   cols = NULL;
+   status = -1;
+
+   if ((nargs == 6) || (nargs == 8))
+     {
+	if (-1 == pop_read_type ("fits_read_col", &read_datatype, &read_type))
+	  goto free_and_return_status;
+	nargs--;
+     }
+
+   if ((nargs == 7)
+       && ((-1 == SLang_pop_ref (&tzero_ref))
+	   || (-1 == SLang_pop_ref (&tscale_ref))))
+     goto free_and_return_status;
+
+   if (SLang_peek_at_stack () == SLANG_ARRAY_TYPE)
+     {
+	if (-1 == SLang_pop_array (&into_at, 0))
+	  goto free_and_return_status;
+     }
+   else if (-1 == SLang_pop_ref (&ref))
+     goto free_and_return_status;
+
+   if ((-1 == pop_rows_value (&num_rows))
+       || (-1 == pop_rows_value (&firstrow))
+       || (-1 == SLang_pop_array (&columns_at, 1))
+       || (NULL == (ft = pop_fits_type (&mmt))))
+     goto free_and_return_status;
+
+   set_call_handle (&cc, ft);
+
+   f = ft->fptr;
+   if (f == NULL)
+     goto free_and_return_status;
+
+   status = 0;
+   if ((0 != fits_get_num_cols (f, &num_columns_in_table, &status))
+       || (0 != fits_get_num_rowsll (f, &num_rows_in_table, &status)))
+     goto free_and_return_status;
+
+   if (num_rows < 0)
+     {
+	SLang_verror (SL_INVALID_PARM, "Number of rows must be non-negative");
+	status = -1;
+	goto free_and_return_status;
+     }
+
+   if ((firstrow <= 0)
+       || ((firstrow > num_rows_in_table) && (num_rows > 0)))
+     {
+	SLang_verror (SL_INVALID_PARM, "Row number out of range");
+	status = -1;
+	goto free_and_return_status;
+     }
+
+   if (firstrow + num_rows > num_rows_in_table + 1)
+     num_rows = num_rows_in_table - (firstrow - 1);
+   firstrow0 = firstrow;
+   num_rows0 = num_rows;
+   if (-1 == get_array_dim (num_rows, &num_rows_dim))
+     {
+	status = -1;
+	goto free_and_return_status;
+     }
+
+   cols = (int *)columns_at->data;
+   num_cols = columns_at->num_elements;
+
+   if (NULL == (ci = (Column_Info_Type *) SLmalloc (num_cols*sizeof (Column_Info_Type))))
+     {
+	status = -1;
+	goto free_and_return_status;
+     }
+
+   if (into_at != NULL)
+     {
+	/* The caller owns these arrays */
+	if ((into_at->data_type != SLANG_ARRAY_TYPE)
+	    || ((int) into_at->num_elements != num_cols))
+	  {
+	     SLang_verror (SL_INVALID_PARM, "fits_read_col: into= requires an array of %d arrays", num_cols);
+	     status = -1;
+	     goto free_and_return_status;
+	  }
+	data_arrays = (SLang_Array_Type **)into_at->data;
+     }
+   else
+     {
+	data_arrays_at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &num_cols, 1);
+	if (data_arrays_at == NULL)
+	  {
+	     status = -1;
+	     goto free_and_return_status;
+	  }
+	data_arrays = (SLang_Array_Type **)data_arrays_at->data;
+     }
+
+   if (tscale_ref != NULL)
+     {
+	if ((NULL == (tscale_at = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, &num_cols, 1)))
+	    || (NULL == (tzero_at = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, &num_cols, 1))))
+	  {
+	     status = -1;
+	     goto free_and_return_status;
+	  }
+	if ((f->Fptr == NULL) || (f->Fptr->tableptr == NULL))
+	  {
+	     SLang_verror (SL_INVALID_PARM, "The current HDU is not a table");
+	     status = -1;
+	     goto free_and_return_status;
+	  }
+     }
+
+   for (i = 0; i < num_cols; i++)
+     {
+	SLang_Array_Type *at;
+	SLtype datatype;
+	long repeat;
+	int type;
+	int col;
+
+	col = cols[i];
+	if ((col <= 0) || (col > num_columns_in_table))
+	  {
+	     SLang_verror (SL_INVALID_PARM, "Column number out of range");
+	     status = -1;
+	     goto free_and_return_status;
+	  }
+
+	if (tscale_at != NULL)
+	  {
+	     /* Turn off the scaling so that the equivalent type is the
+	      * stored one.  The scaling in effect is restored below.
+	      */
+	     tcolumn *colptr = f->Fptr->tableptr + (col - 1);
+	     ((double *)tscale_at->data)[i] = colptr->tscale;
+	     ((double *)tzero_at->data)[i] = colptr->tzero;
+	     if (fits_set_tscale (f, col, 1.0, 0.0, &status))
+	       goto free_and_return_status;
+	     num_unscaled++;
+	  }
+
+	if (0 != GET_COL_TYPE (f, col, &type, &repeat, &ci[i].width, &status))
+	  goto free_and_return_status;
+
+	ci[i].repeat_orig = repeat;
+	if (-1 == map_fitsio_type_to_slang (&type, &repeat, &datatype))
+	  {
+	     status = -1;
+	     goto free_and_return_status;
+	  }
+	convert_column_type (&type, &datatype, read_type, read_datatype);
+	ci[i].repeat = repeat;
+	ci[i].type = type;
+	ci[i].datatype = datatype;
+	ci[i].data_offset = 0;
+
+	if ((type > 0) && (datatype != SLANG_STRING_TYPE)
+	    && (-1 == get_array_dim (num_rows * repeat, &num_rows_dim)))
+	  {
+	     status = -1;
+	     goto free_and_return_status;
+	  }
+	num_rows_dim = (SLindex_Type) num_rows;
+
+	if (into_at != NULL)
+	  {
+	     SLindex_Type dims[2];
+	     at = data_arrays[i];
+	     dims[0] = num_rows_dim;
+	     dims[1] = repeat;
+	     if ((datatype == SLANG_STRING_TYPE) || (type < 0))
+	       {
+		  SLang_verror (SL_NOT_IMPLEMENTED, "fits_read_col: into= is not supported for string or variable length columns");
+		  status = -1;
+		  goto free_and_return_status;
+	       }
+	     if ((at == NULL)
+		 || (-1 == check_into_array ("fits_read_col", at, datatype,
+					     (SLuindex_Type) num_rows_dim * repeat,
+					     dims, 1 + (repeat > 1), 0)))
+	       {
+		  if (at == NULL)
+		    SLang_verror (SL_INVALID_PARM, "fits_read_col: into= array for column %d is NULL", col);
+		  status = -1;
+		  goto free_and_return_status;
+	       }
+	  }
+	else if (datatype == SLANG_STRING_TYPE)
+	  {
+	     at = SLang_create_array (SLANG_STRING_TYPE, 0, NULL, &num_rows_dim, 1);
+	  }
+	else if (type < 0)	       /* variable length */
+	  {
+	     at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &num_rows_dim, 1);
+	  }
+	else
+	  {
+	     SLindex_Type dims[2];
+	     int num_dims = 1;
+	     dims[0] = num_rows_dim;
+	     if (repeat > 1)
+	       {
+		  dims[1] = repeat;
+		  num_dims++;
+	       }
+	     at = SLang_create_array (datatype, 0, NULL, dims, num_dims);
+	  }
+
+	if (at == NULL)
+	  {
+	     status = -1;
+	     goto free_and_return_status;
+	  }
+	data_arrays[i] = at;
+
+	ci[i].cached = 0;
+#ifdef HAVE_COLUMN_CACHE
+	if ((Column_Cache_Dir != NULL) && (num_rows > 0)
+	    && (0 == cache_make_key (f, col, ci+i, at, &key, &cache_filename)))
+	  {
+	     if (0 == cache_read_column (&key, cache_filename, firstrow, num_rows,
+					 (unsigned char *) at->data))
+	       {
+		  ci[i].cached = 1;
+		  count_io (at->num_elements, (double) at->num_elements * at->sizeof_type);
+	       }
+	     SLfree (cache_filename);
+	  }
+#endif
+     }
+
+   if (fits_get_rowsize (f, &delta_rows, &status))
+     goto free_and_return_status;
+
+   if (delta_rows < 1)
+     delta_rows = 1;
+
+   while (num_rows)
+     {
+	if (num_rows < delta_rows)
+	  delta_rows = (long) num_rows;
+
+	for (i = 0; i < num_cols; i++)
+	  {
+	     SLtype datatype = ci[i].datatype;
+	     int type = ci[i].type;
+	     long repeat = ci[i].repeat;
+	     int col = cols[i];
+	     SLang_Array_Type *at = data_arrays[i];
+	     size_t data_offset = ci[i].data_offset;
+
+	     if (ci[i].cached)
+	       continue;
+
+	     if (datatype == SLANG_STRING_TYPE)
+	       {
+		  unsigned int num_substrs;
+		  /* This assumes an ASCII_TBL, which will always have a
+		   * repeat of 1, and the number of bytes is given by the
+		   * width field.  In contrast, a BINARY_TBL will have
+		   * repeat = number of bytes, and width represents the
+		   * number of bytes in a substring.
+		   */
+		  if ((repeat == 1) && (ci[i].width != 1))
+		    {
+		       repeat = ci[i].width;
+		       num_substrs = 1;
+		    }
+		  else
+		    {
+		       if (ci[i].width > 0)
+			 num_substrs = repeat / ci[i].width;
+		       else
+			 num_substrs = 0;
+		    }
+
+		  status = read_string_column_data (f, (type < 0), repeat, num_substrs, col, firstrow, delta_rows,
+						    (char **)at->data + data_offset);
+		  data_offset += delta_rows;
+	       }
+	     else if (type < 0)
+	       {
+		  status = read_var_column_data (f, -type, datatype, col, firstrow, delta_rows,
+						 (SLang_Array_Type **)at->data + data_offset);
+		  data_offset += delta_rows;
+	       }
+	     else
+	       {
+		  LONGLONG num_elements = (LONGLONG) repeat * delta_rows;
+		  unsigned char *data = (unsigned char *)at->data + data_offset;
+
+		  if (type == TBIT)
+		    status = read_bit_column (f, col, firstrow, delta_rows, data, at->sizeof_type, ci[i].repeat_orig, 0);
+		  else
+		    (void) read_col_elements (f, type, col, firstrow, repeat, num_elements,
+					      data, at->sizeof_type, &status);
+
+		  data_offset += (size_t) num_elements * at->sizeof_type;
+	       }
+	     ci[i].data_offset = data_offset;
+
+	     if (status)
+	       goto free_and_return_status;
+	  }
+	firstrow += delta_rows;
+	num_rows -= delta_rows;
+     }
+
+   if (status)
+     goto free_and_return_status;
+
+#ifdef HAVE_COLUMN_CACHE
+   /* Only complete columns are cached */
+   if ((Column_Cache_Dir != NULL) && (firstrow0 == 1) && (num_rows0 > 0)
+       && (num_rows0 == num_rows_in_table))
+     {
+	for (i = 0; i < num_cols; i++)
+	  {
+	     if (ci[i].cached
+		 || (0 != cache_make_key (f, cols[i], ci+i, data_arrays[i], &key, &cache_filename)))
+	       continue;
+	     cache_write_column (&key, cache_filename, (unsigned char *) data_arrays[i]->data);
+	     SLfree (cache_filename);
+	  }
+     }
+#else
+   (void) firstrow0; (void) num_rows0;
+#endif
+
+   if (((ref != NULL)
+	&& (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR)&data_arrays_at)))
+       || ((tscale_ref != NULL)
+	   && ((-1 == SLang_assign_to_ref (tscale_ref, SLANG_ARRAY_TYPE, (VOID_STAR)&tscale_at))
+	       || (-1 == SLang_assign_to_ref (tzero_ref, SLANG_ARRAY_TYPE, (VOID_STAR)&tzero_at)))))
+     status = -1;
+
+   /* drop */
+
+   free_and_return_status:
+   /* Restore in reverse order in case a column was given more than once */
+   while (num_unscaled > 0)
+     {
+	int status1 = 0;
+	num_unscaled--;
+	if ((0 != fits_set_tscale (f, cols[num_unscaled],
+				   ((double *)tscale_at->data)[num_unscaled],
+				   ((double *)tzero_at->data)[num_unscaled], &status1))
+	    && (status == 0))
+	  status = status1;
+     }
+   SLfree ((char *)ci);
+   SLang_free_array (columns_at);
+   SLang_free_ref (ref);
+   SLang_free_array (data_arrays_at);
+   SLang_free_array (into_at);
+   SLang_free_ref (tscale_ref);
+   SLang_free_ref (tzero_ref);
+   SLang_free_array (tscale_at);
+   SLang_free_array (tzero_at);
+
+   (void) end_call (&cc, status);
+   SLang_free_mmt (mmt);
+   return status;
+}
+
+/* The size of an element of a fixed width binary table column that
+ * read_rows decodes itself, or 0 if it leaves the column to cfitsio.
+ */
+static unsigned int get_decoded_elem_size (int tcode)
+{
+   switch (tcode)
+     {
+      case TLOGICAL: case TBYTE: return 1;
+      case TSHORT: return 2;
+      case TLONG: case TFLOAT: return 4;
+      case TLONGLONG: case TDOUBLE: return 8;
+     }
+   return 0;
+}
+
+static int is_decoded_datatype (SLtype type)
+{
+   switch (type)
+     {
+      case SLANG_CHAR_TYPE: case SLANG_UCHAR_TYPE:
+      case SLANG_INT16_TYPE: case SLANG_UINT16_TYPE:
+      case SLANG_INT32_TYPE: case SLANG_UINT32_TYPE:
+#ifdef SLANG_INT64_TYPE
+      case SLANG_INT64_TYPE:
+#endif
+      case SLANG_FLOAT_TYPE: case SLANG_DOUBLE_TYPE:
+	return 1;
+     }
+   return 0;
+}
+
+/* The value of a big-endian element of a binary table column */
+static double get_table_value (unsigned char *p, int tcode, unsigned int size, int swap)
+{
+   union
+     {
+	unsigned char b[8];
+	short s; int i; LONGLONG l; float f; double d;
+     }
+   u;
+   unsigned int k;
+
+   if (tcode == TLOGICAL)
+     return (*p == 'T');
+   if (tcode == TBYTE)
+     return *p;
+
+   for (k = 0; k < size; k++)
+     u.b[k] = swap ? p[size - 1 - k] : p[k];
+
+   switch (tcode)
+     {
+      case TSHORT: return u.s;
+      case TLONG: return u.i;
+      case TLONGLONG: return (double) u.l;
+      case TFLOAT: return u.f;
+     }
+   return u.d;
+}
+
+static void put_array_value (SLtype type, unsigned char *dst, double v)
+{
+   switch (type)
+     {
+      case SLANG_CHAR_TYPE: *(signed char *) dst = (signed char) v; break;
+      case SLANG_UCHAR_TYPE: *dst = (unsigned char) v; break;
+      case SLANG_INT16_TYPE: *(short *) dst = (short) v; break;
+      case SLANG_UINT16_TYPE: *(unsigned short *) dst = (unsigned short) v; break;
+      case SLANG_INT32_TYPE: *(int *) dst = (int) v; break;
+      case SLANG_UINT32_TYPE: *(unsigned int *) dst = (unsigned int) v; break;
+#ifdef SLANG_INT64_TYPE
+      case SLANG_INT64_TYPE: *(LONGLONG *) dst = (LONGLONG) v; break;
+#endif
+      case SLANG_FLOAT_TYPE: *(float *) dst = (float) v; break;
+      default: *(double *) dst = v; break;
+     }
+}
+
+/* Decode the values of a column from num_rows raw table rows into the
+ * array at, starting with its row first.  A string column must have a
+ * single substring.
+ */
+static int decode_table_column (unsigned char *rows, LONGLONG rowlen, LONGLONG num_rows,
+				tcolumn *colptr, long repeat, SLang_Array_Type *at,
+				LONGLONG first)
+{
+   int tcode = colptr->tdatatype;
+   unsigned int size = get_decoded_elem_size (tcode);
+   unsigned int sizeof_type = at->sizeof_type;
+   int swap = (0 == is_big_endian ());
+   LONGLONG r;
+
+   rows += colptr->tbcol;
+
+   if (tcode == TSTRING)
+     {
+	char **strs = (char **) at->data + first;
+	for (r = 0; r < num_rows; r++)
+	  {
+	     char *p = (char *) rows + r * rowlen;
+	     unsigned int len = 0;
+	     while ((len < (unsigned int) repeat) && (p[len] != 0))
+	       len++;
+	     while (len && (p[len-1] == ' '))
+	       len--;
+	     if (NULL == (strs[r] = SLang_create_nslstring (p, len)))
+	       return -1;
+	  }
+	count_read ((double) num_rows, repeat);
+	return 0;
+     }
+
+   if ((colptr->tscale == 1.0) && (colptr->tzero == 0.0) && (size == sizeof_type)
+       && (((tcode == TBYTE) && (at->data_type == SLANG_UCHAR_TYPE))
+	   || ((tcode == TSHORT) && (at->data_type == SLANG_INT16_TYPE))
+	   || ((tcode == TLONG) && (at->data_type == SLANG_INT32_TYPE))
+#ifdef SLANG_INT64_TYPE
+	   || ((tcode == TLONGLONG) && (at->data_type == SLANG_INT64_TYPE))
+#endif
+	   || ((tcode == TFLOAT) && (at->data_type == SLANG_FLOAT_TYPE))
+	   || ((tcode == TDOUBLE) && (at->data_type == SLANG_DOUBLE_TYPE))))
+     {
+	unsigned char *dst = (unsigned char *) at->data + (size_t) (first * repeat) * size;
+	size_t nbytes = (size_t) repeat * size;
+	for (r = 0; r < num_rows; r++)
+	  {
+	     unsigned char *src = rows + r * rowlen;
+	     if (swap && (size > 1))
+	       {
+		  size_t k;
+		  unsigned int b;
+		  for (k = 0; k < nbytes; k += size)
+		    for (b = 0; b < size; b++)
+		      dst[k + b] = src[k + size - 1 - b];
+	       }
+	     else
+	       memcpy (dst, src, nbytes);
+	     dst += nbytes;
+	  }
+     }
+   else
+     {
+	unsigned char *dst = (unsigned char *) at->data + (size_t) (first * repeat) * sizeof_type;
+	for (r = 0; r < num_rows; r++)
+	  {
+	     unsigned char *src = rows + r * rowlen;
+	     long k;
+	     for (k = 0; k < repeat; k++)
+	       {
+		  double v = get_table_value (src + k * size, tcode, size, swap);
+		  put_array_value (at->data_type, dst, v * colptr->tscale + colptr->tzero);
+		  dst += sizeof_type;
+	       }
+	  }
+     }
+   count_read ((double) num_rows * repeat, sizeof_type);
+   return 0;
+}
+
+/* Usage: status = _fits_read_rows (ft, [columns...], firstrow, nrows, &arrays)
+ *        status = _fits_read_rows (ft, [columns...], Long_Type[] rows, &arrays)
+ * This returns the same arrays as _fits_read_cols, but is meant for
+ * fetching a few rows at a time.  The rows are read as raw bytes with a
+ * single call per run of consecutive rows, and the fixed width numeric,
+ * logical and string columns are decoded here using the column
+ * descriptions held by cfitsio.  The remaining columns (bits, complex,
+ * variable length) are read via cfitsio, whose buffers then already hold
+ * the rows.  In the second form, the rows are returned in the order of
+ * the rows array.
+ */
+#define READ_ROWS_BLOCK_BYTES	(4L*1024L*1024L)
+static int read_rows (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt = NULL;
+   SLang_Ref_Type *ref = NULL;
+   SLang_Array_Type *columns_at = NULL, *data_arrays_at = NULL, *rows_at = NULL;
+   SLang_Array_Type **data_arrays;
+   FitsFile_Type *ft;
+   fitsfile *f;
+   Column_Info_Type *ci = NULL;
+   LONGLONG firstrow = 1, num_rows, num_rows_in_table, rowlen, block_rows, r, row, n;
+   unsigned char *buf = NULL, *decoded = NULL;
+   SLindex_Type num_cols, num_rows_dim;
+   long *rows = NULL;
+   int *cols, i, hdutype, num_decoded = 0;
+   int status = 0;
+   int ret = -1;
+
+   if (-1 == SLang_pop_ref (&ref))
+     goto free_and_return;
+
+   if (SLang_Num_Function_Args == 4)
+     {
+	if (-1 == SLang_pop_array_of_type (&rows_at, SLANG_LONG_TYPE))
 	  goto free_and_return;
-	v = (VOID_STAR) s;
-	break;
+	rows = (long *) rows_at->data;
+	num_rows = (LONGLONG) rows_at->num_elements;
+     }
+   else if ((-1 == pop_rows_value (&num_rows))
+	    || (-1 == pop_rows_value (&firstrow)))
+     goto free_and_return;
+
+   if ((-1 == SLang_pop_array_of_type (&columns_at, SLANG_INT_TYPE))
+       || (NULL == (ft = pop_fits_type (&mmt))))
+     goto free_and_return;
+
+   if (NULL == (f = ft->fptr))
+     goto free_and_return;
+
+   begin_call (&cc, ft, "_fits_read_rows");
+
+   if (fits_get_hdu_type (f, &hdutype, &status)
+       || fits_get_num_rowsll (f, &num_rows_in_table, &status))
+     {
+	ret = status;
+	goto end_call_and_return;
+     }
+
+   if ((num_rows < 0) || (firstrow <= 0)
+       || ((firstrow > num_rows_in_table) && (num_rows > 0)))
+     {
+	SLang_verror (SL_INVALID_PARM, "_fits_read_rows: row number out of range");
+	goto end_call_and_return;
+     }
+   if ((rows == NULL) && (firstrow + num_rows > num_rows_in_table + 1))
+     num_rows = num_rows_in_table - (firstrow - 1);
+   for (r = 0; (rows != NULL) && (r < num_rows); r++)
+     {
+	if ((rows[r] <= 0) || (rows[r] > num_rows_in_table))
+	  {
+	     SLang_verror (SL_INVALID_PARM, "_fits_read_rows: row number out of range");
+	     goto end_call_and_return;
+	  }
+     }
+   if (-1 == get_array_dim (num_rows, &num_rows_dim))
+     goto end_call_and_return;
+
+   cols = (int *) columns_at->data;
+   num_cols = (SLindex_Type) columns_at->num_elements;
+
+   if ((NULL == (ci = (Column_Info_Type *) SLcalloc (num_cols + 1, sizeof (Column_Info_Type))))
+       || (NULL == (decoded = (unsigned char *) SLcalloc (num_cols + 1, 1)))
+       || (NULL == (data_arrays_at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &num_cols, 1))))
+     goto end_call_and_return;
+   data_arrays = (SLang_Array_Type **) data_arrays_at->data;
+
+   for (i = 0; i < num_cols; i++)
+     {
+	SLang_Array_Type *at;
+	SLindex_Type dims[2];
+	int num_dims = 1;
+	tcolumn *colptr;
+	int col = cols[i];
+
+	if ((f->Fptr == NULL) || (f->Fptr->tableptr == NULL)
+	    || (col <= 0) || (col > f->Fptr->tfield))
+	  {
+	     SLang_verror (SL_INVALID_PARM, "Column number out of range");
+	     goto end_call_and_return;
+	  }
+	colptr = f->Fptr->tableptr + (col - 1);
+
+	if (0 != GET_COL_TYPE (f, col, &ci[i].type, &ci[i].repeat, &ci[i].width, &status))
+	  {
+	     ret = status;
+	     goto end_call_and_return;
+	  }
+	ci[i].repeat_orig = ci[i].repeat;
+	if (-1 == map_fitsio_type_to_slang (&ci[i].type, &ci[i].repeat, &ci[i].datatype))
+	  goto end_call_and_return;
+
+	dims[0] = num_rows_dim;
+	if (ci[i].datatype == SLANG_STRING_TYPE)
+	  at = SLang_create_array (SLANG_STRING_TYPE, 0, NULL, dims, 1);
+	else if (ci[i].type < 0)
+	  at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, dims, 1);
+	else
+	  {
+	     if (-1 == get_array_dim (num_rows * ci[i].repeat, &dims[1]))
+	       goto end_call_and_return;
+	     if (ci[i].repeat > 1)
+	       {
+		  dims[1] = ci[i].repeat;
+		  num_dims++;
+	       }
+	     at = SLang_create_array (ci[i].datatype, 0, NULL, dims, num_dims);
+	  }
+	if (NULL == (data_arrays[i] = at))
+	  goto end_call_and_return;
+
+	if (hdutype != BINARY_TBL)
+	  continue;
+	if (ci[i].datatype == SLANG_STRING_TYPE)
+	  decoded[i] = ((colptr->tdatatype == TSTRING) && (ci[i].repeat == ci[i].width));
+	else
+	  decoded[i] = ((ci[i].type > 0) && (0 != get_decoded_elem_size (colptr->tdatatype))
+			&& is_decoded_datatype (ci[i].datatype));
+	num_decoded += decoded[i];
+     }
+
+   if (num_decoded && (num_rows > 0))
+     {
+	rowlen = f->Fptr->rowlength;
+	block_rows = READ_ROWS_BLOCK_BYTES / (rowlen + 1);
+	if (block_rows < 1)
+	  block_rows = 1;
+	if (block_rows > num_rows)
+	  block_rows = num_rows;
+	if (NULL == (buf = (unsigned char *) SLmalloc ((size_t) (block_rows * rowlen + 1))))
+	  goto end_call_and_return;
+
+	r = 0;
+	while (0 != (n = next_row_run (rows, num_rows, &r, block_rows, &row)))
+	  {
+	     if (rows == NULL)
+	       row += firstrow - 1;
+	     if (fits_read_tblbytes (f, row, 1, n * rowlen, buf, &status))
+	       {
+		  ret = status;
+		  goto end_call_and_return;
+	       }
+	     for (i = 0; i < num_cols; i++)
+	       {
+		  if (decoded[i]
+		      && (-1 == decode_table_column (buf, rowlen, n, f->Fptr->tableptr + (cols[i] - 1),
+						     ci[i].repeat, data_arrays[i], r - n)))
+		    goto end_call_and_return;
+	       }
+	  }
+     }
+
+   for (i = 0; (i < num_cols) && (num_rows > 0); i++)
+     {
+	SLang_Array_Type *at = data_arrays[i];
+	long repeat = ci[i].repeat;
+	unsigned int num_substrs = 0;
+	int col = cols[i];
+
+	if (decoded[i])
+	  continue;
+
+	if (ci[i].datatype == SLANG_STRING_TYPE)
+	  {
+	     /* See read_cols for the ASCII_TBL case */
+	     if ((repeat == 1) && (ci[i].width != 1))
+	       {
+		  repeat = ci[i].width;
+		  num_substrs = 1;
+	       }
+	     else if (ci[i].width > 0)
+	       num_substrs = repeat / ci[i].width;
+	  }
+
+	r = 0;
+	while ((status == 0)
+	       && (0 != (n = next_row_run (rows, num_rows, &r, num_rows, &row))))
+	  {
+	     LONGLONG dest = r - n;
+	     unsigned char *data = (unsigned char *) at->data
+	       + (size_t) (dest * ci[i].repeat) * at->sizeof_type;
+
+	     if (rows == NULL)
+	       row += firstrow - 1;
+
+	     if (ci[i].datatype == SLANG_STRING_TYPE)
+	       status = read_string_column_data (f, (ci[i].type < 0), repeat, num_substrs, col,
+						 row, n, (char **) at->data + dest);
+	     else if (ci[i].type < 0)
+	       status = read_var_column_data (f, -ci[i].type, ci[i].datatype, col, row, n,
+					      (SLang_Array_Type **) at->data + dest);
+	     else if (ci[i].type == TBIT)
+	       status = read_bit_column (f, col, row, n, data,
+					 at->sizeof_type, ci[i].repeat_orig, 0);
+	     else
+	       (void) read_col_elements (f, ci[i].type, col, row, repeat, n * repeat,
+					 data, at->sizeof_type, &status);
+	  }
+	if (status)
+	  {
+	     ret = status;
+	     goto end_call_and_return;
+	  }
+     }
+
+   ret = SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR) &data_arrays_at);
+
+end_call_and_return:
+   ret = end_call (&cc, ret);
+free_and_return:
+   SLfree ((char *) buf);
+   SLfree ((char *) decoded);
+   SLfree ((char *) ci);
+   SLang_free_array (data_arrays_at);
+   SLang_free_array (columns_at);
+   SLang_free_array (rows_at);
+   SLang_free_ref (ref);
+   SLang_free_mmt (mmt);
+   return ret;
+}
+
+static void free_fits_table (FitsTable_Type *t)
+{
+   int i;
+
+   if (t == NULL)
+     return;
+
+   if (t->names != NULL)
+     {
+	for (i = 0; i < t->num_columns; i++)
+	  SLang_free_slstring (t->names[i]);
+	SLfree ((char *) t->names);
+     }
+   if (t->data != NULL)
+     {
+	for (i = 0; i < t->num_columns; i++)
+	  SLang_free_array (t->data[i]);
+	SLfree ((char *) t->data);
+     }
+   SLfree ((char *) t->colnums);
+   if (t->reader != NULL)
+     SLang_free_function (t->reader);
+   if (t->file_mmt != NULL)
+     SLang_free_mmt (t->file_mmt);
+   SLfree ((char *) t);
+}
+
+static FitsTable_Type *alloc_fits_table (SLang_MMT_Type *file_mmt, SLang_Name_Type *reader,
+					 int num_columns)
+{
+   FitsTable_Type *t;
+   unsigned int n = (num_columns > 0) ? num_columns : 1;
+
+   if (NULL == (t = (FitsTable_Type *) SLmalloc (sizeof (FitsTable_Type))))
+     return NULL;
+   memset ((char *) t, 0, sizeof (FitsTable_Type));
+
+   t->num_columns = num_columns;
+   if ((NULL == (t->names = (char **) SLcalloc (n, sizeof (char *))))
+       || (NULL == (t->colnums = (int *) SLcalloc (n, sizeof (int))))
+       || (NULL == (t->data = (SLang_Array_Type **) SLcalloc (n, sizeof (SLang_Array_Type *)))))
+     {
+	free_fits_table (t);
+	return NULL;
+     }
+
+   /* The references are released by free_fits_table */
+   SLang_inc_mmt (file_mmt);
+   t->file_mmt = file_mmt;
+   t->reader = SLang_copy_function (reader);
+   return t;
+}
 
-      case SLANG_CHAR_TYPE:
-      case SLANG_UCHAR_TYPE:
-	type = TLOGICAL;
-	if (-1 == SLang_pop_integer (&i))
-	  goto free_and_return;
-	if (i == 'F') i = 0;
-	i = (i != 0);
-	v = (VOID_STAR) &i;
-	break;
+static int push_fits_table (FitsTable_Type *t)
+{
+   SLang_MMT_Type *mmt;
 
-      case SLANG_SHORT_TYPE:
-      case SLANG_INT_TYPE:
-	type = TINT;
-	if (-1 == SLang_pop_integer (&i))
-	  goto free_and_return;
-	v = (VOID_STAR) &i;
-	break;
+   if (NULL == (mmt = SLang_create_mmt (Fits_Table_Type_Id, (VOID_STAR) t)))
+     {
+	free_fits_table (t);
+	return -1;
+     }
+   if (-1 == SLang_push_mmt (mmt))
+     {
+	SLang_free_mmt (mmt);
+	return -1;
+     }
+   return 0;
+}
 
-      case SLANG_USHORT_TYPE:
-      case SLANG_UINT_TYPE:
-	type = TUINT;
-	if (-1 == SLang_pop_uint (&ui))
-	  goto free_and_return;
-	v = (VOID_STAR) &ui;
-	break;
+static FitsTable_Type *pop_fits_table (SLang_MMT_Type **mmt)
+{
+   FitsTable_Type *t;
 
-      case SLANG_LONG_TYPE:
-	type = TLONG;
-	if (-1 == SLang_pop_long (&l))
-	  goto free_and_return;
-	v = (VOID_STAR) &l;
-	break;
+   if (NULL == (*mmt = SLang_pop_mmt (Fits_Table_Type_Id)))
+     return NULL;
 
-      case SLANG_ULONG_TYPE:
-	type = TULONG;
-	if (-1 == SLang_pop_long (&l))
-	  goto free_and_return;
-	v = (VOID_STAR) &ul;
-	break;
+   if (NULL == (t = (FitsTable_Type *) SLang_object_from_mmt (*mmt)))
+     {
+	SLang_free_mmt (*mmt);
+	*mmt = NULL;
+     }
+   return t;
+}
 
-      case SLANG_NULL_TYPE:
-	if (-1 == SLang_pop_null ())
-	  goto free_and_return;
-	v = NULL;
-	break;
+static int find_table_column (FitsTable_Type *t, SLFUTURE_CONST char *name)
+{
+   int i;
 
-      case -1:			       /* stack underflow */
-	goto free_and_return;
+   for (i = 0; i < t->num_columns; i++)
+     {
+	if (0 == strcmp (t->names[i], name))
+	  return i;
+     }
+   return -1;
+}
 
-      case SLANG_DOUBLE_TYPE:
-      default:
-	type = TDOUBLE;
-#if SLANG_VERSION < 20000
-	if (-1 == SLang_pop_double (&d, NULL, NULL))
-	  goto free_and_return;
-#else
-	if (-1 == SLang_pop_double (&d))
-	  goto free_and_return;
-#endif
-	v = (VOID_STAR) &d;
-	break;
+/* Read the data for the i'th column via the reader function.  The HDU
+ * of the file that was current before the read is restored afterwards.
+ */
+static int read_table_column (FitsTable_Type *t, int i)
+{
+   FitsFile_Type *ft;
+   SLang_Array_Type *at;
+   int hdunum, status = 0;
+   int ret;
+
+   ft = (FitsFile_Type *) SLang_object_from_mmt (t->file_mmt);
+   if ((ft == NULL) || (ft->fptr == NULL))
+     {
+	SLang_verror (SL_INVALID_PARM, "The file of the table has been closed");
+	return -1;
      }
 
-   if (-1 == SLang_pop_slstring (&key))
-     goto free_and_return;
+   (void) fits_get_hdu_num (ft->fptr, &hdunum);
+   if ((hdunum != t->hdunum)
+       && fits_movabs_hdu (ft->fptr, t->hdunum, NULL, &status))
+     {
+	SLang_verror (SL_READ_ERROR, "Unable to move to HDU %d", t->hdunum);
+	return -1;
+     }
 
-   if (NULL == (ft = pop_fits_type (&mmt)))
-     goto free_and_return;
+   ret = -1;
+   if ((-1 == SLang_start_arg_list ())
+       || (-1 == SLang_push_mmt (t->file_mmt))
+       || (-1 == SLang_push_integer (t->colnums[i]))
+       || (-1 == push_rows_value (t->firstrow))
+       || (-1 == push_rows_value (t->num_rows))
+       || (-1 == SLang_end_arg_list ())
+       || (-1 == SLexecute_function (t->reader))
+       || (-1 == SLang_pop_array (&at, 1)))
+     goto restore_hdu;
+
+   SLang_free_array (t->data[i]);
+   t->data[i] = at;
+   ret = 0;
+
+   restore_hdu:
+   if ((ft->fptr != NULL) && (hdunum != t->hdunum))
+     {
+	status = 0;
+	(void) fits_movabs_hdu (ft->fptr, hdunum, NULL, &status);
+     }
+   return ret;
+}
 
-   if (ft->fptr == NULL)
-     goto free_and_return;
+/* t.name: the column data, read on first access.  The pseudo-field
+ * "rows" (unless it is a column name) returns the table itself, so that
+ * t.rows[a:b] may be used to select a row range.
+ */
+static int table_sget (SLtype type, SLFUTURE_CONST char *name)
+{
+   SLang_MMT_Type *mmt;
+   FitsTable_Type *t;
+   int i, status;
 
-   status = 0;
-   if (v != NULL)
+   (void) type;
+
+   if (NULL == (t = pop_fits_table (&mmt)))
+     return -1;
+
+   status = -1;
+   if (-1 == (i = find_table_column (t, name)))
      {
-	if (type == TSTRING)
-	  fits_update_key_longstr (ft->fptr, key, (char *)v, comment, &status);
+	if (0 == strcmp (name, "rows"))
+	  status = SLang_push_mmt (mmt);
 	else
-	  fits_update_key (ft->fptr, type, key, v, comment, &status);
+	  SLang_verror (SL_INVALID_PARM, "Fits_Table_Type has no column named %s", name);
+	goto free_and_return;
      }
-   else
-     fits_update_key_null (ft->fptr, key, comment, &status);
 
-   free_and_return:
+   if ((t->data[i] == NULL)
+       && (-1 == read_table_column (t, i)))
+     goto free_and_return;
 
-   SLang_free_mmt (mmt);
-   SLang_free_slstring (key);
-   SLang_free_slstring (comment);
-   SLang_free_slstring (s);
+   status = SLang_push_array (t->data[i], 0);
 
+   free_and_return:
+   SLang_free_mmt (mmt);
    return status;
 }
 
-static int update_logical (void)
+/* t.name = value: replaces the (cached) data of an existing column */
+static int table_sput (SLtype type, SLFUTURE_CONST char *name)
 {
    SLang_MMT_Type *mmt;
-   FitsFile_Type *ft;
-   char *comment;
+   FitsTable_Type *t;
+   SLang_Array_Type *at;
    int i;
-   char *key;
-   int status;
 
-   if (-1 == pop_string_or_null (&comment))
+   (void) type;
+
+   if (NULL == (t = pop_fits_table (&mmt)))
      return -1;
 
-   key = NULL;
-   mmt = NULL;
-   status = -1;
+   if (-1 == (i = find_table_column (t, name)))
+     {
+	SLang_verror (SL_INVALID_PARM, "Fits_Table_Type has no column named %s", name);
+	SLang_free_mmt (mmt);
+	return -1;
+     }
 
-   if ((0 == SLang_pop_integer (&i))
-       && (0 == SLang_pop_slstring (&key))
-       && (NULL != (ft = pop_fits_type (&mmt)))
-       && (ft->fptr != NULL))
+   if (-1 == SLang_pop_array (&at, 1))
      {
-	status = 0;
-	fits_update_key (ft->fptr, TLOGICAL, key,
-			 (VOID_STAR) &i, comment, &status);
+	SLang_free_mmt (mmt);
+	return -1;
      }
 
+   SLang_free_array (t->data[i]);
+   t->data[i] = at;
    SLang_free_mmt (mmt);
-   SLang_free_slstring (key);
-   SLang_free_slstring (comment);
-
-   return status;
+   return 0;
 }
 
-static int write_comment (FitsFile_Type *ft, char *comment)
+/* t[rows]: a new table for a contiguous range of rows of t.  The columns
+ * of the new table are read when they are accessed, and only the
+ * selected rows will be read.
+ */
+static int table_aget (SLtype type, unsigned int num_indices)
 {
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   return fits_write_comment (ft->fptr, comment, &status);
-}
+   SLang_MMT_Type *mmt;
+   FitsTable_Type *t, *t1;
+   SLang_Array_Type *at = NULL;
+   LONGLONG *rows, row0;
+   int i, num;
+   int status = -1;
 
-static int write_history (FitsFile_Type *ft, char *comment)
-{
-   int status = 0;
-   if (ft->fptr == NULL)
+   (void) type;
+
+   if (NULL == (t = pop_fits_table (&mmt)))
      return -1;
-   return fits_write_history (ft->fptr, comment, &status);
+
+   if (num_indices != 1)
+     {
+	SLang_verror (SL_INVALID_PARM, "A Fits_Table_Type object requires a single row index");
+	goto free_and_return;
+     }
+
+   if (-1 == SLang_pop_array_of_type (&at, SLANG_LLONG_TYPE))
+     goto free_and_return;
+
+   rows = (LONGLONG *) at->data;
+   num = (int) at->num_elements;
+   row0 = 0;
+   for (i = 0; i < num; i++)
+     {
+	LONGLONG row = rows[i];
+	if (row < 0)
+	  row += t->num_rows;
+	if ((row < 0) || (row >= t->num_rows))
+	  {
+	     SLang_verror (SL_INDEX_ERROR, "Row index %.0f is out of range", (double) rows[i]);
+	     goto free_and_return;
+	  }
+	if (i == 0)
+	  row0 = row;
+	else if (row != row0 + i)
+	  {
+	     SLang_verror (SL_NOT_IMPLEMENTED, "Only a contiguous range of increasing rows may be selected");
+	     goto free_and_return;
+	  }
+     }
+
+   if (NULL == (t1 = alloc_fits_table (t->file_mmt, t->reader, t->num_columns)))
+     goto free_and_return;
+
+   t1->hdunum = t->hdunum;
+   t1->firstrow = t->firstrow + row0;
+   t1->num_rows = num;
+   for (i = 0; i < t->num_columns; i++)
+     {
+	t1->names[i] = SLang_create_slstring (t->names[i]);
+	t1->colnums[i] = t->colnums[i];
+	if (t1->names[i] == NULL)
+	  {
+	     free_fits_table (t1);
+	     goto free_and_return;
+	  }
+     }
+   status = push_fits_table (t1);
+
+   free_and_return:
+   SLang_free_array (at);
+   SLang_free_mmt (mmt);
+   return status;
 }
 
-static int write_date (FitsFile_Type *ft)
+static void destroy_fits_table_type (SLtype type, VOID_STAR t)
 {
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   return fits_write_date (ft->fptr, &status);
+   (void) type;
+   free_fits_table ((FitsTable_Type *) t);
 }
 
-static int write_record (FitsFile_Type *ft, char *card)
+/* Usage: t = _fits_open_table (fptr, names, colnums, nrows, &reader) */
+static void open_table (void)
 {
-   int status = 0;
+   SLang_MMT_Type *mmt = NULL;
+   FitsFile_Type *ft;
+   SLang_Name_Type *reader = NULL;
+   SLang_Array_Type *names_at = NULL, *cols_at = NULL;
+   FitsTable_Type *t;
+   LONGLONG num_rows;
+   int num_columns, i;
+
+   if ((NULL == (reader = SLang_pop_function ()))
+       || (-1 == pop_rows_value (&num_rows))
+       || (-1 == SLang_pop_array_of_type (&cols_at, SLANG_INT_TYPE))
+       || (-1 == SLang_pop_array_of_type (&names_at, SLANG_STRING_TYPE))
+       || (NULL == (ft = pop_fits_type (&mmt))))
+     goto free_and_return;
 
+   num_columns = (int) cols_at->num_elements;
+   if ((num_rows < 0) || ((int) names_at->num_elements != num_columns))
+     {
+	SLang_verror (SL_INVALID_PARM, "_fits_open_table: invalid number of rows or columns");
+	goto free_and_return;
+     }
    if (ft->fptr == NULL)
-     return -1;
+     {
+	SLang_verror (SL_INVALID_PARM, "_fits_open_table: the file is not open");
+	goto free_and_return;
+     }
 
-   /* How robust is fits_write_record to cards that are not 80 characters long? */
-   return fits_write_record (ft->fptr, card, &status);
-}
+   if (NULL == (t = alloc_fits_table (mmt, reader, num_columns)))
+     goto free_and_return;
 
-static int insert_record (FitsFile_Type *ft, int *keynum, char *card)
-{
-   int status = 0;
+   (void) fits_get_hdu_num (ft->fptr, &t->hdunum);
+   t->firstrow = 1;
+   t->num_rows = num_rows;
+   for (i = 0; i < num_columns; i++)
+     {
+	t->colnums[i] = ((int *) cols_at->data)[i];
+	if (NULL == (t->names[i] = SLang_create_slstring (((char **) names_at->data)[i])))
+	  {
+	     free_fits_table (t);
+	     goto free_and_return;
+	  }
+     }
+   (void) push_fits_table (t);
 
-   if (ft->fptr == NULL)
-     return -1;
+   free_and_return:
+   SLang_free_array (names_at);
+   SLang_free_array (cols_at);
+   if (reader != NULL)
+     SLang_free_function (reader);
+   SLang_free_mmt (mmt);
+}
+
+#ifdef HAVE_FITS_THREADS
+/* The prefetcher reads blocks of rows of fixed width columns in a
+ * background thread, which uses its own handle of the file.  A ring of
+ * num_blocks blocks is used.  The main thread allocates the arrays of a
+ * block and queues it; the thread fills the arrays and marks the block as
+ * ready.  Only the main thread calls into S-Lang.
+ */
+#define PREFETCH_FREE	0
+#define PREFETCH_QUEUED	1
+#define PREFETCH_READY	2
 
-   return fits_insert_record (ft->fptr, *keynum, card, &status);
+typedef struct
+{
+   int state;
+   LONGLONG firstrow;
+   int num_rows;
+   int status;			       /* cfitsio status of the read */
+   SLang_Array_Type **arrays;	       /* owned by the main thread */
+   VOID_STAR *data;		       /* data pointers used by the thread */
 }
+Prefetch_Block_Type;
 
-static int modify_name (FitsFile_Type *ft, char *oldname, char *newname)
+typedef struct
 {
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   return fits_modify_name (ft->fptr, oldname, newname, &status);
+   SLang_MMT_Type *file_mmt;	       /* handle used for the statistics */
+   fitsfile *fptr;		       /* private handle of the thread */
+   pthread_t thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   int thread_started;
+   int quit;
+   int num_cols;
+   int *cols;
+   int *types;
+   SLtype *datatypes;
+   long *repeats;
+   LONGLONG next_row, last_row;	       /* rows still to be queued */
+   int block_rows;
+   int num_blocks;
+   int head;			       /* next block to be returned */
+   Prefetch_Block_Type *blocks;
 }
+Prefetch_Type;
 
-static int do_get_keytype (fitsfile *f, char *name, int *stype)
+static SLtype Prefetch_Type_Id = 0;
+
+static void *prefetch_thread (void *arg)
 {
-   int status = 0;
-   char type;
-   int s;
-   char card [FLEN_CARD + 1];
-   char value [FLEN_CARD + 1];
+   Prefetch_Type *pf = (Prefetch_Type *) arg;
+   unsigned int k = 0;
 
-   if (f == NULL)
-     return -1;
+   pthread_mutex_lock (&pf->mutex);
+   while (1)
+     {
+	Prefetch_Block_Type *b = pf->blocks + k;
+	int i, status = 0;
 
-   if (0 != fits_read_card (f, name, card, &status))
-     return status;
+	while ((pf->quit == 0) && (b->state != PREFETCH_QUEUED))
+	  pthread_cond_wait (&pf->cond, &pf->mutex);
+	if (pf->quit)
+	  break;
+	pthread_mutex_unlock (&pf->mutex);
 
-   if (0 != fits_parse_value (card, value, NULL, &status))
-     return status;
+	for (i = 0; (i < pf->num_cols) && (status == 0); i++)
+	  {
+	     LONGLONG num_elements = (LONGLONG) pf->repeats[i] * b->num_rows;
+	     if (num_elements > 0)
+	       (void) fits_read_col (pf->fptr, pf->types[i], pf->cols[i], b->firstrow, 1,
+				     num_elements, NULL, b->data[i], NULL, &status);
+	  }
+
+	pthread_mutex_lock (&pf->mutex);
+	b->status = status;
+	b->state = PREFETCH_READY;
+	pthread_cond_broadcast (&pf->cond);
+	k = (k + 1) % pf->num_blocks;
+     }
+   pthread_mutex_unlock (&pf->mutex);
+   return NULL;
+}
+
+static void free_prefetch (Prefetch_Type *pf)
+{
+   int i, j, status = 0;
+
+   if (pf == NULL)
+     return;
 
-   if (0 != fits_get_keytype (value, &type, &status))
-     return status;
+   if (pf->thread_started)
+     {
+	pthread_mutex_lock (&pf->mutex);
+	pf->quit = 1;
+	pthread_cond_broadcast (&pf->cond);
+	pthread_mutex_unlock (&pf->mutex);
+	pthread_join (pf->thread, NULL);
+     }
+   pthread_mutex_destroy (&pf->mutex);
+   pthread_cond_destroy (&pf->cond);
 
-   switch (type)
+   if (pf->blocks != NULL)
      {
-      case 'C':
-	s = SLANG_STRING_TYPE;
-	break;
+	for (i = 0; i < pf->num_blocks; i++)
+	  {
+	     Prefetch_Block_Type *b = pf->blocks + i;
+	     if (b->arrays != NULL)
+	       {
+		  for (j = 0; j < pf->num_cols; j++)
+		    SLang_free_array (b->arrays[j]);
+		  SLfree ((char *) b->arrays);
+	       }
+	     SLfree ((char *) b->data);
+	  }
+	SLfree ((char *) pf->blocks);
+     }
+   if (pf->fptr != NULL)
+     (void) fits_close_file (pf->fptr, &status);
+   SLfree ((char *) pf->cols);
+   SLfree ((char *) pf->types);
+   SLfree ((char *) pf->datatypes);
+   SLfree ((char *) pf->repeats);
+   if (pf->file_mmt != NULL)
+     SLang_free_mmt (pf->file_mmt);
+   SLfree ((char *) pf);
+}
 
-      case 'L':
-	s = SLANG_INT_TYPE;
-	break;
+/* Allocate the arrays for the next range of rows and queue the block.
+ * The block must not be in use by the thread.
+ */
+static int queue_prefetch_block (Prefetch_Type *pf, Prefetch_Block_Type *b)
+{
+   LONGLONG num_left;
+   int i, num_rows;
 
-      case 'F':
-	s = SLANG_DOUBLE_TYPE;
-	break;
+   num_left = pf->last_row - pf->next_row + 1;
+   num_rows = (num_left > pf->block_rows) ? pf->block_rows : (int) num_left;
 
-      case 'X':
-	s = SLANG_COMPLEX_TYPE;
-	break;
+   if (num_rows <= 0)
+     {
+	b->state = PREFETCH_FREE;
+	return 0;
+     }
 
-      case 'I':
-      default:
-	s = SLANG_INT_TYPE;
-	break;
+   for (i = 0; i < pf->num_cols; i++)
+     {
+	SLindex_Type dims[2];
+	int num_dims = 1;
+
+	dims[0] = num_rows;
+	if (pf->repeats[i] > 1)
+	  {
+	     dims[1] = pf->repeats[i];
+	     num_dims++;
+	  }
+	SLang_free_array (b->arrays[i]);
+	if (NULL == (b->arrays[i] = SLang_create_array (pf->datatypes[i], 0, NULL, dims, num_dims)))
+	  return -1;
+	b->data[i] = b->arrays[i]->data;
      }
-   *stype = s;
 
+   b->firstrow = pf->next_row;
+   b->num_rows = num_rows;
+   b->status = 0;
+   pf->next_row += num_rows;
+
+   pthread_mutex_lock (&pf->mutex);
+   b->state = PREFETCH_QUEUED;
+   pthread_cond_broadcast (&pf->cond);
+   pthread_mutex_unlock (&pf->mutex);
    return 0;
 }
 
-static int read_key (int type)
+/* Open a second handle of the file of ft, positioned at the current HDU.
+ * Returns NULL without an error if the file cannot be reopened.
+ */
+static fitsfile *reopen_fits_file (fitsfile *f)
 {
-   SLang_MMT_Type *mmt;
-   FitsFile_Type *ft;
-   int status;
-   char *name;
-   char comment_buf [FLEN_COMMENT];
-   SLang_Ref_Type *comment_ref, *v_ref;
-   int ival;
-   long lval;
-   double dval;
-   char *sval = NULL;
-   int ftype;
-   VOID_STAR v;
+   char filename[FLEN_FILENAME];
+   char urltype[FLEN_FILENAME];
+   fitsfile *g = NULL;
+   int mode, hdunum;
+   int status = 0;
 
-   v_ref = comment_ref = NULL;
-   name = NULL;
-   mmt = NULL;
-   status = -1;
+   if (fits_file_mode (f, &mode, &status)
+       || (mode != READONLY)
+       || fits_url_type (f, urltype, &status)
+       || ((0 != strcmp (urltype, "file://"))
+	   && (0 != strcmp (urltype, "compress://"))
+	   && (0 != strcmp (urltype, "gzidx://")))
+       || fits_file_name (f, filename, &status)
+       || (NULL != strchr (filename, '[')))
+     return NULL;
 
-   if (SLANG_NULL_TYPE == SLang_peek_at_stack ())
+   (void) fits_get_hdu_num (f, &hdunum);
+   if (fits_open_file (&g, filename, READONLY, &status)
+       || fits_movabs_hdu (g, hdunum, NULL, &status))
      {
-	if (-1 == SLang_pop_null ())
-	  return -1;
+	if (g != NULL)
+	  {
+	     int status1 = 0;
+	     (void) fits_close_file (g, &status1);
+	  }
+	fits_clear_errmsg ();
+	return NULL;
      }
-   else if (-1 == SLang_pop_ref (&comment_ref))
-     return -1;
+   return g;
+}
 
-   if (-1 == SLang_pop_ref (&v_ref))
+/* Usage: pf = _fits_prefetch_open (ft, [columns...], block_rows, num_blocks)
+ * NULL is returned if the columns cannot be prefetched, in which case the
+ * caller should read them in the usual way.
+ */
+static void prefetch_open (void)
+{
+   SLang_MMT_Type *mmt = NULL, *pf_mmt;
+   FitsFile_Type *ft;
+   SLang_Array_Type *columns_at = NULL;
+   Prefetch_Type *pf = NULL;
+   int block_rows, num_blocks, num_cols;
+   LONGLONG num_rows;
+   int i, status = 0;
+
+   if ((-1 == SLang_pop_integer (&num_blocks))
+       || (-1 == SLang_pop_integer (&block_rows))
+       || (-1 == SLang_pop_array_of_type (&columns_at, SLANG_INT_TYPE))
+       || (NULL == (ft = pop_fits_type (&mmt))))
      goto free_and_return;
 
-   if (-1 == SLang_pop_slstring (&name))
-     goto free_and_return;
+   if ((block_rows <= 0) || (num_blocks <= 0))
+     {
+	SLang_verror (SL_INVALID_PARM, "_fits_prefetch_open: invalid block size or number of blocks");
+	goto free_and_return;
+     }
 
-   if (NULL == (ft = pop_fits_type (&mmt)))
-     goto free_and_return;
+   num_cols = (int) columns_at->num_elements;
+   if ((ft->fptr == NULL) || (num_cols == 0)
+       || (0 == fits_is_reentrant ())
+       || (ft->fptr->Fptr == NULL) || (ft->fptr->Fptr->tableptr == NULL)
+       || fits_get_num_rowsll (ft->fptr, &num_rows, &status))
+     goto push_null;
 
-   if (ft->fptr == NULL)
+   if (NULL == (pf = (Prefetch_Type *) SLmalloc (sizeof (Prefetch_Type))))
+     goto free_and_return;
+   memset ((char *) pf, 0, sizeof (Prefetch_Type));
+   pthread_mutex_init (&pf->mutex, NULL);
+   pthread_cond_init (&pf->cond, NULL);
+   SLang_inc_mmt (mmt);
+   pf->file_mmt = mmt;
+   pf->num_cols = num_cols;
+   pf->num_blocks = num_blocks;
+   pf->block_rows = block_rows;
+   pf->next_row = 1;
+   pf->last_row = num_rows;
+
+   if ((NULL == (pf->cols = (int *) SLcalloc (num_cols, sizeof (int))))
+       || (NULL == (pf->types = (int *) SLcalloc (num_cols, sizeof (int))))
+       || (NULL == (pf->datatypes = (SLtype *) SLcalloc (num_cols, sizeof (SLtype))))
+       || (NULL == (pf->repeats = (long *) SLcalloc (num_cols, sizeof (long))))
+       || (NULL == (pf->blocks = (Prefetch_Block_Type *) SLcalloc (num_blocks, sizeof (Prefetch_Block_Type)))))
      goto free_and_return;
 
-   if (type == SLANG_VOID_TYPE)
+   if (NULL == (pf->fptr = reopen_fits_file (ft->fptr)))
+     goto push_null;
+
+   for (i = 0; i < num_cols; i++)
      {
-	if (0 != (status = do_get_keytype (ft->fptr, name, &type)))
+	tcolumn *colptr;
+	long repeat, width;
+	int type, col = ((int *) columns_at->data)[i];
+
+	if ((col <= 0) || (col > ft->fptr->Fptr->tfield))
+	  goto push_null;
+
+	/* Use the scaling that is in effect for the caller's handle */
+	colptr = ft->fptr->Fptr->tableptr + (col - 1);
+	if (fits_set_tscale (pf->fptr, col, colptr->tscale, colptr->tzero, &status)
+	    || GET_COL_TYPE (pf->fptr, col, &type, &repeat, &width, &status))
+	  {
+	     fits_clear_errmsg ();
+	     goto push_null;
+	  }
+	if ((type <= 0) || (type == TBIT) || (type == TSTRING))
+	  goto push_null;
+	if (-1 == map_fitsio_type_to_slang (&type, &repeat, &pf->datatypes[i]))
 	  goto free_and_return;
-	/* if (type == SLANG_INT_TYPE) type = SLANG_LONG_TYPE; */
+	if (pf->datatypes[i] == SLANG_STRING_TYPE)
+	  goto push_null;
+	pf->cols[i] = col;
+	pf->types[i] = type;
+	pf->repeats[i] = repeat;
+     }
 
-	status = -1;
+   for (i = 0; i < num_blocks; i++)
+     {
+	Prefetch_Block_Type *b = pf->blocks + i;
+	if ((NULL == (b->arrays = (SLang_Array_Type **) SLcalloc (num_cols, sizeof (SLang_Array_Type *))))
+	    || (NULL == (b->data = (VOID_STAR *) SLcalloc (num_cols, sizeof (VOID_STAR)))))
+	  goto free_and_return;
      }
 
-   switch (type)
+   if (0 != pthread_create (&pf->thread, NULL, prefetch_thread, (void *) pf))
+     goto push_null;
+   pf->thread_started = 1;
+
+   for (i = 0; i < num_blocks; i++)
      {
-      case SLANG_INT_TYPE:
-	v = (VOID_STAR) &ival;
-	ftype = TINT;
-	ival = 0;
-	break;
+	if (-1 == queue_prefetch_block (pf, pf->blocks + i))
+	  goto free_and_return;
+     }
 
-      case SLANG_LONG_TYPE:
-	v = (VOID_STAR) &lval;
-	ftype = TLONG;
-	ival = 0;
-	break;
+   if (NULL == (pf_mmt = SLang_create_mmt (Prefetch_Type_Id, (VOID_STAR) pf)))
+     goto free_and_return;
+   pf = NULL;
+   if (-1 == SLang_push_mmt (pf_mmt))
+     SLang_free_mmt (pf_mmt);
+   goto free_and_return;
 
-      case SLANG_DOUBLE_TYPE:
-	ftype = TDOUBLE;
-	v = (VOID_STAR) &dval;
-	dval = 0.0;
-	break;
+   push_null:
+   (void) SLang_push_null ();
+   /* drop */
 
-      case SLANG_STRING_TYPE:
-	ftype = TSTRING;
-	v = (VOID_STAR) &sval;
-	break;
+   free_and_return:
+   free_prefetch (pf);
+   SLang_free_array (columns_at);
+   SLang_free_mmt (mmt);
+}
 
-      default:
-	SLang_verror (SL_INVALID_PARM,
-		      "fits_read_key: type %s not supported",
-		      SLclass_get_datatype_name (type));
+/* Usage: status = _fits_prefetch_next (pf, &arrays, &firstrow, &nrows)
+ * Waits for the next block of rows.  NULL is assigned to arrays after the
+ * last block.
+ */
+static int prefetch_next (void)
+{
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt = NULL;
+   SLang_Ref_Type *ref = NULL, *firstrow_ref = NULL, *nrows_ref = NULL;
+   SLang_Array_Type *at = NULL;
+   Prefetch_Type *pf;
+   Prefetch_Block_Type *b;
+   int i, status = -1;
+
+   begin_call (&cc, NULL, "_fits_prefetch_next");
+
+   if ((-1 == SLang_pop_ref (&nrows_ref))
+       || (-1 == SLang_pop_ref (&firstrow_ref))
+       || (-1 == SLang_pop_ref (&ref))
+       || (NULL == (mmt = SLang_pop_mmt (Prefetch_Type_Id)))
+       || (NULL == (pf = (Prefetch_Type *) SLang_object_from_mmt (mmt))))
+     goto free_and_return;
+
+   set_call_handle (&cc, (FitsFile_Type *) SLang_object_from_mmt (pf->file_mmt));
+
+   b = pf->blocks + pf->head;
+   pthread_mutex_lock (&pf->mutex);
+   while (b->state == PREFETCH_QUEUED)
+     pthread_cond_wait (&pf->cond, &pf->mutex);
+   pthread_mutex_unlock (&pf->mutex);
+
+   if (b->state == PREFETCH_FREE)
+     {
+	/* No more rows */
+	status = SLang_assign_to_ref (ref, SLANG_NULL_TYPE, NULL);
 	goto free_and_return;
      }
 
-   status = 0;
-   if (ftype == TSTRING)
-     fits_read_key_longstr (ft->fptr, name, &sval, comment_buf, &status);
-   else
-     fits_read_key (ft->fptr, ftype, name, v, comment_buf, &status);
+   if (0 != (status = b->status))
+     goto free_and_return;
 
-   if (status == 0)
+   if (NULL == (at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &pf->num_cols, 1)))
      {
-	if (comment_ref != NULL)
-	  {
-	     char *cptr = comment_buf;
-	     if (-1 == SLang_assign_to_ref (comment_ref,
-					    SLANG_STRING_TYPE, (VOID_STAR) &cptr))
-	       {
-		  status = -1;
-		  goto free_and_return;
-	       }
-	  }
-	if (-1 == SLang_assign_to_ref (v_ref, type, v))
-	  {
-	     status = -1;
-	     goto free_and_return;
-	  }
+	status = -1;
+	goto free_and_return;
+     }
+   for (i = 0; i < pf->num_cols; i++)
+     {
+	count_read (b->arrays[i]->num_elements, b->arrays[i]->sizeof_type);
+	((SLang_Array_Type **) at->data)[i] = b->arrays[i];
+	b->arrays[i] = NULL;
+     }
+
+   if ((-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR) &at))
+       || (-1 == assign_rows_value (firstrow_ref, b->firstrow))
+       || (-1 == SLang_assign_to_ref (nrows_ref, SLANG_INT_TYPE, (VOID_STAR) &b->num_rows)))
+     {
+	status = -1;
+	goto free_and_return;
      }
 
+   pf->head = (pf->head + 1) % pf->num_blocks;
+   if (-1 == queue_prefetch_block (pf, b))
+     status = -1;
+
    free_and_return:
-   SLfree (sval);
-   SLang_free_ref (comment_ref);
-   SLang_free_ref (v_ref);
-   SLang_free_slstring (name);
+   SLang_free_array (at);
+   SLang_free_ref (ref);
+   SLang_free_ref (firstrow_ref);
+   SLang_free_ref (nrows_ref);
+   (void) end_call (&cc, status);
    SLang_free_mmt (mmt);
    return status;
 }
 
-static int read_key_integer (void)
+static void destroy_prefetch_type (SLtype type, VOID_STAR pf)
 {
-   return read_key (SLANG_INT_TYPE);
+   (void) type;
+   free_prefetch ((Prefetch_Type *) pf);
 }
+#endif				       /* HAVE_FITS_THREADS */
 
-static int read_key_double (void)
+/* Reading the images of several HDUs at once.  The arrays are created by
+ * the main thread.  Worker threads, each with its own handle to the file,
+ * then take the next image from a shared counter and read (and for
+ * compressed images, decompress) it into its array.
+ */
+#define IMAGES_MAX_THREADS	64
+
+typedef struct
 {
-   return read_key (SLANG_DOUBLE_TYPE);
+   int hdunum;
+   int type;
+   LONGLONG num_elements;
+   VOID_STAR data;
+   int status;
 }
+Image_Job_Type;
 
-static int read_key_string (void)
+static void read_image_job (fitsfile *f, Image_Job_Type *job)
 {
-   return read_key (SLANG_STRING_TYPE);
+   int anynul = 0, status = 0;
+
+   if ((0 == fits_movabs_hdu (f, job->hdunum, NULL, &status))
+       && (job->num_elements > 0))
+     (void) fits_read_img (f, job->type, 1, job->num_elements, NULL,
+			   job->data, &anynul, &status);
+   job->status = status;
 }
 
-static int read_generic_key (void)
+#ifdef HAVE_FITS_THREADS
+typedef struct
 {
-   return read_key (SLANG_VOID_TYPE);
+   fitsfile *fptr;
+   Image_Job_Type *jobs;
+   int num_jobs;
+   int *next_job;
+   pthread_mutex_t *mutex;
 }
+Image_Worker_Type;
 
-static int read_record (FitsFile_Type *ft, int *keynum, SLang_Ref_Type *ref)
+static void *image_worker_thread (void *arg)
 {
-   int status = 0;
-   char card[FLEN_CARD+1];
-
-   if (ft->fptr == NULL)
-     return -1;
+   Image_Worker_Type *w = (Image_Worker_Type *) arg;
 
-   if (0 == fits_read_record (ft->fptr, *keynum, card, &status))
+   while (1)
      {
-	char *c = card;
-	if (-1 == SLang_assign_to_ref (ref, SLANG_STRING_TYPE, &c))
-	  return -1;
+	int j;
+
+	pthread_mutex_lock (w->mutex);
+	j = (*w->next_job)++;
+	pthread_mutex_unlock (w->mutex);
+	if (j >= w->num_jobs)
+	  break;
+	read_image_job (w->fptr, w->jobs + j);
      }
-
-   return status;
+   return NULL;
 }
 
-static int delete_key (FitsFile_Type *ft, char *key)
+/* Returns the number of images read in parallel, or 0 if the file cannot
+ * be reopened, in which case the caller reads them.
+ */
+static int read_images_in_threads (fitsfile *f, Image_Job_Type *jobs, int num_jobs,
+				   int num_threads)
 {
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   return fits_delete_key (ft->fptr, key, &status);
+   Image_Worker_Type workers[IMAGES_MAX_THREADS];
+   pthread_t threads[IMAGES_MAX_THREADS];
+   int started[IMAGES_MAX_THREADS];
+   pthread_mutex_t mutex;
+   int next_job = 0;
+   int t, n, status;
+
+   if (num_threads > IMAGES_MAX_THREADS)
+     num_threads = IMAGES_MAX_THREADS;
+   if (num_threads > num_jobs)
+     num_threads = num_jobs;
+   if ((num_threads < 2) || (0 == fits_is_reentrant ()))
+     return 0;
+
+   n = 0;
+   for (t = 0; t < num_threads; t++)
+     {
+	if (NULL == (workers[n].fptr = reopen_fits_file (f)))
+	  break;
+	n++;
+     }
+   if (n < 2)
+     {
+	status = 0;
+	if (n == 1)
+	  (void) fits_close_file (workers[0].fptr, &status);
+	return 0;
+     }
+
+   pthread_mutex_init (&mutex, NULL);
+   for (t = 0; t < n; t++)
+     {
+	workers[t].jobs = jobs;
+	workers[t].num_jobs = num_jobs;
+	workers[t].next_job = &next_job;
+	workers[t].mutex = &mutex;
+	started[t] = (0 == pthread_create (&threads[t], NULL, image_worker_thread, workers + t));
+     }
+   for (t = 0; t < n; t++)
+     {
+	if (started[t])
+	  pthread_join (threads[t], NULL);
+	else
+	  (void) image_worker_thread (workers + t);
+	status = 0;
+	(void) fits_close_file (workers[t].fptr, &status);
+     }
+   pthread_mutex_destroy (&mutex);
+   return num_jobs;
 }
+#endif
 
-static int get_colnum_internal (FitsFile_Type *ft, char *name, SLang_Ref_Type *ref, int casesen)
+/* Usage: status = _fits_read_images (ft, hdunums, nthreads, &images)
+ * The images of the specified HDUs are assigned to images as an array of
+ * arrays.  If nthreads is 0, the number of CPUs is used.
+ */
+static int read_images (void)
 {
-   int status = 0;
-   int col;
+   Call_Context_Type cc;
+   SLang_MMT_Type *mmt = NULL;
+   FitsFile_Type *ft;
+   SLang_Ref_Type *ref = NULL;
+   SLang_Array_Type *hdus_at = NULL, *images_at = NULL;
+   SLang_Array_Type **images;
+   Image_Job_Type *jobs = NULL;
+   int num_threads, num_jobs, hdunum0, i;
+   int status = 0, ret = -1;
+
+   if ((-1 == SLang_pop_ref (&ref))
+       || (-1 == SLang_pop_integer (&num_threads))
+       || (-1 == SLang_pop_array_of_type (&hdus_at, SLANG_INT_TYPE))
+       || (NULL == (ft = pop_fits_type (&mmt))))
+     goto free_and_return;
 
    if (ft->fptr == NULL)
-     return -1;
-   /* FIXME: fits_get_colnum may be used to get columns matching a pattern */
-   col = 1;
-   fits_get_colnum (ft->fptr, casesen, name, &col, &status);
+     goto free_and_return;
+
+   begin_call (&cc, ft, "_fits_read_images");
+
+   num_jobs = (int) hdus_at->num_elements;
+   if ((NULL == (images_at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &num_jobs, 1)))
+       || ((num_jobs > 0)
+	   && (NULL == (jobs = (Image_Job_Type *) SLcalloc (num_jobs, sizeof (Image_Job_Type))))))
+     goto end_call_and_return;
+   images = (SLang_Array_Type **) images_at->data;
+
+   (void) fits_get_hdu_num (ft->fptr, &hdunum0);
+   for (i = 0; i < num_jobs; i++)
+     {
+	Image_Job_Type *job = jobs + i;
+	long ldims[SLARRAY_MAX_DIMS];
+	SLindex_Type dims[SLARRAY_MAX_DIMS];
+	SLtype stype;
+	int img_type, num_dims, k;
+
+	job->hdunum = ((int *) hdus_at->data)[i];
+	if (fits_movabs_hdu (ft->fptr, job->hdunum, NULL, &status)
+#ifdef fits_get_img_equivtype
+	    || fits_get_img_equivtype (ft->fptr, &img_type, &status)
+#else
+	    || fits_get_img_type (ft->fptr, &img_type, &status)
+#endif
+	    || fits_get_img_dim (ft->fptr, &num_dims, &status))
+	  {
+	     ret = status;
+	     goto restore_hdu;
+	  }
+	if ((num_dims > SLARRAY_MAX_DIMS) || (num_dims < 0))
+	  {
+	     SLang_verror (SL_NOT_IMPLEMENTED, "Image dimensionality of HDU %d is not supported",
+			   job->hdunum);
+	     goto restore_hdu;
+	  }
+	if (fits_get_img_size (ft->fptr, num_dims, ldims, &status))
+	  {
+	     ret = status;
+	     goto restore_hdu;
+	  }
+	for (k = 0; k < num_dims; k++)
+	  dims[num_dims-1-k] = (SLindex_Type) ldims[k];
+
+	map_img_type (img_type, &stype, &job->type);
+	if (NULL == (images[i] = SLang_create_array (stype, 0, NULL, dims, num_dims)))
+	  goto restore_hdu;
+	job->data = images[i]->data;
+	job->num_elements = (LONGLONG) images[i]->num_elements;
+     }
+
+   if (num_threads <= 0)
+     {
+	num_threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	num_threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+     }
+
+#ifdef HAVE_FITS_THREADS
+   if (0 == read_images_in_threads (ft->fptr, jobs, num_jobs, num_threads))
+#endif
+     {
+	for (i = 0; i < num_jobs; i++)
+	  read_image_job (ft->fptr, jobs + i);
+     }
+
+   ret = 0;
+   for (i = 0; i < num_jobs; i++)
+     {
+	if ((ret == 0) && jobs[i].status)
+	  ret = jobs[i].status;
+	count_read ((double) images[i]->num_elements, images[i]->sizeof_type);
+     }
 
-   if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &col))
-     status = -1;
+   if ((ret == 0)
+       && (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR) &images_at)))
+     ret = -1;
 
-   return status;
+restore_hdu:
+   status = 0;
+   if (fits_movabs_hdu (ft->fptr, hdunum0, NULL, &status) && (ret == 0))
+     ret = status;
+end_call_and_return:
+   ret = end_call (&cc, ret);
+free_and_return:
+   SLfree ((char *) jobs);
+   SLang_free_array (images_at);
+   SLang_free_array (hdus_at);
+   SLang_free_ref (ref);
+   SLang_free_mmt (mmt);
+   return ret;
 }
 
-static int get_colnum (FitsFile_Type *ft, char *name, SLang_Ref_Type *ref)
+/* Scanning the headers of many files.  The header blocks of a plain FITS
+ * file are read with pread and parsed by the module, skipping the data
+ * units before the requested HDU by their size, so that nothing else is
+ * read.  Other files, e.g., compressed ones or names with a cfitsio
+ * filter, are read with cfitsio.  A pool of threads takes the files from
+ * a shared counter, so that the I/O of different files overlaps; the
+ * results are converted to S-Lang arrays by the main thread.  As the
+ * S-Lang allocation functions are not thread-safe, the workers use
+ * malloc and free.
+ */
+#define SCAN_MAX_THREADS	64
+#define SCAN_CHUNK_BLOCKS	8      /* header blocks per read */
+
+#define SCAN_MISSING	0
+#define SCAN_STRING	1
+#define SCAN_LOGICAL	2
+#define SCAN_INTEGER	3
+#define SCAN_FLOAT	4
+#define SCAN_OTHER	5	       /* e.g., complex: returned as text */
+
+typedef struct
 {
-   return get_colnum_internal (ft, name, ref, CASEINSEN);
+   int kind;
+   char *text;			       /* the value, unquoted for strings */
+   double dval;
 }
+Scan_Value_Type;
 
-static int get_colnum_casesen (FitsFile_Type *ft, char *name, SLang_Ref_Type *ref)
+typedef struct
 {
-   return get_colnum_internal (ft, name, ref, CASESEN);
+   char **files;
+   unsigned int num_files;
+   char **keys;			       /* upper case, without HIERARCH */
+   unsigned int num_keys;
+   int hdunum;			       /* 0 if not specified */
+   char *extname;		       /* NULL if not specified */
+   Scan_Value_Type *values;	       /* num_files x num_keys */
+   char **errors;
+   unsigned char *deferred;	       /* files left to the main thread */
+   unsigned int next_file;
+#ifdef HAVE_FITS_THREADS
+   pthread_mutex_t mutex;
+#endif
 }
+Scan_Type;
 
+typedef struct
+{
+   Scan_Type *sc;
+   int use_cfitsio;		       /* cfitsio may be called by this thread */
+   double bytes_read;
+}
+Scan_Worker_Type;
 
-static int insert_rows (FitsFile_Type *ft, int *first, int *num)
+static char *scan_make_nstring (char *s, unsigned int len)
 {
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   if ((*first < 0) || (*num < 0))
+   char *t = (char *) malloc (len + 1);
+   if (t != NULL)
      {
-	SLang_verror (SL_INVALID_PARM, "fits_insert_rows: first and num must be non-negative");
-	return -1;
+	memcpy (t, s, len);
+	t[len] = 0;
      }
+   return t;
+}
 
-   return fits_insert_rows (ft->fptr, *first, *num, &status);
+static void scan_set_error (Scan_Type *sc, unsigned int i, char *msg)
+{
+   char *file = sc->files[i];
+   char *err = (char *) malloc (strlen (file) + strlen (msg) + 3);
+   if (err != NULL)
+     sprintf (err, "%s: %s", file, msg);
+   sc->errors[i] = err;
 }
 
-static int delete_rows (FitsFile_Type *ft, int *first, int *num)
+static void scan_set_errno_error (Scan_Type *sc, unsigned int i, int errnum)
 {
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   if ((*first <= 0) || (*num < 0))
-     {
-	SLang_verror (SL_INVALID_PARM, "fits_delete_rows: first and num must be positive");
-	return -1;
-     }
+   char buf[256];
+   char *msg = buf;
 
-   return fits_delete_rows (ft->fptr, *first, *num, &status);
+   buf[0] = 0;
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+   msg = strerror_r (errnum, buf, sizeof (buf));
+#else
+   if (0 != strerror_r (errnum, buf, sizeof (buf)))
+     sprintf (buf, "error %d", errnum);
+#endif
+   scan_set_error (sc, i, msg);
 }
 
-static int insert_cols (FitsFile_Type *ft, int *colnum,
-			SLang_Array_Type *at_ttype,
-			SLang_Array_Type *at_tform)
+static void free_scan_value (Scan_Value_Type *v)
 {
-   int ncols;
-   char **ttype, **tform;
-   int i;
-   int status = 0;
+   free (v->text);
+   v->text = NULL;
+   v->kind = SCAN_MISSING;
+}
 
-   if (ft->fptr == NULL)
-     return -1;
-   ncols = at_ttype->num_elements;
-   if ((ncols < 0) || (ncols != (int) at_tform->num_elements)
-       || (at_ttype->data_type != SLANG_STRING_TYPE)
-       || (at_tform->data_type != SLANG_STRING_TYPE))
+/* Parse the value field of a card, or a value returned by cfitsio.  An
+ * undefined value is left missing.  Returns -1 if out of memory.
+ */
+static int parse_scan_value (char *s, unsigned int len, Scan_Value_Type *v)
+{
+   char buf[FLEN_CARD + 1];
+   char *e = s + len, *p, *endp;
+   unsigned int n = 0;
+   long long l;
+
+   free_scan_value (v);
+   while ((s < e) && (*s == ' '))
+     s++;
+   if (s == e)
+     return 0;
+
+   if (*s == '\'')
      {
-	SLang_verror (SL_INVALID_PARM,
-		      "fits_insert_cols: ttype and tform must be string arrays of same size");
-	return -1;
+	for (s++; s < e; s++)
+	  {
+	     if (*s == '\'')
+	       {
+		  if ((s + 1 == e) || (s[1] != '\''))
+		    break;
+		  s++;
+	       }
+	     if (n < FLEN_CARD)
+	       buf[n++] = *s;
+	  }
+	while ((n > 0) && (buf[n-1] == ' '))
+	  n--;
+	v->kind = SCAN_STRING;
+	return (NULL == (v->text = scan_make_nstring (buf, n))) ? -1 : 0;
      }
 
-   if (*colnum <= 0)
+   while ((s < e) && (*s != '/') && (n < FLEN_CARD))
+     buf[n++] = *s++;
+   while ((n > 0) && (buf[n-1] == ' '))
+     n--;
+   buf[n] = 0;
+   if (n == 0)
+     return 0;
+   if (NULL == (v->text = scan_make_nstring (buf, n)))
+     return -1;
+
+   v->kind = SCAN_OTHER;
+   if ((n == 1) && ((buf[0] == 'T') || (buf[0] == 'F')))
      {
-	SLang_verror (SL_INVALID_PARM, "fits_insert_cols: colnum must be positive");
-	return -1;
+	v->kind = SCAN_LOGICAL;
+	v->dval = (buf[0] == 'T');
+	return 0;
      }
 
-   tform = (char **)at_tform->data;
-   ttype = (char **)at_ttype->data;
-
-   for (i = 0; i < ncols; i++)
+   l = strtoll (buf, &endp, 10);
+   if ((*endp == 0) && (endp != buf))
      {
-	if ((tform[i] == NULL) || (ttype[i] == NULL))
-	  {
-	     SLang_verror (SL_INVALID_PARM,
-			   "fits_insert_cols: ttype and tform elements muts be non NULL");
-	     return -1;
-	  }
+	v->kind = SCAN_INTEGER;
+	v->dval = (double) l;
+	return 0;
+     }
+   for (p = buf; *p; p++)
+     {
+	if ((*p == 'D') || (*p == 'd'))
+	  *p = 'E';
      }
-   return fits_insert_cols (ft->fptr, *colnum, ncols, ttype, tform, &status);
+   v->dval = strtod (buf, &endp);
+   if ((*endp == 0) && (endp != buf))
+     v->kind = SCAN_FLOAT;
+   return 0;
 }
 
-static int delete_col (FitsFile_Type *ft, int *col)
+/* A string whose value ends with & continues in the next CONTINUE card */
+static int scan_is_continued (Scan_Value_Type *v)
 {
-   int status = 0;
-   if (ft->fptr == NULL)
-     return -1;
-   return fits_delete_col (ft->fptr, *col, &status);
+   unsigned int len;
+
+   if ((v == NULL) || (v->kind != SCAN_STRING))
+     return 0;
+   len = strlen (v->text);
+   return (len > 0) && (v->text[len-1] == '&');
 }
 
-static int get_num_rows (FitsFile_Type *ft, SLang_Ref_Type *ref)
+static int scan_continue_string (Scan_Value_Type *v, char *card)
 {
-   long nrows;
-   int status = 0;
+   Scan_Value_Type c;
+   unsigned int len;
+   char *text;
+   int ret = 0;
 
-   if (ft->fptr == NULL)
+   memset ((char *) &c, 0, sizeof (c));
+   if (-1 == parse_scan_value (card + 8, 72, &c))
      return -1;
-   if (0 == fits_get_num_rows (ft->fptr, &nrows, &status))
+   if (c.kind == SCAN_STRING)
      {
-	int inrows = (int) nrows;
-	if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &inrows))
-	  return -1;
+	len = strlen (v->text) - 1;    /* without the & */
+	if (NULL == (text = (char *) malloc (len + strlen (c.text) + 1)))
+	  ret = -1;
+	else
+	  {
+	     memcpy (text, v->text, len);
+	     strcpy (text + len, c.text);
+	     free (v->text);
+	     v->text = text;
+	  }
      }
-   return status;
+   free_scan_value (&c);
+   return ret;
 }
 
-static int get_rowsize (FitsFile_Type *ft, SLang_Ref_Type *ref)
+/* Does the name of length len match key, which is in upper case? */
+static int scan_name_equals (char *name, unsigned int len, char *key)
 {
-   long nrows;
-   int status = 0;
+   unsigned int i;
 
-   if (ft->fptr == NULL)
-     return -1;
-   if (0 == fits_get_rowsize (ft->fptr, &nrows, &status))
+   for (i = 0; i < len; i++)
      {
-	int inrows = (int) nrows;
-	if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &inrows))
-	  return -1;
+	if ((key[i] == 0) || (toupper ((unsigned char) name[i]) != key[i]))
+	  return 0;
      }
-   return status;
+   return (key[i] == 0);
 }
 
-static int get_num_cols (FitsFile_Type *ft, SLang_Ref_Type *ref)
+/* Does the string value of an EXTNAME or HDUNAME card match extname? */
+static int scan_extname_matches (char *card, char *extname)
 {
-   int ncols;
-   int status = 0;
+   Scan_Value_Type v;
+   int match = 0;
 
-   if (ft->fptr == NULL)
-     return -1;
-   if (0 == fits_get_num_cols (ft->fptr, &ncols, &status))
+   memset ((char *) &v, 0, sizeof (v));
+   if ((0 == parse_scan_value (card + 10, 70, &v)) && (v.kind == SCAN_STRING))
      {
-	if (-1 == SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &ncols))
-	  return -1;
+	char *p = v.text, *q = extname;
+	while (*p == ' ')
+	  p++;
+	while (*p && (toupper ((unsigned char) *p) == toupper ((unsigned char) *q)))
+	  {
+	     p++;
+	     q++;
+	  }
+	match = (*p == 0) && (*q == 0);
      }
-   return status;
+   free_scan_value (&v);
+   return match;
 }
 
-static void byte_swap32 (unsigned char *ss, unsigned int n)
+static void scan_hdu_not_found (Scan_Type *sc, unsigned int i)
 {
-   unsigned char *p, *pmax, ch;
-
-   p = (unsigned char *) ss;
-   pmax = p + 4 * n;
-   while (p < pmax)
-     {
-	ch = *p;
-	*p = *(p + 3);
-	*(p + 3) = ch;
+   char msg[FLEN_CARD + 64];
 
-	ch = *(p + 1);
-	*(p + 1) = *(p + 2);
-	*(p + 2) = ch;
-	p += 4;
-     }
+   if (sc->hdunum)
+     sprintf (msg, "HDU %d does not exist", sc->hdunum);
+   else if (sc->extname != NULL)
+     sprintf (msg, "no HDU named %.*s", FLEN_CARD, sc->extname);
+   else
+     strcpy (msg, "Unable to locate an interesting hdu");
+   scan_set_error (sc, i, msg);
 }
 
-static void byte_swap16 (unsigned char *p, unsigned int nread)
+/* Returns 0 upon success, -1 upon an error, which is recorded, or 1 if
+ * the file is not a plain FITS file and must be read with cfitsio.
+ */
+#ifdef HAVE_MMAP
+static int scan_file_raw (Scan_Worker_Type *w, unsigned int i)
 {
-   unsigned char *pmax, ch;
+   Scan_Type *sc = w->sc;
+   char *file = sc->files[i];
+   Scan_Value_Type *values = sc->values + i * sc->num_keys;
+   Scan_Value_Type *last = NULL;
+   unsigned char *found;
+   char *buf, *msg = NULL;
+   int errnum = 0;
+   LONGLONG offset = 0, hdu_start = 0, naxes_product = 1;
+   long bitpix = 0, naxis = 0, pcount = 0, gcount = 1, naxis1 = -1;
+   int hdunum = 1, groups = 0, name_match = 0;
+   int fd, ret = -1;
+   unsigned int k;
+
+   if ((NULL != strchr (file, '[')) || (NULL != strstr (file, "://")))
+     return 1;
+   if (-1 == (fd = open (file, O_RDONLY)))
+     {
+	scan_set_errno_error (sc, i, errno);
+	return -1;
+     }
+   if (NULL == (buf = (char *) malloc (SCAN_CHUNK_BLOCKS * 2880 + sc->num_keys)))
+     {
+	(void) close (fd);
+	scan_set_error (sc, i, "out of memory");
+	return -1;
+     }
+   /* found[k] is set once the key has been seen in the current header,
+    * so that the first of repeated keys is used, as by cfitsio.
+    */
+   found = (unsigned char *) buf + SCAN_CHUNK_BLOCKS * 2880;
+   memset ((char *) found, 0, sc->num_keys);
+
+   while (1)
+     {
+	ssize_t nread = pread (fd, buf, SCAN_CHUNK_BLOCKS * 2880, offset);
+	char *card;
+	int at_end = 0;
+
+	if (nread < 0)
+	  {
+	     errnum = errno;
+	     goto close_and_return;
+	  }
+	w->bytes_read += nread;
+	nread -= nread % 2880;
+
+	if (offset == hdu_start)
+	  {
+	     if ((nread == 0)
+		 || strncmp (buf, (hdunum == 1) ? "SIMPLE  =" : "XTENSION=", 9))
+	       {
+		  if (hdunum == 1)
+		    ret = 1;	       /* cfitsio knows what it is */
+		  else
+		    scan_hdu_not_found (sc, i);
+		  goto close_and_return;
+	       }
+	  }
+	else if (nread == 0)
+	  {
+	     msg = "truncated header";
+	     goto close_and_return;
+	  }
+
+	for (card = buf; card < buf + nread; card += 80)
+	  {
+	     char *name = card, *val;
+	     unsigned int len = 8;
+
+	     if (0 == strncmp (card, "END     ", 8))
+	       {
+		  at_end = 1;
+		  offset += (card - buf) + 80;
+		  break;
+	       }
+	     if (0 == strncmp (card, "CONTINUE", 8))
+	       {
+		  if (scan_is_continued (last)
+		      && (-1 == scan_continue_string (last, card)))
+		    {
+		       msg = "out of memory";
+		       goto close_and_return;
+		    }
+		  continue;
+	       }
+	     last = NULL;
+
+	     if (0 == strncmp (card, "HIERARCH ", 9))
+	       {
+		  if (NULL == (val = (char *) memchr (card, '=', 80)))
+		    continue;
+		  for (name = card + 9; (name < val) && (*name == ' '); name++)
+		    ;
+		  len = val - name;
+		  val++;
+	       }
+	     else if ((card[8] == '=') && (card[9] == ' '))
+	       {
+		  val = card + 10;
+		  if (0 == strncmp (card, "BITPIX  ", 8))
+		    bitpix = atol (val);
+		  else if (0 == strncmp (card, "NAXIS   ", 8))
+		    naxis = atol (val);
+		  else if ((0 == strncmp (card, "NAXIS", 5)) && isdigit ((unsigned char) card[5]))
+		    {
+		       long n = atol (val);
+		       if (atoi (card + 5) == 1)
+			 naxis1 = n;
+		       /* NAXIS1 = 0 for random groups */
+		       if ((n != 0) || (atoi (card + 5) != 1))
+			 naxes_product *= n;
+		    }
+		  else if (0 == strncmp (card, "PCOUNT  ", 8))
+		    pcount = atol (val);
+		  else if (0 == strncmp (card, "GCOUNT  ", 8))
+		    gcount = atol (val);
+		  else if (0 == strncmp (card, "GROUPS  ", 8))
+		    groups = (NULL != memchr (val, 'T', 21));
+		  else if ((sc->extname != NULL)
+			   && ((0 == strncmp (card, "EXTNAME ", 8))
+			       || (0 == strncmp (card, "HDUNAME ", 8))))
+		    name_match |= scan_extname_matches (card, sc->extname);
+	       }
+	     else
+	       continue;
 
-   pmax = p + 2 * nread;
-   while (p < pmax)
+	     while ((len > 0) && (name[len-1] == ' '))
+	       len--;
+	     for (k = 0; k < sc->num_keys; k++)
+	       {
+		  if (found[k] || (0 == scan_name_equals (name, len, sc->keys[k])))
+		    continue;
+		  found[k] = 1;
+		  if (-1 == parse_scan_value (val, (card + 80) - val, values + k))
+		    {
+		       msg = "out of memory";
+		       goto close_and_return;
+		    }
+		  last = values + k;
+		  break;
+	       }
+	  }
+
+	if (at_end == 0)
+	  {
+	     offset += nread;
+	     continue;
+	  }
+
+	/* The end of a header: is this the HDU? */
+	if ((sc->hdunum == hdunum)
+	    || ((sc->extname != NULL) && name_match)
+	    || ((sc->hdunum == 0) && (sc->extname == NULL) && (naxis != 0)))
+	  {
+	     ret = 0;
+	     goto close_and_return;
+	  }
+
+	/* Skip the data unit */
+	if ((naxis == 0) || ((naxis1 == 0) && (groups == 0)))
+	  naxes_product = 0;
+	offset = 2880 * ((offset + 2879) / 2880);
+	offset += 2880 * ((((bitpix < 0) ? -bitpix : bitpix) / 8
+			   * (LONGLONG) gcount * (pcount + naxes_product) + 2879) / 2880);
+	hdu_start = offset;
+	hdunum++;
+	for (k = 0; k < sc->num_keys; k++)
+	  free_scan_value (values + k);
+	memset ((char *) found, 0, sc->num_keys);
+	last = NULL;
+	bitpix = naxis = pcount = 0;
+	gcount = 1;
+	naxis1 = -1;
+	naxes_product = 1;
+	groups = name_match = 0;
+     }
+
+close_and_return:
+   if (ret != 0)
      {
-	ch = *p;
-	*p = *(p + 1);
-	*(p + 1) = ch;
-	p += 2;
+	for (k = 0; k < sc->num_keys; k++)
+	  free_scan_value (values + k);
      }
+   if (errnum != 0)
+     scan_set_errno_error (sc, i, errnum);
+   else if (msg != NULL)
+     scan_set_error (sc, i, msg);
+   free (buf);
+   (void) close (fd);
+   return ret;
+}
+#else
+static int scan_file_raw (Scan_Worker_Type *w, unsigned int i)
+{
+   (void) w; (void) i;
+   return 1;
 }
+#endif
 
-/* MAJOR HACK!!!! */
-static int hack_write_bit_col (fitsfile *f, unsigned int col,
-			       unsigned int row, unsigned int firstelem,
-			       unsigned int sizeof_type, unsigned int num_elements,
-			       unsigned char *bytes)
+static void scan_file_cfitsio (Scan_Type *sc, unsigned int i)
 {
-   static int status = 0;
-   tcolumn *colptr;
-   long trepeat;
-   int tcode;
+   char *file = sc->files[i];
+   Scan_Value_Type *values = sc->values + i * sc->num_keys;
+   char card[FLEN_CARD + 1], value[FLEN_CARD + 1];
+   char errbuf[FLEN_ERRMSG];
+   fitsfile *f = NULL;
+   unsigned int k;
+   int naxis, status = 0, status1 = 0;
+
+   if (fits_open_file (&f, file, READONLY, &status))
+     goto return_error;
+
+   if (sc->hdunum)
+     (void) fits_movabs_hdu (f, sc->hdunum, NULL, &status);
+   else if (sc->extname != NULL)
+     (void) fits_movnam_hdu (f, ANY_HDU, sc->extname, 0, &status);
+   else if (NULL == strchr (file, '['))
+     {
+	/* The first HDU with NAXIS != 0, as for fits_read_key */
+	while ((0 == fits_read_key (f, TINT, "NAXIS", &naxis, NULL, &status))
+	       && (naxis == 0))
+	  (void) fits_movrel_hdu (f, 1, NULL, &status);
+     }
+   if (status == END_OF_FILE)
+     scan_hdu_not_found (sc, i);
 
-   if ((f == NULL) || (f->Fptr == NULL)
-       || (NULL == (colptr  = (f->Fptr)->tableptr)))
-     return WRITE_ERROR;
+   for (k = 0; (status == 0) && (k < sc->num_keys); k++)
+     {
+	if (fits_read_card (f, sc->keys[k], card, &status))
+	  {
+	     if (status == KEY_NO_EXIST)
+	       status = 0;
+	     continue;
+	  }
+	if (fits_parse_value (card, value, NULL, &status))
+	  break;
+	if (value[0] == '\'')
+	  {
+	     char *longstr = NULL;
+	     if (fits_read_key_longstr (f, sc->keys[k], &longstr, NULL, &status))
+	       break;
+	     values[k].kind = SCAN_STRING;
+	     values[k].text = scan_make_nstring (longstr, strlen (longstr));
+	     free (longstr);
+	     if (values[k].text == NULL)
+	       status = MEMORY_ALLOCATION;
+	  }
+	else if (-1 == parse_scan_value (value, strlen (value), values + k))
+	  status = MEMORY_ALLOCATION;
+     }
 
-   colptr += (col - 1);     /* offset to correct column structure */
-   trepeat = colptr->trepeat;
-   tcode = colptr->tdatatype;
+   (void) fits_close_file (f, &status1);
+   if (status == 0)
+     return;
 
-   colptr->tdatatype = TBYTE;
-   colptr->trepeat = sizeof_type;
+return_error:
+   for (k = 0; k < sc->num_keys; k++)
+     free_scan_value (values + k);
+   if (sc->errors[i] == NULL)
+     {
+	fits_get_errstatus (status, errbuf);
+	scan_set_error (sc, i, errbuf);
+     }
+}
 
-   (void) fits_write_col (f, TBYTE, col, row, firstelem,
-			  num_elements*sizeof_type, bytes, &status);
+static void scan_file (Scan_Worker_Type *w, unsigned int i)
+{
+   if (1 != scan_file_raw (w, i))
+     return;
+   if (w->use_cfitsio)
+     scan_file_cfitsio (w->sc, i);
+   else
+     w->sc->deferred[i] = 1;
+}
 
-   colptr->tdatatype = tcode;
-   colptr->trepeat = trepeat;
+#ifdef HAVE_FITS_THREADS
+static void *scan_worker_thread (void *arg)
+{
+   Scan_Worker_Type *w = (Scan_Worker_Type *) arg;
+   Scan_Type *sc = w->sc;
 
-   return status;
+   while (1)
+     {
+	unsigned int i;
+
+	pthread_mutex_lock (&sc->mutex);
+	i = sc->next_file++;
+	pthread_mutex_unlock (&sc->mutex);
+	if (i >= sc->num_files)
+	  break;
+	scan_file (w, i);
+     }
+   return NULL;
 }
+#endif
 
-static int write_tbit_col (fitsfile *f, unsigned int col, unsigned int row,
-			   unsigned int firstelem, unsigned int repeat,
-			   unsigned int width, SLang_Array_Type *at)
+/* Returns the values of key k for all files as an array: strings if any
+ * value is a string (NULL if missing), integers for integer and logical
+ * values that are all present and fit, and otherwise doubles, with NaN
+ * for the missing values.
+ */
+static SLang_Array_Type *scan_values_to_array (Scan_Type *sc, unsigned int k)
 {
-   int status = 0;
-   unsigned int num_elements;
-   unsigned int sizeof_type;
-   unsigned char *data, *buf;
-   unsigned short s;
-   void (*bs) (unsigned char *, unsigned int);
+   SLang_Array_Type *at;
+   SLindex_Type n = (SLindex_Type) sc->num_files;
+   unsigned int counts[SCAN_OTHER + 1];
+   unsigned int i;
+   int fits_int = 1;
 
-   (void) width;
-   num_elements = at->num_elements;
-   sizeof_type = at->sizeof_type;
-   data = (unsigned char *) at->data;
+   memset ((char *) counts, 0, sizeof (counts));
+   for (i = 0; i < sc->num_files; i++)
+     {
+	Scan_Value_Type *v = sc->values + i * sc->num_keys + k;
+	counts[v->kind]++;
+	if (((v->kind == SCAN_INTEGER) || (v->kind == SCAN_LOGICAL))
+	    && ((v->dval > 2147483647.0) || (v->dval < -2147483648.0)))
+	  fits_int = 0;
+     }
 
-   if (8 * sizeof_type != repeat)
+   if (counts[SCAN_STRING] || counts[SCAN_OTHER] || (counts[SCAN_MISSING] == sc->num_files))
      {
-	SLang_verror (SL_NOT_IMPLEMENTED, "Writing a %dX bit column requires the appropriately sized integer",
-		      repeat);
-	return -1;
+	char **strs;
+	if (NULL == (at = SLang_create_array (SLANG_STRING_TYPE, 0, NULL, &n, 1)))
+	  return NULL;
+	strs = (char **) at->data;
+	for (i = 0; i < sc->num_files; i++)
+	  {
+	     Scan_Value_Type *v = sc->values + i * sc->num_keys + k;
+	     if ((v->text != NULL)
+		 && (NULL == (strs[i] = SLang_create_slstring (v->text))))
+	       {
+		  SLang_free_array (at);
+		  return NULL;
+	       }
+	  }
+	return at;
      }
 
-   s = 0x1234;
-   if ((*(unsigned char *) &s == 0x12)
-       || (sizeof_type == 1))
+   if (fits_int && (counts[SCAN_FLOAT] == 0) && (counts[SCAN_MISSING] == 0))
      {
-	return hack_write_bit_col (f, col, row, firstelem,
-				   sizeof_type, num_elements, data);
+	int *ints;
+	if (NULL == (at = SLang_create_array (SLANG_INT_TYPE, 0, NULL, &n, 1)))
+	  return NULL;
+	ints = (int *) at->data;
+	for (i = 0; i < sc->num_files; i++)
+	  ints[i] = (int) sc->values[i * sc->num_keys + k].dval;
+	return at;
      }
 
-   /* Sigh.  Need to byteswap */
-   switch (sizeof_type)
+   if (NULL == (at = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, &n, 1)))
+     return NULL;
+   for (i = 0; i < sc->num_files; i++)
      {
-      case 2:
-	bs = byte_swap16;
-	break;
+	Scan_Value_Type *v = sc->values + i * sc->num_keys + k;
+	((double *) at->data)[i] = (v->kind == SCAN_MISSING) ? BIN_NAN_VALUE : v->dval;
+     }
+   return at;
+}
 
-      case 4:
-	bs = byte_swap32;
-	break;
+/* Usage: status = _fits_scan_headers (files, keys, hdu, nthreads, &values, &errors)
+ * hdu is an HDU number, an extension name, or NULL for the first HDU
+ * with NAXIS != 0.  values is assigned an array of arrays, one per key,
+ * and errors an array of messages, NULL for the files that were read.
+ * If nthreads is 0, the number of CPUs is used.
+ */
+static int scan_headers (void)
+{
+   Call_Context_Type cc;
+   SLang_Ref_Type *values_ref = NULL, *errors_ref = NULL;
+   SLang_Array_Type *files_at = NULL, *keys_at = NULL;
+   SLang_Array_Type *values_at = NULL, *errors_at = NULL;
+   Scan_Type sc;
+   Scan_Worker_Type main_worker;
+   double bytes_read = 0.0;
+   SLindex_Type num_files, num_keys;
+   unsigned int i, k;
+   int num_threads;
+   int ret = -1;
+
+   memset ((char *) &sc, 0, sizeof (sc));
+   if ((-1 == SLang_pop_ref (&errors_ref))
+       || (-1 == SLang_pop_ref (&values_ref))
+       || (-1 == SLang_pop_integer (&num_threads)))
+     goto free_and_return;
 
+   switch (SLang_peek_at_stack ())
+     {
+      case SLANG_NULL_TYPE:
+	if (-1 == SLang_pop_null ())
+	  goto free_and_return;
+	break;
+      case SLANG_STRING_TYPE:
+	if (-1 == SLang_pop_slstring (&sc.extname))
+	  goto free_and_return;
+	break;
       default:
-	SLang_verror (SL_NOT_IMPLEMENTED, "writing to a %dX column is not supported", repeat);
-	return -1;
+	if (-1 == SLang_pop_integer (&sc.hdunum))
+	  goto free_and_return;
+	if (sc.hdunum <= 0)
+	  {
+	     SLang_verror (SL_INVALID_PARM, "fits_scan_headers: HDU numbers start at 1");
+	     goto free_and_return;
+	  }
      }
 
-   buf = (unsigned char *) SLmalloc (num_elements * sizeof_type);
-   if (buf == NULL)
-     return -1;
-
-   memcpy (buf, data, num_elements * sizeof_type);
-   (*bs) (buf, num_elements);
-
-   status = hack_write_bit_col (f, col, row, firstelem,
-				sizeof_type, num_elements, buf);
-
-   SLfree ((char *) buf);
-   return status;
-}
-
-#ifdef fits_get_eqcoltype
-# define GET_COL_TYPE fits_get_eqcoltype
-#else
-# define GET_COL_TYPE my_fits_get_coltype
-static int my_fits_get_coltype (fitsfile *fptr, int col, int *type,
-				long *repeat, long *width, int *statusp)
-{
-   int status = *statusp;
-   char tscaln[32];
-   char tzeron[32];
-   double tscal, tzero;
-   double min_val, max_val;
+   if ((-1 == SLang_pop_array_of_type (&keys_at, SLANG_STRING_TYPE))
+       || (-1 == SLang_pop_array_of_type (&files_at, SLANG_STRING_TYPE)))
+     goto free_and_return;
 
-   if (ft->fptr == NULL)
-     return -1;
+   begin_call (&cc, NULL, "_fits_scan_headers");
 
-   if (0 != fits_get_coltype (fptr, col, type, repeat, width, &status))
+   sc.files = (char **) files_at->data;
+   sc.num_files = (unsigned int) files_at->num_elements;
+   sc.num_keys = (unsigned int) keys_at->num_elements;
+   for (i = 0; i < sc.num_files; i++)
      {
-	*statusp = status;
-	return status;
+	if (sc.files[i] == NULL)
+	  {
+	     SLang_verror (SL_INVALID_PARM, "fits_scan_headers: a file name is NULL");
+	     goto end_call_and_return;
+	  }
      }
 
-   sprintf (tscaln, "TSCAL%d", col);
-   sprintf (tzeron, "TZERO%d", col);
+   if ((NULL == (sc.keys = (char **) SLcalloc (sc.num_keys + 1, sizeof (char *))))
+       || (NULL == (sc.values = (Scan_Value_Type *) SLcalloc (sc.num_files * sc.num_keys + 1, sizeof (Scan_Value_Type))))
+       || (NULL == (sc.errors = (char **) SLcalloc (sc.num_files + 1, sizeof (char *))))
+       || (NULL == (sc.deferred = (unsigned char *) SLcalloc (sc.num_files + 1, 1))))
+     goto end_call_and_return;
 
-   if (0 != fits_read_key (fptr, TDOUBLE, tscaln, &tscal, NULL, &status))
+   for (k = 0; k < sc.num_keys; k++)
      {
-	fits_clear_errmsg ();
-	tscal = 1.0;
+	char *key = ((char **) keys_at->data)[k], *p;
+	if (key == NULL)
+	  {
+	     SLang_verror (SL_INVALID_PARM, "fits_scan_headers: a key is NULL");
+	     goto end_call_and_return;
+	  }
+	if (0 == strncmp (key, "HIERARCH ", 9))
+	  key += 9;
+	if (NULL == (sc.keys[k] = SLmake_string (key)))
+	  goto end_call_and_return;
+	for (p = sc.keys[k]; *p; p++)
+	  *p = toupper ((unsigned char) *p);
      }
 
-   if (0 != fits_read_key (fptr, TDOUBLE, tzeron, &tzero, NULL, &status))
+   if (num_threads <= 0)
      {
-	fits_clear_errmsg ();
-	tzero = 0;
+	num_threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	num_threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+#endif
      }
+   if (num_threads > SCAN_MAX_THREADS)
+     num_threads = SCAN_MAX_THREADS;
+   if ((unsigned int) num_threads > sc.num_files)
+     num_threads = (int) sc.num_files;
 
-   switch (*type)
+   main_worker.sc = &sc;
+   main_worker.use_cfitsio = 1;
+   main_worker.bytes_read = 0.0;
+
+#ifdef HAVE_FITS_THREADS
+   if (num_threads >= 2)
      {
-      case TSHORT:
-	min_val = -32768.0;
-	max_val = 32767.0;
-	break;
+	Scan_Worker_Type workers[SCAN_MAX_THREADS];
+	pthread_t threads[SCAN_MAX_THREADS];
+	int started[SCAN_MAX_THREADS];
+	int t, reentrant = fits_is_reentrant ();
 
-      case TLONG:
-	min_val = -2147483648.0;
-	max_val = 2147483647.0;
-	break;
+	pthread_mutex_init (&sc.mutex, NULL);
+	for (t = 0; t < num_threads; t++)
+	  {
+	     workers[t].sc = &sc;
+	     workers[t].use_cfitsio = reentrant;
+	     workers[t].bytes_read = 0.0;
+	     started[t] = (0 == pthread_create (&threads[t], NULL, scan_worker_thread, workers + t));
+	  }
+	for (t = 0; t < num_threads; t++)
+	  {
+	     if (started[t])
+	       pthread_join (threads[t], NULL);
+	     else
+	       (void) scan_worker_thread (workers + t);
+	     bytes_read += workers[t].bytes_read;
+	  }
+	pthread_mutex_destroy (&sc.mutex);
 
-      default:
-	return 0;
+	for (i = 0; i < sc.num_files; i++)
+	  {
+	     if (sc.deferred[i])
+	       scan_file_cfitsio (&sc, i);
+	  }
      }
-
-   min_val = tzero + tscal * min_val;
-   max_val = tzero + tscal * max_val;
-
-   if (min_val > max_val)
+   else
+#endif
      {
-	double tmp = max_val;
-	max_val = min_val;
-	min_val = tmp;
+	for (i = 0; i < sc.num_files; i++)
+	  scan_file (&main_worker, i);
      }
+   bytes_read += main_worker.bytes_read;
+   count_read (bytes_read, 1);
+   COUNT_STAT(num_key_reads, sc.num_files * sc.num_keys);
+   /* The errors are reported per file */
+   fits_clear_errmsg ();
 
-   if ((min_val >= -32768.0) && (max_val <= 32767.0))
+   num_files = (SLindex_Type) sc.num_files;
+   num_keys = (SLindex_Type) sc.num_keys;
+   if ((NULL == (values_at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &num_keys, 1)))
+       || (NULL == (errors_at = SLang_create_array (SLANG_STRING_TYPE, 0, NULL, &num_files, 1))))
+     goto end_call_and_return;
+   for (k = 0; k < sc.num_keys; k++)
      {
-	*type = TSHORT;
-	return 0;
+	if (NULL == (((SLang_Array_Type **) values_at->data)[k] = scan_values_to_array (&sc, k)))
+	  goto end_call_and_return;
      }
-
-   if ((min_val >= 0) && (max_val <= 65535.0))
+   for (i = 0; i < sc.num_files; i++)
      {
-	*type = TUSHORT;
-	return 0;
+	if ((sc.errors[i] != NULL)
+	    && (NULL == (((char **) errors_at->data)[i] = SLang_create_slstring (sc.errors[i]))))
+	  goto end_call_and_return;
      }
 
-   if ((min_val >= -2147483648.0) && (max_val <= 2147483647.0))
+   if ((-1 == SLang_assign_to_ref (values_ref, SLANG_ARRAY_TYPE, (VOID_STAR) &values_at))
+       || (-1 == SLang_assign_to_ref (errors_ref, SLANG_ARRAY_TYPE, (VOID_STAR) &errors_at)))
+     goto end_call_and_return;
+   ret = 0;
+
+end_call_and_return:
+   ret = end_call (&cc, ret);
+free_and_return:
+   if (sc.values != NULL)
      {
-	*type = TLONG;
-	return 0;
+	for (i = 0; i < sc.num_files * sc.num_keys; i++)
+	  free (sc.values[i].text);
+	SLfree ((char *) sc.values);
      }
-
-   if ((min_val >= 0.0) && (max_val <= 4294967295.0))
+   if (sc.errors != NULL)
      {
-	*type = TULONG;
-	return 0;
+	for (i = 0; i < sc.num_files; i++)
+	  free (sc.errors[i]);
+	SLfree ((char *) sc.errors);
      }
+   if (sc.keys != NULL)
+     {
+	for (k = 0; k < sc.num_keys; k++)
+	  SLfree (sc.keys[k]);
+	SLfree ((char *) sc.keys);
+     }
+   SLfree ((char *) sc.deferred);
+   SLang_free_slstring (sc.extname);
+   SLang_free_array (values_at);
+   SLang_free_array (errors_at);
+   SLang_free_array (keys_at);
+   SLang_free_array (files_at);
+   SLang_free_ref (values_ref);
+   SLang_free_ref (errors_ref);
+   return ret;
+}
 
-   *type = TDOUBLE;
-   return 0;
+static void clear_errmsg (void)
+{
+   fits_clear_errmsg ();
 }
-#endif
 
-static int write_col (FitsFile_Type *ft, int *colnum,
-		      int *firstrow, int *firstelem, SLang_Array_Type *at)
+static void get_errstatus (int *status)
 {
-   int type;
+   char errbuf [FLEN_ERRMSG];
+
+   *errbuf = 0;
+   fits_get_errstatus (*status, errbuf);
+   (void) SLang_push_string (errbuf);
+}
+
+static void read_errmsg (void)
+{
+   char errbuf [FLEN_ERRMSG];
+
+   if (0 == fits_read_errmsg (errbuf))
+     (void) SLang_push_null ();
+   else
+     (void) SLang_push_string (errbuf);
+}
+
+static int get_num_keys (FitsFile_Type *f, SLang_Ref_Type *ref)
+{
+   Call_Context_Type cc;
    int status = 0;
-   int col;
-   long repeat;
-   long width;
+   int nkeys;
 
-   if (ft->fptr == NULL)
+   if (f->fptr == NULL)
      return -1;
 
-   col = *colnum;
+   begin_call (&cc, f, "_fits_get_num_keys");
+   if (0 == fits_get_hdrspace (f->fptr, &nkeys, NULL, &status))
+     return end_call (&cc, SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &nkeys));
 
-   if (0 != GET_COL_TYPE (ft->fptr, col, &type, &repeat, &width, &status))
-     return status;
+   return end_call (&cc, status);
+}
 
-   if (type == TBIT)
-     return write_tbit_col (ft->fptr, col, *firstrow, *firstelem,
-			    repeat, width, at);
+static int get_keytype (FitsFile_Type *f, char *name, SLang_Ref_Type *v)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   int type;
 
-   switch (at->data_type)
+   if (f->fptr == NULL)
+     return -1;
+
+   begin_call (&cc, f, "_fits_get_keytype");
+   if (0 == (status = do_get_keytype (f->fptr, name, &type)))
+     return end_call (&cc, SLang_assign_to_ref (v, SLANG_DATATYPE_TYPE, (VOID_STAR) &type));
+
+   return end_call (&cc, status);
+}
+
+#if 0
+static int _read_key_n (FitsFile_Type *f, SLang_Ref_Type *v, SLang_Ref_Type *c)
+{
+   int status = 0;
+
+   if (fits_get_keytype (card, &type, &status))
+     return status;
+   switch (type)
      {
-      case SLANG_INT16_TYPE:
-	type = CFITSIO_INT16_TYPE;
-	break;
-      case SLANG_UINT16_TYPE:
-	type = CFITSIO_UINT16_TYPE;
-	break;
-      case SLANG_INT32_TYPE:
-	type = CFITSIO_INT32_TYPE;
-	break;
-      case SLANG_UINT32_TYPE:
-	type = CFITSIO_UINT32_TYPE;
-	break;
-#ifdef CFITSIO_INT64_TYPE
-      case SLANG_INT64_TYPE:
-	type = CFITSIO_INT64_TYPE;
+      case 'C':			       /* string */
 	break;
-#endif
 
-      case SLANG_DOUBLE_TYPE:
-	type = TDOUBLE;
+      case 'L':			       /* logical */
 	break;
 
-      case SLANG_FLOAT_TYPE:
-	type = TFLOAT;
+      case 'I':			       /* integer */
 	break;
 
-      case SLANG_STRING_TYPE:
-	type = TSTRING;
+      case 'F':			       /* floating point */
 	break;
 
-      case SLANG_CHAR_TYPE:
-      case SLANG_UCHAR_TYPE:
-	type = TBYTE;
+      case 'X':			       /* complex */
 	break;
-
-      default:
-	SLang_verror (SL_NOT_IMPLEMENTED,
-		      "fits_write_col: %s not suppported",
-		      SLclass_get_datatype_name (at->data_type));
-	return -1;
      }
+}
+#endif
+
+static void get_version (void)
+{
+   float v;
+   (void) fits_get_version (&v);
+   (void) SLang_push_float (v);
+}
 
-   return fits_write_col (ft->fptr, type, *colnum, *firstrow, *firstelem,
-			  at->num_elements, at->data, &status);
+static int get_keyclass (char *card)
+{
+   return fits_get_keyclass (card);
 }
 
-static int read_string_cell (fitsfile *f, unsigned int row, unsigned int col,
-			     unsigned int len, unsigned int num_substrs, char **sp)
+static int do_fits_fun_f(int (*fun)(fitsfile *, int *), FitsFile_Type *f, char *name)
 {
-   char *s, *ss;
-   char *sls;
+   Call_Context_Type cc;
    int status = 0;
-   int anynul;
-   unsigned int i;
-   unsigned int width;
-
-   *sp = NULL;
 
-   if (f == NULL)
+   if (f->fptr == NULL)
      return -1;
 
-   if (NULL == (s = SLmalloc (len + 1)))
-     return -1;
-   memset (s, ' ', len);
+   begin_call (&cc, f, name);
+   (void) (*fun) (f->fptr, &status);
+   return end_call (&cc, status);
+}
 
-   width = len/num_substrs;
-   ss = s;
-   for (i = 0; i < num_substrs; i++)
+/* Checksums.  The FITS checksum is the 32 bit ones' complement sum of
+ * the big-endian 32 bit words of the HDU.  Since the sum is associative
+ * and 2^32 is congruent to 1, it may be computed by summing the four byte
+ * lanes separately and combining the lane sums by rotation, which the
+ * compiler can vectorize, and chunks of the data may be summed in
+ * parallel.  The data are accessed directly from the mmapped file or the
+ * buffer of an in-memory file; other files are left to cfitsio.
+ */
+#define CHKSUM_LANE_BLOCK	(1UL << 24)   /* lane sums < 2^32 */
+#define CHKSUM_CHUNK_SIZE	(16UL << 20)  /* min bytes per thread */
+#define CHKSUM_MAX_THREADS	8
+
+static unsigned long ones_add32 (unsigned long a, unsigned long b)
+{
+   unsigned long s;
+
+   a &= 0xFFFFFFFFUL;
+   b &= 0xFFFFFFFFUL;
+   s = (a + b) & 0xFFFFFFFFUL;
+   if (s < a)
+     s = (s + 1) & 0xFFFFFFFFUL;      /* end-around carry */
+   return s;
+}
+
+/* x*2^n modulo 2^32-1 */
+static unsigned long ones_rotl32 (unsigned long x, unsigned int n)
+{
+   x &= 0xFFFFFFFFUL;
+   return ((x << n) | (x >> (32 - n))) & 0xFFFFFFFFUL;
+}
+
+/* The number of bytes must be a multiple of 4 */
+static unsigned long chksum_bytes (const unsigned char *p, size_t num)
+{
+   unsigned long sum = 0;
+
+   while (num)
      {
-	/* Note that the number of elements passed to this must be 1 */
-	if (0 != fits_read_col (f, TSTRING, col, row, i+1, 1, NULL,
-				&ss, &anynul, &status))
-	  {
-	     SLfree (s);
-	     return status;
-	  }
-	/* If there is more than one substring, append them together.  Only the
-	 * last substring will have trailing whitespace removed.  This is
-	 * probably ok because fits does not like trailing whitespace.
-	 */
-	if (i + 1 < num_substrs)
+	size_t i, n = (num < CHKSUM_LANE_BLOCK) ? num : CHKSUM_LANE_BLOCK;
+	unsigned int s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+	for (i = 0; i < n; i += 4)
 	  {
-	     unsigned int len1 = strlen (ss);
-	     ss[len1] = ' ';
+	     s0 += p[i];
+	     s1 += p[i+1];
+	     s2 += p[i+2];
+	     s3 += p[i+3];
 	  }
-	ss += width;
+	sum = ones_add32 (sum, ones_add32 (ones_add32 (ones_rotl32 (s0, 24), ones_rotl32 (s1, 16)),
+					   ones_add32 (ones_rotl32 (s2, 8), s3)));
+	p += n;
+	num -= n;
+     }
+   return sum;
+}
+
+#ifdef HAVE_FITS_THREADS
+typedef struct
+{
+   const unsigned char *p;
+   size_t num;
+   unsigned long sum;
+}
+Chksum_Chunk_Type;
+
+static void *chksum_thread (void *arg)
+{
+   Chksum_Chunk_Type *c = (Chksum_Chunk_Type *) arg;
+   c->sum = chksum_bytes (c->p, c->num);
+   return NULL;
+}
+#endif
+
+static unsigned long parallel_chksum_bytes (const unsigned char *p, size_t num)
+{
+#ifdef HAVE_FITS_THREADS
+   Chksum_Chunk_Type chunks[CHKSUM_MAX_THREADS];
+   pthread_t threads[CHKSUM_MAX_THREADS];
+   int started[CHKSUM_MAX_THREADS];
+   unsigned long sum;
+   size_t chunk_size;
+   long ncpus = 1;
+   int i, n;
+
+# ifdef _SC_NPROCESSORS_ONLN
+   ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+# endif
+   n = (int) (num / CHKSUM_CHUNK_SIZE);
+   if (n > ncpus) n = (int) ncpus;
+   if (n > CHKSUM_MAX_THREADS) n = CHKSUM_MAX_THREADS;
+   if (n < 2)
+     return chksum_bytes (p, num);
+
+   chunk_size = (num / n) & ~(size_t) 3;
+   for (i = 0; i < n; i++)
+     {
+	chunks[i].p = p + i * chunk_size;
+	chunks[i].num = (i == n - 1) ? num - i * chunk_size : chunk_size;
+	started[i] = (0 == pthread_create (&threads[i], NULL, chksum_thread, chunks + i));
+	if (started[i] == 0)
+	  chunks[i].sum = chksum_bytes (chunks[i].p, chunks[i].num);
      }
-   sls = SLang_create_slstring (s);
-   SLfree (s);
-   if (sls == NULL)
-     return -1;
 
-   *sp = sls;
-   return 0;
+   sum = 0;
+   for (i = 0; i < n; i++)
+     {
+	if (started[i])
+	  pthread_join (threads[i], NULL);
+	sum = ones_add32 (sum, chunks[i].sum);
+     }
+   return sum;
+#else
+   return chksum_bytes (p, num);
+#endif
 }
 
-static int read_string_column (fitsfile *f, int is_var, long repeat, unsigned int num_substrs,
-			       int col, unsigned int firstrow, unsigned int numrows,
-			       SLang_Array_Type **atp)
+/* Compute the header and data sums of the current HDU without going
+ * through cfitsio.  Returns -1 if the bytes of the HDU are not directly
+ * accessible, in which case the caller should fall back to cfitsio.
+ */
+static int fast_hdu_chksums (FitsFile_Type *ft, unsigned long *hsum, unsigned long *dsum)
 {
-   int num_elements;
-   char **ats;
-   unsigned int i;
+   LONGLONG headstart, datastart, dataend;
+   fitsfile *f = ft->fptr;
    int status = 0;
-   SLang_Array_Type *at;
+   int mode;
 
-   *atp = NULL;
-
-   if (f == NULL)
-     return -1;
-
-   num_elements = (int) numrows;
-   at = SLang_create_array (SLANG_STRING_TYPE, 0, NULL, &num_elements, 1);
-   if (at == NULL)
+   if (fits_file_mode (f, &mode, &status)
+       || ((mode == READWRITE) && fits_flush_file (f, &status))
+       || fits_get_hduaddrll (f, &headstart, &datastart, &dataend, &status)
+       || (headstart < 0) || (datastart < headstart) || (dataend < datastart)
+       || (headstart % 4) || (datastart % 4) || (dataend % 4))
      return -1;
 
-   ats = (char **) at->data;
+   if (ft->mem_ptr != NULL)
+     {
+	const unsigned char *p = (const unsigned char *) ft->mem_ptr;
+	if ((size_t) dataend > ft->mem_size)
+	  return -1;
+	*hsum = chksum_bytes (p + headstart, (size_t) (datastart - headstart));
+	*dsum = parallel_chksum_bytes (p + datastart, (size_t) (dataend - datastart));
+	count_read ((double) (dataend - headstart), 1);
+	return 0;
+     }
 
-   for (i = 0; i < numrows; i++)
+#ifdef HAVE_MMAP
      {
-	long offset;
-	long row;
+	char filename[FLEN_FILENAME];
+	char urltype[FLEN_FILENAME];
+	unsigned char *addr;
+	off_t offset;
+	size_t len;
+	long pagesize;
+	int fd;
+
+	if (fits_url_type (f, urltype, &status)
+	    || (0 != strcmp (urltype, "file://"))
+	    || fits_file_name (f, filename, &status)
+	    || (NULL != strchr (filename, '[')))
+	  return -1;
 
-	row = firstrow + i;
-	if (is_var)
+	if (dataend == headstart)
 	  {
-	     if (0 != fits_read_descript (f, col, row, &repeat, &offset, &status))
-	       {
-		  SLang_free_array (at);
-		  return status;
-	       }
+	     *hsum = *dsum = 0;
+	     return 0;
 	  }
 
-	status = read_string_cell (f, row, col, repeat, num_substrs, ats+i);
-	if (status != 0)
+	pagesize = sysconf (_SC_PAGESIZE);
+	if (pagesize <= 0) pagesize = 4096;
+	offset = (off_t) (headstart - headstart % pagesize);
+	len = (size_t) (dataend - offset);
+
+	while (-1 == (fd = open (filename, O_RDONLY)))
 	  {
-	     SLang_free_array (at);
-	     return status;
+	     if (errno != EINTR)
+	       return -1;
 	  }
+	addr = (unsigned char *) mmap (NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+	(void) close (fd);
+	if (addr == (unsigned char *) MAP_FAILED)
+	  return -1;
+# ifdef MADV_SEQUENTIAL
+	(void) madvise ((void *) addr, len, MADV_SEQUENTIAL);
+# endif
+	*hsum = chksum_bytes (addr + (headstart - offset), (size_t) (datastart - headstart));
+	*dsum = parallel_chksum_bytes (addr + (datastart - offset), (size_t) (dataend - datastart));
+	(void) munmap ((void *) addr, len);
+	count_read ((double) (dataend - headstart), 1);
+	return 0;
      }
-
-   *atp = at;
-   return 0;
+#else
+   (void) hsum; (void) dsum;
+   return -1;
+#endif
 }
 
-static int read_bit_column (fitsfile *f, unsigned int col, unsigned int row,
-			    unsigned int firstelem, unsigned int num_elements,
-			    unsigned char *data, unsigned int bytes_per_elem,
-			    unsigned int bits_per_elem)
+static int write_chksum (FitsFile_Type *f)
 {
-   int status, anynul;
-   unsigned short s;
+   Call_Context_Type cc;
+   char value[FLEN_VALUE], comment[FLEN_COMMENT], datestr[FLEN_VALUE];
+   unsigned long hsum, dsum;
+   int status = 0, timeref;
 
-   if (f == NULL)
+   if (f->fptr == NULL)
      return -1;
 
-   status = 0;
-   if (0 != fits_read_col (f, TBYTE, col, row,
-			   firstelem, num_elements*bytes_per_elem,
-			   NULL, data, &anynul, &status))
-     return status;
+   /* The variable length TFORMs of a table with a heap may be updated
+    * by cfitsio, so let it handle that case.
+    */
+   if ((f->fptr->Fptr == NULL) || (f->fptr->Fptr->heapsize > 0))
+     return do_fits_fun_f (fits_write_chksum, f, "_fits_write_chksum");
 
-   s = 0x1234;
-   if (*(unsigned char *) &s == 0x12)
-     return status;
+   begin_call (&cc, f, "_fits_write_chksum");
 
-   /* Otherwise, byteswap */
-   switch (bytes_per_elem)
+   /* Reserve the keywords before the data sum is computed since adding
+    * them may cause the header to grow.
+    */
+   if (fits_get_system_time (datestr, &timeref, &status))
+     return end_call (&cc, status);
+   if (fits_read_key (f->fptr, TSTRING, "DATASUM", value, NULL, &status))
      {
-	SLuindex_Type i;
-	int shift;
-	int16_type *data16;
-	int32_type *data32;
-
-      case 1:
-	shift = 8*bytes_per_elem - bits_per_elem;
-	if (shift) for (i = 0; i < num_elements; i++)
-	  {
-	     data[i] = (data[i] >> shift);
-	  }
-	break;
-
-      case 2:
-	byte_swap16 (data, num_elements);
-	shift = 8*bytes_per_elem - bits_per_elem;
-	data16 = (int16_type *)data;
-	if (shift) for (i = 0; i < num_elements; i++)
-	  {
-	     data16[i] = (data16[i] >> shift);
-	  }
-	break;
-
-      case 4:
-	byte_swap32 (data, num_elements);
-	shift = 8*bytes_per_elem - bits_per_elem;
-	data32 = (int32_type *)data;
-	if (shift) for (i = 0; i < num_elements; i++)
-	  {
-	     data32[i] = (data32[i] >> shift);
-	  }
-	break;
+	if (status != KEY_NO_EXIST)
+	  return end_call (&cc, status);
+	status = 0;
+	fits_clear_errmsg ();
+	strcpy (value, "0");
+	(void) fits_write_key (f->fptr, TSTRING, "DATASUM", value, "data unit checksum", &status);
+     }
+   if (fits_read_key (f->fptr, TSTRING, "CHECKSUM", value, NULL, &status))
+     {
+	if (status != KEY_NO_EXIST)
+	  return end_call (&cc, status);
+	status = 0;
+	fits_clear_errmsg ();
+	strcpy (value, "0000000000000000");
+	(void) fits_write_key (f->fptr, TSTRING, "CHECKSUM", value, "HDU checksum", &status);
+     }
+   if (status)
+     return end_call (&cc, status);
 
-      default:
-	SLang_verror (SL_NOT_IMPLEMENTED, "%u byte integers are unsupported",
-		      bytes_per_elem);
-	return -1;
+   if (-1 == fast_hdu_chksums (f, &hsum, &dsum))
+     {
+	(void) fits_write_chksum (f->fptr, &status);
+	return end_call (&cc, status);
      }
 
-   return 0;
+   sprintf (value, "%lu", dsum);
+   sprintf (comment, "data unit checksum updated %s", datestr);
+   (void) fits_update_key (f->fptr, TSTRING, "DATASUM", value, comment, &status);
+   /* This only sums the header and uses the DATASUM value */
+   (void) fits_update_chksum (f->fptr, &status);
+   return end_call (&cc, status);
+}
+static int update_chksum (FitsFile_Type *f)
+{
+   return do_fits_fun_f (fits_update_chksum, f, "_fits_update_chksum");
 }
 
-static int read_column_values (fitsfile *f, int type, SLtype datatype,
-			       unsigned int row, unsigned int col, unsigned int num_rows,
-			       int repeat, int repeat_orig, SLang_Array_Type **atp)
+/* Same semantics as fits_verify_chksum: 1 if the sum is correct, 0 if the
+ * keyword is missing, and -1 if the sum is incorrect.
+ */
+static int fast_verify_chksum (FitsFile_Type *f, int *dataok, int *hduok, int *statusp)
 {
-   int num_elements;
+   char value[FLEN_VALUE];
+   unsigned long hsum, dsum, keysum = 0;
+   int have_datasum, have_checksum;
    int status = 0;
-   int anynul;
-   SLang_Array_Type *at;
-   int dims[2];
-   int num_dims;
-
-   *atp = NULL;
-
-   if (f == NULL)
-     return -1;
 
-   num_elements = num_rows * repeat;
-   if (num_rows <= 1)
+   *dataok = *hduok = 0;
+   if (fits_read_key (f->fptr, TSTRING, "DATASUM", value, NULL, &status))
      {
-	dims[0] = num_elements;
-	num_dims = 1;
+	if (status != KEY_NO_EXIST)
+	  return *statusp = status;
+	status = 0;
+	have_datasum = 0;
      }
-   else				       /* was repeat>1 */
+   else
      {
-	dims[0] = num_rows;
-	dims[1] = repeat;
-	num_dims = 2;
+	have_datasum = 1;
+	keysum = (unsigned long) atof (value);
      }
-
-   at = SLang_create_array (datatype, 0, NULL, dims, num_dims);
-   if (at == NULL)
-     return -1;
-
-   if (num_elements)
+   if (fits_read_key (f->fptr, TSTRING, "CHECKSUM", value, NULL, &status))
      {
-	if (type == TBIT)
-	  status = read_bit_column (f, col, row, 1, num_elements, (unsigned char *)at->data, at->sizeof_type, repeat_orig);
-	else
-	  (void) fits_read_col (f, type, col, row, 1, num_elements, NULL,
-				at->data, &anynul, &status);
+	if (status != KEY_NO_EXIST)
+	  return *statusp = status;
+	status = 0;
+	have_checksum = 0;
      }
+   else have_checksum = 1;
+   fits_clear_errmsg ();
 
-   if (status)
+   if ((have_datasum == 0) && (have_checksum == 0))
+     return 0;
+
+   if (-1 == fast_hdu_chksums (f, &hsum, &dsum))
+     return fits_verify_chksum (f->fptr, dataok, hduok, statusp);
+
+   if (have_datasum)
+     *dataok = (dsum == keysum) ? 1 : -1;
+   if (have_checksum)
      {
-	SLang_free_array (at);
-	return status;
+	hsum = ones_add32 (hsum, dsum);
+	*hduok = ((hsum == 0) || (hsum == 0xFFFFFFFFUL)) ? 1 : -1;
      }
-
-   *atp = at;
    return 0;
 }
 
-static int read_var_column (fitsfile *f, int ftype, SLtype datatype,
-			    int col, unsigned int firstrow, unsigned int num_rows,
-			    SLang_Array_Type **atp)
+static int verify_chksum (FitsFile_Type *f, SLang_Ref_Type *dataok, SLang_Ref_Type *hduok)
 {
-   int num_elements;
-   unsigned int i;
-   SLang_Array_Type **ati;
-   SLang_Array_Type *at;
+   Call_Context_Type cc;
+   int status = 0;
+   int dok=0, hok=0;
 
-   *atp = NULL;
-   if (f == NULL)
+   if (f->fptr == NULL)
      return -1;
 
-   num_elements = (int) num_rows;
+   begin_call (&cc, f, "_fits_verify_chksum");
 
-   at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &num_elements, 1);
-   if (at == NULL)
+   if (0 == fast_verify_chksum (f, &dok, &hok, &status))
+     {
+	if ((-1 == SLang_assign_to_ref (dataok, SLANG_INT_TYPE, (VOID_STAR)&dok))
+	    || (-1 == SLang_assign_to_ref (hduok, SLANG_INT_TYPE, (VOID_STAR)&hok)))
+	  status = -1;
+     }
+   return end_call (&cc, status);
+}
+
+static int get_chksum (FitsFile_Type *f, SLang_Ref_Type *datasum, SLang_Ref_Type *hdusum)
+{
+   Call_Context_Type cc;
+   int status = 0;
+   unsigned long dsum, hsum;
+
+   if (f->fptr == NULL)
      return -1;
 
-   ati = (SLang_Array_Type **) at->data;
-   for (i = 0; i < num_rows; i++)
+   begin_call (&cc, f, "_fits_get_chksum");
+
+   if (0 == fits_get_chksum (f->fptr, &dsum, &hsum, &status))
      {
-	long offset;
-	long repeat;
-	unsigned int row;
-	int status = 0;
+	if ((-1 == SLang_assign_to_ref (datasum, SLANG_ULONG_TYPE, (VOID_STAR)&dsum))
+	    || (-1 == SLang_assign_to_ref (hdusum, SLANG_ULONG_TYPE, (VOID_STAR)&hsum)))
+	  status = -1;
+     }
+   return end_call (&cc, status);
+}
 
-	row = firstrow + i;
-	if (0 != fits_read_descript (f, col, row, &repeat, &offset, &status))
-	  {
-	     SLang_free_array (at);
-	     return status;
-	  }
+static int set_bscale (FitsFile_Type *f, double *scale, double *zero)
+{
+   Call_Context_Type cc;
+   int status = 0;
 
-	status = read_column_values (f, ftype, datatype, row, col, 1, repeat, repeat, ati+i);
-	if (status)
-	  {
-	     SLang_free_array (at);
-	     return status;
-	  }
-     }
+   if (f->fptr == NULL)
+     return -1;
 
-   *atp = at;
-   return 0;
+   begin_call (&cc, f, "_fits_set_bscale");
+
+   return end_call (&cc, fits_set_bscale (f->fptr, *scale, *zero, &status));
 }
 
-static int read_col (FitsFile_Type *ft, int *colnum, int *firstrowp,
-		     int *num_rowsp, SLang_Ref_Type *ref)
+static int set_tscale (FitsFile_Type *f, int *colp, double *scale, double *zero)
 {
-   SLang_Array_Type *at;
-   int type;
-   long num_rows;
-   long width;
-   int status;
-   SLtype datatype;
-   int num_columns;
-   int firstrow;
-   long repeat, save_repeat;
-   int col;
+   Call_Context_Type cc;
+   int status = 0;
 
-   if (ft->fptr == NULL)
+   if (f->fptr == NULL)
      return -1;
 
-   status = 0;
-   if (0 != fits_get_num_cols (ft->fptr, &num_columns, &status))
-     return status;
+   begin_call (&cc, f, "_fits_set_tscale");
 
-   if (0 != fits_get_num_rows (ft->fptr, &num_rows, &status))
-     return status;
+   return end_call (&cc, fits_set_tscale (f->fptr, *colp, *scale, *zero, &status));
+}
 
-   if (*num_rowsp <= 0)
+static int trace_start (char *file, int *max_events)
+{
+   if (*max_events < 0)
      {
-	SLang_verror (SL_INVALID_PARM, "Number of rows must positive");
+	SLang_verror (SL_INVALID_PARM, "fits_trace_start: max_events must be non-negative");
 	return -1;
      }
+   return start_trace (file, (unsigned long) *max_events);
+}
 
-   col = *colnum;
+static int trace_stop (void)
+{
+   int status;
 
-   if ((col <= 0) || (col > num_columns))
+   if (Trace_Events == NULL)
+     return 0;
+
+   if (-1 == (status = write_trace_file ()))
+     SLang_verror (SL_WRITE_ERROR, "Unable to write the trace file %s", Trace_File);
+   free_trace ();
+   return status;
+}
+
+static int push_stats (Fits_Stats_Type *s)
+{
+   static SLFUTURE_CONST char *field_names[] =
      {
-	SLang_verror (SL_INVALID_PARM, "Column number out of range");
-	return -1;
-     }
-   firstrow = *firstrowp;
-   if ((firstrow <= 0) || (firstrow > num_rows))
+	"num_calls", "num_reads", "num_writes", "bytes_read", "bytes_written",
+	"num_hdu_moves", "num_key_reads", "secs",
+	"call_names", "call_counts", "call_secs"
+     };
+#define NUM_STATS_FIELDS (sizeof(field_names)/sizeof(field_names[0]))
+   SLtype field_types[NUM_STATS_FIELDS];
+   VOID_STAR field_values[NUM_STATS_FIELDS];
+   SLang_Array_Type *at_names, *at_counts, *at_secs;
+   unsigned int i;
+   int n;
+   int status = -1;
+
+   /* Only the calls that were made with these statistics */
+   n = 0;
+   for (i = 0; i < Num_Call_Names; i++)
+     n += (s->calls[i].num_calls != 0);
+   at_counts = at_secs = NULL;
+   if ((NULL == (at_names = SLang_create_array (SLANG_STRING_TYPE, 0, NULL, &n, 1)))
+       || (NULL == (at_counts = SLang_create_array (SLANG_ULONG_TYPE, 0, NULL, &n, 1)))
+       || (NULL == (at_secs = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, &n, 1))))
+     goto free_and_return;
+
+   n = 0;
+   for (i = 0; i < Num_Call_Names; i++)
      {
-	SLang_verror (SL_INVALID_PARM, "Row number out of range");
-	return -1;
+	if (s->calls[i].num_calls == 0)
+	  continue;
+	if (NULL == (((char **)at_names->data)[n] = SLang_create_slstring (Call_Names[i])))
+	  goto free_and_return;
+	((unsigned long *)at_counts->data)[n] = s->calls[i].num_calls;
+	((double *)at_secs->data)[n] = s->calls[i].secs;
+	n++;
      }
 
-   if (firstrow + *num_rowsp > num_rows + 1)
-     num_rows = num_rows - (firstrow - 1);
-   else
-     num_rows = *num_rowsp;
+   field_types[0] = SLANG_ULONG_TYPE; field_values[0] = &s->num_calls;
+   field_types[1] = SLANG_ULONG_TYPE; field_values[1] = &s->num_reads;
+   field_types[2] = SLANG_ULONG_TYPE; field_values[2] = &s->num_writes;
+   field_types[3] = SLANG_DOUBLE_TYPE; field_values[3] = &s->bytes_read;
+   field_types[4] = SLANG_DOUBLE_TYPE; field_values[4] = &s->bytes_written;
+   field_types[5] = SLANG_ULONG_TYPE; field_values[5] = &s->num_hdu_moves;
+   field_types[6] = SLANG_ULONG_TYPE; field_values[6] = &s->num_key_reads;
+   field_types[7] = SLANG_DOUBLE_TYPE; field_values[7] = &s->secs;
+   field_types[8] = SLANG_ARRAY_TYPE; field_values[8] = &at_names;
+   field_types[9] = SLANG_ARRAY_TYPE; field_values[9] = &at_counts;
+   field_types[10] = SLANG_ARRAY_TYPE; field_values[10] = &at_secs;
+
+   status = SLstruct_create_struct (NUM_STATS_FIELDS, field_names,
+				    field_types, field_values);
+#undef NUM_STATS_FIELDS
 
-   if (0 != GET_COL_TYPE (ft->fptr, col, &type, &repeat, &width, &status))
-     return status;
+   free_and_return:
+   SLang_free_array (at_names);
+   SLang_free_array (at_counts);
+   SLang_free_array (at_secs);
+   return status;
+}
 
-   save_repeat = repeat;
-   if (-1 == map_fitsio_type_to_slang (&type, &repeat, &datatype))
-     return -1;
+/* Usage: Struct_Type _fits_get_stats (fptr or NULL)
+ * If NULL is passed, the statistics aggregated over all handles are returned.
+ */
+static void get_stats (void)
+{
+   SLang_MMT_Type *mmt = NULL;
+   FitsFile_Type *ft;
+   Fits_Stats_Type *s = &Global_Stats;
 
-   if (datatype == SLANG_STRING_TYPE)
+   if (SLANG_NULL_TYPE == SLang_peek_at_stack ())
      {
-	unsigned int num_substrs;
-	/* This assumes an ASCII_TBL, which will always have a
-	 * repeat of 1, and the number of bytes is given by the
-	 * width field.  In contrast, a BINARY_TBL will have
-	 * repeat = number of bytes, and width represents the
-	 * number of bytes in a substring.
-	 */
-	if ((repeat == 1) && (width != 1))
-	  {
-	     num_substrs = 1;
-	     repeat = width;
-	  }
-	else
-	  {
-	     if (width > 0)
-	       num_substrs = repeat/width;
-	     else
-	       num_substrs = 0;
-	  }
-	status = read_string_column (ft->fptr, (type < 0), repeat, num_substrs, col, firstrow, num_rows, &at);
+	if (-1 == SLang_pop_null ())
+	  return;
      }
-   else if (type < 0)
-     status = read_var_column (ft->fptr, -type, datatype, col, firstrow, num_rows, &at);
    else
-     status = read_column_values (ft->fptr, type, datatype, firstrow, col, num_rows, repeat, save_repeat, &at);
+     {
+	if (NULL == (ft = pop_fits_type (&mmt)))
+	  return;
+	s = &ft->stats;
+     }
 
-   if (status)
-     return status;
+   (void) push_stats (s);
+   SLang_free_mmt (mmt);
+}
 
-   if (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR)&at))
-     status = -1;
+/* Usage: _fits_reset_stats (fptr or NULL) */
+static void reset_stats (void)
+{
+   SLang_MMT_Type *mmt;
+   FitsFile_Type *ft;
 
-   SLang_free_array (at);
-   return status;
+   if (SLANG_NULL_TYPE == SLang_peek_at_stack ())
+     {
+	if (0 == SLang_pop_null ())
+	  memset ((char *) &Global_Stats, 0, sizeof (Fits_Stats_Type));
+	return;
+     }
+
+   if (NULL == (ft = pop_fits_type (&mmt)))
+     return;
+   memset ((char *) &ft->stats, 0, sizeof (Fits_Stats_Type));
+   SLang_free_mmt (mmt);
 }
 
+#ifdef HAVE_GZIP_INDEX
+/* The gzidx:// driver gives random access to gzip-compressed files
+ * without decompressing them into memory or a temporary file, as
+ * cfitsio's compress:// driver does.  The first time a file is opened,
+ * one pass over it records an access point every GZIDX_SPAN bytes of
+ * uncompressed data: the position in the compressed stream, and the
+ * 32K of output preceding it, from which inflation may be restarted
+ * (see zlib's examples/zran.c).  A BGZF file (as written by bgzip)
+ * consists of gzip members of at most 64K whose sizes are stored in
+ * their headers and trailers; for such a file every member start serves
+ * as an access point, and the index is built without inflating anything.
+ * The index is saved next to the file with the suffix GZIDX_SUFFIX when
+ * possible, and reused as long as the identity of the file is unchanged:
+ * its size, its mtime and ctime with their nanoseconds, and a CRC of its
+ * first GZIDX_HEAD_BYTES bytes.  Only read-only access is supported.
+ */
+#define GZIDX_WINSIZE	32768
+#define GZIDX_CHUNK	65536
+#define GZIDX_SPAN	(4L*1024L*1024L)
+#define GZIDX_MAGIC	"SLFGZI02"
+#define GZIDX_HEAD_BYTES	4096
+#define GZIDX_SUFFIX	".slgzi"
+#define GZIDX_MAX_HANDLES	64
+
 typedef struct
 {
-   int type;
-   long repeat, width;
-   long repeat_orig;		       /* used for tbit columns */
-   SLtype datatype;
-   unsigned int data_offset;
+   LONGLONG out;		       /* uncompressed offset */
+   LONGLONG in;			       /* compressed offset of the next full byte */
+   int bits;			       /* bits of the byte before in that are still unused */
+   int member_start;		       /* a gzip header starts at in */
+   unsigned char *window;	       /* the preceding 32K of output, NULL at a member start */
 }
-Column_Info_Type;
+Gzidx_Point_Type;
 
-static int read_var_column_data (fitsfile *f, int ftype, SLtype datatype,
-				 int col, unsigned int firstrow, unsigned int num_rows,
-				 SLang_Array_Type **at_data)
+typedef struct
 {
-   unsigned int i;
+   LONGLONG size;
+   LONGLONG mtime, mtime_nsec;
+   LONGLONG ctime, ctime_nsec;
+   LONGLONG head_crc;
+}
+Gzidx_File_Id_Type;
 
-   for (i = 0; i < num_rows; i++)
-     {
-	long offset;
-	long repeat;
-	unsigned int row;
-	int status = 0;
+typedef struct _Gzidx_Index_Type
+{
+   struct _Gzidx_Index_Type *next;
+   unsigned int ref_count;
+   char *filename;
+   Gzidx_File_Id_Type id;
+   LONGLONG total_out;
+   unsigned int num_points, max_points;
+   Gzidx_Point_Type *points;
+}
+Gzidx_Index_Type;
 
-	row = firstrow + i;
-	if (0 != fits_read_descript (f, col, row, &repeat, &offset, &status))
-	  return status;
+typedef struct
+{
+   int fd;
+   Gzidx_Index_Type *index;
+   z_stream strm;
+   int strm_active;
+   int raw;			       /* a gzip trailer follows the deflate data */
+   int at_eof;
+   LONGLONG pos;		       /* uncompressed offset of the stream */
+   LONGLONG in_pos;		       /* offset of the next compressed input */
+   LONGLONG seek_pos;		       /* set by the seek callback */
+   unsigned char in[GZIDX_CHUNK];
+   unsigned char discard[GZIDX_WINSIZE];
+}
+Gzidx_File_Type;
+
+/* Declared in fitsio2.h, which is not meant for applications */
+extern int fits_init_cfitsio (void);
+extern int fits_register_driver (char *prefix,
+				 int (*init)(void), int (*shutdown)(void),
+				 int (*setoptions)(int), int (*getoptions)(int *),
+				 int (*getversion)(int *),
+				 int (*checkfile)(char *, char *, char *),
+				 int (*open)(char *, int, int *), int (*create)(char *, int *),
+				 int (*truncate)(int, LONGLONG), int (*close)(int),
+				 int (*remove)(char *), int (*size)(int, LONGLONG *),
+				 int (*flush)(int), int (*seek)(int, LONGLONG),
+				 int (*read)(int, void *, long), int (*write)(int, void *, long));
+
+static Gzidx_File_Type *Gzidx_Files[GZIDX_MAX_HANDLES];
+static Gzidx_Index_Type *Gzidx_Indices = NULL;
+
+#ifdef HAVE_FITS_THREADS
+static pthread_mutex_t Gzidx_Mutex = PTHREAD_MUTEX_INITIALIZER;
+# define GZIDX_LOCK	pthread_mutex_lock (&Gzidx_Mutex)
+# define GZIDX_UNLOCK	pthread_mutex_unlock (&Gzidx_Mutex)
+#else
+# define GZIDX_LOCK
+# define GZIDX_UNLOCK
+#endif
 
-	status = read_column_values (f, ftype, datatype, row, col, 1, repeat, repeat, at_data+i);
-	if (status)
-	  return status;
-     }
-   return 0;
+/* The driver functions may be called by any thread that opens a file,
+ * e.g., the workers of fits_scan_headers, so they use malloc and free
+ * rather than the S-Lang allocation functions.
+ */
+static char *gzidx_make_string (const char *s)
+{
+   char *t = (char *) malloc (strlen (s) + 1);
+   if (t != NULL)
+     strcpy (t, s);
+   return t;
 }
 
-static int read_string_column_data (fitsfile *f, int is_var, long repeat, unsigned int num_substrs, int col,
-				    long firstrow, unsigned int num_rows,
-				    char **strs)
+static void free_gzidx_index (Gzidx_Index_Type *idx)
 {
    unsigned int i;
-   int status = 0;
-
-   for (i = 0; i < num_rows; i++)
-     {
-	long offset;
-	long row;
-
-	row = firstrow + i;
-	if (is_var)
-	  {
-	     if (0 != fits_read_descript (f, col, row, &repeat, &offset, &status))
-	       return status;
-	  }
 
-	status = read_string_cell (f, row, col, repeat, num_substrs, strs + i);
-	if (status != 0)
-	  return status;
-     }
-   return 0;
+   if (idx == NULL)
+     return;
+   for (i = 0; i < idx->num_points; i++)
+     free (idx->points[i].window);
+   free (idx->points);
+   free (idx->filename);
+   free (idx);
 }
 
-/* Usage: read_cols (ft, [columns...], firstrow, nrows, &ref) */
-/* TODO: Add support for the following calling convention:
- *    read_cols (ft, [columns...], [rows], &ref)
- * Here rows is an integer-valued array that specifies what rows to be
- * read.
+/* The window is the circular buffer used for the output, of which the
+ * last left bytes are unused.
  */
-static int read_cols (void)
+static int gzidx_add_point (Gzidx_Index_Type *idx, LONGLONG out, LONGLONG in, int bits,
+			    unsigned char *window, unsigned int left)
 {
-   SLang_MMT_Type *mmt;
-   FitsFile_Type *ft;
-   fitsfile *f;
-   int status;
-   int num_columns_in_table;
-   long num_rows_in_table, delta_rows;
-   int num_rows;
-   int firstrow;
-   int *cols;
-   int num_cols;
-   int i;
-   SLang_Ref_Type *ref;
-   Column_Info_Type *ci = NULL;
-   SLang_Array_Type *data_arrays_at = NULL;
-   SLang_Array_Type **data_arrays = NULL;
-   SLang_Array_Type *columns_at = NULL;
+   Gzidx_Point_Type *p;
 
-   if (-1 == SLang_pop_ref (&ref))
-     return -1;
-   if ((-1 == SLang_pop_integer (&num_rows))
-       || (-1 == SLang_pop_integer (&firstrow))
-       || (-1 == SLang_pop_array (&columns_at, 1)))
+   if (idx->num_points == idx->max_points)
      {
-	SLang_free_ref (ref);
-	return -1;
+	unsigned int max_points = 2 * idx->max_points + 16;
+	p = (Gzidx_Point_Type *) realloc (idx->points, max_points * sizeof (Gzidx_Point_Type));
+	if (p == NULL)
+	  return -1;
+	idx->points = p;
+	idx->max_points = max_points;
      }
-   if (NULL == (ft = pop_fits_type (&mmt)))
+
+   p = idx->points + idx->num_points;
+   p->out = out;
+   p->in = in;
+   p->bits = bits;
+   p->member_start = (window == NULL);
+   p->window = NULL;
+   if (window != NULL)
      {
-	SLang_free_array (columns_at);
-	SLang_free_ref (ref);
-	return -1;
+	if (NULL == (p->window = (unsigned char *) malloc (GZIDX_WINSIZE)))
+	  return -1;
+	if (left)
+	  memcpy (p->window, window + GZIDX_WINSIZE - left, left);
+	if (left < GZIDX_WINSIZE)
+	  memcpy (p->window + left, window, GZIDX_WINSIZE - left);
      }
+   idx->num_points++;
+   return 0;
+}
 
-   status = -1;
-   f = ft->fptr;
-   if (f == NULL)
-     goto free_and_return_status;
+static unsigned int gzidx_get_le (unsigned char *p, unsigned int n)
+{
+   unsigned int v = 0;
+   while (n--)
+     v = (v << 8) | p[n];
+   return v;
+}
 
-   status = 0;
-   if ((0 != fits_get_num_cols (f, &num_columns_in_table, &status))
-       || (0 != fits_get_num_rows (f, &num_rows_in_table, &status)))
-     goto free_and_return_status;
+/* Returns 1 if a gzip member starts at offset.  Like gzip, zero padding
+ * or other data after the last member is ignored.
+ */
+static int gzidx_member_follows (int fd, LONGLONG offset)
+{
+   unsigned char magic[2];
 
-   if (num_rows < 0)
-     {
-	SLang_verror (SL_INVALID_PARM, "Number of rows must be non-negative");
-	status = -1;
-	goto free_and_return_status;
-     }
+   return ((2 == pread (fd, magic, 2, offset))
+	   && (magic[0] == 0x1f) && (magic[1] == 0x8b));
+}
 
-   if ((firstrow <= 0)
-       || ((firstrow > num_rows_in_table) && (num_rows > 0)))
+/* Returns 1 if the file consists of BGZF members, whose starts are then
+ * the access points, 0 if not, or -1 upon a read error.
+ */
+static int gzidx_scan_bgzf (int fd, Gzidx_Index_Type *idx)
+{
+   unsigned char h[12], extra[65536], isize[4];
+   LONGLONG in = 0, out = 0;
+
+   while (in < idx->id.size)
      {
-	SLang_verror (SL_INVALID_PARM, "Row number out of range");
-	return -1;
-     }
+	unsigned int xlen, i, bsize = 0;
+
+	if ((in > 0) && (0 == gzidx_member_follows (fd, in)))
+	  break;
+	if ((12 != pread (fd, h, 12, in))
+	    || (h[0] != 0x1f) || (h[1] != 0x8b) || (h[2] != 8) || (0 == (h[3] & 4)))
+	  return 0;
+	xlen = gzidx_get_le (h + 10, 2);
+	if ((ssize_t) xlen != pread (fd, extra, xlen, in + 12))
+	  return 0;
+	for (i = 0; i + 4 <= xlen; i += 4 + gzidx_get_le (extra + i + 2, 2))
+	  {
+	     if ((extra[i] == 'B') && (extra[i+1] == 'C')
+		 && (gzidx_get_le (extra + i + 2, 2) == 2) && (i + 6 <= xlen))
+	       {
+		  bsize = 1 + gzidx_get_le (extra + i + 4, 2);
+		  break;
+	       }
+	  }
+	if ((bsize < 12 + xlen + 8) || (in + bsize > idx->id.size)
+	    || (4 != pread (fd, isize, 4, in + bsize - 4)))
+	  return 0;
 
-   if (firstrow + num_rows > num_rows_in_table + 1)
-     num_rows = num_rows_in_table - (firstrow - 1);
+	if (-1 == gzidx_add_point (idx, out, in, 0, NULL, 0))
+	  return -1;
+	out += gzidx_get_le (isize, 4);
+	in += bsize;
+     }
+   idx->total_out = out;
+   return (idx->num_points > 0);
+}
 
-   cols = (int *)columns_at->data;
-   num_cols = columns_at->num_elements;
+/* Inflate the whole file, adding an access point every GZIDX_SPAN bytes */
+static int gzidx_build_index (int fd, Gzidx_Index_Type *idx)
+{
+   z_stream strm;
+   unsigned char *window, *input;
+   LONGLONG totin = 0, totout = 0, last = 0, rdpos = 0;
+   int ret = Z_OK, in_member = 1;
+   int status = -1;
+
+   window = (unsigned char *) malloc (GZIDX_WINSIZE + GZIDX_CHUNK);
+   if (window == NULL)
+     return -1;
+   input = window + GZIDX_WINSIZE;
 
-   if (NULL == (ci = (Column_Info_Type *) SLmalloc (num_cols*sizeof (Column_Info_Type))))
+   memset ((char *) &strm, 0, sizeof (z_stream));
+   if (Z_OK != inflateInit2 (&strm, 47))    /* gzip or zlib header */
      {
-	status = -1;
-	goto free_and_return_status;
+	free (window);
+	return -1;
      }
 
-   data_arrays_at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &num_cols, 1);
-   if (data_arrays_at == NULL)
-     {
-	status = -1;
-	goto free_and_return_status;
-     }
-   data_arrays = (SLang_Array_Type **)data_arrays_at->data;
+   if (-1 == gzidx_add_point (idx, 0, 0, 0, NULL, 0))
+     goto free_and_return;
 
-   for (i = 0; i < num_cols; i++)
+   strm.avail_in = 0;
+   strm.avail_out = 0;
+   while (1)
      {
-	SLang_Array_Type *at;
-	SLtype datatype;
-	long repeat;
-	int type;
-	int col;
-
-	col = cols[i];
-	if ((col <= 0) || (col > num_columns_in_table))
+	if (strm.avail_in == 0)
 	  {
-	     SLang_verror (SL_INVALID_PARM, "Column number out of range");
-	     status = -1;
-	     goto free_and_return_status;
+	     ssize_t n = pread (fd, input, GZIDX_CHUNK, rdpos);
+	     if (n < 0)
+	       goto free_and_return;
+	     if (n == 0)
+	       {
+		  if (in_member)
+		    goto free_and_return;       /* truncated */
+		  break;
+	       }
+	     rdpos += n;
+	     strm.next_in = input;
+	     strm.avail_in = (uInt) n;
 	  }
 
-	if (0 != GET_COL_TYPE (f, col, &type, &repeat, &ci[i].width, &status))
-	  goto free_and_return_status;
-
-	ci[i].repeat_orig = repeat;
-	if (-1 == map_fitsio_type_to_slang (&type, &repeat, &datatype))
+	if (in_member == 0)
 	  {
-	     status = -1;
-	     goto free_and_return_status;
-	  }
-	ci[i].repeat = repeat;
-	ci[i].type = type;
-	ci[i].datatype = datatype;
-	ci[i].data_offset = 0;
+	     if (0 == gzidx_member_follows (fd, totin))
+	       break;
 
-	if (datatype == SLANG_STRING_TYPE)
-	  {
-	     at = SLang_create_array (SLANG_STRING_TYPE, 0, NULL, &num_rows, 1);
-	  }
-	else if (type < 0)	       /* variable length */
-	  {
-	     if (-type == TBIT)
+	     /* Another gzip member follows */
+	     if (Z_OK != inflateReset (&strm))
+	       goto free_and_return;
+	     if (totout - last > GZIDX_SPAN)
 	       {
-		  SLang_verror (SL_NOT_IMPLEMENTED, "Read bit-data from the heap is not supported.  Please report this problem");
-		  status = -1;
-		  goto free_and_return_status;
+		  if (-1 == gzidx_add_point (idx, totout, totin, 0, NULL, 0))
+		    goto free_and_return;
+		  last = totout;
 	       }
-	     at = SLang_create_array (SLANG_ARRAY_TYPE, 0, NULL, &num_rows, 1);
+	     in_member = 1;
 	  }
-	else
+
+	if (strm.avail_out == 0)
 	  {
-	     int dims[2];
-	     int num_dims = 1;
-	     dims[0] = num_rows;
-	     if (repeat > 1)
-	       {
-		  dims[1] = repeat;
-		  num_dims++;
-	       }
-	     at = SLang_create_array (datatype, 0, NULL, dims, num_dims);
+	     strm.avail_out = GZIDX_WINSIZE;
+	     strm.next_out = window;
 	  }
 
-	if (at == NULL)
+	totin += strm.avail_in;
+	totout += strm.avail_out;
+	ret = inflate (&strm, Z_BLOCK);
+	totin -= strm.avail_in;
+	totout -= strm.avail_out;
+
+	if ((ret == Z_NEED_DICT) || (ret == Z_DATA_ERROR) || (ret == Z_MEM_ERROR))
+	  goto free_and_return;
+	if (ret == Z_STREAM_END)
 	  {
-	     status = -1;
-	     goto free_and_return_status;
+	     in_member = 0;
+	     continue;
 	  }
-	data_arrays[i] = at;
-     }
 
-   if (fits_get_rowsize (f, &delta_rows, &status))
-     goto free_and_return_status;
+	/* At the end of a deflate block, but not of the last one */
+	if ((strm.data_type & 128) && (0 == (strm.data_type & 64))
+	    && (totout - last > GZIDX_SPAN))
+	  {
+	     if (-1 == gzidx_add_point (idx, totout, totin, strm.data_type & 7,
+					window, strm.avail_out))
+	       goto free_and_return;
+	     last = totout;
+	  }
+     }
 
-   if (delta_rows < 1)
-     delta_rows = 1;
+   idx->total_out = totout;
+   status = 0;
 
-   while (num_rows)
-     {
-	if (num_rows < delta_rows)
-	  delta_rows = num_rows;
+free_and_return:
+   (void) inflateEnd (&strm);
+   free (window);
+   return status;
+}
 
-	for (i = 0; i < num_cols; i++)
-	  {
-	     SLtype datatype = ci[i].datatype;
-	     int type = ci[i].type;
-	     long repeat = ci[i].repeat;
-	     int col = cols[i];
-	     SLang_Array_Type *at = data_arrays[i];
-	     unsigned int data_offset = ci[i].data_offset;
+static char *gzidx_sidecar_name (char *filename)
+{
+   char *name = (char *) malloc (strlen (filename) + strlen (GZIDX_SUFFIX) + 16);
+   if (name != NULL)
+     sprintf (name, "%s%s", filename, GZIDX_SUFFIX);
+   return name;
+}
 
-	     if (datatype == SLANG_STRING_TYPE)
-	       {
-		  unsigned int num_substrs;
-		  /* This assumes an ASCII_TBL, which will always have a
-		   * repeat of 1, and the number of bytes is given by the
-		   * width field.  In contrast, a BINARY_TBL will have
-		   * repeat = number of bytes, and width represents the
-		   * number of bytes in a substring.
-		   */
-		  if ((repeat == 1) && (ci[i].width != 1))
-		    {
-		       repeat = ci[i].width;
-		       num_substrs = 1;
-		    }
-		  else
-		    {
-		       if (ci[i].width > 0)
-			 num_substrs = repeat / ci[i].width;
-		       else
-			 num_substrs = 0;
-		    }
+typedef struct
+{
+   char magic[8];
+   Gzidx_File_Id_Type id;
+   LONGLONG span;
+   LONGLONG total_out, num_points;
+}
+Gzidx_Header_Type;
 
-		  status = read_string_column_data (f, (type < 0), repeat, num_substrs, col, firstrow, delta_rows,
-						    (char **)at->data + data_offset);
-		  data_offset += delta_rows;
-	       }
-	     else if (type < 0)
-	       {
-		  status = read_var_column_data (f, -type, datatype, col, firstrow, delta_rows,
-						 (SLang_Array_Type **)at->data + data_offset);
-		  data_offset += delta_rows;
-	       }
-	     else
-	       {
-		  unsigned int num_elements = repeat * delta_rows;
-		  unsigned char *data = (unsigned char *)at->data + data_offset;
-		  /* int anynul; */
+typedef struct
+{
+   LONGLONG out, in;
+   int bits, member_start;
+}
+Gzidx_Record_Type;
 
-		  if (type == TBIT)
-		    status = read_bit_column (f, col, firstrow, 1, num_elements, data, at->sizeof_type, ci[i].repeat_orig);
-		  else
-		    (void) fits_read_col (f, type, col, firstrow, 1, num_elements, NULL,
-					  data, NULL, &status);
+static int gzidx_read_sidecar (Gzidx_Index_Type *idx)
+{
+   Gzidx_Header_Type h;
+   Gzidx_Record_Type rec;
+   char *name;
+   FILE *fp;
+   LONGLONG i;
+   int status = -1;
 
-		  data_offset += num_elements * at->sizeof_type;
-	       }
-	     ci[i].data_offset = data_offset;
+   if (NULL == (name = gzidx_sidecar_name (idx->filename)))
+     return -1;
+   fp = fopen (name, "rb");
+   free (name);
+   if (fp == NULL)
+     return -1;
 
-	     if (status)
-	       goto free_and_return_status;
-	  }
-	firstrow += delta_rows;
-	num_rows -= delta_rows;
+   if ((1 != fread ((char *) &h, sizeof (h), 1, fp))
+       || memcmp (h.magic, GZIDX_MAGIC, 8)
+       || memcmp ((char *) &h.id, (char *) &idx->id, sizeof (Gzidx_File_Id_Type))
+       || (h.num_points < 1))
+     goto close_and_return;
+
+   for (i = 0; i < h.num_points; i++)
+     {
+	unsigned char window[GZIDX_WINSIZE];
+
+	if (1 != fread ((char *) &rec, sizeof (rec), 1, fp))
+	  goto close_and_return;
+	if ((0 == rec.member_start)
+	    && (1 != fread ((char *) window, GZIDX_WINSIZE, 1, fp)))
+	  goto close_and_return;
+	if (-1 == gzidx_add_point (idx, rec.out, rec.in, rec.bits,
+				   rec.member_start ? NULL : window, 0))
+	  goto close_and_return;
      }
+   idx->total_out = h.total_out;
+   status = 0;
 
+close_and_return:
+   fclose (fp);
    if (status)
-     return status;
+     {
+	/* Discard a partially read index */
+	for (i = 0; i < idx->num_points; i++)
+	  free (idx->points[i].window);
+	idx->num_points = 0;
+     }
+   return status;
+}
 
-   if (-1 == SLang_assign_to_ref (ref, SLANG_ARRAY_TYPE, (VOID_STAR)&data_arrays_at))
-     status = -1;
+/* Failing to save the index is not an error */
+static void gzidx_write_sidecar (Gzidx_Index_Type *idx)
+{
+   Gzidx_Header_Type h;
+   char *name, *tmp;
+   FILE *fp;
+   unsigned int i;
+   int ok;
 
-   /* drop */
+   if (NULL == (name = gzidx_sidecar_name (idx->filename)))
+     return;
+   if (NULL == (tmp = (char *) malloc (strlen (name) + 32)))
+     {
+	free (name);
+	return;
+     }
+   sprintf (tmp, "%s.%ld", name, (long) getpid ());
 
-   free_and_return_status:
-   SLfree ((char *)ci);
-   SLang_free_mmt (mmt);
-   SLang_free_array (columns_at);
-   SLang_free_ref (ref);
-   SLang_free_array (data_arrays_at);
+   if (NULL == (fp = fopen (tmp, "wb")))
+     goto free_and_return;
 
-   return status;
+   memset ((char *) &h, 0, sizeof (h));
+   memcpy (h.magic, GZIDX_MAGIC, 8);
+   h.id = idx->id;
+   h.span = GZIDX_SPAN;
+   h.total_out = idx->total_out;
+   h.num_points = idx->num_points;
+   ok = (1 == fwrite ((char *) &h, sizeof (h), 1, fp));
+   for (i = 0; ok && (i < idx->num_points); i++)
+     {
+	Gzidx_Point_Type *p = idx->points + i;
+	Gzidx_Record_Type rec;
+	memset ((char *) &rec, 0, sizeof (rec));
+	rec.out = p->out;
+	rec.in = p->in;
+	rec.bits = p->bits;
+	rec.member_start = p->member_start;
+	ok = ((1 == fwrite ((char *) &rec, sizeof (rec), 1, fp))
+	      && ((p->window == NULL)
+		  || (1 == fwrite ((char *) p->window, GZIDX_WINSIZE, 1, fp))));
+     }
+   if ((0 == fclose (fp)) && ok && (0 == rename (tmp, name)))
+     goto free_and_return;
+   (void) remove (tmp);
+
+free_and_return:
+   free (tmp);
+   free (name);
 }
 
-static void clear_errmsg (void)
+static int gzidx_get_file_id (int fd, Gzidx_File_Id_Type *id)
 {
-   fits_clear_errmsg ();
+   unsigned char head[GZIDX_HEAD_BYTES];
+   struct stat st;
+   ssize_t n;
+
+   if ((-1 == fstat (fd, &st))
+       || (-1 == (n = pread (fd, head, GZIDX_HEAD_BYTES, 0))))
+     return -1;
+
+   memset ((char *) id, 0, sizeof (Gzidx_File_Id_Type));
+   id->size = (LONGLONG) st.st_size;
+   id->mtime = (LONGLONG) st.st_mtime;
+   id->mtime_nsec = STAT_MTIME_NSEC(st);
+   id->ctime = (LONGLONG) st.st_ctime;
+   id->ctime_nsec = STAT_CTIME_NSEC(st);
+   id->head_crc = (LONGLONG) crc32 (crc32 (0L, Z_NULL, 0), head, (uInt) n);
+   return 0;
 }
 
-static void get_errstatus (int *status)
+/* Called with the lock held */
+static Gzidx_Index_Type *gzidx_find_index (char *filename, Gzidx_File_Id_Type *id)
 {
-   char errbuf [FLEN_ERRMSG];
+   Gzidx_Index_Type *idx;
 
-   *errbuf = 0;
-   fits_get_errstatus (*status, errbuf);
-   (void) SLang_push_string (errbuf);
+   for (idx = Gzidx_Indices; idx != NULL; idx = idx->next)
+     {
+	if ((0 == strcmp (idx->filename, filename))
+	    && (0 == memcmp ((char *) &idx->id, (char *) id, sizeof (Gzidx_File_Id_Type))))
+	  {
+	     idx->ref_count++;
+	     return idx;
+	  }
+     }
+   return NULL;
 }
 
-static void read_errmsg (void)
+/* Returns the index of the file, which is shared by all of its handles.
+ * The index is built without holding the lock, so that opening a large
+ * file does not block the other handles.  If two threads index the same
+ * file at once, the first one to finish wins.
+ */
+static Gzidx_Index_Type *gzidx_get_index (char *filename, int fd)
 {
-   char errbuf [FLEN_ERRMSG];
+   Gzidx_Index_Type *idx, *other;
+   Gzidx_File_Id_Type id;
+   int ret;
 
-   if (0 == fits_read_errmsg (errbuf))
-     (void) SLang_push_null ();
-   else
-     (void) SLang_push_string (errbuf);
+   if (-1 == gzidx_get_file_id (fd, &id))
+     return NULL;
+
+   GZIDX_LOCK;
+   idx = gzidx_find_index (filename, &id);
+   GZIDX_UNLOCK;
+   if (idx != NULL)
+     return idx;
+
+   if (NULL == (idx = (Gzidx_Index_Type *) calloc (1, sizeof (Gzidx_Index_Type))))
+     return NULL;
+   if (NULL == (idx->filename = gzidx_make_string (filename)))
+     {
+	free (idx);
+	return NULL;
+     }
+   idx->id = id;
+
+   if (-1 == gzidx_read_sidecar (idx))
+     {
+	if (0 == (ret = gzidx_scan_bgzf (fd, idx)))
+	  {
+	     unsigned int i;
+	     for (i = 0; i < idx->num_points; i++)
+	       free (idx->points[i].window);
+	     idx->num_points = 0;
+	     ret = gzidx_build_index (fd, idx);
+	  }
+	if (ret == -1)
+	  {
+	     free_gzidx_index (idx);
+	     return NULL;
+	  }
+	gzidx_write_sidecar (idx);
+     }
+
+   GZIDX_LOCK;
+   if (NULL != (other = gzidx_find_index (filename, &id)))
+     {
+	GZIDX_UNLOCK;
+	free_gzidx_index (idx);
+	return other;
+     }
+   idx->ref_count = 1;
+   idx->next = Gzidx_Indices;
+   Gzidx_Indices = idx;
+   GZIDX_UNLOCK;
+   return idx;
 }
 
-static int get_num_keys (FitsFile_Type *f, SLang_Ref_Type *ref)
+static void gzidx_release_index (Gzidx_Index_Type *idx)
 {
-   int status = 0;
-   int nkeys;
+   Gzidx_Index_Type **p;
 
-   if (f->fptr == NULL)
+   if (--idx->ref_count)
+     return;
+   for (p = &Gzidx_Indices; *p != NULL; p = &(*p)->next)
+     {
+	if (*p == idx)
+	  {
+	     *p = idx->next;
+	     break;
+	  }
+     }
+   free_gzidx_index (idx);
+}
+
+/* Restart the inflation at an access point */
+static int gzidx_start_at (Gzidx_File_Type *g, Gzidx_Point_Type *p)
+{
+   if (g->strm_active)
+     (void) inflateEnd (&g->strm);
+   memset ((char *) &g->strm, 0, sizeof (z_stream));
+   g->strm_active = 0;
+   if (Z_OK != inflateInit2 (&g->strm, p->member_start ? 47 : -15))
      return -1;
-   if (0 == fits_get_hdrspace (f->fptr, &nkeys, NULL, &status))
-     return SLang_assign_to_ref (ref, SLANG_INT_TYPE, (VOID_STAR) &nkeys);
+   g->strm_active = 1;
+   g->raw = (p->member_start == 0);
+   g->at_eof = 0;
+   g->pos = p->out;
+   g->in_pos = p->in;
 
-   return status;
+   if (p->bits)
+     {
+	unsigned char c;
+	if ((1 != pread (g->fd, &c, 1, p->in - 1))
+	    || (Z_OK != inflatePrime (&g->strm, p->bits, c >> (8 - p->bits))))
+	  return -1;
+     }
+   if ((p->window != NULL)
+       && (Z_OK != inflateSetDictionary (&g->strm, p->window, GZIDX_WINSIZE)))
+     return -1;
+   return 0;
 }
 
-static int get_keytype (FitsFile_Type *f, char *name, SLang_Ref_Type *v)
+static int gzidx_fill_input (Gzidx_File_Type *g)
 {
-   int status = 0;
-   int type;
-
-   if (f->fptr == NULL)
+   ssize_t n = pread (g->fd, g->in, GZIDX_CHUNK, g->in_pos);
+   if (n <= 0)
      return -1;
-   if (0 == (status = do_get_keytype (f->fptr, name, &type)))
-     return SLang_assign_to_ref (v, SLANG_DATATYPE_TYPE, (VOID_STAR) &type);
+   g->in_pos += n;
+   g->strm.next_in = g->in;
+   g->strm.avail_in = (uInt) n;
+   return 0;
+}
 
-   return status;
+/* Called at the end of a deflate stream to move to the next member */
+static int gzidx_next_member (Gzidx_File_Type *g)
+{
+   z_stream *s = &g->strm;
+
+   if (g->raw)
+     {
+	/* Skip the CRC and size that end a gzip member */
+	unsigned int n = 8;
+	while (n)
+	  {
+	     unsigned int k;
+	     if ((s->avail_in == 0) && (-1 == gzidx_fill_input (g)))
+	       return -1;
+	     k = (s->avail_in < n) ? s->avail_in : n;
+	     s->next_in += k;
+	     s->avail_in -= k;
+	     n -= k;
+	  }
+     }
+
+   if (((s->avail_in == 0) && (-1 == gzidx_fill_input (g)))
+       || (0 == gzidx_member_follows (g->fd, g->in_pos - s->avail_in)))
+     {
+	g->at_eof = 1;
+	return 0;
+     }
+   if (Z_OK != inflateReset2 (s, 47))
+     return -1;
+   g->raw = 0;
+   return 0;
 }
 
-#if 0
-static int _read_key_n (FitsFile_Type *f, SLang_Ref_Type *v, SLang_Ref_Type *c)
+/* Inflate n bytes into buf, or discard them if buf is NULL */
+static int gzidx_inflate (Gzidx_File_Type *g, unsigned char *buf, LONGLONG n)
 {
-   int status = 0;
+   z_stream *s = &g->strm;
 
-   if (fits_get_keytype (card, &type, &status))
-     return status;
-   switch (type)
+   while (n > 0)
      {
-      case 'C':			       /* string */
-	break;
+	uInt want = (n > GZIDX_WINSIZE) ? GZIDX_WINSIZE : (uInt) n;
+	int ret;
 
-      case 'L':			       /* logical */
-	break;
+	if (g->at_eof)
+	  return -1;
+	if ((s->avail_in == 0) && (-1 == gzidx_fill_input (g)))
+	  return -1;
 
-      case 'I':			       /* integer */
-	break;
+	s->next_out = (buf == NULL) ? g->discard : buf;
+	s->avail_out = want;
+	ret = inflate (s, Z_NO_FLUSH);
+	if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR))
+	  return -1;
 
-      case 'F':			       /* floating point */
-	break;
+	want -= s->avail_out;
+	g->pos += want;
+	n -= want;
+	if (buf != NULL)
+	  buf += want;
 
-      case 'X':			       /* complex */
-	break;
+	if ((ret == Z_STREAM_END) && (-1 == gzidx_next_member (g)))
+	  return -1;
      }
+   return 0;
 }
-#endif
 
-static void get_version (void)
+static Gzidx_File_Type *gzidx_get_file (int handle)
 {
-   float v;
-   (void) fits_get_version (&v);
-   (void) SLang_push_float (v);
+   if ((handle < 0) || (handle >= GZIDX_MAX_HANDLES))
+     return NULL;
+   return Gzidx_Files[handle];
 }
 
-static int get_keyclass (char *card)
+static int gzidx_init (void)
 {
-   return fits_get_keyclass (card);
+   return 0;
 }
 
-static int do_fits_fun_f(int (*fun)(fitsfile *, int *), FitsFile_Type *f)
+static int gzidx_shutdown (void)
 {
-   int status = 0;
+   return 0;
+}
 
-   if (f->fptr == NULL)
-     return -1;
+static int gzidx_setoptions (int options)
+{
+   (void) options;
+   return 0;
+}
 
-   (void) (*fun) (f->fptr, &status);
-   return status;
+static int gzidx_getoptions (int *options)
+{
+   *options = 0;
+   return 0;
 }
 
-static int write_chksum (FitsFile_Type *f)
+static int gzidx_getversion (int *version)
 {
-   return do_fits_fun_f (fits_write_chksum, f);
+   *version = 10;
+   return 0;
 }
-static int update_chksum (FitsFile_Type *f)
+
+static int gzidx_checkfile (char *urltype, char *infile, char *outfile)
 {
-   return do_fits_fun_f (fits_update_chksum, f);
+   (void) urltype; (void) infile; (void) outfile;
+   return 0;
 }
 
-static int verify_chksum (FitsFile_Type *f, SLang_Ref_Type *dataok, SLang_Ref_Type *hduok)
+static int gzidx_open (char *filename, int rwmode, int *handle)
 {
-   int status = 0;
-   int dok=0, hok=0;
+   Gzidx_File_Type *g;
+   int i;
 
-   if (f->fptr == NULL)
-     return -1;
+   *handle = -1;
+   if (rwmode != READONLY)
+     {
+	ffpmsg ("gzidx:// files may only be opened read-only");
+	return READONLY_FILE;
+     }
 
-   if (0 == fits_verify_chksum (f->fptr, &dok, &hok, &status))
+   if (NULL == (g = (Gzidx_File_Type *) calloc (1, sizeof (Gzidx_File_Type))))
+     return MEMORY_ALLOCATION;
+   if (-1 == (g->fd = open (filename, O_RDONLY)))
      {
-	if ((-1 == SLang_assign_to_ref (dataok, SLANG_INT_TYPE, (VOID_STAR)&dok))
-	    || (-1 == SLang_assign_to_ref (hduok, SLANG_INT_TYPE, (VOID_STAR)&hok)))
-	  status = -1;
+	free (g);
+	return FILE_NOT_OPENED;
      }
-   return status;
+
+   if (NULL == (g->index = gzidx_get_index (filename, g->fd)))
+     {
+	ffpmsg ("gzidx://: unable to index the gzip file");
+	(void) close (g->fd);
+	free (g);
+	return FILE_NOT_OPENED;
+     }
+
+   GZIDX_LOCK;
+   for (i = 0; i < GZIDX_MAX_HANDLES; i++)
+     {
+	if (Gzidx_Files[i] == NULL)
+	  break;
+     }
+   if (i == GZIDX_MAX_HANDLES)
+     {
+	gzidx_release_index (g->index);
+	GZIDX_UNLOCK;
+	ffpmsg ("gzidx://: too many open files");
+	(void) close (g->fd);
+	free (g);
+	return TOO_MANY_FILES;
+     }
+   Gzidx_Files[i] = g;
+   GZIDX_UNLOCK;
+
+   *handle = i;
+   return 0;
 }
 
-static int get_chksum (FitsFile_Type *f, SLang_Ref_Type *datasum, SLang_Ref_Type *hdusum)
+static int gzidx_create (char *filename, int *handle)
 {
-   int status = 0;
-   unsigned long dsum, hsum;
+   (void) filename;
+   *handle = -1;
+   return FILE_NOT_CREATED;
+}
 
-   if (f->fptr == NULL)
-     return -1;
+static int gzidx_truncate (int handle, LONGLONG size)
+{
+   (void) handle; (void) size;
+   return READONLY_FILE;
+}
 
-   if (0 == fits_get_chksum (f->fptr, &dsum, &hsum, &status))
-     {
-	if ((-1 == SLang_assign_to_ref (datasum, SLANG_ULONG_TYPE, (VOID_STAR)&dsum))
-	    || (-1 == SLang_assign_to_ref (hdusum, SLANG_ULONG_TYPE, (VOID_STAR)&hsum)))
-	  status = -1;
-     }
-   return status;
+static int gzidx_close (int handle)
+{
+   Gzidx_File_Type *g = gzidx_get_file (handle);
+
+   if (g == NULL)
+     return FILE_NOT_CLOSED;
+
+   GZIDX_LOCK;
+   Gzidx_Files[handle] = NULL;
+   gzidx_release_index (g->index);
+   GZIDX_UNLOCK;
+
+   if (g->strm_active)
+     (void) inflateEnd (&g->strm);
+   (void) close (g->fd);
+   free (g);
+   return 0;
 }
 
-static int set_bscale (FitsFile_Type *f, double *scale, double *zero)
+static int gzidx_remove (char *filename)
 {
-   int status = 0;
+   (void) filename;
+   return FILE_NOT_OPENED;
+}
 
-   if (f->fptr == NULL)
-     return -1;
+static int gzidx_size (int handle, LONGLONG *size)
+{
+   Gzidx_File_Type *g = gzidx_get_file (handle);
+   if (g == NULL)
+     return READ_ERROR;
+   *size = g->index->total_out;
+   return 0;
+}
 
-   return fits_set_bscale (f->fptr, *scale, *zero, &status);
+static int gzidx_flush (int handle)
+{
+   (void) handle;
+   return 0;
 }
 
-static int set_tscale (FitsFile_Type *f, int *colp, double *scale, double *zero)
+static int gzidx_seek (int handle, LONGLONG offset)
 {
-   int status = 0;
+   Gzidx_File_Type *g = gzidx_get_file (handle);
+   if (g == NULL)
+     return SEEK_ERROR;
+   g->seek_pos = offset;
+   return 0;
+}
 
-   if (f->fptr == NULL)
-     return -1;
+static int gzidx_read (int handle, void *buffer, long nbytes)
+{
+   Gzidx_File_Type *g = gzidx_get_file (handle);
+   Gzidx_Index_Type *idx;
+   Gzidx_Point_Type *p;
+   unsigned int lo, hi;
+
+   if (g == NULL)
+     return READ_ERROR;
+   idx = g->index;
+   if (g->seek_pos + nbytes > idx->total_out)
+     return END_OF_FILE;
+
+   /* The last access point at or before the position */
+   lo = 0;
+   hi = idx->num_points;
+   while (hi - lo > 1)
+     {
+	unsigned int mid = (lo + hi) / 2;
+	if (idx->points[mid].out <= g->seek_pos)
+	  lo = mid;
+	else
+	  hi = mid;
+     }
+   p = idx->points + lo;
+
+   /* Continue with the current stream unless the access point is closer */
+   if ((g->strm_active == 0) || (g->seek_pos < g->pos) || (p->out > g->pos))
+     {
+	if (-1 == gzidx_start_at (g, p))
+	  {
+	     g->strm_active = 0;
+	     return READ_ERROR;
+	  }
+     }
+
+   if ((-1 == gzidx_inflate (g, NULL, g->seek_pos - g->pos))
+       || (-1 == gzidx_inflate (g, (unsigned char *) buffer, nbytes)))
+     {
+	/* Force a restart at the next read */
+	(void) inflateEnd (&g->strm);
+	g->strm_active = 0;
+	return READ_ERROR;
+     }
+   g->seek_pos += nbytes;
+   return 0;
+}
 
-   return fits_set_tscale (f->fptr, *colp, *scale, *zero, &status);
+static int gzidx_write (int handle, void *buffer, long nbytes)
+{
+   (void) handle; (void) buffer; (void) nbytes;
+   return WRITE_ERROR;
+}
+
+static int register_gzidx_driver (void)
+{
+   int status = fits_init_cfitsio ();
+   if (status == 0)
+     status = fits_register_driver ("gzidx://", gzidx_init, gzidx_shutdown,
+				    gzidx_setoptions, gzidx_getoptions, gzidx_getversion,
+				    gzidx_checkfile, gzidx_open, gzidx_create,
+				    gzidx_truncate, gzidx_close, gzidx_remove,
+				    gzidx_size, gzidx_flush, gzidx_seek,
+				    gzidx_read, gzidx_write);
+   return status;
 }
+#endif				       /* HAVE_GZIP_INDEX */
 
 /* DUMMY_FITS_FILE_TYPE is a temporary hack that will be modified to the true
  * id once the interpreter provides it when the class is registered.  See below
@@ -2399,6 +10641,7 @@ static int set_tscale (FitsFile_Type *f, int *colp, double *scale, double *zero)
 #define A SLANG_ARRAY_TYPE
 #define T SLANG_DATATYPE_TYPE
 #define D SLANG_DOUBLE_TYPE
+#define L SLANG_ROWS_TYPE		       /* row numbers and counts */
 
 static SLang_Intrin_Fun_Type Fits_Intrinsics [] =
 {
@@ -2408,6 +10651,9 @@ static SLang_Intrin_Fun_Type Fits_Intrinsics [] =
    MAKE_INTRINSIC_3("_fits_open_file", open_file, I, R, S, S),
    MAKE_INTRINSIC_1("_fits_delete_file", delete_file, I, F),
    MAKE_INTRINSIC_1("_fits_close_file", close_file, SLANG_INT_TYPE, F),
+   MAKE_INTRINSIC_0("_fits_open_memory", open_memory, I),
+   MAKE_INTRINSIC_1("_fits_create_memory", create_memory, I, R),
+   MAKE_INTRINSIC_2("_fits_get_memory_bytes", get_memory_bytes, I, F, R),
 
    /* HDU Access Routines */
    MAKE_INTRINSIC_2("_fits_movabs_hdu", movabs_hdu, I, F, I),
@@ -2419,11 +10665,19 @@ static SLang_Intrin_Fun_Type Fits_Intrinsics [] =
    MAKE_INTRINSIC_5("_fits_copy_file", copy_file, I, F, F, I, I, I),
    MAKE_INTRINSIC_3("_fits_copy_hdu", copy_hdu, I, F, F, I),
    MAKE_INTRINSIC_2("_fits_copy_header", copy_header, I, F, F),
+   MAKE_INTRINSIC_0("_fits_copy_table", copy_table, I),
+   MAKE_INTRINSIC_0("_fits_sort_table", sort_table, I),
+   MAKE_INTRINSIC_1("_fits_readahead", readahead_file, SLANG_VOID_TYPE, S),
    MAKE_INTRINSIC_1("_fits_delete_hdu", delete_hdu, I, F),
 
    MAKE_INTRINSIC_3("_fits_create_img", create_img, I, F, I, A),
    MAKE_INTRINSIC_2("_fits_write_img", write_img, I, F, A),
-   MAKE_INTRINSIC_2("_fits_read_img", read_img, I, F, R),
+   MAKE_INTRINSIC_0("_fits_write_subset", write_subset, I),
+   MAKE_INTRINSIC_0("_fits_read_img", read_img, I),
+   MAKE_INTRINSIC_0("_fits_read_img_binned", read_img_binned, I),
+   MAKE_INTRINSIC_0("_fits_read_pixels", read_pixels, I),
+   MAKE_INTRINSIC_0("_fits_read_images", read_images, I),
+   MAKE_INTRINSIC_0("_fits_scan_headers", scan_headers, I),
 
    /* Keword Writing Routines */
    MAKE_INTRINSIC_0("_fits_create_binary_tbl", create_binary_tbl, I),
@@ -2447,8 +10701,8 @@ static SLang_Intrin_Fun_Type Fits_Intrinsics [] =
    MAKE_INTRINSIC_3("_fits_get_colnum", get_colnum, I, F, S, R),
    MAKE_INTRINSIC_3("_fits_get_colnum_casesen", get_colnum_casesen, I, F, S, R),
 
-   MAKE_INTRINSIC_3("_fits_insert_rows", insert_rows, I, F, I, I),
-   MAKE_INTRINSIC_3("_fits_delete_rows", delete_rows, I, F, I, I),
+   MAKE_INTRINSIC_3("_fits_insert_rows", insert_rows, I, F, L, L),
+   MAKE_INTRINSIC_3("_fits_delete_rows", delete_rows, I, F, L, L),
 
    MAKE_INTRINSIC_4("_fits_insert_cols", insert_cols, I, F, I, A, A),
    MAKE_INTRINSIC_2("_fits_delete_col", delete_col, I, F, I),
@@ -2456,12 +10710,23 @@ static SLang_Intrin_Fun_Type Fits_Intrinsics [] =
    MAKE_INTRINSIC_2("_fits_get_num_cols", get_num_cols, I, F, R),
    MAKE_INTRINSIC_2("_fits_get_rowsize", get_rowsize, I, F, R),
    MAKE_INTRINSIC_2("_fits_get_num_rows", get_num_rows, I, F, R),
-   MAKE_INTRINSIC_5("_fits_write_col", write_col, I, F, I, I, I, A),
-   MAKE_INTRINSIC_5("_fits_read_col", read_col, I, F, I, I, I, R),
+   MAKE_INTRINSIC_5("_fits_write_col", write_col, I, F, I, L, L, A),
+   MAKE_INTRINSIC_0("_fits_write_var_col", write_var_col, I),
+   MAKE_INTRINSIC_0("_fits_read_rows", read_rows, I),
+   MAKE_INTRINSIC_0("_fits_read_col", read_col, I),
+   MAKE_INTRINSIC_5("_fits_read_bit_mask", read_bit_mask, I, F, I, L, L, R),
+   MAKE_INTRINSIC_0("_fits_search_sorted", search_sorted, I),
+   MAKE_INTRINSIC_3("_fits_get_sort_order", get_sort_order, I, F, I, R),
    MAKE_INTRINSIC_3("_fits_get_keytype", get_keytype, I, F, S, R),
    MAKE_INTRINSIC_1("_fits_get_keyclass", get_keyclass, I, S),
 
    MAKE_INTRINSIC_0("_fits_read_cols", read_cols, I),
+   MAKE_INTRINSIC_0("_fits_open_table", open_table, SLANG_VOID_TYPE),
+#ifdef HAVE_FITS_THREADS
+   MAKE_INTRINSIC_0("_fits_prefetch_open", prefetch_open, SLANG_VOID_TYPE),
+   MAKE_INTRINSIC_0("_fits_prefetch_next", prefetch_next, I),
+#endif
+   MAKE_INTRINSIC_0("_fits_set_column_cache", set_column_cache, SLANG_VOID_TYPE),
    MAKE_INTRINSIC_3("_fits_set_bscale", set_bscale, I, F, D, D),
    MAKE_INTRINSIC_4("_fits_set_tscale", set_tscale, I, F, I, D, D),
 
@@ -2472,6 +10737,12 @@ static SLang_Intrin_Fun_Type Fits_Intrinsics [] =
    MAKE_INTRINSIC_3("_fits_get_chksum", get_chksum, I, F, R, R),
 
    MAKE_INTRINSIC_0("_fits_get_version", get_version, SLANG_VOID_TYPE),
+
+   /* I/O statistics */
+   MAKE_INTRINSIC_0("_fits_get_stats", get_stats, SLANG_VOID_TYPE),
+   MAKE_INTRINSIC_0("_fits_reset_stats", reset_stats, SLANG_VOID_TYPE),
+   MAKE_INTRINSIC_2("_fits_trace_start", trace_start, I, S, I),
+   MAKE_INTRINSIC_0("_fits_trace_stop", trace_stop, I),
    SLANG_END_INTRIN_FUN_TABLE
 };
 
@@ -2625,8 +10896,7 @@ static void free_fits_file_type (SLtype type, VOID_STAR f)
    (void) type;
 
    ft = (FitsFile_Type *) f;
-   if (ft->fptr != NULL)
-     fits_close_file (ft->fptr, &status);
+   close_fits_handle (ft, &status);
 
    SLfree ((char *) ft);
 }
@@ -2659,6 +10929,7 @@ static int check_version (void)
 int init_cfitsio_module_ns (char *ns_name)
 {
    SLang_NameSpace_Type *ns;
+   char *trace_file;
 
    ns = SLns_create_namespace (ns_name);
    if (ns == NULL)
@@ -2684,6 +10955,40 @@ int init_cfitsio_module_ns (char *ns_name)
 
 	Fits_Type_Id = SLclass_get_class_id (cl);
 	patchup_intrinsic_table ();
+	init_bit_mask_table ();
+
+	cl = SLclass_allocate_class ("Fits_Table_Type");
+	if (cl == NULL) return -1;
+	(void) SLclass_set_destroy_function (cl, destroy_fits_table_type);
+	(void) SLclass_set_sget_function (cl, table_sget);
+	(void) SLclass_set_sput_function (cl, table_sput);
+	(void) SLclass_set_aget_function (cl, table_aget);
+	if (-1 == SLclass_register_class (cl, SLANG_VOID_TYPE,
+					  sizeof (FitsTable_Type),
+					  SLANG_CLASS_TYPE_MMT))
+	  return -1;
+	Fits_Table_Type_Id = SLclass_get_class_id (cl);
+
+#ifdef HAVE_FITS_THREADS
+	cl = SLclass_allocate_class ("Fits_Prefetch_Type");
+	if (cl == NULL) return -1;
+	(void) SLclass_set_destroy_function (cl, destroy_prefetch_type);
+	if (-1 == SLclass_register_class (cl, SLANG_VOID_TYPE,
+					  sizeof (Prefetch_Type),
+					  SLANG_CLASS_TYPE_MMT))
+	  return -1;
+	Prefetch_Type_Id = SLclass_get_class_id (cl);
+#endif
+
+	if (NULL != (trace_file = getenv (TRACE_ENV_VAR)))
+	  {
+	     if (*trace_file && (-1 == start_trace (trace_file, 0)))
+	       return -1;
+	  }
+#ifdef HAVE_GZIP_INDEX
+	/* Without room for another driver, gzidx:// is simply unavailable */
+	(void) register_gzidx_driver ();
+#endif
      }
 
    if (-1 == SLns_add_intrin_fun_table (ns, Fits_Intrinsics, "__CFITSIO__"))